@@ -222,6 +222,9 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* DECAF: starts with the write-then-execute check, so that
+       retranslating it for search_pc gives the same code */
+    uint8_t DECAF_write_exec;
 #ifdef CONFIG_TCG_LLVM
     /* pointer to LLVM translated code */
     struct TCGLLVMContext *tcg_llvm_context;
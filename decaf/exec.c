@@ -2517,7 +2517,9 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
             /* Write access calls the I/O callback.  */
             te->addr_write = address | TLB_MMIO;
         } else if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM &&
-                   !cpu_physical_memory_is_dirty(pd)) {
+                   (!cpu_physical_memory_is_dirty(pd) ||
+                    DECAF_is_WriteExecWatch_needed(env, vaddr, mmu_idx))) {
+            /* DECAF: the first write to a watched page must be seen too */
             te->addr_write = address | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
@@ -3519,6 +3521,8 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
         dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
+    DECAF_write_exec_notdirty(cpu_single_env, cpu_single_env->mem_io_vaddr,
+                              ram_addr);
     stb_p(qemu_get_ram_ptr(ram_addr), val);
 
 #ifdef CONFIG_TCG_TAINT
@@ -3544,6 +3548,8 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
         dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
+    DECAF_write_exec_notdirty(cpu_single_env, cpu_single_env->mem_io_vaddr,
+                              ram_addr);
     stw_p(qemu_get_ram_ptr(ram_addr), val);
 #ifdef CONFIG_TCG_TAINT
     __taint_stw_raw_paddr(ram_addr, cpu_single_env->mem_io_vaddr);
@@ -3567,6 +3573,8 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
         dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
+    DECAF_write_exec_notdirty(cpu_single_env, cpu_single_env->mem_io_vaddr,
+                              ram_addr);
     stl_p(qemu_get_ram_ptr(ram_addr), val);
 #ifdef CONFIG_TCG_TAINT
     __taint_stl_raw_paddr(ram_addr, cpu_single_env->mem_io_vaddr);
@@ -587,6 +587,8 @@ static void help_cmd_dump(Monitor *mon, const mon_cmd_t *cmds,
 
 static void help_cmd(Monitor *mon, const char *name)
 {
+    int i;
+
     if (name && !strcmp(name, "info")) {
         help_cmd_dump(mon, info_cmds, "info ", NULL);
         //LOK: Added the DECAF commands
@@ -594,16 +596,18 @@ static void help_cmd(Monitor *mon, const char *name)
         {
           help_cmd_dump(mon, DECAF_info_cmds, "info ", NULL);
         }
-	if (decaf_plugin && decaf_plugin->info_cmds)
-            help_cmd_dump(mon, decaf_plugin->info_cmds, "info ", NULL);
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++)
+            if (decaf_plugins[i] && decaf_plugins[i]->info_cmds)
+                help_cmd_dump(mon, decaf_plugins[i]->info_cmds, "info ", NULL);
     } else {
         help_cmd_dump(mon, mon_cmds, "", name);
         if (DECAF_mon_cmds != NULL)
         {
           help_cmd_dump(mon, DECAF_mon_cmds, "", name);
         }
-        if (decaf_plugin && decaf_plugin->mon_cmds)
-            help_cmd_dump(mon, decaf_plugin->mon_cmds, "", name);
+        for (i = 0; i < DECAF_MAX_PLUGINS; i++)
+            if (decaf_plugins[i] && decaf_plugins[i]->mon_cmds)
+                help_cmd_dump(mon, decaf_plugins[i]->mon_cmds, "", name);
         if (name && !strcmp(name, "log")) {
             const CPULogItem *item;
             monitor_printf(mon, "Log items (comma separated):\n");
@@ -3726,6 +3730,7 @@ static const mon_cmd_t *search_dispatch_table(const mon_cmd_t *disp_table,
 static const mon_cmd_t *monitor_find_command(const char *cmdname)
 {
   const mon_cmd_t *cmd;
+  int i;
   // AWH - search the standard monitor cmds first
   cmd = search_dispatch_table(mon_cmds, cmdname);
   if (cmd) return cmd;
@@ -3748,13 +3753,16 @@ static const mon_cmd_t *monitor_find_command(const char *cmdname)
     }
   }
   // AWH - if you can't find it, try to search the plugin term cmds
-  if (decaf_plugin) {
-    if (decaf_plugin->mon_cmds) {
-      cmd = search_dispatch_table(decaf_plugin->mon_cmds, cmdname);
+  // in load order
+  for (i = 0; i < DECAF_MAX_PLUGINS; i++) {
+    if (!decaf_plugins[i])
+      continue;
+    if (decaf_plugins[i]->mon_cmds) {
+      cmd = search_dispatch_table(decaf_plugins[i]->mon_cmds, cmdname);
       if (cmd) return cmd;
     }
-    if (decaf_plugin->info_cmds) {
-      cmd = search_dispatch_table(decaf_plugin->info_cmds, cmdname);
+    if (decaf_plugins[i]->info_cmds) {
+      cmd = search_dispatch_table(decaf_plugins[i]->info_cmds, cmdname);
       if (cmd) return cmd;
     } 
   }
@@ -4328,7 +4336,7 @@ static void monitor_find_completion(const char *cmdline)
 {
     const char *cmdname;
     char *args[MAX_ARGS];
-    int nb_args, i, len;
+    int nb_args, i, j, len;
     const char *ptype, *str;
     const mon_cmd_t *cmd;
     const KeyDef *key;
@@ -4368,9 +4376,10 @@ static void monitor_find_completion(const char *cmdline)
           }
         }
 	// AWH - plugin cmds
-	if (decaf_plugin && decaf_plugin->mon_cmds)
-            for (cmd = decaf_plugin->mon_cmds; cmd->name != NULL; cmd++)
-                cmd_completion(cmdname, cmd->name);
+	for (j = 0; j < DECAF_MAX_PLUGINS; j++)
+            if (decaf_plugins[j] && decaf_plugins[j]->mon_cmds)
+                for (cmd = decaf_plugins[j]->mon_cmds; cmd->name != NULL; cmd++)
+                    cmd_completion(cmdname, cmd->name);
         //if (temu_plugin && temu_plugin->info_cmds)
         //    for (cmd = temu_plugin->info_cmds; cmd->name != NULL; cmd++)
         //        cmd_completion(cmdname, cmd->name);
@@ -4395,9 +4404,10 @@ static void monitor_find_completion(const char *cmdline)
         }
 
         // AWH - plugin cmds
-        if (!cmd->name && decaf_plugin && decaf_plugin->mon_cmds)
-            for (cmd = decaf_plugin->mon_cmds; cmd->name != NULL; cmd++)
-                if (compare_cmd(args[0], cmd->name)) break;
+        for (j = 0; !cmd->name && j < DECAF_MAX_PLUGINS; j++)
+            if (decaf_plugins[j] && decaf_plugins[j]->mon_cmds)
+                for (cmd = decaf_plugins[j]->mon_cmds; cmd->name != NULL; cmd++)
+                    if (compare_cmd(args[0], cmd->name)) break;
         //if (!cmd->name && temu_plugin && temu_plugin->info_cmds) {
         //    for (cmd = temu_plugin->term_cmds; cmd->name != NULL; cmd++) 
         //        if (compare_cmd(args[0], cmd->name)) break;
@@ -4447,9 +4457,10 @@ static void monitor_find_completion(const char *cmdline)
                 }
 
 		// AWH - plugin info cmds
-                if (decaf_plugin && decaf_plugin->info_cmds)
-                    for (cmd = decaf_plugin->info_cmds; cmd->name != NULL; cmd++)
-                        cmd_completion(str, cmd->name);
+                for (j = 0; j < DECAF_MAX_PLUGINS; j++)
+                    if (decaf_plugins[j] && decaf_plugins[j]->info_cmds)
+                        for (cmd = decaf_plugins[j]->info_cmds; cmd->name != NULL; cmd++)
+                            cmd_completion(str, cmd->name);
  
             } else if (!strcmp(cmd->name, "sendkey")) {
                 char *sep = strrchr(str, '-');
@@ -4474,9 +4485,10 @@ static void monitor_find_completion(const char *cmdline)
                   }
                 }
                 // AWH - plugin cmds
-                if (decaf_plugin && decaf_plugin->mon_cmds)
-                    for (cmd = decaf_plugin->mon_cmds; cmd->name != NULL; cmd++)
-                        cmd_completion(str, cmd->name);
+                for (j = 0; j < DECAF_MAX_PLUGINS; j++)
+                    if (decaf_plugins[j] && decaf_plugins[j]->mon_cmds)
+                        for (cmd = decaf_plugins[j]->mon_cmds; cmd->name != NULL; cmd++)
+                            cmd_completion(str, cmd->name);
             }
             break;
         default:
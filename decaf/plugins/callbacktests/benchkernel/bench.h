@@ -0,0 +1,55 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * bench.h
+ *
+ * What the benchmark kernel tells the callbacktests plugin. The kernel
+ * fills a struct bench_info at BENCH_INFO_ADDR, on a page of its own, then
+ * runs bench_loop forever, with interrupts off, incrementing iterations
+ * once per round. A round is BENCH_INSNS_PER_ITER guest instructions.
+ */
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+#define BENCH_INFO_ADDR 0x200000
+#define BENCH_MAGIC 0x434e4244 /* "DBNC" */
+#define BENCH_VERSION 1
+
+/* Offsets in struct bench_info */
+#define BENCH_INFO_MAGIC 0
+#define BENCH_INFO_VERSION 4
+#define BENCH_INFO_ITERATIONS 8
+#define BENCH_INFO_INSNS 12
+#define BENCH_INFO_LOOP 16
+#define BENCH_INFO_FUNC 20
+
+/* Rounds of the inner loop of bench_func */
+#define BENCH_INNER 16
+
+/* call, incl, jmp in bench_loop; push, mov, mov, pop, ret and the inner
+   loop (add, dec, jnz) in bench_func */
+#define BENCH_INSNS_PER_ITER (8 + 3 * BENCH_INNER)
+
+#ifndef __ASSEMBLER__
+struct bench_info {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t iterations;
+	uint32_t insns_per_iter;
+	uint32_t loop; //address of bench_loop
+	uint32_t func; //address of bench_func, called once per round
+};
+#endif
+
+#endif /* BENCH_H_INCLUDED */
@@ -0,0 +1,426 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * callbackbench.c
+ *
+ * Callback overhead benchmarks against the benchmark kernel (see
+ * benchkernel/bench.h), so that they do not depend on a particular guest.
+ * Each benchmark enables one kind of instrumentation, lets the guest run
+ * for a while and measures how many guest instructions it ran, from the
+ * round counter of the kernel. The results go to a CSV file:
+ *
+ *   test,seconds,guest_insns,mips,slowdown,events,overhead_ns
+ *
+ * slowdown is relative to the baseline, with nothing enabled, and
+ * overhead_ns is the time added by each event (callback, hook or flush).
+ */
+
+#include "DECAF_types.h"
+#include "DECAF_main.h"
+#include "DECAF_callback.h"
+#include "hookapi.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
+#include "benchkernel/bench.h"
+#include "callbackbench.h"
+
+#define CALLBACKBENCH_WARMUP_MS 500
+#define CALLBACKBENCH_DEFAULT_SECONDS 5
+#define CALLBACKBENCH_DEFAULT_FILE "callbacktests_bench.csv"
+/* Period of the flushes of the TB flush benchmark */
+#define CALLBACKBENCH_FLUSH_MS 10
+
+typedef enum
+{
+  BENCH_BASELINE,
+  BENCH_CALLBACK,
+  BENCH_HOOK,
+  BENCH_HOOK_RETURN,
+  BENCH_FLUSH,
+} benchkind_t;
+
+/* Addresses of the benchmark kernel, resolved when the run starts */
+typedef enum
+{
+  BENCH_ADDR_NONE,
+  BENCH_ADDR_INV,
+  BENCH_ADDR_LOOP,
+  BENCH_ADDR_FUNC,
+} benchaddr_t;
+
+typedef struct _callbackbench_t
+{
+  char name[64];
+  benchkind_t kind;
+  DECAF_callback_type_t cbtype;
+  OCB_t ocbtype;
+  benchaddr_t from;
+  benchaddr_t to;
+  //results
+  double seconds;
+  uint64_t insns;
+  uint64_t events;
+}callbackbench_t;
+
+#define CALLBACKBENCH_COUNT 11
+
+static callbackbench_t callbackbenches[CALLBACKBENCH_COUNT] = {
+    {"Baseline", BENCH_BASELINE, 0, 0, BENCH_ADDR_NONE, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Block Begin Single", BENCH_CALLBACK, DECAF_BLOCK_BEGIN_CB, OCB_CONST, BENCH_ADDR_FUNC, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Block Begin Page", BENCH_CALLBACK, DECAF_BLOCK_BEGIN_CB, OCB_PAGE, BENCH_ADDR_FUNC, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Block Begin All", BENCH_CALLBACK, DECAF_BLOCK_BEGIN_CB, OCB_ALL, BENCH_ADDR_NONE, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Block End From Page", BENCH_CALLBACK, DECAF_BLOCK_END_CB, OCB_PAGE, BENCH_ADDR_LOOP, BENCH_ADDR_INV, 0.0, 0, 0},
+    {"Block End To Page", BENCH_CALLBACK, DECAF_BLOCK_END_CB, OCB_PAGE, BENCH_ADDR_INV, BENCH_ADDR_FUNC, 0.0, 0, 0},
+    {"Insn Begin", BENCH_CALLBACK, DECAF_INSN_BEGIN_CB, OCB_ALL, BENCH_ADDR_NONE, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Insn End", BENCH_CALLBACK, DECAF_INSN_END_CB, OCB_ALL, BENCH_ADDR_NONE, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Hookapi Hook", BENCH_HOOK, 0, 0, BENCH_ADDR_FUNC, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"Hookapi Hook Return", BENCH_HOOK_RETURN, 0, 0, BENCH_ADDR_FUNC, BENCH_ADDR_NONE, 0.0, 0, 0},
+    {"TB Flush", BENCH_FLUSH, 0, 0, BENCH_ADDR_NONE, BENCH_ADDR_NONE, 0.0, 0, 0},
+};
+
+static int curBench = -1; //-1 when no run is in progress
+static int bMeasuring = 0;
+static int benchSeconds = CALLBACKBENCH_DEFAULT_SECONDS;
+static char benchFile[512];
+static struct bench_info benchInfo;
+
+static QEMUTimer* bench_timer = NULL;
+static QEMUTimer* flush_timer = NULL;
+static DECAF_Handle bench_handle = DECAF_NULL_HANDLE;
+static uintptr_t hook_handle = 0;
+static uintptr_t ret_handle = 0;
+
+static uint64_t benchEvents = 0;
+static uint32_t startIterations = 0;
+static int64_t startTime = 0;
+
+static uint32_t callbackbench_addr(benchaddr_t addr)
+{
+  switch (addr)
+  {
+    case (BENCH_ADDR_INV):
+      return (INV_ADDR);
+    case (BENCH_ADDR_LOOP):
+      return (benchInfo.loop);
+    case (BENCH_ADDR_FUNC):
+      return (benchInfo.func);
+    default:
+      return (0);
+  }
+}
+
+static uint32_t callbackbench_iterations(void)
+{
+  uint32_t iterations = 0;
+  cpu_physical_memory_read(BENCH_INFO_ADDR + BENCH_INFO_ITERATIONS, (uint8_t*)&iterations, sizeof(iterations));
+  return (iterations);
+}
+
+static void callbackbench_genericcallback(DECAF_Callback_Params* param)
+{
+  benchEvents++;
+}
+
+static void callbackbench_ret(void* opaque)
+{
+  benchEvents++;
+  hookapi_remove_hook(ret_handle);
+  ret_handle = 0;
+}
+
+static void callbackbench_hook(void* opaque)
+{
+  uint32_t retaddr = 0;
+
+  if (curBench < 0 || callbackbenches[curBench].kind != BENCH_HOOK_RETURN)
+  {
+    benchEvents++;
+    return;
+  }
+
+  //the kernel makes one call at a time, so there is at most one return hook
+  if (ret_handle != 0)
+  {
+    return;
+  }
+  DECAF_read_mem(cpu_single_env, DECAF_getESP(cpu_single_env), sizeof(retaddr), &retaddr);
+  ret_handle = hookapi_hook_return(retaddr, &callbackbench_ret, NULL, 0);
+}
+
+static void callbackbench_flush(void* opaque)
+{
+  DECAF_flushTranslationCache(ALL_CACHE, 0);
+  benchEvents++;
+  qemu_mod_timer(flush_timer, qemu_get_clock_ms(rt_clock) + CALLBACKBENCH_FLUSH_MS);
+}
+
+static int callbackbench_setup(callbackbench_t* bench)
+{
+  switch (bench->kind)
+  {
+    case (BENCH_CALLBACK):
+    {
+      switch (bench->cbtype)
+      {
+        case (DECAF_BLOCK_BEGIN_CB):
+          bench_handle = DECAF_registerOptimizedBlockBeginCallback(&callbackbench_genericcallback, NULL, callbackbench_addr(bench->from), bench->ocbtype);
+          break;
+        case (DECAF_BLOCK_END_CB):
+          bench_handle = DECAF_registerOptimizedBlockEndCallback(&callbackbench_genericcallback, NULL, callbackbench_addr(bench->from), callbackbench_addr(bench->to));
+          break;
+        default:
+          bench_handle = DECAF_register_callback(bench->cbtype, &callbackbench_genericcallback, NULL);
+      }
+      return (bench_handle == DECAF_NULL_HANDLE ? -1 : 0);
+    }
+    case (BENCH_HOOK):
+    case (BENCH_HOOK_RETURN):
+    {
+      hook_handle = hookapi_hook_function(1, callbackbench_addr(bench->from), 0, &callbackbench_hook, NULL, 0);
+      return (hook_handle == 0 ? -1 : 0);
+    }
+    case (BENCH_FLUSH):
+    {
+      qemu_mod_timer(flush_timer, qemu_get_clock_ms(rt_clock) + CALLBACKBENCH_FLUSH_MS);
+      return (0);
+    }
+    default:
+      return (0);
+  }
+}
+
+static void callbackbench_teardown(callbackbench_t* bench)
+{
+  if (bench_handle != DECAF_NULL_HANDLE)
+  {
+    if (bench->cbtype == DECAF_BLOCK_BEGIN_CB)
+    {
+      DECAF_unregisterOptimizedBlockBeginCallback(bench_handle);
+    }
+    else if (bench->cbtype == DECAF_BLOCK_END_CB)
+    {
+      DECAF_unregisterOptimizedBlockEndCallback(bench_handle);
+    }
+    else
+    {
+      DECAF_unregister_callback(bench->cbtype, bench_handle);
+    }
+    bench_handle = DECAF_NULL_HANDLE;
+  }
+  if (hook_handle != 0)
+  {
+    hookapi_remove_hook(hook_handle);
+    hook_handle = 0;
+  }
+  if (ret_handle != 0)
+  {
+    hookapi_remove_hook(ret_handle);
+    ret_handle = 0;
+  }
+  qemu_del_timer(flush_timer);
+}
+
+static double callbackbench_mips(callbackbench_t* bench)
+{
+  if (bench->seconds <= 0.0)
+  {
+    return (0.0);
+  }
+  return ((double)bench->insns / bench->seconds / 1000000.0);
+}
+
+//time added by each event, from the time the baseline would have taken
+// for the same instructions
+static double callbackbench_overhead(callbackbench_t* bench)
+{
+  double mips = callbackbench_mips(&callbackbenches[0]);
+  if (bench->events == 0 || mips <= 0.0)
+  {
+    return (0.0);
+  }
+  return ((bench->seconds - (double)bench->insns / (mips * 1000000.0)) * 1000000000.0 / (double)bench->events);
+}
+
+static void callbackbench_report(void)
+{
+  int i = 0;
+  FILE* fp = NULL;
+  double base = callbackbench_mips(&callbackbenches[0]);
+  double mips = 0.0;
+
+  DECAF_printf("******* BENCHMARK SUMMARY *******\n");
+  DECAF_printf("%-30s\t%10s\t%10s\t%12s\t%12s\n", "Test", "MIPS", "Slowdown", "Events", "ns/Event");
+  for (i = 0; i < CALLBACKBENCH_COUNT; i++)
+  {
+    mips = callbackbench_mips(&callbackbenches[i]);
+    DECAF_printf("%-30s\t%10.2f\t%10.2f\t%12llu\t%12.1f\n", callbackbenches[i].name, mips,
+        mips > 0.0 ? base / mips : 0.0, (unsigned long long)callbackbenches[i].events,
+        callbackbench_overhead(&callbackbenches[i]));
+  }
+
+  fp = fopen(benchFile, "w");
+  if (fp == NULL)
+  {
+    DECAF_printf("Could not open %s\n", benchFile);
+    return;
+  }
+  fprintf(fp, "# DECAF callback benchmark\n");
+#ifdef QEMU_VERSION
+  fprintf(fp, "# qemu_version=%s\n", QEMU_VERSION);
+#endif
+  fprintf(fp, "# plugin_built=%s %s\n", __DATE__, __TIME__);
+  fprintf(fp, "# seconds=%d insns_per_iter=%u\n", benchSeconds, benchInfo.insns_per_iter);
+  fprintf(fp, "test,seconds,guest_insns,mips,slowdown,events,overhead_ns\n");
+  for (i = 0; i < CALLBACKBENCH_COUNT; i++)
+  {
+    mips = callbackbench_mips(&callbackbenches[i]);
+    fprintf(fp, "%s,%.6f,%llu,%.3f,%.3f,%llu,%.1f\n", callbackbenches[i].name, callbackbenches[i].seconds,
+        (unsigned long long)callbackbenches[i].insns, mips, mips > 0.0 ? base / mips : 0.0,
+        (unsigned long long)callbackbenches[i].events, callbackbench_overhead(&callbackbenches[i]));
+  }
+  fclose(fp);
+  DECAF_printf("Results written to %s\n", benchFile);
+}
+
+static void callbackbench_start(int bench)
+{
+  curBench = bench;
+  bMeasuring = 0;
+  DECAF_printf("Running the %s benchmark\n", callbackbenches[bench].name);
+  if (callbackbench_setup(&callbackbenches[bench]) != 0)
+  {
+    DECAF_printf("Could not set up the %s benchmark\n", callbackbenches[bench].name);
+    callbackbench_teardown(&callbackbenches[bench]);
+  }
+  //let the translation cache fill up again before measuring
+  qemu_mod_timer(bench_timer, qemu_get_clock_ms(rt_clock) + CALLBACKBENCH_WARMUP_MS);
+}
+
+static void callbackbench_tick(void* opaque)
+{
+  callbackbench_t* bench = NULL;
+  int64_t now = qemu_get_clock_ns(rt_clock);
+
+  if (curBench < 0)
+  {
+    return;
+  }
+  bench = &callbackbenches[curBench];
+
+  if (!bMeasuring)
+  {
+    bMeasuring = 1;
+    benchEvents = 0;
+    startIterations = callbackbench_iterations();
+    startTime = now;
+    qemu_mod_timer(bench_timer, qemu_get_clock_ms(rt_clock) + benchSeconds * 1000);
+    return;
+  }
+
+  //the guest does not run while we are here
+  bench->insns = (uint64_t)(callbackbench_iterations() - startIterations) * benchInfo.insns_per_iter;
+  bench->seconds = (double)(now - startTime) / 1000000000.0;
+  bench->events = benchEvents;
+  callbackbench_teardown(bench);
+
+  if (curBench + 1 < CALLBACKBENCH_COUNT)
+  {
+    callbackbench_start(curBench + 1);
+    return;
+  }
+
+  curBench = -1;
+  bMeasuring = 0;
+  DECAF_printf("All benchmarks have completed\n");
+  callbackbench_report();
+}
+
+void do_callbacktests_bench(Monitor* mon, const QDict* qdict)
+{
+  int i = 0;
+
+  if (curBench >= 0)
+  {
+    DECAF_printf("The %s benchmark is currently running\n", callbackbenches[curBench].name);
+    return;
+  }
+
+  benchSeconds = CALLBACKBENCH_DEFAULT_SECONDS;
+  if ((qdict != NULL) && qdict_haskey(qdict, "seconds"))
+  {
+    benchSeconds = qdict_get_int(qdict, "seconds");
+  }
+  if (benchSeconds <= 0)
+  {
+    benchSeconds = CALLBACKBENCH_DEFAULT_SECONDS;
+  }
+  strncpy(benchFile, CALLBACKBENCH_DEFAULT_FILE, 512);
+  if ((qdict != NULL) && qdict_haskey(qdict, "file"))
+  {
+    strncpy(benchFile, qdict_get_str(qdict, "file"), 512);
+  }
+  benchFile[511] = '\0';
+
+  cpu_physical_memory_read(BENCH_INFO_ADDR, (uint8_t*)&benchInfo, sizeof(benchInfo));
+  if ((benchInfo.magic != BENCH_MAGIC) || (benchInfo.version != BENCH_VERSION))
+  {
+    DECAF_printf("The benchmark kernel is not running, boot benchkernel/benchkernel.elf with -kernel\n");
+    return;
+  }
+  if (!runstate_is_running())
+  {
+    DECAF_printf("The guest is stopped, the benchmarks need it to run\n");
+    return;
+  }
+
+  if (bench_timer == NULL)
+  {
+    bench_timer = qemu_new_timer_ms(rt_clock, &callbackbench_tick, NULL);
+  }
+  if (flush_timer == NULL)
+  {
+    flush_timer = qemu_new_timer_ms(rt_clock, &callbackbench_flush, NULL);
+  }
+
+  for (i = 0; i < CALLBACKBENCH_COUNT; i++)
+  {
+    callbackbenches[i].seconds = 0.0;
+    callbackbenches[i].insns = 0;
+    callbackbenches[i].events = 0;
+  }
+  DECAF_printf("Running %d benchmarks of %d seconds, results go to %s\n", CALLBACKBENCH_COUNT, benchSeconds, benchFile);
+  callbackbench_start(0);
+}
+
+void callbackbench_cleanup(void)
+{
+  if (curBench >= 0)
+  {
+    callbackbench_teardown(&callbackbenches[curBench]);
+    curBench = -1;
+    bMeasuring = 0;
+  }
+  if (bench_timer != NULL)
+  {
+    qemu_del_timer(bench_timer);
+    qemu_free_timer(bench_timer);
+    bench_timer = NULL;
+  }
+  if (flush_timer != NULL)
+  {
+    qemu_del_timer(flush_timer);
+    qemu_free_timer(flush_timer);
+    flush_timer = NULL;
+  }
+}
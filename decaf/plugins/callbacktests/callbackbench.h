@@ -0,0 +1,31 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * callbackbench.h
+ *
+ * Callback overhead benchmarks against the benchmark kernel.
+ */
+#ifndef CALLBACKBENCH_H_INCLUDED
+#define CALLBACKBENCH_H_INCLUDED
+
+#include "monitor.h"
+
+/* Monitor command: run all of the benchmarks, [seconds] each, and write
+   the results to [file] */
+void do_callbacktests_bench(Monitor* mon, const QDict* qdict);
+
+/* Stop a run in progress */
+void callbackbench_cleanup(void);
+
+#endif /* CALLBACKBENCH_H_INCLUDED */
@@ -24,6 +24,7 @@ http://code.google.com/p/decaf-platform/
 #include "vmi_callback.h"
 #include "utils/Output.h"
 #include "vmi_c_wrapper.h"
+#include "callbackbench.h"
 //basic stub for plugins
 static plugin_interface_t callbacktests_interface;
 static int bVerboseTest = 0;
@@ -310,6 +311,8 @@ static void callbacktests_cleanup(void)
 
   DECAF_printf("Bye world\n");
 
+  callbackbench_cleanup();
+
   if (processbegin_handle != DECAF_NULL_HANDLE)
   {
     VMI_unregister_callback(VMI_CREATEPROC_CB, processbegin_handle);
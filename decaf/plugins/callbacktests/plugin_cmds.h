@@ -5,3 +5,10 @@
 	.params		= "[procname]",
 	.help		= "Run the tests with program [procname]"
 },
+{
+	.name		= "callbacktests_bench",
+	.args_type	= "seconds:i?,file:F?",
+	.mhandler.cmd	= do_callbacktests_bench,
+	.params		= "[seconds] [file]",
+	.help		= "Benchmark the callbacks against benchkernel.elf, [seconds] per test, results to [file] (CSV)"
+},
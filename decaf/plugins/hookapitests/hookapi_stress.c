@@ -0,0 +1,441 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * hookapi_stress.c
+ *
+ * Stress harness for hookapi. It collects the targets of the calls the
+ * guest makes, in any process, and hooks up to N thousand of them. Every
+ * hooked call also hooks its return, so the return hooks nest as the
+ * calls do and come from all of the guest threads. The hooks can then be
+ * churned, and saved and restored as in a snapshot, while the table
+ * statistics of hookapi and the flushes it requests are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dlfcn.h>
+
+#include "DECAF_types.h"
+#include "DECAF_main.h"
+#include "DECAF_target.h"
+#include "DECAF_callback.h"
+#include "hookapi.h"
+#include "qemu-timer.h"
+#include "hookapi_stress.h"
+
+#define STRESS_MAX_HOOKS 65536
+/* Return hooks pending at once */
+#define STRESS_MAX_RETURNS 4096
+#define STRESS_COLLECT_MS 200
+#define STRESS_COLLECT_TIMEOUT_MS 60000
+
+typedef struct {
+	uint32_t pc;
+	uint32_t cr3;
+	uintptr_t handle;
+} stress_hook_t;
+
+#define SLOT_IN_USE -2
+
+typedef struct {
+	int next_free; //SLOT_IN_USE if in use
+	uint16_t gen;
+	uintptr_t handle;
+} stress_slot_t;
+
+static stress_hook_t *stress_hooks = NULL;
+static uint64_t *stress_keys = NULL;
+static GHashTable *stress_seen = NULL;
+static uint32_t stress_count = 0, stress_target = 0;
+static int stress_installed = 0;
+
+static DECAF_Handle collect_handle = DECAF_NULL_HANDLE;
+static QEMUTimer *collect_timer = NULL;
+static int64_t collect_start = 0;
+
+static stress_slot_t stress_slots[STRESS_MAX_RETURNS];
+static int free_slot = -1;
+
+static uint64_t entries = 0, returns = 0, returns_dropped = 0;
+static uint32_t pending = 0, max_pending = 0;
+static uint64_t flush_base[3];
+
+static void stress_reset_slots(void)
+{
+	int i;
+
+	for (i = 0; i < STRESS_MAX_RETURNS; i++) {
+		stress_slots[i].next_free = i + 1;
+		stress_slots[i].handle = 0;
+	}
+	stress_slots[STRESS_MAX_RETURNS - 1].next_free = -1;
+	free_slot = 0;
+	pending = 0;
+}
+
+static void stress_ret(void *opaque)
+{
+	uint32_t cookie = (uint32_t) (uintptr_t) opaque;
+	stress_slot_t *slot;
+
+	if ((cookie & 0xffff) >= STRESS_MAX_RETURNS)
+		return;
+	slot = &stress_slots[cookie & 0xffff];
+	if (slot->next_free != SLOT_IN_USE || slot->gen != (cookie >> 16))
+		return;
+
+	returns++;
+	hookapi_remove_hook(slot->handle);
+	slot->handle = 0;
+	slot->gen++;
+	slot->next_free = free_slot;
+	free_slot = slot - stress_slots;
+	pending--;
+}
+
+static void stress_entry(void *opaque)
+{
+	stress_slot_t *slot;
+	uint32_t ret_addr;
+
+	entries++;
+	if (free_slot < 0) {
+		returns_dropped++;
+		return;
+	}
+	if (DECAF_read_mem(cpu_single_env, DECAF_getESP(cpu_single_env), 4, &ret_addr) < 0)
+		return;
+
+	slot = &stress_slots[free_slot];
+	slot->handle = hookapi_hook_return(ret_addr, stress_ret,
+			(void *) (uintptr_t) (((uint32_t) slot->gen << 16) | (slot - stress_slots)), 0);
+	if (slot->handle == 0)
+		return;
+	free_slot = slot->next_free;
+	slot->next_free = SLOT_IN_USE;
+	if (++pending > max_pending)
+		max_pending = pending;
+}
+
+/* Keep the targets of the calls, which are function entries */
+static void stress_collect_cb(DECAF_Callback_Params *param)
+{
+	unsigned char insn_buf[2];
+	uint64_t key;
+	int b;
+
+	if (stress_count >= stress_target)
+		return;
+	if (DECAF_read_mem(param->be.env, param->be.cur_pc, 2, insn_buf) < 0)
+		return;
+	switch (insn_buf[0]) {
+	case 0x9a:
+	case 0xe8:
+		break;
+	case 0xff:
+		b = (insn_buf[1] >> 3) & 7;
+		if (b == 2 || b == 3)
+			break;
+		return;
+	default:
+		return;
+	}
+
+	key = ((uint64_t) DECAF_getPGD(param->be.env) << 32) | param->be.next_pc;
+	if (g_hash_table_lookup(stress_seen, &key))
+		return;
+	stress_keys[stress_count] = key;
+	stress_hooks[stress_count].pc = param->be.next_pc;
+	stress_hooks[stress_count].cr3 = DECAF_getPGD(param->be.env);
+	stress_hooks[stress_count].handle = 0;
+	g_hash_table_insert(stress_seen, &stress_keys[stress_count], GINT_TO_POINTER(1));
+	stress_count++;
+}
+
+static int64_t stress_hook_all(void)
+{
+	int64_t start = get_clock();
+	uint32_t i;
+
+	for (i = 0; i < stress_count; i++)
+		stress_hooks[i].handle = hookapi_hook_function(1, stress_hooks[i].pc,
+				stress_hooks[i].cr3, stress_entry, (void *) (uintptr_t) i, 0);
+	return get_clock() - start;
+}
+
+static void stress_print_flushes(const char *what, const uint64_t before[3])
+{
+	uint64_t now[3];
+
+	DECAF_getFlushCounts(now);
+	DECAF_printf("%s: %llu page, %llu block and %llu full flushes requested\n", what,
+			(unsigned long long) (now[PAGE_LEVEL] - before[PAGE_LEVEL]),
+			(unsigned long long) (now[BLOCK_LEVEL] - before[BLOCK_LEVEL]),
+			(unsigned long long) (now[ALL_CACHE] - before[ALL_CACHE]));
+}
+
+static void stress_collect_done(void *opaque)
+{
+	uint64_t flushes[3];
+	int64_t ns;
+
+	if (stress_count < stress_target
+			&& qemu_get_clock_ms(rt_clock) - collect_start < STRESS_COLLECT_TIMEOUT_MS) {
+		qemu_mod_timer(collect_timer, qemu_get_clock_ms(rt_clock) + STRESS_COLLECT_MS);
+		return;
+	}
+
+	DECAF_unregisterOptimizedBlockEndCallback(collect_handle);
+	collect_handle = DECAF_NULL_HANDLE;
+	DECAF_printf("Collected %u call targets\n", stress_count);
+
+	stress_reset_slots();
+	DECAF_getFlushCounts(flushes);
+	ns = stress_hook_all();
+	stress_installed = 1;
+	DECAF_printf("Installed %u hooks in %.3f ms, %.0f ns per hook\n", stress_count,
+			ns / 1000000.0, stress_count ? (double) ns / stress_count : 0.0);
+	stress_print_flushes("Install", flushes);
+}
+
+static void stress_remove_all(void)
+{
+	uint32_t i;
+
+	if (collect_handle != DECAF_NULL_HANDLE) {
+		DECAF_unregisterOptimizedBlockEndCallback(collect_handle);
+		collect_handle = DECAF_NULL_HANDLE;
+	}
+	if (collect_timer)
+		qemu_del_timer(collect_timer);
+	if (stress_installed) {
+		for (i = 0; i < stress_count; i++)
+			if (stress_hooks[i].handle)
+				hookapi_remove_hook(stress_hooks[i].handle);
+		for (i = 0; i < STRESS_MAX_RETURNS; i++)
+			if (stress_slots[i].next_free == SLOT_IN_USE)
+				hookapi_remove_hook(stress_slots[i].handle);
+		stress_installed = 0;
+	}
+	if (stress_seen) {
+		g_hash_table_destroy(stress_seen);
+		stress_seen = NULL;
+	}
+	free(stress_hooks);
+	free(stress_keys);
+	stress_hooks = NULL;
+	stress_keys = NULL;
+	stress_count = stress_target = 0;
+}
+
+void do_hookapitests_stress(Monitor *mon, const QDict *qdict)
+{
+	int64_t n = qdict_get_int(qdict, "hooks");
+
+	if (n <= 0 || n > STRESS_MAX_HOOKS) {
+		DECAF_printf("The number of hooks must be between 1 and %d\n", STRESS_MAX_HOOKS);
+		return;
+	}
+	stress_remove_all();
+
+	stress_hooks = (stress_hook_t *) calloc(n, sizeof(stress_hook_t));
+	stress_keys = (uint64_t *) calloc(n, sizeof(uint64_t));
+	if (!stress_hooks || !stress_keys) {
+		DECAF_printf("Out of memory\n");
+		stress_remove_all();
+		return;
+	}
+	stress_seen = g_hash_table_new(g_int64_hash, g_int64_equal);
+	stress_target = n;
+	entries = returns = returns_dropped = 0;
+	max_pending = 0;
+	DECAF_getFlushCounts(flush_base);
+
+	collect_handle = DECAF_registerOptimizedBlockEndCallback(stress_collect_cb, NULL, INV_ADDR, INV_ADDR);
+	if (collect_handle == DECAF_NULL_HANDLE) {
+		DECAF_printf("Could not register the block end callback\n");
+		stress_remove_all();
+		return;
+	}
+	if (!collect_timer)
+		collect_timer = qemu_new_timer_ms(rt_clock, stress_collect_done, NULL);
+	collect_start = qemu_get_clock_ms(rt_clock);
+	qemu_mod_timer(collect_timer, collect_start + STRESS_COLLECT_MS);
+	DECAF_printf("Collecting %u call targets, let the guest run\n", stress_target);
+}
+
+void do_hookapitests_churn(Monitor *mon, const QDict *qdict)
+{
+	int64_t rounds = qdict_get_int(qdict, "rounds");
+	int64_t remove_ns = 0, add_ns = 0, t;
+	uint64_t flushes[3], ops = 0;
+	uint32_t seed = 1, k, i, j, *picked;
+
+	if (!stress_installed || stress_count == 0) {
+		DECAF_printf("Run hookapitests_stress first\n");
+		return;
+	}
+	k = stress_count / 10 ? stress_count / 10 : 1;
+	picked = (uint32_t *) malloc(k * sizeof(uint32_t));
+	if (!picked)
+		return;
+
+	DECAF_getFlushCounts(flushes);
+	for (; rounds > 0; rounds--) {
+		//a tenth of the hooks, maybe twice the same
+		for (j = 0; j < k; j++) {
+			seed = seed * 1103515245 + 12345;
+			picked[j] = (seed >> 8) % stress_count;
+		}
+		t = get_clock();
+		for (j = 0; j < k; j++) {
+			i = picked[j];
+			if (stress_hooks[i].handle) {
+				hookapi_remove_hook(stress_hooks[i].handle);
+				stress_hooks[i].handle = 0;
+				ops++;
+			}
+		}
+		remove_ns += get_clock() - t;
+		t = get_clock();
+		for (j = 0; j < k; j++) {
+			i = picked[j];
+			if (!stress_hooks[i].handle)
+				stress_hooks[i].handle = hookapi_hook_function(1, stress_hooks[i].pc,
+						stress_hooks[i].cr3, stress_entry, (void *) (uintptr_t) i, 0);
+		}
+		add_ns += get_clock() - t;
+	}
+	free(picked);
+
+	DECAF_printf("Churned %llu hooks: %.0f ns per removal, %.0f ns per install\n",
+			(unsigned long long) ops, ops ? (double) remove_ns / ops : 0.0,
+			ops ? (double) add_ns / ops : 0.0);
+	stress_print_flushes("Churn", flushes);
+}
+
+void do_hookapitests_saveload(Monitor *mon, const QDict *qdict)
+{
+	const char *file = qdict_get_str(qdict, "file");
+	char file2[PATH_MAX], plugin_path[PATH_MAX];
+	hookapi_stats_t before, after;
+	int64_t t0, t1, t2;
+	uint64_t flushes[3];
+	FILE *fp;
+	long size = -1, size2 = -2;
+	Dl_info dl;
+
+	if (!stress_installed) {
+		DECAF_printf("Run hookapitests_stress first\n");
+		return;
+	}
+	hookapi_get_stats(&before);
+	DECAF_getFlushCounts(flushes);
+
+	t0 = get_clock();
+	if (hookapi_save_file(file) != 0) {
+		DECAF_printf("Could not save the hooks to %s\n", file);
+		return;
+	}
+	t1 = get_clock();
+	//this replaces the hooks of all of the plugins, as loadvm does
+	if (hookapi_load_file(file) != 0)
+		DECAF_printf("Could not load the hooks from %s\n", file);
+	t2 = get_clock();
+	hookapi_get_stats(&after);
+
+	//saving the restored hooks again gives the same records
+	snprintf(file2, sizeof(file2), "%s.2", file);
+	if (hookapi_save_file(file2) == 0 && (fp = fopen(file2, "rb"))) {
+		fseek(fp, 0, SEEK_END);
+		size2 = ftell(fp);
+		fclose(fp);
+	}
+	if ((fp = fopen(file, "rb"))) {
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fclose(fp);
+	}
+
+	DECAF_printf("Saved %u hooks in %.3f ms (%ld bytes), restored %u in %.3f ms\n",
+			before.records, (t1 - t0) / 1000000.0, size, after.records, (t2 - t1) / 1000000.0);
+	DECAF_printf("Restored hooks %s the saved ones\n",
+			(before.records == after.records && size == size2) ? "match" : "DO NOT match");
+	stress_print_flushes("Save and restore", flushes);
+
+	/* The restored hooks have new handles: drop the hooks of this plugin,
+	   the pending returns included, and hook the call targets again */
+	if (dladdr((void *) stress_entry, &dl) != 0) {
+		strncpy(plugin_path, dl.dli_fname, PATH_MAX - 1);
+		plugin_path[PATH_MAX - 1] = '\0';
+		hookapi_flush_hooks(plugin_path);
+	}
+	stress_reset_slots();
+	stress_hook_all();
+	DECAF_printf("The stress hooks are installed again, the other hooks of hookapitests are gone\n");
+}
+
+void do_hookapitests_stats(Monitor *mon, const QDict *qdict)
+{
+	hookapi_stats_t stats;
+	int i;
+
+	hookapi_get_stats(&stats);
+	DECAF_printf("Hooks: %u (%u waiting for their module)\n", stats.records, stats.unresolved);
+	DECAF_printf("Buckets: %u used of %u, longest chain %u, %.2f hooks per used bucket\n",
+			stats.used_buckets, stats.buckets, stats.max_chain,
+			stats.used_buckets ? (double) stats.records / stats.used_buckets : 0.0);
+	for (i = 0; i < HOOKAPI_STATS_CHAINS; i++)
+		if (stats.chains[i])
+			DECAF_printf("  %s%2d hooks: %u buckets\n", i == HOOKAPI_STATS_CHAINS - 1 ? ">=" : "  ",
+					i, stats.chains[i]);
+	DECAF_printf("Longest probe: %u buckets\n", stats.max_probe);
+	DECAF_printf("Dispatches: %llu, %.2f buckets probed, %.2f hooks compared and %.2f invoked per dispatch\n",
+			(unsigned long long) stats.dispatches,
+			stats.dispatches ? (double) stats.probes / stats.dispatches : 0.0,
+			stats.dispatches ? (double) stats.visited / stats.dispatches : 0.0,
+			stats.dispatches ? (double) stats.invoked / stats.dispatches : 0.0);
+	if (stats.timed)
+		DECAF_printf("Dispatch latency: %.0f ns, hooks excluded, over %llu dispatches\n",
+				(double) stats.dispatch_ns / stats.timed, (unsigned long long) stats.timed);
+	DECAF_printf("Stress: %llu entries, %llu returns, %u pending (at most %u), %llu returns not hooked\n",
+			(unsigned long long) entries, (unsigned long long) returns, pending, max_pending,
+			(unsigned long long) returns_dropped);
+	stress_print_flushes("Since the last reset", flush_base);
+
+	if (qdict_get_try_bool(qdict, "reset", 0) || qdict_get_try_bool(qdict, "timing", 0)) {
+		hookapi_reset_stats(qdict_get_try_bool(qdict, "timing", 0));
+		entries = returns = returns_dropped = 0;
+		max_pending = pending;
+		DECAF_getFlushCounts(flush_base);
+		DECAF_printf("Counters reset, dispatch timing %s\n", qdict_get_try_bool(qdict, "timing", 0) ? "on" : "off");
+	}
+}
+
+void do_hookapitests_unstress(Monitor *mon, const QDict *qdict)
+{
+	stress_remove_all();
+	DECAF_printf("Stress hooks removed\n");
+}
+
+void hookapi_stress_cleanup(void)
+{
+	stress_remove_all();
+	if (collect_timer) {
+		qemu_free_timer(collect_timer);
+		collect_timer = NULL;
+	}
+	hookapi_reset_stats(0);
+}
@@ -0,0 +1,43 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * hookapi_stress.h
+ *
+ * Monitor commands of the hookapi stress harness.
+ */
+
+#ifndef HOOKAPI_STRESS_H_
+#define HOOKAPI_STRESS_H_
+
+#include "monitor.h"
+
+/* Hook the targets of the next <hooks> distinct calls, and their returns */
+void do_hookapitests_stress(Monitor *mon, const QDict *qdict);
+
+/* Remove and install again a tenth of the stress hooks, <rounds> times */
+void do_hookapitests_churn(Monitor *mon, const QDict *qdict);
+
+/* Save all of the hooks to <file> and restore them */
+void do_hookapitests_saveload(Monitor *mon, const QDict *qdict);
+
+/* Print the hook table statistics; -r resets the counters, -t also times
+   the dispatches */
+void do_hookapitests_stats(Monitor *mon, const QDict *qdict);
+
+/* Remove the stress hooks */
+void do_hookapitests_unstress(Monitor *mon, const QDict *qdict);
+
+void hookapi_stress_cleanup(void);
+
+#endif /* HOOKAPI_STRESS_H_ */
@@ -25,6 +25,7 @@ http://code.google.com/p/decaf-platform/
 #include "shared/vmi_callback.h"
 #include "utils/Output.h"
 #include "custom_handlers.h"
+#include "hookapi_stress.h"
 
 //basic stub for plugins
 static plugin_interface_t hookapitests_interface;
@@ -176,6 +177,8 @@ static void hookapitests_cleanup(void)
 
 	DECAF_printf("Bye world\n");
 
+	hookapi_stress_cleanup();
+
 	if (processbegin_handle != DECAF_NULL_HANDLE) {
 		VMI_unregister_callback(VMI_CREATEPROC_CB,
 				processbegin_handle);
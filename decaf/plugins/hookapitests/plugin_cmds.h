@@ -5,3 +5,38 @@
 	.params		= "[procname]",
 	.help		= "Run the tests with program [procname]"
 },
+{
+	.name		= "hookapitests_stress",
+	.args_type	= "hooks:i",
+	.mhandler.cmd	= do_hookapitests_stress,
+	.params		= "hooks",
+	.help		= "Hook the targets of the next [hooks] distinct calls of the guest, and their returns"
+},
+{
+	.name		= "hookapitests_churn",
+	.args_type	= "rounds:i",
+	.mhandler.cmd	= do_hookapitests_churn,
+	.params		= "rounds",
+	.help		= "Remove and install again a tenth of the stress hooks, [rounds] times"
+},
+{
+	.name		= "hookapitests_saveload",
+	.args_type	= "file:F",
+	.mhandler.cmd	= do_hookapitests_saveload,
+	.params		= "file",
+	.help		= "Save all of the hooks to [file] and restore them, as a snapshot does"
+},
+{
+	.name		= "hookapitests_stats",
+	.args_type	= "reset:-r,timing:-t",
+	.mhandler.cmd	= do_hookapitests_stats,
+	.params		= "[-r] [-t]",
+	.help		= "Print the hookapi table statistics; -r resets the counters, -t also times the dispatches"
+},
+{
+	.name		= "hookapitests_unstress",
+	.args_type	= "",
+	.mhandler.cmd	= do_hookapitests_unstress,
+	.params		= "",
+	.help		= "Remove the stress hooks"
+},
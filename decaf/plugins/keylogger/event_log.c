@@ -0,0 +1,228 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "main-loop.h"
+#include "qemu-timer.h"
+#include "utils/SlotQueue.h"
+
+#include "DECAF_main.h"
+#include "function_map.h"
+#include "vmi_c_wrapper.h"
+#include "event_log.h"
+
+/* The ring is cut in batches of records. The emulation thread appends to
+   the batch of the queue's fill slot and the formatter thread formats the
+   submitted batches */
+struct event_batch {
+	int n;
+	struct key_event ev[EVENT_LOG_BATCH];
+};
+
+struct _event_log {
+	FILE *log;
+	struct event_batch *batches;
+	SlotQueue_t *queue;
+	QEMUTimer *flush_timer;
+	uint32_t dropped;
+
+	/* owned by the formatter thread */
+	GString *text;
+};
+
+/* Last lookups of a batch. The guest runs between two batches, so they
+   are not kept from one batch to the next */
+static struct {
+	uint32_t cr3;
+	uint32_t base;
+	uint32_t size;
+	char proc[128];
+	tmodinfo_t mod;
+} last_module;
+
+static struct {
+	uint32_t cr3;
+	uint32_t entry;
+	char mod[512];
+	char func[512];
+} last_caller;
+
+static void locate_module(uint32_t eip, uint32_t cr3)
+{
+	if (cr3 == last_module.cr3 && eip - last_module.base < last_module.size)
+		return;
+
+	last_module.cr3 = cr3;
+	if (VMI_locate_module_c(eip, cr3, last_module.proc, &last_module.mod) == -1) {
+		strcpy(last_module.proc, "<None>");
+		memset(&last_module.mod, 0, sizeof(last_module.mod));
+		//not in a module, do not look it up again for this page
+		last_module.base = eip & TARGET_PAGE_MASK;
+		last_module.size = TARGET_PAGE_SIZE;
+		return;
+	}
+	last_module.base = last_module.mod.base;
+	last_module.size = last_module.mod.size;
+}
+
+static void locate_caller(uint32_t entry, uint32_t cr3)
+{
+	if (entry == last_caller.entry && cr3 == last_caller.cr3)
+		return;
+
+	last_caller.entry = entry;
+	last_caller.cr3 = cr3;
+	if (entry == 0 || funcmap_get_name_c(entry, cr3, last_caller.mod, last_caller.func) != 0) {
+		last_caller.mod[0] = '\0';
+		last_caller.func[0] = '\0';
+	}
+}
+
+/* Look up and format n records, with the global mutex held so that the
+   module lists do not change under us, then write them without it */
+static void event_log_format(EventLog *l, const struct key_event *batch, int n)
+{
+	const struct key_event *ev;
+	int i;
+
+	memset(&last_module, 0, sizeof(last_module));
+	memset(&last_caller, 0, sizeof(last_caller));
+
+	qemu_mutex_lock_iothread();
+	for (i = 0; i < n; i++) {
+		ev = &batch[i];
+		locate_module(ev->eip, ev->cr3);
+		locate_caller(ev->caller, ev->cr3);
+		if (ev->size <= 4)
+			g_string_append_printf(l->text,
+					"%s   \t %d \t 0x%08x \t\t 0x%08x \t %d      0x%08x  0x%08x %15s    \t%s\t%s\n",
+					last_module.proc, ev->is_write, ev->vaddr, ev->paddr, ev->size,
+					(uint32_t) ev->taint, ev->eip, last_module.mod.name,
+					last_caller.mod, last_caller.func);
+		else
+			g_string_append_printf(l->text,
+					"%s   \t %d \t 0x%08x \t\t 0x%08x \t %d      0x%16" PRIx64 "  0x%08x %15s    \t%s\t%s\n",
+					last_module.proc, ev->is_write, ev->vaddr, ev->paddr, ev->size,
+					ev->taint, ev->eip, last_module.mod.name,
+					last_caller.mod, last_caller.func);
+	}
+	qemu_mutex_unlock_iothread();
+
+	fwrite(l->text->str, 1, l->text->len, l->log);
+	fflush(l->log);
+	g_string_truncate(l->text, 0);
+}
+
+/* Format a batch, in the formatter thread */
+static void event_log_process(void *opaque, int slot)
+{
+	EventLog *l = opaque;
+	struct event_batch *b = &l->batches[slot];
+
+	event_log_format(l, b->ev, b->n);
+	b->n = 0;
+}
+
+/* Hand over a partial batch, so that records of a slow typist do not
+   wait for the batch to fill. Runs in the main loop, with the global
+   mutex held like event_log_push */
+static void event_log_flush(void *opaque)
+{
+	EventLog *l = opaque;
+
+	if (l->batches[SlotQueue_fill_slot(l->queue)].n)
+		SlotQueue_try_submit(l->queue);
+	qemu_mod_timer(l->flush_timer, qemu_get_clock_ms(rt_clock) + EVENT_LOG_FLUSH_MS);
+}
+
+EventLog *event_log_open(FILE *log)
+{
+	EventLog *l;
+
+	l = calloc(1, sizeof(EventLog));
+	if (l == NULL)
+		return NULL;
+	l->batches = calloc(EVENT_LOG_SLOTS, sizeof(struct event_batch));
+	if (l->batches == NULL) {
+		free(l);
+		return NULL;
+	}
+	l->log = log;
+	l->text = g_string_sized_new(EVENT_LOG_BATCH * 128);
+
+	l->queue = SlotQueue_new(EVENT_LOG_SLOTS, event_log_process, l);
+	if (l->queue == NULL) {
+		g_string_free(l->text, TRUE);
+		free(l->batches);
+		free(l);
+		return NULL;
+	}
+
+	l->flush_timer = qemu_new_timer_ms(rt_clock, event_log_flush, l);
+	qemu_mod_timer(l->flush_timer, qemu_get_clock_ms(rt_clock) + EVENT_LOG_FLUSH_MS);
+
+	return l;
+}
+
+void event_log_push(EventLog *l, const struct key_event *ev)
+{
+	struct event_batch *b = &l->batches[SlotQueue_fill_slot(l->queue)];
+
+	/* the formatter thread needs the global mutex, that the emulation
+	   thread holds, to make room: waiting here would deadlock */
+	if (b->n == EVENT_LOG_BATCH) {
+		if (SlotQueue_try_submit(l->queue) < 0) {
+			l->dropped++;
+			return;
+		}
+		b = &l->batches[SlotQueue_fill_slot(l->queue)];
+	}
+	b->ev[b->n++] = *ev;
+
+	//only full batches are handed over here; a full batch that cannot go
+	//yet is tried again above, and the flush timer hands over the rest
+	if (b->n == EVENT_LOG_BATCH)
+		SlotQueue_try_submit(l->queue);
+}
+
+void event_log_close(EventLog *l)
+{
+	if (l == NULL)
+		return;
+
+	qemu_del_timer(l->flush_timer);
+	qemu_free_timer(l->flush_timer);
+
+	/* the formatter thread needs the global mutex for the records that
+	   are left */
+	qemu_mutex_unlock_iothread();
+	if (l->batches[SlotQueue_fill_slot(l->queue)].n)
+		SlotQueue_submit(l->queue);
+	SlotQueue_delete(l->queue);
+	qemu_mutex_lock_iothread();
+
+	if (l->dropped) {
+		fprintf(l->log, "%u records were dropped, the ring was full\n", l->dropped);
+		DECAF_printf("keylogger: %u records were dropped, the ring was full\n", l->dropped);
+	}
+
+	g_string_free(l->text, TRUE);
+	free(l->batches);
+	free(l);
+}
@@ -0,0 +1,63 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+This is a plugin of DECAF. You can redistribute and modify it
+under the terms of BSD license but it is made available
+WITHOUT ANY WARRANTY. See the top-level COPYING file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * event_log.h
+ *
+ * The taint callbacks only put a fixed-size record of each access into a
+ * ring; a formatter thread looks up the process, the module and the
+ * caller of the records and writes them as text lines to the log.
+ */
+#ifndef EVENT_LOG_H_INCLUDED
+#define EVENT_LOG_H_INCLUDED
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "DECAF_types.h"
+
+/* Number of records the ring holds */
+#define EVENT_LOG_RING 65536
+
+/* Largest number of records formatted at once */
+#define EVENT_LOG_BATCH 4096
+
+#define EVENT_LOG_SLOTS (EVENT_LOG_RING / EVENT_LOG_BATCH)
+
+/* A partial batch is handed to the formatter thread after this long */
+#define EVENT_LOG_FLUSH_MS 200
+
+struct key_event {
+	gva_t vaddr;
+	gpa_t paddr;
+	uint64_t taint; //the taint of the first 8 bytes
+	uint32_t eip;
+	uint32_t cr3;
+	uint32_t caller; //entry of the function called last in cr3, or 0
+	uint8_t is_write;
+	uint8_t size;
+	uint8_t reserved[2];
+};
+
+typedef struct _event_log EventLog;
+
+/* Start the formatter thread, writing to log. Returns NULL on error */
+EventLog *event_log_open(FILE *log);
+
+/* Queue a record. It is dropped, and counted, if the ring is full */
+void event_log_push(EventLog *l, const struct key_event *ev);
+
+/* Write out the queued records and stop the formatter thread. The caller
+   holds the global mutex, which is released while waiting */
+void event_log_close(EventLog *l);
+
+#endif /* EVENT_LOG_H_INCLUDED */
@@ -28,6 +28,7 @@ http://code.google.com/p/decaf-platform/
 #include "function_map.h"
 #include "vmi_callback.h"
 #include "vmi_c_wrapper.h"
+#include "event_log.h"
 //basic stub for plugins
 static plugin_interface_t keylogger_interface;
 static int taint_key_enabled=0;
@@ -37,6 +38,7 @@ DECAF_Handle handle_write_taint_mem = DECAF_NULL_HANDLE;
 DECAF_Handle handle_read_taint_mem = DECAF_NULL_HANDLE;
 DECAF_Handle handle_block_end_cb = DECAF_NULL_HANDLE;
 FILE * keylogger_log=DECAF_NULL_HANDLE;
+static EventLog *keylogger_events = NULL;
 
 #define MAX_STACK_SIZE 5000
 char modname_t[512];
@@ -119,78 +121,34 @@ void do_block_end_cb(DECAF_Callback_Params *param)
 	check_ret(param);
 
 }
-void do_read_taint_mem(DECAF_Callback_Params *param)
+/* The callbacks only queue a record, the event log looks it up and formats
+   it on its own thread */
+static void push_taint_event(DECAF_Callback_Params *param, int is_write)
 {
-	uint32_t eip=DECAF_getPC(cpu_single_env);
-	uint32_t cr3= DECAF_getPGD(cpu_single_env);
-	char name[128];
-	tmodinfo_t dm;// (tmodinfo_t *) malloc(sizeof(tmodinfo_t));
-	if(VMI_locate_module_c(eip,cr3, name, &dm) == -1)
-	{
-		strcpy(name, "<None>");
-		bzero(&dm, sizeof(dm));
-	}
-	if(stack_top)
-	{
-		if(cr3 == cr3_stack[stack_top-1])
-			funcmap_get_name_c(sys_call_entry_stack[stack_top-1], cr3, modname_t, func_name_t);
-		else {
-			memset(modname_t, 0, 512);
-			memset(func_name_t, 0, 512);
-		}
-	}
-	else {
-		memset(modname_t, 0, 512);
-		memset(func_name_t, 0, 512);
-	}
-	if(param->rt.size <=4)
-		fprintf(keylogger_log,"%s   \t 0 \t 0x%08x \t\t 0x%08x \t %d      0x%08x  0x%08x %15s    \t%s\t%s\n",
-			name, param->rt.vaddr, param->rt.paddr, param->rt.size,*((uint32_t *)param->rt.taint_info), eip, dm.name,modname_t,func_name_t);
-	else
-		fprintf(keylogger_log,"%s   \t 0 \t 0x%08x \t\t 0x%08x \t %d      0x%16x  0x%08x %15s     \t%s\t%s\n",
-					name, param->rt.vaddr, param->rt.paddr, param->rt.size,*((uint32_t *)param->rt.taint_info), eip, dm.name,  modname_t,func_name_t);
-
-
+	struct key_event ev;
+	uint32_t cr3 = DECAF_getPGD(cpu_single_env);
+
+	ev.vaddr = param->rt.vaddr;
+	ev.paddr = param->rt.paddr;
+	ev.size = param->rt.size;
+	ev.is_write = is_write;
+	ev.eip = DECAF_getPC(cpu_single_env);
+	ev.cr3 = cr3;
+	ev.caller = (stack_top && cr3 == cr3_stack[stack_top-1]) ?
+			sys_call_entry_stack[stack_top-1] : 0;
+	ev.taint = 0;
+	memcpy(&ev.taint, param->rt.taint_info, ev.size < 8 ? ev.size : 8);
+	event_log_push(keylogger_events, &ev);
 }
 
+void do_read_taint_mem(DECAF_Callback_Params *param)
+{
+	push_taint_event(param, 0);
+}
 
 void do_write_taint_mem(DECAF_Callback_Params *param)
 {
-	uint32_t eip= DECAF_getPC(cpu_single_env);
-	uint32_t cr3= DECAF_getPGD(cpu_single_env);
-	char name[128];
-	tmodinfo_t  dm;// (tmodinfo_t *) malloc(sizeof(tmodinfo_t));
-	if(VMI_locate_module_c(eip,cr3, name, &dm) == -1)
-	{
-		strcpy(name, "<None>");
-		bzero(&dm, sizeof(dm));
-	}
-
-	if(stack_top)
-	{
-		if(cr3 == cr3_stack[stack_top-1])
-			funcmap_get_name_c(sys_call_entry_stack[stack_top-1], cr3, modname_t, func_name_t);
-		else {
-			memset(modname_t, 0, 512);
-			memset(func_name_t, 0, 512);
-		}
-	}
-	else {
-		memset(modname_t, 0, 512);
-		memset(func_name_t, 0, 512);
-	}
-
-	//fprintf(keylogger_log,"%s    1  0x%08x  0x%08x  %d   0x%08x %s   0x%08x  %d    %s\n",
-	//		name, param->rt.vaddr, param->rt.paddr, param->rt.size, eip, dm->name, dm->base, dm->size, dm->fullname);
-	if(param->rt.size <=4)
-			fprintf(keylogger_log,"%s   \t 1 \t 0x%08x \t\t 0x%08x \t %d      0x%08x  0x%08x %15s   \t%s\t%s\n",
-				name, param->rt.vaddr, param->rt.paddr, param->rt.size,*((uint32_t *)param->rt.taint_info), eip, dm.name,modname_t,func_name_t);
-		else
-			fprintf(keylogger_log,"%s   \t 1 \t 0x%08x \t\t 0x%08x \t %d      0x%16x  0x%08x %15s    \t%s\t%s\n",
-						name, param->rt.vaddr, param->rt.paddr, param->rt.size,*((uint32_t *)param->rt.taint_info), eip, dm.name, modname_t,func_name_t);
-
-
-
+	push_taint_event(param, 1);
 }
 
 static void tracing_send_keystroke(DECAF_Callback_Params *params)
@@ -225,14 +183,17 @@ void do_taint_sendkey(Monitor *mon, const QDict *qdict)
 
 void keylogger_cleanup()
 {
-	  if(keylogger_log)
-			fclose(keylogger_log);
 		if(handle_read_taint_mem)
 			DECAF_unregister_callback(DECAF_READ_TAINTMEM_CB,handle_read_taint_mem);
 		if(handle_write_taint_mem)
 			DECAF_unregister_callback(DECAF_WRITE_TAINTMEM_CB,handle_write_taint_mem);
 		if(handle_block_end_cb)
 			DECAF_unregisterOptimizedBlockEndCallback(handle_block_end_cb);
+		//the callbacks are gone, write out what they queued
+		event_log_close(keylogger_events);
+		if(keylogger_log)
+			fclose(keylogger_log);
+		keylogger_events = NULL;
 		handle_read_taint_mem = DECAF_NULL_HANDLE;
 		handle_write_taint_mem = DECAF_NULL_HANDLE;
 		keylogger_log = NULL;
@@ -242,6 +203,8 @@ void keylogger_cleanup()
 void do_enable_keylogger_check( Monitor *mon, const QDict *qdict)
 {
 	const char *tracefile_t = qdict_get_str(qdict, "tracefile");
+	if(keylogger_events)
+		keylogger_cleanup();
 	keylogger_log= fopen(tracefile_t,"w");
 	if(!keylogger_log)
 	{
@@ -250,6 +213,14 @@ void do_enable_keylogger_check( Monitor *mon, const QDict *qdict)
 	}
 	fprintf(keylogger_log,"Process Read(0)/Write(1) vaddOfTaintedMem   paddrOfTaintedMem    Size   "
 			"TaintInfo   CurEIP \t ModuleName   \t CallerModuleName \t CallerSystemCall\n");
+	keylogger_events = event_log_open(keylogger_log);
+	if(!keylogger_events)
+	{
+		DECAF_printf("cannot start the keylogger event log\n");
+		fclose(keylogger_log);
+		keylogger_log = NULL;
+		return;
+	}
 	if(!handle_read_taint_mem)
 		handle_read_taint_mem = DECAF_register_callback(DECAF_READ_TAINTMEM_CB,do_read_taint_mem,NULL);
 	if(!handle_write_taint_mem)
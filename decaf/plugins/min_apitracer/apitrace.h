@@ -0,0 +1,129 @@
+/*
+ * apitrace.h
+ *
+ * Binary API trace. The config file is compiled into a flat table of APIs
+ * and of the reads of their arguments, which the plugin uses to capture
+ * each call and which heads the trace, so that apitrace_print can turn the
+ * trace back into text without the config file.
+ *
+ * Layout, in host byte order:
+ *   struct apitrace_header
+ *   struct apitrace_api[n_apis]
+ *   struct apitrace_arg[n_args]   the arguments of all the apis, in order
+ *   records: struct apitrace_rec followed by len bytes
+ *
+ * The payload of a call record holds, in order: the value before the call
+ * of each argument that has one (see apitrace_arg_has_before), then the
+ * value after the call of each argument that has one, then the return
+ * value (ret_size bytes). A number takes size bytes; a string takes one
+ * length byte followed by that many characters.
+ */
+
+#ifndef APITRACE_H_
+#define APITRACE_H_
+
+#include <stdio.h>
+#include <inttypes.h>
+
+#define APITRACE_MAGIC "DECAFAPI"
+#define APITRACE_VERSION 1
+
+#define APITRACE_NAME_SIZE 128
+#define APITRACE_MODULE_NAME_SIZE 32
+/* Longest string captured, in characters */
+#define APITRACE_STR_MAX 127
+/* Largest call record, header included */
+#define APITRACE_REC_MAX 4096
+#define APITRACE_MAX_ARGS 32
+/* Largest part of the stack read at the entry, return address included */
+#define APITRACE_STACK_MAX 256
+
+struct apitrace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_apis;
+	uint32_t n_args;
+	uint32_t reserved;
+};
+
+/* How an argument is read */
+enum {
+	APITRACE_OP_SKIP	= 0, //ignored, nothing is recorded
+	APITRACE_OP_VALUE	= 1, //the number on the stack
+	APITRACE_OP_DEREF	= 2, //the number the pointer on the stack points to
+	APITRACE_OP_STR		= 3, //the string the pointer on the stack points to
+};
+
+/* Values of apitrace_api.flags */
+#define APITRACE_API_KERNEL 1
+#define APITRACE_API_STACK 2 //arguments on the stack (stdcall or cdecl)
+
+struct apitrace_api {
+	char modname[APITRACE_NAME_SIZE];
+	char apiname[APITRACE_NAME_SIZE];
+	char retname[APITRACE_NAME_SIZE];
+	uint32_t first_arg; //index in the argument table
+	uint16_t n_args;
+	uint16_t stack_size; //bytes read from esp at the entry
+	uint16_t max_len; //largest payload of a call
+	uint8_t ret_type; //ArgType, see parser.h
+	uint8_t ret_size; //0 if the return value is not recorded
+	uint8_t flags;
+	uint8_t reserved[3];
+};
+
+struct apitrace_arg {
+	char name[APITRACE_NAME_SIZE];
+	uint16_t stack_off; //from esp at the entry
+	uint8_t type; //ArgType
+	uint8_t spec; //ArgSpec
+	uint8_t op;
+	uint8_t size; //of a number
+	uint8_t reserved[2];
+};
+
+/* Types of records */
+enum {
+	APITRACE_REC_CALL	= 1,
+	APITRACE_REC_MODULE	= 2, //a caller module, struct apitrace_module
+};
+
+struct apitrace_rec {
+	uint16_t type;
+	uint16_t len; //of the payload
+	uint32_t api; //index in the api table
+	uint32_t pid;
+	uint32_t tid;
+	uint32_t caller; //return address
+};
+
+struct apitrace_module {
+	uint32_t base;
+	uint32_t size;
+	char name[APITRACE_MODULE_NAME_SIZE];
+};
+
+/* ArgSpec and ArgType values, as in parser.h */
+#define APITRACE_SPEC_IN 1
+#define APITRACE_SPEC_OUT 2
+#define APITRACE_TYPE_VOID 9
+
+static inline int apitrace_arg_has_before(const struct apitrace_arg *arg)
+{
+	return arg->op != APITRACE_OP_SKIP && (arg->spec & APITRACE_SPEC_IN);
+}
+
+static inline int apitrace_arg_has_after(const struct apitrace_arg *arg)
+{
+	/* a number on the stack does not change */
+	return arg->op != APITRACE_OP_SKIP && arg->op != APITRACE_OP_VALUE
+			&& (arg->spec & APITRACE_SPEC_OUT);
+}
+
+/* Largest encoding of a value of arg */
+static inline unsigned int apitrace_arg_max_len(const struct apitrace_arg *arg)
+{
+	return arg->op == APITRACE_OP_STR ? 1 + APITRACE_STR_MAX : arg->size;
+}
+
+#endif /* APITRACE_H_ */
@@ -0,0 +1,201 @@
+/*
+ * apitrace_print.c
+ *
+ * Prints a binary API trace (see apitrace.h) as text, one line per call.
+ *
+ * Usage: apitrace_print tracefile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "apitrace.h"
+
+#define MAX_MODULES 1024
+
+static struct apitrace_api *apis;
+static struct apitrace_arg *args;
+static struct apitrace_header hdr;
+
+static struct {
+	uint32_t pid;
+	struct apitrace_module m;
+} modules[MAX_MODULES];
+static int n_modules = 0;
+
+static void add_module(uint32_t pid, const struct apitrace_module *m)
+{
+	int i;
+
+	for(i = 0; i < n_modules; i++)
+		if(modules[i].pid == pid && modules[i].m.base == m->base)
+			break;
+	if(i == MAX_MODULES)
+		return;
+	if(i == n_modules)
+		n_modules++;
+	modules[i].pid = pid;
+	modules[i].m = *m;
+	modules[i].m.name[APITRACE_MODULE_NAME_SIZE - 1] = '\0';
+}
+
+static const char *find_module(uint32_t pid, uint32_t addr)
+{
+	int i;
+
+	for(i = 0; i < n_modules; i++)
+		if(modules[i].pid == pid && addr - modules[i].m.base < modules[i].m.size)
+			return modules[i].m.name;
+	return "unknown";
+}
+
+/* Print the value at *p as arg says, and move *p past it. Returns -1 if the
+ * record is too short */
+static int print_value(char *out, size_t size, const struct apitrace_arg *arg,
+		unsigned int nbytes, const unsigned char **p, const unsigned char *end)
+{
+	uint64_t v = 0;
+	unsigned int len;
+
+	if(arg->op == APITRACE_OP_STR) {
+		if(*p >= end || (len = **p) > end - *p - 1 || len >= size)
+			return -1;
+		memcpy(out, *p + 1, len);
+		out[len] = '\0';
+		*p += 1 + len;
+		return 0;
+	}
+
+	if(nbytes > end - *p || nbytes > sizeof(v))
+		return -1;
+	memcpy(&v, *p, nbytes);
+	*p += nbytes;
+	switch(nbytes) {
+	case 1:
+		snprintf(out, size, "%02x", (unsigned int) v);
+		break;
+	case 2:
+		snprintf(out, size, "%04x", (unsigned int) v);
+		break;
+	case 4:
+		snprintf(out, size, "%08x", (unsigned int) v);
+		break;
+	default:
+		snprintf(out, size, "%llx", (unsigned long long) v);
+		break;
+	}
+	return 0;
+}
+
+static int print_call(const struct apitrace_rec *rec, const unsigned char *payload)
+{
+	char before[APITRACE_MAX_ARGS][APITRACE_STR_MAX + 1];
+	char after[APITRACE_MAX_ARGS][APITRACE_STR_MAX + 1];
+	char ret[32];
+	const unsigned char *p = payload, *end = payload + rec->len;
+	const struct apitrace_api *api;
+	const struct apitrace_arg *a;
+	struct apitrace_arg ret_arg;
+	int i;
+
+	if(rec->api >= hdr.n_apis)
+		return -1;
+	api = &apis[rec->api];
+	a = &args[api->first_arg];
+	if(api->n_args > APITRACE_MAX_ARGS)
+		return -1;
+
+	for(i = 0; i < api->n_args; i++)
+		if(apitrace_arg_has_before(&a[i])
+				&& print_value(before[i], sizeof(before[i]), &a[i], a[i].size, &p, end) != 0)
+			return -1;
+	for(i = 0; i < api->n_args; i++)
+		if(apitrace_arg_has_after(&a[i])
+				&& print_value(after[i], sizeof(after[i]), &a[i], a[i].size, &p, end) != 0)
+			return -1;
+	memset(&ret_arg, 0, sizeof(ret_arg));
+	if(api->ret_size && print_value(ret, sizeof(ret), &ret_arg, api->ret_size, &p, end) != 0)
+		return -1;
+
+	printf("PID:%u, TID:%u. Called from: %s:0x%08x, %s:%s( ", rec->pid, rec->tid,
+			find_module(rec->pid, rec->caller), rec->caller, api->modname, api->apiname);
+	for(i = 0; i < api->n_args; i++) {
+		printf("%s=", a[i].name);
+		if(a[i].op == APITRACE_OP_SKIP)
+			printf("IGNORED");
+		else if(apitrace_arg_has_before(&a[i]) && apitrace_arg_has_after(&a[i]))
+			printf("before:%s after:%s", before[i], after[i]);
+		else if(apitrace_arg_has_before(&a[i]))
+			printf("%s", before[i]);
+		else
+			printf("%s", after[i]);
+		if(i != api->n_args - 1)
+			printf(", ");
+	}
+	printf("), RET: ");
+	if(api->ret_size)
+		printf("%s=%s\n", api->retname, ret);
+	else if(api->ret_type == APITRACE_TYPE_VOID)
+		printf("VOID\n");
+	else
+		printf("%s=IGNORED\n", api->retname);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char payload[APITRACE_REC_MAX];
+	struct apitrace_rec rec;
+	uint32_t i;
+	FILE *fp;
+
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+		return 1;
+	}
+	fp = fopen(argv[1], "rb");
+	if(!fp) {
+		fprintf(stderr, "cannot open file %s\n", argv[1]);
+		return 1;
+	}
+
+	if(fread(&hdr, sizeof(hdr), 1, fp) != 1
+			|| memcmp(hdr.magic, APITRACE_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.version != APITRACE_VERSION) {
+		fprintf(stderr, "%s is not an API trace\n", argv[1]);
+		return 1;
+	}
+	apis = (struct apitrace_api *) calloc (hdr.n_apis + 1, sizeof(*apis));
+	args = (struct apitrace_arg *) calloc (hdr.n_args + 1, sizeof(*args));
+	if(!apis || !args
+			|| fread(apis, sizeof(*apis), hdr.n_apis, fp) != hdr.n_apis
+			|| fread(args, sizeof(*args), hdr.n_args, fp) != hdr.n_args) {
+		fprintf(stderr, "%s: truncated api table\n", argv[1]);
+		return 1;
+	}
+	for(i = 0; i < hdr.n_apis; i++) {
+		if(apis[i].first_arg > hdr.n_args || apis[i].n_args > hdr.n_args - apis[i].first_arg) {
+			fprintf(stderr, "%s: bad api table\n", argv[1]);
+			return 1;
+		}
+		apis[i].modname[APITRACE_NAME_SIZE - 1] = '\0';
+		apis[i].apiname[APITRACE_NAME_SIZE - 1] = '\0';
+		apis[i].retname[APITRACE_NAME_SIZE - 1] = '\0';
+	}
+	for(i = 0; i < hdr.n_args; i++)
+		args[i].name[APITRACE_NAME_SIZE - 1] = '\0';
+
+	while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+		if(rec.len > sizeof(payload) || fread(payload, 1, rec.len, fp) != rec.len) {
+			fprintf(stderr, "%s: truncated record\n", argv[1]);
+			return 1;
+		}
+		if(rec.type == APITRACE_REC_MODULE && rec.len == sizeof(struct apitrace_module))
+			add_module(rec.pid, (const struct apitrace_module *) payload);
+		else if(rec.type == APITRACE_REC_CALL && print_call(&rec, payload) != 0)
+			fprintf(stderr, "%s: bad record for api %u\n", argv[1], rec.api);
+	}
+
+	fclose(fp);
+	return 0;
+}
@@ -53,6 +53,7 @@ void do_tracing_stop (Monitor *mon, const QDict *qdict)
 	}
 
 	if(mon_proc.tracefile) {
+		handlers_stop();
 		fclose(mon_proc.tracefile);
 		mon_proc.cr3 = mon_proc.pid = 0;
 		mon_proc.tracefile = NULL;
@@ -87,7 +88,7 @@ void handle_trace_by_name(const char *procname, const char *config_file, const c
 	strncpy(mon_proc.name, procname, 512);
 	mon_proc.name[511] = '\0';
 
-	tracefile = fopen(tracefile_path, "w");
+	tracefile = fopen(tracefile_path, "wb");
 	if(tracefile == NULL) {
 		printf("Unable to open trace file %s for writing. Check filename.\n", tracefile_path);
 		goto done;
@@ -137,6 +138,7 @@ void apitracer_cleanup()
 
 
 	if(mon_proc.tracefile){
+		handlers_stop();
 		fclose(mon_proc.tracefile);
 	}
 
@@ -159,6 +161,10 @@ static void apitracer_loadmainmodule_notify(VMI_Callback_Params *pcp)
 				printf("%s", errorstring);
 				return;
 			}
+			if(handlers_start() != 0) {
+				printf("Unable to start the trace in the trace file.\n");
+				return;
+			}
 		}
 	}
 }
@@ -167,7 +173,8 @@ static void apitracer_procexit(VMI_Callback_Params *pcp)
 {
 	int i = 0;
 	uint32_t pid=pcp->rp.pid;
-	if(pid == mon_proc.pid) {
+	if(pid == mon_proc.pid && mon_proc.tracefile) {
+		handlers_stop();
 		fclose(mon_proc.tracefile);
 		mon_proc.tracefile = NULL;
 	}
@@ -5,20 +5,45 @@
  *      Author: Aravind Prakash (arprakas@syr.edu)
  */
 #include <stdio.h>
+#include <glib.h>
 #include "DECAF_main.h"
 #include "hookapi.h"
 #include "vmi_c_wrapper.h"
 #include "parser.h"
 #include "handlers.h"
+#include "tracebuf.h"
 
 extern struct monitored_proc mon_proc;
 
-void (*spec_handlers[]) (struct api_entry *) = {
-										stdcall_handler, 	/* Corresponds to stdcall  */
-										cdecl_handler,   	/* Corresponds to cdecl    */
-										fastcall_handler, 	/* Corresponds to fastcall */
-										thiscall_handler 	/* Corresponds to thiscall */
-								   };
+/*
+ * A call is captured into a slot of a preallocated arena, at the entry for
+ * the values before the call and at the return for the others, in the
+ * layout of its trace record, which is then copied as it is to the trace.
+ * The return hook gets the index and the generation of the slot, so that
+ * a stale hook (e.g. after loadvm) does not use a slot given to another
+ * call.
+ */
+#define CALL_SLOTS 1024
+#define SLOT_IN_USE -2
+
+struct call_slot {
+	int next_free; //SLOT_IN_USE if in use
+	uint16_t gen;
+	uint16_t before_len; //of the payload at the entry
+	uintptr_t hook_handle;
+	uint32_t ptrs[APITRACE_MAX_ARGS]; //arguments read again at the return
+	unsigned char rec[APITRACE_REC_MAX];
+};
+
+static struct call_slot *slots = NULL;
+static int free_slot = -1;
+static uint32_t dropped_calls = 0;
+
+/* Modules already in the trace, by base address */
+static GHashTable *noted_modules = NULL;
+/* Range of the last caller module, so that a call from the same module
+ * does not look it up */
+static uint32_t caller_base = 0, caller_size = 0, caller_cr3 = 0;
 
 /* The following apis get the data as offsets from from fs:base */
 /* Get the 'current' thread's thread id */
@@ -30,444 +55,288 @@ static inline uint32_t get_this_tid(void)
 	return tid;
 }
 
-void convertval2str (char *store, struct apiarg *arg)
+/* Read up to len bytes at addr, a page at a time, stopping at the first
+ * page that cannot be read or, for a string of characters of width bytes,
+ * after its terminating 0. Returns the number of bytes read. */
+static unsigned int read_guest(CPUState *env, uint32_t addr, unsigned char *buf,
+		unsigned int len, unsigned int width)
 {
-	switch(arg->type) {
-		case IGNORE:
-			sprintf(store, "IGNORED");
-			break;
-		case U8:
-			if(arg->spec == in) {
-				sprintf(store, "%02x", arg->value_before.val_8);
-			} else if(arg->spec == out) {
-				sprintf(store, "%02x", arg->value_after.val_8);
-			} else if(arg->spec == inout) {
-				sprintf(store, "before:%02x after:%02x", arg->value_before.val_8, arg->value_after.val_8);
-			}
-			break;
-		case U16:
-			if(arg->spec == in) {
-				sprintf(store, "%04x", arg->value_before.val_16);
-			} else if(arg->spec == out) {
-				sprintf(store, "%04x", arg->value_after.val_16);
-			} else if(arg->spec == inout) {
-				sprintf(store, "before:%04x after:%04x", arg->value_before.val_16, arg->value_after.val_16);
-			}
-			break;
-		case U32:
-			if(arg->spec == in) {
-				sprintf(store, "%08x", arg->value_before.val_32);
-			} else if(arg->spec == out) {
-				sprintf(store, "%08x", arg->value_after.val_32);
-			} else if(arg->spec == inout) {
-				sprintf(store, "before:%08x after:%08x", arg->value_before.val_32, arg->value_after.val_32);
-			}
-			break;
-		case U64:
-			if(arg->spec == in) {
-				sprintf(store, "%llx", arg->value_before.val_64);
-			} else if(arg->spec == out) {
-				sprintf(store, "%llx", arg->value_after.val_64);
-			} else if(arg->spec == inout) {
-				sprintf(store, "before:%llx after:%llx", arg->value_before.val_64, arg->value_after.val_64);
-			}
-			break;
+	unsigned int done = 0, n, i;
 
-		case WSTR:
-		case CSTR:
-		case USTR:
-			if(arg->spec == in)
-				strcpy(store, arg->value_before.str);
-			else if(arg->spec == out)
-				strcpy(store, arg->value_after.str);
-			else if(arg->spec == inout)
-				sprintf(store, "before:%s after:%s", arg->value_before.str, arg->value_after.str);
-		default:
+	while(done < len) {
+		n = TARGET_PAGE_SIZE - ((addr + done) & ~TARGET_PAGE_MASK);
+		if(n > len - done)
+			n = len - done;
+		if(DECAF_read_mem(env, addr + done, n, buf + done) < 0)
 			break;
+		if(width) {
+			for(i = done - done % width; i + width <= done + n; i += width) {
+				if(buf[i] == 0 && (width == 1 || buf[i + 1] == 0))
+					return i + width;
+			}
 		}
-}
-
-#define ENTRY_SIZE 2048
-
-void populate_trace_str(struct api_entry *api, uint32_t pid, uint32_t tid)
-{
-	char trace_entry[ENTRY_SIZE] = {'\0'};
-	char temp[512] = {'\0'};
-	char data_str[512] = {'\0'};
-	char mon_proc_temp[256] = {'\0'};
-	struct apiarg *args;
-	int i;
-	tmodinfo_t *modinfo;
-	target_ulong pc = 0;
-	struct mem_region *mr = NULL;
-
-	modinfo = (tmodinfo_t *)malloc(sizeof(tmodinfo_t));
-	VMI_locate_module_c(cpu_single_env->eip, cpu_single_env->cr[3], mon_proc_temp,modinfo);
-
-	args = (struct apiarg *) api->args;
-	if(modinfo) {
-		sprintf(trace_entry, "PID:%d, TID:%d. Called from: %s:0x%08x, %s:%s( ", pid, tid, modinfo->name, cpu_single_env->eip, api->modname, api->apiname);
-	} else {
-		sprintf(trace_entry, "PID:%d, TID:%d, %s:%s( ", pid, tid, api->modname, api->apiname);
-	}
-	for(i = 0; i < api->numargs; i++) {
-		memset(data_str, 0, sizeof(data_str));
-		memset(temp, 0, sizeof(temp));
-
-		 if(args[i].tostr) {
-			 args[i].tostr(data_str, (struct apiarg *)&(args[i]));
-		 } else {
-			 convertval2str(data_str, (struct apiarg *)&(args[i]));
-		 }
-
-		sprintf(temp, "%s=%s", args[i].name, data_str);
-		strcat(trace_entry, temp);
-		if(i != api->numargs - 1)
-			strcat(trace_entry, ", ");
-	}
-	strcat(trace_entry, "), RET: ");
-	memset(data_str, 0, sizeof(data_str));
-	memset(temp, 0, sizeof(temp));
-	if(api->retarg.type == IGNORE) {
-		sprintf(temp, "%s=IGNORED", args[i].name);
-		strcat(trace_entry, temp);
-	} else if (api->retarg.type == VOID) {
-		sprintf(temp, "VOID");
-		strcat(trace_entry, temp);
-	} else {
-		if(api->retarg.tostr) {
-			api->retarg.tostr(data_str, &(api->retarg));
-		} else {
-			convertval2str(data_str, &(api->retarg));
-		}
-
-		sprintf(temp, "%s=%s\n", api->retarg.name, data_str);
-		strcat(trace_entry, temp);
+		done += n;
 	}
-
-	fputs(trace_entry, mon_proc.tracefile);
+	return done;
 }
 
-static inline int readu8(target_ulong addr, void *buf)
+static unsigned char *read_number(CPUState *env, uint32_t addr,
+		unsigned int size, unsigned char *p)
 {
-	if(!DECAF_read_mem(cpu_single_env, addr, 1,buf))
-		return 1;
-	return 0;
+	if(addr == 0 || DECAF_read_mem(env, addr, size, p) < 0)
+		memset(p, 0, size);
+	return p + size;
 }
 
-static inline int readu16(target_ulong addr, void *buf)
+/* A string as one length byte and its characters. Wide characters are cut
+ * to their low byte. */
+static unsigned char *read_string(CPUState *env, uint8_t type, uint32_t addr,
+		unsigned char *p)
 {
-	if(!DECAF_read_mem(cpu_single_env, addr,2, buf))
-		return 2;
-	return 0;
-}
-
-static inline int readu32(target_ulong addr, void *buf)
-{
-	if(!DECAF_read_mem(cpu_single_env, addr,4, buf))
-		return 4;
-	return 0;
-}
-
-static inline int readu64(target_ulong addr, void *buf)
-{
-	if(!DECAF_read_mem(cpu_single_env, addr,8, buf))
-		return 8;
-	return 0;
-}
-
-int readwstr(target_ulong addr, void *buf)
-{
-	//bytewise for now, perhaps block wise later.
-	char *store = (char *) buf;
-	int i = -1;
-	do {
-		if(++i == MAX_NAME_LENGTH)
-			break;
-
-		if(DECAF_read_mem(cpu_single_env, addr+(2*i), 1,(uint8_t *)&store[i]) < 0) {
-			store[i] = '\0';
-			return i;
+	unsigned char raw[2 * APITRACE_STR_MAX];
+	uint32_t ustr[2]; //UNICODE_STRING: Length, MaximumLength, Buffer
+	unsigned int width = (type == CSTR) ? 1 : 2;
+	unsigned int max = APITRACE_STR_MAX, n, i, len = 0;
+
+	if(addr && type == USTR) {
+		if(DECAF_read_mem(env, addr, sizeof(ustr), ustr) < 0) {
+			addr = 0;
+		} else {
+			if((ustr[0] & 0xffff) / 2 < max)
+				max = (ustr[0] & 0xffff) / 2;
+			addr = ustr[1];
 		}
-
-	} while (store[i] != '\0');
-
-	if(i == MAX_NAME_LENGTH) {
-		store[i-1] = '\0';
 	}
-	return i-1;
-}
 
-int readcstr(target_ulong addr, void *buf)
-{
-	//bytewise for now, perhaps block wise later.
-	char *store = (char *) buf;
-	int i = -1;
-	do {
-		if(++i == MAX_NAME_LENGTH)
+	n = addr ? read_guest(env, addr, raw, width * max, (type == USTR) ? 0 : width) : 0;
+	for(i = 0; i + width <= n; i += width) {
+		if(type != USTR && raw[i] == 0 && (width == 1 || raw[i + 1] == 0))
 			break;
-
-		if(DECAF_read_mem(cpu_single_env, addr+i, 1,(uint8_t *)&store[i]) < 0) {
-			store[i] = '\0';
-			return i;
-		}
-
-	} while (store[i] != '\0');
-
-	if(i == MAX_NAME_LENGTH) {
-		store[i-1] = '\0';
+		p[1 + len++] = raw[i];
 	}
-	return i-1;
+	p[0] = len;
+	return p + 1 + len;
 }
 
-
-int readustr(uint32_t addr, void *buf)
+static struct call_slot *alloc_slot(void)
 {
-	    uint32_t unicode_data[2];
-		int unicode_len = 0;
-		int j, i;
-		uint8_t unicode_str[MAX_UNICODE_LENGTH] = {'\0'};
-		char *store = (char *) buf;
-		CPUState *env = cpu_single_env ? cpu_single_env : first_cpu;
-
-	    if(DECAF_read_mem(env, addr,  sizeof(unicode_data),(uint8_t *)&unicode_data) < 0) {
-	            printf("DECAF_read_mem(0x%08x, %d) returned non-zero.\n", addr, sizeof(unicode_data));
-	            store[0] = '\0';
-	            goto done;
-	    }
-
-	    unicode_len = (unsigned int)((unicode_data[0]>>16) & 0xFFFF);
-	    if (unicode_len > MAX_UNICODE_LENGTH)
-	            unicode_len = MAX_UNICODE_LENGTH;
-
-	    if(DECAF_read_mem(env, unicode_data[1],unicode_len,(uint8_t *)unicode_str) < 0) {
-	            monitor_printf(default_mon, "DECAF read mem(cpu, 0x%08x, 0x%08x, %d, 0) returned non-zero.\n", unicode_data[1], (target_ulong)unicode_str, unicode_len);
-	            store[0] = '\0';
-	            goto done;
-	    }
-
-	    for (i = 0, j = 0; i < unicode_len; i+=2, j++) {
-	            store[j] = unicode_str[i];
-	    }
-	    store[j] = '\0';
-
-	done:
-	    return strlen(store);
+	struct call_slot *slot;
+
+	if(free_slot < 0)
+		return NULL;
+	slot = &slots[free_slot];
+	free_slot = slot->next_free;
+	slot->next_free = SLOT_IN_USE;
+	return slot;
 }
 
+static void free_call_slot(struct call_slot *slot)
+{
+	slot->gen++;
+	slot->hook_handle = 0;
+	slot->next_free = free_slot;
+	free_slot = slot - slots;
+}
 
-unsigned int populate_arg (struct apiarg *arg, target_ulong vaddr, unsigned int after)
+/* Put the module of the caller in the trace the first time it calls */
+static void note_caller_module(CPUState *env, uint32_t caller)
 {
-	union data_holder *dest;
-	int i, ret = 0;
-	uint32_t addr=0;
-
-	if(arg->size == 0 || arg->type == IGNORE)
-		return arg->size;
-
-	if(after == 0) {
-		dest = &(arg->value_before);
-		if(arg->type == CSTR || arg->type == USTR || arg->type == WSTR)
-			DECAF_read_mem(cpu_single_env, vaddr, 4,(uint8_t *)&addr);
-	} else {
-		dest = &(arg->value_after);
-		addr = (uint32_t) arg->temp;
-	}
+	struct {
+		struct apitrace_rec h;
+		struct apitrace_module m;
+	} rec;
+	tmodinfo_t modinfo;
+	char proc[512];
+	uint32_t cr3 = env->cr[3];
+
+	if(cr3 == caller_cr3 && caller - caller_base < caller_size)
+		return;
 
-	switch(arg->type) {
-	case U8:
-		ret = readu8(addr, &(dest->val_8));
-		break;
-	case U16:
-		ret = readu16(addr, &(dest->val_16));
-		break;
-	case U32:
-		ret = readu32(addr, &(dest->val_32));
-		break;
-	case U64:
-		ret = readu64(addr, &(dest->val_64));
-		break;
-	case WSTR:
-		dest->str =malloc (sizeof(char) * MAX_NAME_LENGTH);
-		ret = (readwstr(addr, dest->str) > 0)? sizeof(target_ulong): 0;
-		break;
-	case CSTR:
-		dest->str =malloc (sizeof(char) * MAX_NAME_LENGTH);
-		ret = (readcstr(addr, dest->str) > 0)? sizeof(target_ulong): 0;
-		break;
-	case USTR:
-		dest->str =malloc (sizeof(char) * MAX_UNICODE_LENGTH);
-		ret = (readustr(addr, dest->str) > 0)? sizeof(target_ulong): 0;
-		break;
-	default:
-		break;
+	caller_cr3 = cr3;
+	if(VMI_locate_module_c(caller, cr3, proc, &modinfo) != 0) {
+		//not in a module, do not look it up again for this page
+		caller_base = caller & TARGET_PAGE_MASK;
+		caller_size = TARGET_PAGE_SIZE;
+		return;
 	}
-
-	return ret;
+	caller_base = modinfo.base;
+	caller_size = modinfo.size;
+	if(g_hash_table_lookup(noted_modules, GUINT_TO_POINTER(caller_base)))
+		return;
+	g_hash_table_insert(noted_modules, GUINT_TO_POINTER(caller_base), GUINT_TO_POINTER(1));
+
+	memset(&rec, 0, sizeof(rec));
+	rec.h.type = APITRACE_REC_MODULE;
+	rec.h.len = sizeof(rec.m);
+	rec.h.pid = (cr3 == mon_proc.cr3) ? mon_proc.pid : VMI_find_pid_by_cr3_c(cr3);
+	rec.m.base = modinfo.base;
+	rec.m.size = modinfo.size;
+	strncpy(rec.m.name, modinfo.name, APITRACE_MODULE_NAME_SIZE - 1);
+	tracebuf_write(&rec, sizeof(rec));
 }
 
-
-void cdecl_ret_handler(void *opaque)
+void gen_ret_handler(void *opaque)
 {
+	uint32_t cookie = (uint32_t) (uintptr_t) opaque;
+	const struct apitrace_api *api;
+	const struct apitrace_arg *args;
+	struct apitrace_rec *rec;
+	struct call_slot *slot;
+	CPUState *env = cpu_single_env;
+	unsigned char *p;
+	uint32_t ret[2];
 	int i;
-	uint32_t esp, offset;
-	struct api_entry *api;
-	struct apiarg *args;
-	int bytes_read;
-	CPUState *cpu;
-	uint32_t tid;
-
-	bytes_read = 0;
-	api = (struct api_entry *) opaque;
-	cpu = cpu_single_env;
-
-	/* Populate the return value */
-	if(api->retarg.size > 4) { //Ret val in edx:eax
-		api->retarg.value_after.val_64 = cpu->regs[R_EDX];
-		api->retarg.value_after.val_64 <<= 32;
-		api->retarg.value_after.val_64 |= cpu->regs[R_EAX];
-	} else if (api->retarg.size > 0) {
-		api->retarg.value_after.val_32 = cpu->regs[R_EAX];
-	}
+
+	if(slots == NULL || (cookie & 0xffff) >= CALL_SLOTS)
+		return;
+	slot = &slots[cookie & 0xffff];
+	if(slot->next_free != SLOT_IN_USE || slot->gen != (cookie >> 16))
+		return;
+
+	rec = (struct apitrace_rec *) slot->rec;
+	api = &api_table[rec->api];
+	args = &arg_table[api->first_arg];
+	p = slot->rec + sizeof(*rec) + slot->before_len;
 
 	/* Populate out arguments */
-	esp = cpu->regs[R_ESP];
-	//This is true if caller cleans the stack.
-	offset = esp;
-	args = (struct apiarg *) api->args;
-	for(i = 0; i < api->numargs; i++) {
-		switch(args[i].spec) {
-		case out:
-		case inout:
-			if(args[i].func) {
-				bytes_read = args[i].func((struct apiarg *)&args[i], (target_ulong)args[i].temp, 1);
-			} else {
-				bytes_read = populate_arg((struct apiarg *)&args[i], (target_ulong)(args[i].temp), 1);
-			}
-			offset += args[i].size;
-			break;
-		case in:
-			offset += args[i].size;
-			break;
-		default:
-			break;
-		}
+	for(i = 0; i < api->n_args; i++) {
+		if(!apitrace_arg_has_after(&args[i]))
+			continue;
+		if(args[i].op == APITRACE_OP_STR)
+			p = read_string(env, args[i].type, slot->ptrs[i], p);
+		else
+			p = read_number(env, slot->ptrs[i], args[i].size, p);
 	}
 
-	tid = get_this_tid();
-	populate_trace_str(api, VMI_find_pid_by_cr3_c(cpu_single_env->cr[3]), tid);
+	/* Populate the return value, in edx:eax if it is larger than 4 bytes */
+	if(api->ret_size) {
+		ret[0] = env->regs[R_EAX];
+		ret[1] = env->regs[R_EDX];
+		memcpy(p, ret, api->ret_size);
+		p += api->ret_size;
+	}
 
-	hookapi_remove_hook(api->hook_handle);
+	rec->caller = env->eip;
+	rec->len = p - (slot->rec + sizeof(*rec));
+	note_caller_module(env, rec->caller);
+	tracebuf_write(slot->rec, sizeof(*rec) + rec->len);
 
-	//Free this instance
-	free(api);
+	hookapi_remove_hook(slot->hook_handle);
+	free_call_slot(slot);
 }
 
 /*
- * WINAPI calling convention
- * Stack cleanup by called function
- * Return value in eax
- */
-void stdcall_handler (struct api_entry *api)
-{
-	cdecl_handler(api);
-}
-
-
-/*  __cdecl (compiler option /Gd)
- * Return value in eax
- * Stack cleanup by caller
+ * The arguments of stdcall (WINAPI) and cdecl calls are on the stack, and
+ * the return value is in eax (edx:eax). fastcall and thiscall apis are not
+ * traced.
  */
-void cdecl_handler(struct api_entry *api_act)
+void gen_api_handler(void *opaque)
 {
+	uint32_t index = (uint32_t) (uintptr_t) opaque;
+	const struct apitrace_api *api;
+	const struct apitrace_arg *args;
+	struct apitrace_rec *rec;
+	struct call_slot *slot;
+	CPUState *env = cpu_single_env;
+	unsigned char stack[APITRACE_STACK_MAX];
+	unsigned char *p;
+	uint32_t ret_addr;
 	int i;
-	uint32_t esp, ebp;
-	target_ulong ret_addr, offset;
-	int bytes_read;
-	struct apiarg *args;
-	CPUState *cpu;
-
-	//A new api instance.
-	struct api_entry *api = (struct api_entry *) malloc (sizeof(struct api_entry) + api_act->numargs * sizeof(struct apiarg));
-	if(api == NULL) {
-		DECAF_printf("Malloc failed in cdecl_handler().\n");
+
+	if(slots == NULL || index >= api_table_size)
+		return;
+	api = &api_table[index];
+	if((api->flags & APITRACE_API_KERNEL) || !(api->flags & APITRACE_API_STACK))
 		return;
-	}
-	memset(api, 0, sizeof(struct api_entry) + api_act->numargs * sizeof(struct apiarg));
-	memcpy(api, api_act, sizeof(struct api_entry) + api_act->numargs * sizeof(struct apiarg));
 
-	if(api->iskernel)
+	/* the return address and all of the arguments, in one read */
+	if(DECAF_read_mem(env, env->regs[R_ESP], api->stack_size, stack) < 0)
 		return;
+	slot = alloc_slot();
+	if(slot == NULL) {
+		dropped_calls++;
+		return;
+	}
 
-	bytes_read = 0;
-	cpu = cpu_single_env;
-	args = (struct apiarg *) (api->args);
-	esp = cpu->regs[R_ESP];
-	ebp = cpu->regs[R_EBP];
-	DECAF_read_mem(cpu_single_env, esp, 4,(uint8_t *)&ret_addr);
-	api->hook_handle = hookapi_hook_return(ret_addr, cdecl_ret_handler, api, sizeof(struct api_entry) + api->numargs * sizeof(struct apiarg));
-
-	offset = esp + sizeof(target_ulong); //ret addr
-	for(i = 0; i < api->numargs; i++) {
-		switch(args[i].spec) {
-
-		case inout:
-			readu32(offset, &(args[i].temp));
-			; //pass through
-		case in:
-			//If there is a special interpreter function, invoke it.
-			if(args[i].func) {
-				bytes_read = args[i].func(&args[i], offset, 0);
-			} else {
-				bytes_read = populate_arg(&args[i], offset, 0);
-			}
-			offset += args[i].size;//EK bytes_read;
-			break;
-		case out:
-			readu32(offset, (void *)&(args[i].temp));
-			offset += 4;
-			break;
-		default:
-			break;
+	args = &arg_table[api->first_arg];
+	p = slot->rec + sizeof(*rec);
+	for(i = 0; i < api->n_args; i++) {
+		if(args[i].op == APITRACE_OP_SKIP)
+			continue;
+		if(args[i].op == APITRACE_OP_VALUE) {
+			memcpy(p, stack + args[i].stack_off, args[i].size);
+			p += args[i].size;
+			continue;
 		}
+		memcpy(&slot->ptrs[i], stack + args[i].stack_off, sizeof(uint32_t));
+		if(!apitrace_arg_has_before(&args[i]))
+			continue;
+		if(args[i].op == APITRACE_OP_STR)
+			p = read_string(env, args[i].type, slot->ptrs[i], p);
+		else
+			p = read_number(env, slot->ptrs[i], args[i].size, p);
 	}
-}
+	slot->before_len = p - (slot->rec + sizeof(*rec));
 
-/*
- * __fastcall (compiler option /Gr)
- * args 1 and 2 go in ecx and edx. Rest pushed from right to left on stack.
- * Return value in eax
- * stack cleanup by called function
- */
-void fastcall_handler (struct api_entry *api)
-{
+	memcpy(&ret_addr, stack, sizeof(ret_addr));
+	slot->hook_handle = hookapi_hook_return(ret_addr, gen_ret_handler,
+			(void *) (uintptr_t) (((uint32_t) slot->gen << 16) | (slot - slots)), 0);
+	if(slot->hook_handle == 0) {
+		free_call_slot(slot);
+		return;
+	}
 
+	rec = (struct apitrace_rec *) slot->rec;
+	rec->type = APITRACE_REC_CALL;
+	rec->api = index;
+	rec->pid = (env->cr[3] == mon_proc.cr3) ? mon_proc.pid : VMI_find_pid_by_cr3_c(env->cr[3]);
+	rec->tid = get_this_tid();
 }
 
-
-/*
- * Default for calling c++ member functions (except when var args)
- * this ptr in ecx. Args on stack.
- * Stack cleanup by called function.
- */
-void thiscall_handler(struct api_entry *api)
+int handlers_start(void)
 {
+	int i;
 
+	handlers_stop();
+	slots = (struct call_slot *) calloc (CALL_SLOTS, sizeof(struct call_slot));
+	if(slots == NULL)
+		return -1;
+	for(i = 0; i < CALL_SLOTS; i++)
+		slots[i].next_free = i + 1;
+	slots[CALL_SLOTS - 1].next_free = -1;
+	free_slot = 0;
+	dropped_calls = 0;
+
+	noted_modules = g_hash_table_new(g_direct_hash, g_direct_equal);
+	caller_base = caller_size = caller_cr3 = 0;
+
+	if(tracebuf_open(mon_proc.tracefile, api_table, api_table_size,
+			arg_table, arg_table_size) != 0) {
+		handlers_stop();
+		return -1;
+	}
+	return 0;
 }
 
-void gen_api_handler(void *opaque)
+void handlers_stop(void)
 {
-	struct api_entry *api, *instance;
-	api = (struct api_entry *) opaque;
-
-	//Create a copy for this instance.
-	instance = (struct api_entry *) malloc (sizeof(struct api_entry) + api->numargs * sizeof(struct apiarg));
-	memcpy(instance, api, sizeof(struct api_entry) + api->numargs * sizeof(struct apiarg));
-	spec_handlers[api->conv]((void*) instance);
-}
+	int i;
 
+	if(slots == NULL)
+		return;
 
-void gen_ret_handler(void * opaque)
-{
-	cdecl_ret_handler(opaque);
+	/* the calls that did not return are not in the trace */
+	for(i = 0; i < CALL_SLOTS; i++) {
+		if(slots[i].next_free == SLOT_IN_USE)
+			hookapi_remove_hook(slots[i].hook_handle);
+	}
+	tracebuf_close();
+	if(dropped_calls)
+		DECAF_printf("apitracer: %u calls were not traced, too many calls in progress\n", dropped_calls);
+
+	free(slots);
+	slots = NULL;
+	free_slot = -1;
+	g_hash_table_destroy(noted_modules);
+	noted_modules = NULL;
 }
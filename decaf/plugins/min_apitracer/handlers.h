@@ -31,21 +31,15 @@ struct service_entry {
 
 extern struct monitored_proc mon_proc;
 
-void stdcall_handler (struct api_entry *api);
-void cdecl_handler(struct api_entry *api);
-void fastcall_handler (struct api_entry *api);
-void thiscall_handler(struct api_entry *api);
-void gen_ret_handler(void *opaque);
+/* Hooks of the entry and of the return of the apis */
 void gen_api_handler(void *opaque);
+void gen_ret_handler(void *opaque);
 
-/* Helpers */
-void convertval2str (char *store, struct apiarg *arg);
-void populate_trace_str(struct api_entry *api, uint32_t pid, uint32_t tid);
-
-int readustr(uint32_t addr, void *buf);
-
+/* Start capturing the calls of the compiled apis into the trace file of
+ * mon_proc. Returns -1 on error */
+int handlers_start(void);
 
-/* Argument handler */
-unsigned int populate_arg (struct apiarg *arg, target_ulong addr, unsigned int after);
+/* Write out the captured calls and stop capturing */
+void handlers_stop(void);
 
 #endif /* HANDLERS_H_ */
@@ -21,19 +21,21 @@
 static char error_string_response[512];
 
 QLIST_HEAD (apilist_head, api_entry) apilist;
-void gen_api_handler();
 
+struct apitrace_api *api_table = NULL;
+uint32_t api_table_size = 0;
+struct apitrace_arg *arg_table = NULL;
+uint32_t arg_table_size = 0;
+
+/* Argument handlers. Only the default one, which reads the argument as its
+ * type says, is known; it is compiled into the plan of the api. */
 struct interpreters {
 	const char *name;
-	Interpreter handler;
-	val2str tostr;
 };
 
 struct interpreters interpreters[] = {
 		{
 				.name 		= "default",
-				.handler 	= (Interpreter) populate_arg,
-				.tostr		= (val2str) convertval2str,
 		},
 };
 
@@ -114,15 +116,13 @@ int update_defaults(char *error_string)
 	int i;
 
 	QLIST_FOREACH(api, &apilist, api_list_entry) {
-		if(api->modname == 0 || api->apiname == 0) {
+		if(api->modname[0] == 0 || api->apiname[0] == 0) {
 			sprintf(error_string, "Ensure that all apis have modulename and apiname");
 			goto error_ret;
 		}
 		if(api->numargs <= 0)
 			api->numargs = 0;
 		api->retarg.spec = out;
-		if(api->retarg.name == 0)
-			strcpy(api->retarg.name, "");
 		set_arg_defaults(&(api->retarg));
 		args = (struct apiarg *) api->args;
 		for(i = 0; i < api->numargs; i++) {
@@ -136,30 +136,154 @@ error_ret:
 	return -1;
 }
 
-void process_apilist(uint32_t cr3)
+/* Bytes of an argument on the stack: the value itself, or a pointer */
+static unsigned int arg_stack_len(const struct apitrace_arg *dst)
+{
+	return (dst->op == APITRACE_OP_VALUE) ? dst->size : sizeof(uint32_t);
+}
+
+/* Compile an argument. *offset is where it is on the stack, and is moved
+ * to the next argument */
+static int compile_arg(struct apitrace_arg *dst, const struct apiarg *arg,
+		unsigned int *offset, char *error_string)
+{
+	memset(dst, 0, sizeof(*dst));
+	strncpy(dst->name, arg->name, APITRACE_NAME_SIZE - 1);
+	dst->type = arg->type;
+	dst->spec = arg->spec ? arg->spec : in;
+	dst->stack_off = *offset;
+
+	switch(arg->type) {
+	case U8:
+	case U16:
+	case U32:
+	case U64:
+		dst->op = (dst->spec == in) ? APITRACE_OP_VALUE : APITRACE_OP_DEREF;
+		dst->size = arg->size;
+		break;
+	case USTR:
+	case CSTR:
+	case WSTR:
+		dst->op = APITRACE_OP_STR;
+		dst->size = sizeof(uint32_t);
+		break;
+	default:
+		dst->op = APITRACE_OP_SKIP;
+		break;
+	}
+
+	/* out and inout arguments are pointers */
+	*offset += (dst->spec == out || dst->spec == inout) ? sizeof(uint32_t) : arg->size;
+	if(dst->op != APITRACE_OP_SKIP
+			&& dst->stack_off + arg_stack_len(dst) > APITRACE_STACK_MAX) {
+		sprintf(error_string, "argument %s is too far on the stack", arg->name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compile the apilist into api_table and arg_table, so that a call only
+ * follows the plan of its api.
+ */
+static int compile_apilist(char *error_string)
 {
 	struct api_entry *api;
-	target_ulong pc;
+	struct apiarg *args;
+	struct apitrace_api *t;
+	struct apitrace_arg *a;
+	uint32_t n_apis = 0, n_args = 0;
+	unsigned int offset, end, len;
+	int i;
+
 	QLIST_FOREACH(api, &apilist, api_list_entry) {
-		if(api->iskernel) {
-			hookapi_hook_function_byname(
-					api->modname,
-					api->apiname,
-					1,
-					0,
-					gen_api_handler,
-					(void *) api,
-					(sizeof(struct api_entry) + api->numargs * sizeof(struct apiarg)));
-		} else {
-			hookapi_hook_function_byname(
-					api->modname,
-					api->apiname,
-					1,
-					cr3,
-					gen_api_handler,
-					(void *) api,
-					(sizeof(struct api_entry) + api->numargs * sizeof(struct apiarg)));
+		if(api->numargs > APITRACE_MAX_ARGS) {
+			sprintf(error_string, "%s has more than %d arguments", api->apiname, APITRACE_MAX_ARGS);
+			return -1;
 		}
+		n_apis++;
+		n_args += api->numargs;
+	}
+
+	free(api_table);
+	free(arg_table);
+	api_table_size = arg_table_size = 0;
+	api_table = (struct apitrace_api *) calloc (n_apis ? n_apis : 1, sizeof(struct apitrace_api));
+	arg_table = (struct apitrace_arg *) calloc (n_args ? n_args : 1, sizeof(struct apitrace_arg));
+	if(api_table == NULL || arg_table == NULL) {
+		sprintf(error_string, "out of memory");
+		return -1;
+	}
+
+	QLIST_FOREACH(api, &apilist, api_list_entry) {
+		t = &api_table[api_table_size];
+		strncpy(t->modname, api->modname, APITRACE_NAME_SIZE - 1);
+		strncpy(t->apiname, api->apiname, APITRACE_NAME_SIZE - 1);
+		strncpy(t->retname, api->retarg.name, APITRACE_NAME_SIZE - 1);
+		t->first_arg = arg_table_size;
+		t->n_args = api->numargs;
+		t->ret_type = api->retarg.type;
+		switch(api->retarg.type) {
+		case U8:
+		case U16:
+		case U32:
+		case U64:
+			t->ret_size = api->retarg.size;
+			break;
+		case USTR:
+		case CSTR:
+		case WSTR:
+			t->ret_size = sizeof(uint32_t); //the pointer
+			break;
+		default:
+			t->ret_size = 0;
+			break;
+		}
+		if(api->iskernel)
+			t->flags |= APITRACE_API_KERNEL;
+		if(api->conv == STDCALL || api->conv == CDECL)
+			t->flags |= APITRACE_API_STACK;
+
+		args = (struct apiarg *) api->args;
+		offset = sizeof(uint32_t); //return address
+		end = offset;
+		len = t->ret_size;
+		for(i = 0; i < api->numargs; i++) {
+			a = &arg_table[arg_table_size++];
+			if(compile_arg(a, &args[i], &offset, error_string) != 0)
+				return -1;
+			if(a->op != APITRACE_OP_SKIP && a->stack_off + arg_stack_len(a) > end)
+				end = a->stack_off + arg_stack_len(a);
+			if(apitrace_arg_has_before(a))
+				len += apitrace_arg_max_len(a);
+			if(apitrace_arg_has_after(a))
+				len += apitrace_arg_max_len(a);
+		}
+		if(sizeof(struct apitrace_rec) + len > APITRACE_REC_MAX) {
+			sprintf(error_string, "the arguments of %s are too large", api->apiname);
+			return -1;
+		}
+		t->stack_size = end;
+		t->max_len = len;
+		api_table_size++;
+	}
+
+	return 0;
+}
+
+void process_apilist(uint32_t cr3)
+{
+	uint32_t i;
+
+	for(i = 0; i < api_table_size; i++) {
+		hookapi_hook_function_byname(
+				api_table[i].modname,
+				api_table[i].apiname,
+				1,
+				(api_table[i].flags & APITRACE_API_KERNEL) ? 0 : cr3,
+				gen_api_handler,
+				(void *) (uintptr_t) i,
+				0);
 	}
 }
 
@@ -331,12 +455,9 @@ int api_parse (const char *config_file, char **error_string, uint32_t cr3)
 				else
 					goto parse_error_with_cleanup;
 			} else if ((loc = strstr_rs (line, "handler=")) != 0) {
-				for(index = 0; index < sizeof(interpreters); index++) {
-					if(strcmp(loc, interpreters[index].name) == 0) {
-						argptr->func = interpreters[index].handler;
-						argptr->tostr = interpreters[index].tostr;
+				for(index = 0; index < sizeof(interpreters) / sizeof(interpreters[0]); index++) {
+					if(strcmp(loc, interpreters[index].name) == 0)
 						break;
-					}
 				}
 			} else if ((loc = strstr_rs (line, "size=")) != 0) {
 				argptr->size = atoi(loc);
@@ -356,6 +477,8 @@ int api_parse (const char *config_file, char **error_string, uint32_t cr3)
 	/* Fill in the default fields and the inferred fields for the arguments */
 	if(update_defaults(update_error_str) != 0)
 		goto update_error;
+	if(compile_apilist(update_error_str) != 0)
+		goto compile_error;
 
 	process_apilist(cr3);
 	return 0;
@@ -377,6 +500,11 @@ update_error:
 	sprintf(error_string_response,
 			"parser failed the mandatory field validation: %s\n", update_error_str);
 	*error_string = error_string_response;
-	fclose(fp);
+	return -1;
+
+compile_error:
+	sprintf(error_string_response,
+			"cannot compile %s: %s\n", config_file, update_error_str);
+	*error_string = error_string_response;
 	return -1;
 }
@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include "qemu-queue.h"
+#include "apitrace.h"
 
 typedef enum {
 	U8 		= 1, //1 byte
@@ -52,7 +53,7 @@ typedef void (*val2str) (char *store, struct apiarg *arg);
 
 struct apiarg {
 	char name[128];
-	//Value variables are malloc'd when value is read off memory and converted to str. Freed in populate_trace_str()
+	//Values are not kept here, the calls are captured as compiled in apitrace.h
 	union data_holder value_before; //used for in and inout variables
 	union data_holder value_after;  //used in out and inout variables.
 	//void *temp; //Temporary variable to hold the address of the out variables (needed for STDCALL)
@@ -82,6 +83,13 @@ struct api_entry {
 /* Main parse function that parses the config file into the global hash table */
 int api_parse (const char *config_file, char **error_string, uint32_t cr3);
 
+/* The config, as compiled by api_parse (see apitrace.h). The hook of the
+ * api at index i of api_table gets i as opaque. */
+extern struct apitrace_api *api_table;
+extern uint32_t api_table_size;
+extern struct apitrace_arg *arg_table;
+extern uint32_t arg_table_size;
+
 void process_apilist(uint32_t cr3);
 void hook_module_apis(char *name, uint32_t base, uint32_t cr3);
 
@@ -16,5 +16,5 @@
 		.args_type = "proc_name:s,tracefile:F,configfile:F",
 		.mhandler.cmd = do_trace_by_name,
 		.params = "process_name trace_file_name config_file_name",
-		.help = "Trace by name of the process. The process must not have started yet. The trace is saved to the said file. Configuration is parsed from the configfile",
+		.help = "Trace by name of the process. The process must not have started yet. The binary trace is saved to the said file, apitrace_print prints it. Configuration is parsed from the configfile",
 },
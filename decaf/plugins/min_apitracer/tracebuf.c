@@ -0,0 +1,68 @@
+/*
+ * tracebuf.c
+ *
+ * Buffered writer of the binary API trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracebuf.h"
+
+static FILE *tb_fp = NULL;
+static unsigned char *tb_buf = NULL;
+static size_t tb_len = 0;
+
+int tracebuf_open(FILE *fp, const struct apitrace_api *apis, uint32_t n_apis,
+		const struct apitrace_arg *args, uint32_t n_args)
+{
+	struct apitrace_header h;
+
+	tracebuf_close();
+	if(tb_buf == NULL) {
+		tb_buf = (unsigned char *) malloc (TRACEBUF_SIZE);
+		if(tb_buf == NULL)
+			return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, APITRACE_MAGIC, sizeof(h.magic));
+	h.version = APITRACE_VERSION;
+	h.n_apis = n_apis;
+	h.n_args = n_args;
+	if(fwrite(&h, sizeof(h), 1, fp) != 1
+			|| fwrite(apis, sizeof(*apis), n_apis, fp) != n_apis
+			|| fwrite(args, sizeof(*args), n_args, fp) != n_args)
+		return -1;
+
+	tb_fp = fp;
+	tb_len = 0;
+	return 0;
+}
+
+void tracebuf_flush(void)
+{
+	if(tb_fp == NULL || tb_len == 0)
+		return;
+	if(fwrite(tb_buf, 1, tb_len, tb_fp) != tb_len)
+		fprintf(stderr, "apitracer: cannot write the trace\n");
+	fflush(tb_fp);
+	tb_len = 0;
+}
+
+void tracebuf_write(const void *rec, size_t len)
+{
+	if(tb_fp == NULL)
+		return;
+	if(tb_len + len > TRACEBUF_SIZE)
+		tracebuf_flush();
+	memcpy(tb_buf + tb_len, rec, len);
+	tb_len += len;
+}
+
+void tracebuf_close(void)
+{
+	tracebuf_flush();
+	tb_fp = NULL;
+}
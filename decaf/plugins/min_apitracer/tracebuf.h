@@ -0,0 +1,30 @@
+/*
+ * tracebuf.h
+ *
+ * Buffered writer of the binary API trace (see apitrace.h). Records are
+ * appended to a large buffer that is written out when it is full, so that
+ * a call costs a copy instead of a formatted write.
+ */
+
+#ifndef TRACEBUF_H_
+#define TRACEBUF_H_
+
+#include <stdio.h>
+#include "apitrace.h"
+
+#define TRACEBUF_SIZE (1 << 20)
+
+/* Start the trace in fp with the compiled api table. Returns -1 on error */
+int tracebuf_open(FILE *fp, const struct apitrace_api *apis, uint32_t n_apis,
+		const struct apitrace_arg *args, uint32_t n_args);
+
+/* Append a record of len bytes, header included */
+void tracebuf_write(const void *rec, size_t len);
+
+/* Write out the buffer */
+void tracebuf_flush(void);
+
+/* Write out the buffer and stop writing to the file, which is left open */
+void tracebuf_close(void);
+
+#endif /* TRACEBUF_H_ */
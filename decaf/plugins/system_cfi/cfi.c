@@ -17,6 +17,10 @@
 //For whitelist
 #include <dirent.h>
 #include <glib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <mcheck.h>
 
@@ -33,6 +37,7 @@
 #include "peheaders.h"
 
 #include "cfi.h"
+#include "wl_db.h"
 
 
 /* Hash table to hold the cr3 to process entry mapping */
@@ -177,40 +182,138 @@ static void print_generic_table(GHashTable *ht)
 	monitor_printf(default_mon, "\n");
 }
 
-static uint32_t lookup_in_whitelist (struct proc_entry *p, uint32_t val)
+static inline uint32_t addr_hash(uint32_t val)
 {
-	uint32_t ret = 0;
-	int index;
-	struct bin_file *file = NULL;
-	if(g_hash_table_lookup(p->misc_whitelist, val)) {
-		ret = 1;
-		goto done;
+	val ^= val >> 16;
+	val *= 0x45d9f3b;
+	return val ^ (val >> 16);
+}
+
+static inline int addr_set_contains(struct addr_set *set, uint32_t val)
+{
+	uint32_t i, mask = set->size - 1;
+
+	if(set->size == 0 || val == 0)
+		return 0;
+	for(i = addr_hash(val) & mask; set->slots[i]; i = (i + 1) & mask) {
+		if(set->slots[i] == val)
+			return 1;
 	}
+	return 0;
+}
 
-	index = binsearch_mr(p->modules, val, p->module_count);
-	if(index == 0 || index == -1 * (p->module_count)) {
-		goto done;
-	} else {
-		index = (index > 0)? index : -(index);
-		if(!(index & 0x1))
-			goto done;
+static void addr_set_add(struct addr_set *set, uint32_t val)
+{
+	uint32_t i, mask;
 
-		file = g_hash_table_lookup(p->mod_hashtable, p->modules[index - 1]);
-		if(!file) {
-			//FIXME: This needs to be handled. Possibly a race condition.
-			//monitor_printf(default_mon, "Corresponding module file not present... next_eip: 0x%08x\n", val);
-			//print_generic_table(p->mod_hashtable);
-			//vm_stop();
-		} else {
-			if(g_hash_table_lookup(file->whitelist, val - p->modules[index - 1])) {
-				ret = 1;
-				goto done;
-			}
-		}
+	if(val == 0)
+		return;
+	/* Keep at least half of the slots free */
+	if(2 * (set->count + 1) > set->size) {
+		struct addr_set old = *set;
+		set->size = old.size ? 2 * old.size : 256;
+		set->slots = (uint32_t *) calloc (set->size, sizeof(uint32_t));
+		set->count = 0;
+		for(i = 0; i < old.size; i++)
+			if(old.slots[i])
+				addr_set_add(set, old.slots[i]);
+		free(old.slots);
+	}
+	mask = set->size - 1;
+	for(i = addr_hash(val) & mask; set->slots[i]; i = (i + 1) & mask) {
+		if(set->slots[i] == val)
+			return;
 	}
+	set->slots[i] = val;
+	set->count++;
+}
 
-done:
-	return ret;
+static void addr_set_free(struct addr_set *set)
+{
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Build the whitelist from the count addresses in addrs, which it keeps */
+static void wl_array_build(struct wl_array *wl, uint32_t *addrs, uint32_t count)
+{
+	uint32_t i, j;
+
+	memset(wl, 0, sizeof(*wl));
+	if(count == 0) {
+		free(addrs);
+		return;
+	}
+	qsort(addrs, count, sizeof(uint32_t), compare_uint32);
+	for(i = 1, j = 1; i < count; i++)
+		if(addrs[i] != addrs[j - 1])
+			addrs[j++] = addrs[i];
+	wl->addrs = addrs;
+	wl->count = j;
+
+	wl->pages = wl_db_pages(addrs, j);
+	if(wl->pages == 0)
+		return;
+	wl->page_index = (uint32_t *) malloc ((wl->pages + 1) * sizeof(uint32_t));
+	wl_db_page_index(addrs, j, wl->page_index, wl->pages);
+}
+
+static inline int wl_array_contains(struct wl_array *wl, uint32_t val)
+{
+	int low = 0, high = wl->count - 1, mid;
+
+	if(wl->pages) {
+		if((val >> 12) >= wl->pages)
+			return 0;
+		low = wl->page_index[val >> 12];
+		high = wl->page_index[(val >> 12) + 1] - 1;
+	}
+	while(low <= high) {
+		mid = (low + high)/2;
+		if(wl->addrs[mid] > val)
+			high = mid - 1;
+		else if(wl->addrs[mid] < val)
+			low = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+static struct module *find_module(struct proc_entry *p, uint32_t addr)
+{
+	int low = 0, high = p->module_count - 1, mid;
+
+	while(low <= high) {
+		mid = (low + high)/2;
+		if(addr < p->modules[mid].start)
+			high = mid - 1;
+		else if(addr >= p->modules[mid].end)
+			low = mid + 1;
+		else
+			return &p->modules[mid];
+	}
+	return NULL;
+}
+
+static uint32_t lookup_in_whitelist (struct proc_entry *p, uint32_t val)
+{
+	struct module *m;
+
+	if(addr_set_contains(&p->misc_whitelist, val))
+		return 1;
+
+	m = find_module(p, val);
+	if(!m || !m->file)
+		return 0;
+
+	return wl_array_contains(&m->file->whitelist, val - m->start);
 }
 
 /*
@@ -228,6 +331,12 @@ int add_monitored_region(struct proc_entry *p, uint32_t addr, uint32_t size)
 	if(p->dr.mem_regions_count > (2 * MAX_REGIONS) - 2)
 		return -1;
 
+	if(p->dr.mem_regions_count + 2 > p->dr.mem_regions_max) {
+		p->dr.mem_regions_max = p->dr.mem_regions_max ? 2 * p->dr.mem_regions_max : 64;
+		p->dr.mem_regions = (uint32_t *) realloc (p->dr.mem_regions,
+				p->dr.mem_regions_max * sizeof(uint32_t));
+	}
+
 	index = -(index);
 
 	memmove(&((p->dr.mem_regions)[index+2]), &((p->dr.mem_regions)[index]), (p->dr.mem_regions_count - index) * sizeof(target_ulong));
@@ -241,24 +350,36 @@ int add_monitored_region(struct proc_entry *p, uint32_t addr, uint32_t size)
 /*
  * Adds a particular module to a process.
  */
-int add_proc_module(struct proc_entry *p, uint32_t addr, uint32_t size)
+int add_proc_module(struct proc_entry *p, uint32_t addr, uint32_t size, struct bin_file *file)
 {
-	int index;
-
-	index = binsearch_mr(p->modules, addr, p->module_count);
+	int low = 0, high = p->module_count - 1, mid;
 
-	if(index > 0 || ((-index) & 0x1) == 1)
+	while(low <= high) {
+		mid = (low + high)/2;
+		if(p->modules[mid].start > addr)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+	/* low is the first module after addr. Modules cannot overlap */
+	if((low > 0 && p->modules[low - 1].end > addr)
+			|| (low < p->module_count && p->modules[low].start < addr + size))
 		return -1;
 
-	if(p->module_count > (2 * MAX_REGIONS) - 2)
+	if(p->module_count >= MAX_MODULES)
 		return -1;
 
-	index = -(index);
+	if(p->module_count == p->module_max) {
+		p->module_max = p->module_max ? 2 * p->module_max : 32;
+		p->modules = (struct module *) realloc (p->modules,
+				p->module_max * sizeof(struct module));
+	}
 
-	memmove(&((p->modules)[index+2]), &((p->modules)[index]), (p->module_count - index) * sizeof(target_ulong));
-	(p->modules)[index] = addr;
-	(p->modules)[index+1] = addr + size;
-	p->module_count += 2;
+	memmove(&(p->modules[low+1]), &(p->modules[low]), (p->module_count - low) * sizeof(struct module));
+	p->modules[low].start = addr;
+	p->modules[low].end = addr + size;
+	p->modules[low].file = file;
+	p->module_count++;
 
 	return 0;
 }
@@ -279,190 +400,39 @@ int remove_monitored_region(struct proc_entry *p, uint32_t addr)
 	}
 }
 
-void Stack_Init(Stack *s[0xffff], uint32_t tid, uint32_t fiber_id, uint32_t max_size)
-{
-	Stack *curr; //, *next;
-	if(s[tid] == NULL) {
-		s[tid] = (Stack *) malloc (sizeof (Stack));
-		s[tid]->max_size = max_size;
-		s[tid]->data = (struct Data *) malloc (max_size * sizeof(struct Data));
-		memset(s[tid]->data, 0, max_size * sizeof(struct Data));
-		s[tid]->size = 0;
-		s[tid]->fiber_id = fiber_id;
-		s[tid]->next = s[tid]->prev = s[tid];
-	} else { //Thread exists, create new fiber and insert at tail. Assume that the fiber doesn't exist.
-		curr = (Stack *) malloc (sizeof (Stack));
-		curr->max_size = max_size;
-		curr->data = (struct Data *) malloc (max_size * sizeof(struct Data));
-		memset(curr->data, 0, max_size * sizeof(struct Data));
-		curr->size = 0;
-		curr->fiber_id = fiber_id;
-
-		curr->next = s[tid];
-		curr->prev = s[tid]->prev;
-		s[tid]->prev = curr;
-	}
-}
-
-static Stack *get_fiber_stack(Stack *s, uint32_t fiber_id) {
-	Stack *curr, *next;
-	if(s == NULL || s->fiber_id == fiber_id)
-		return s;
-	curr = s;
-	while((next = curr->next) != s) {
-		if(next->fiber_id == fiber_id)
-			return next;
-		curr = next;
-	}
-	//It turns out that fiber_data isn't quite fiber id. :( If a fiber id is not found, then, use the default value.
-	return s;
-}
-
-uint32_t Stack_Contains(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id, uint32_t next_eip)
+/* Index of the entry pushed at esp, or -1 */
+static inline int Stack_Find(Stack *s, uint32_t esp)
 {
-	unsigned int i;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL) { //Stack not initialized. Return 0
-		goto not_present;
-	}
-	for(i = 0; i < fiber_stack->size; i++) {
-		if(fiber_stack->data[i].data == next_eip)
-			return 1;
-	}
-not_present:
-	return 0;
-}
+	int low = 0, high = s->size - 1, mid;
 
-uint32_t Stack_Pop(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	uint32_t ret;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-        fprintf(stderr, "Stack pop error()\n");
-        return 0xFFFFFFFF;
-    }
-    ret = fiber_stack->data[fiber_stack->size-1].data;
-    fiber_stack->size--;
-    if(fiber_stack->size == 0) {
-    	free(fiber_stack->data);
-    	fiber_stack->prev->next = fiber_stack->next;
-    	fiber_stack->next->prev = fiber_stack->prev;
-    	if(fiber_stack == s[tid])
-    		s[tid] = NULL;
-    	free(fiber_stack);
-    }
-    return ret;
-}
-
-struct Data Stack_Pop_with_esp(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	struct Data ret;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-	       fprintf(stderr, "Stack pop error()\n");
-	       ret.data = 0xFFFFFFFF;
-	       return ret;
-	}
-	memcpy(&ret, &(fiber_stack->data[fiber_stack->size-1]), sizeof(struct Data));
-	fiber_stack->size--;
-	if(fiber_stack->size == 0) {
-		free(fiber_stack->data);
-		fiber_stack->prev->next = fiber_stack->next;
-		fiber_stack->next->prev = fiber_stack->prev;
-		if(fiber_stack == s[tid])
-			s[tid] = NULL;
-		free(fiber_stack);
-	}
-	return ret;
-}
-
-static void reset_fiber_stack(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-		   fprintf(stderr, "reset_fiber_stack: Stack pop error()\n");
-	}
-
-	free(fiber_stack->data);
-	fiber_stack->prev->next = fiber_stack->next;
-	fiber_stack->next->prev = fiber_stack->prev;
-	if(fiber_stack == s[tid])
-		s[tid] = NULL;
-	free(fiber_stack);
-}
-
-
-struct Data Stack_MultiPop_till(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id, uint32_t eip)
-{
-	struct Data ret, popval;
-	ret.data = ret.esp = 0;
-	while(ret.data != 0xFFFFFFFF) {
-		popval = Stack_Pop_with_esp(s, tid, fiber_id);
-		if(popval.data == eip)
-			return popval;
-	}
-//	monitor_printf(default_mon,"\n");
-	return ret;
-}
-
-uint32_t Stack_Top(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	struct Data *data;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-		fprintf(stderr, "Stack pop error()\n");
-		return 0xFFFFFFFF;
-	}
-	data = fiber_stack->data;
-	return data[fiber_stack->size-1].data;
-}
-
-struct Data Stack_Top_with_esp(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	struct Data ret;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-		   fprintf(stderr, "Stack pop error()\n");
-		   ret.data = 0xFFFFFFFF;
-		   return ret;
-	}
-	memcpy(&ret, &(fiber_stack->data[fiber_stack->size-1]), sizeof(struct Data));
-	return ret;
-}
-
-uint32_t Stack_esp(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id)
-{
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL || fiber_stack->data == NULL || fiber_stack->size == 0) {
-		fprintf(stderr, "Stack pop error()\n");
-		return 0xFFFFFFFF;
+	if(s->size == 0)
+		return -1;
+	if(s->data[high].esp == esp)
+		return high;
+	while(low <= high) {
+		mid = (low + high)/2;
+		if(s->data[mid].esp < esp)
+			high = mid - 1;
+		else if(s->data[mid].esp > esp)
+			low = mid + 1;
+		else
+			return mid;
 	}
-	return fiber_stack->data[fiber_stack->size - 1].esp;
+	return -1;
 }
 
 struct Data Stack_Pop_until(Stack *s, int index)
 {
-	int i = 0;
 	struct Data ret;
 	ret.data = ret.esp = 0;
 
 	if(index >= s->size) {
 		monitor_printf(default_mon, "Invalid index. %d in stack 0x%08x\n", index, s);
 		vm_stop(0);
+		return ret;
 	}
 
-	for(i = s->size-1; i >= index; i--) {
-		ret.data = s->data[i].data;
-		ret.esp = s->data[i].esp;
-		g_hash_table_remove(s->ht, ret.esp);
-	}
+	ret = s->data[index];
 	s->size = index;
 
 	return ret;
@@ -470,15 +440,13 @@ struct Data Stack_Pop_until(Stack *s, int index)
 
 int Stack_Push_new(Stack *s, uint32_t esp, uint32_t addr)
 {
-	int i = 0;
 	if(s->data == NULL) {
 		s->data = (struct Data *) malloc (sizeof(struct Data) * s->max_size);
 	}
+	/* The calls made at or below esp have returned already */
+	while(s->size > 0 && s->data[s->size-1].esp <= esp)
+		s->size--;
 	if(s->size == s->max_size) { //Maximum size reached. Reset stack.
-		for(i = 0; i < s->max_size; i++) {
-			g_hash_table_remove(s->ht, s->data[i].esp);
-		}
-		memset(s->data, 0, sizeof(struct Data) * s->max_size);
 		s->size = 0;
 	}
 	s->data[s->size].data = addr;
@@ -488,30 +456,6 @@ int Stack_Push_new(Stack *s, uint32_t esp, uint32_t addr)
 	return s->size - 1;
 }
 
-void Stack_Push(Stack *s[MAX_THREADS], uint32_t tid, uint32_t fiber_id, uint32_t d, uint32_t esp)
-{
-	Stack *fiber_stack;
-	if(s[tid] == NULL) {
-		Stack_Init(s, tid, fiber_id, 1000); //start with 10000 elements
-	}
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	uint32_t cur_size = fiber_stack->size;
-    if (fiber_stack->size < fiber_stack->max_size) {
-    	fiber_stack->data[cur_size].data = d;
-    	fiber_stack->data[cur_size].esp = esp;
-    	fiber_stack->size++;
-    }
-    else {
-    	fiber_stack->max_size = cur_size = 1000;
-    	fiber_stack->size = 0;
-        fprintf(stderr, "Stack full. Reseting stack to size:%d\n", fiber_stack->max_size);
-        memset(&(fiber_stack->data[cur_size]), 0, fiber_stack->max_size * sizeof(struct Data));
-        fiber_stack->data[cur_size].data = d;
-        fiber_stack->data[cur_size].esp = esp;
-        fiber_stack->size++;
-    }
-}
-
 /* END - Stack Impl */
 
 int is_kernel_instruction()
@@ -519,32 +463,6 @@ int is_kernel_instruction()
     return ((*TEMU_cpu_hflags & HF_CPL_MASK) != 3);
 }
 
-static inline void dump_stack (
-		uint32_t cr3,
-		char *name,
-		Stack *s[MAX_THREADS],
-		uint32_t tid,
-		uint32_t fiber_id,
-		uint32_t eip,
-		uint32_t next_eip,
-		uint32_t esp )
-{
-	unsigned int i;
-	Stack *fiber_stack;
-	fiber_stack = get_fiber_stack(s[tid], fiber_id);
-	if(fiber_stack == NULL) { //Stack not initialized. Return 0
-		goto not_present;
-	}
-	monitor_printf(default_mon, "MISMATCH in %s:%d. CR3: 0x%08x, EIP: 0x%08x, NEXT_EIP: 0x%08x. ESP: 0x%08x ", name, tid, cr3, eip, next_eip, esp);
-	for(i = 0; i < fiber_stack->size; i++) {
-		monitor_printf(default_mon, "(0x%08x, 0x%08x), ", fiber_stack->data[i].data, fiber_stack->data[i].esp);
-	}
-	monitor_printf(default_mon, "\n");
-not_present:
-	return;
-}
-
-
 static Thread *alloc_thread (uint32_t tid)
 {
 	Thread *thread = NULL;
@@ -556,12 +474,82 @@ static Thread *alloc_thread (uint32_t tid)
 	memset(thread->kstack, 0, sizeof(Stack));
 	thread->ustack->tid = thread->kstack->tid = tid;
 	thread->ustack->max_size = thread->kstack->max_size = 1000;
-	thread->ustack->ht = g_hash_table_new(0,0);
-	thread->kstack->ht = g_hash_table_new(0,0);
 	thread->tid = tid;
 	return thread;
 }
 
+static void free_thread (Thread *thread)
+{
+	free(thread->kstack->data);
+	free(thread->kstack);
+	free(thread->ustack->data);
+	free(thread->ustack);
+	free(thread);
+}
+
+static Thread *get_thread (struct proc_entry *p, uint32_t tid)
+{
+	uint32_t i, mask = p->thread_hash_size - 1;
+
+	if(p->thread_hash_size == 0)
+		return NULL;
+	for(i = addr_hash(tid) & mask; p->threads[i]; i = (i + 1) & mask) {
+		if(p->threads[i]->tid == tid)
+			return p->threads[i];
+	}
+	return NULL;
+}
+
+/* Adds the thread tid, which must not exist yet */
+static Thread *add_thread (struct proc_entry *p, uint32_t tid)
+{
+	uint32_t i, mask;
+
+	/* Keep at least half of the slots free */
+	if(2 * (p->thread_count + 1) > p->thread_hash_size) {
+		Thread **old = p->threads;
+		uint32_t old_size = p->thread_hash_size;
+		p->thread_hash_size = old_size ? 2 * old_size : 64;
+		p->threads = (Thread **) calloc (p->thread_hash_size, sizeof(Thread *));
+		mask = p->thread_hash_size - 1;
+		for(i = 0; i < old_size; i++) {
+			uint32_t j;
+			if(!old[i])
+				continue;
+			for(j = addr_hash(old[i]->tid) & mask; p->threads[j]; j = (j + 1) & mask)
+				;
+			p->threads[j] = old[i];
+		}
+		free(old);
+	}
+	mask = p->thread_hash_size - 1;
+	for(i = addr_hash(tid) & mask; p->threads[i]; i = (i + 1) & mask)
+		;
+	p->threads[i] = alloc_thread(tid);
+	p->thread_count++;
+	return p->threads[i];
+}
+
+/* Called when esp left the stacks of the current thread */
+static void switch_thread (struct proc_entry *p)
+{
+	p->curr_tid = wl_get_tid();
+	p->curr_thread = get_thread(p, p->curr_tid);
+}
+
+/* Process of the last lookup. Most branches come in a row from the same process */
+static struct proc_entry *last_pe = NULL;
+static uint32_t last_pe_cr3 = 0;
+
+static inline struct proc_entry *get_proc_entry(uint32_t cr3)
+{
+	if(last_pe == NULL || last_pe_cr3 != cr3) {
+		last_pe = g_hash_table_lookup(cr3_pe_ht, (gpointer) cr3);
+		last_pe_cr3 = cr3;
+	}
+	return last_pe;
+}
+
 static inline Stack *get_curr_stack(Thread *th)
 {
 	if(!TEMU_is_in_kernel())
@@ -586,7 +574,7 @@ void ret_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t e
 
 	CPUState *env = cpu_single_env ? cpu_single_env : first_cpu;
 
-	struct proc_entry *p = g_hash_table_lookup(cr3_pe_ht, (gpointer) env->cr[3]);
+	struct proc_entry *p = get_proc_entry(env->cr[3]);
 	if(!p) {
 		goto done;
 	}
@@ -597,13 +585,14 @@ void ret_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t e
 	ret_count++;
 	uint32_t esp = 0, esp_page = 0, not_curr_page = 0;
 	Stack *st = NULL;
+	int found;
 	esp = espval;
 	esp_page = (esp >> 3) << 3;
-	if(esp_page != p->threads[p->curr_tid]->kernel_stack
-			&& esp_page != p->threads[p->curr_tid]->user_stack) { //Still in the same thread. Push to stack and be done.
-		p->curr_tid = wl_get_tid();
-		if(!p->threads[p->curr_tid]) {
-			p->threads[p->curr_tid] = alloc_thread(p->curr_tid);
+	if(esp_page != p->curr_thread->kernel_stack
+			&& esp_page != p->curr_thread->user_stack) { //Still in the same thread. Push to stack and be done.
+		switch_thread(p);
+		if(!p->curr_thread) {
+			p->curr_thread = add_thread(p, p->curr_tid);
 			uint32_t ret = lookup_in_whitelist(p, next_eip);
 			if(!ret) {
 				miss_ret1++;
@@ -613,14 +602,14 @@ void ret_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t e
 			goto done;
 		}
 		if(TEMU_is_in_kernel())
-			p->threads[p->curr_tid]->kernel_stack = esp_page;
+			p->curr_thread->kernel_stack = esp_page;
 		else
-			p->threads[p->curr_tid]->user_stack = esp_page;
+			p->curr_thread->user_stack = esp_page;
 		not_curr_page = 1;
 	}
-	st = get_curr_stack(p->threads[p->curr_tid]);
-	index = g_hash_table_lookup(st->ht, esp);
-	if(!index) {
+	st = get_curr_stack(p->curr_thread);
+	found = Stack_Find(st, esp);
+	if(found < 0) {
 		uint32_t ret = lookup_in_whitelist(p, next_eip);
 		if(!ret) {
 			miss_ret2++;
@@ -629,9 +618,7 @@ void ret_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t e
 		}
 		goto done;
 	}
-
-	if(index == 0xabcdef)
-		index = 0;
+	index = found;
 
 	if(index == st->size - 1)
 		stack_top++;
@@ -671,7 +658,7 @@ void floating_point_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32
 	uint8_t bytes[15];
 	CPUState *env = cpu_single_env ? cpu_single_env : first_cpu;
 
-	struct proc_entry *p = g_hash_table_lookup(cr3_pe_ht, (gpointer) env->cr[3]);
+	struct proc_entry *p = get_proc_entry(env->cr[3]);
 	if(!p) {
 		goto done;
 	}
@@ -682,7 +669,7 @@ void floating_point_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32
 	cpu_memory_rw_debug(env, eip, &bytes[0], 15, 0); //Read the instruction
 
 	if(bytes[0] == 0xd9 && bytes[1] == 0xee)
-		g_hash_table_insert(p->misc_whitelist, (gpointer) eip, (gpointer) 2); //2 == FLDZ insn
+		addr_set_add(&p->misc_whitelist, eip); //FLDZ insn
 
 done:
 	return;
@@ -709,7 +696,7 @@ void callff_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_
 	if(next_eip == 0)
 		goto done;
 
-	struct proc_entry *p = g_hash_table_lookup(cr3_pe_ht, (gpointer) env->cr[3]);
+	struct proc_entry *p = get_proc_entry(env->cr[3]);
 	if(!p) {
 		goto done;
 	}
@@ -758,20 +745,19 @@ void callff_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_
 		cpu_memory_rw_debug(env, eip, &bytes[0], 15, 0); //Read the instruction
 		insn_len = get_insn_len(bytes);
 		ret_addr = eip + insn_len;
-		if(esp_page != p->threads[p->curr_tid]->kernel_stack
-				&& esp_page != p->threads[p->curr_tid]->user_stack) { //Still in the same thread. Push to stack and be done.
-			p->curr_tid = wl_get_tid();
-			if(!p->threads[p->curr_tid])
-				p->threads[p->curr_tid] = alloc_thread(p->curr_tid);
+		if(esp_page != p->curr_thread->kernel_stack
+				&& esp_page != p->curr_thread->user_stack) { //Still in the same thread. Push to stack and be done.
+			switch_thread(p);
+			if(!p->curr_thread)
+				p->curr_thread = add_thread(p, p->curr_tid);
 			if(TEMU_is_in_kernel())
-				p->threads[p->curr_tid]->kernel_stack = esp_page;
+				p->curr_thread->kernel_stack = esp_page;
 			else
-				p->threads[p->curr_tid]->user_stack = esp_page;
+				p->curr_thread->user_stack = esp_page;
 			not_curr_page = 1;
 		}
-		st = get_curr_stack(p->threads[p->curr_tid]);
+		st = get_curr_stack(p->curr_thread);
 		index = Stack_Push_new(st, esp, ret_addr);
-		g_hash_table_insert(st->ht, esp, ((index == 0)? 0xabcdef : index));
 
 		if(not_curr_page) {
 			update_stack_layout(st, esp);
@@ -780,7 +766,7 @@ void callff_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_
 		call_count++;
 
 		//and whitelist the ret addr since some rets are incorporated using indirect jumps Eg: rpcrt4.dll::ObjectStubless()
-		g_hash_table_insert(p->misc_whitelist, (gpointer) eip+insn_len, (gpointer) 12);
+		addr_set_add(&p->misc_whitelist, ret_addr);
 	}
 
 done:
@@ -806,7 +792,7 @@ void call_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t
 	int index = 0;
 	uint32_t esp = 0, not_curr_page = 0;
 
-	struct proc_entry *p = g_hash_table_lookup(cr3_pe_ht, (gpointer) env->cr[3]);
+	struct proc_entry *p = get_proc_entry(env->cr[3]);
 	if(!p) {
 		goto done;
 	}
@@ -817,20 +803,19 @@ void call_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t
 	esp = env->regs[R_ESP];
 	esp_page = (esp >> 3) << 3;
 	ret_addr = eip + 5;
-	if(esp_page != p->threads[p->curr_tid]->kernel_stack
-			&& esp_page != p->threads[p->curr_tid]->user_stack) { //Still in the same thread. Push to stack and be done.
-		p->curr_tid = wl_get_tid();
-		if(!p->threads[p->curr_tid])
-			p->threads[p->curr_tid] = alloc_thread(p->curr_tid);
+	if(esp_page != p->curr_thread->kernel_stack
+			&& esp_page != p->curr_thread->user_stack) { //Still in the same thread. Push to stack and be done.
+		switch_thread(p);
+		if(!p->curr_thread)
+			p->curr_thread = add_thread(p, p->curr_tid);
 		if(TEMU_is_in_kernel())
-			p->threads[p->curr_tid]->kernel_stack = esp_page;
+			p->curr_thread->kernel_stack = esp_page;
 		else
-			p->threads[p->curr_tid]->user_stack = esp_page;
+			p->curr_thread->user_stack = esp_page;
 		not_curr_page = 1;
 	}
-	st = get_curr_stack(p->threads[p->curr_tid]);
+	st = get_curr_stack(p->curr_thread);
 	index = Stack_Push_new(st, esp, ret_addr);
-	g_hash_table_insert(st->ht, esp, ((index == 0)? 0xabcdef : index));
 
 	if(not_curr_page) {
 		update_stack_layout(st, esp);
@@ -839,8 +824,7 @@ void call_target_handler(uint32_t eip, uint32_t next_eip, uint32_t op, uint32_t
 	call_count++;
 
 	//and whitelist the ret addr since some rets are incorporated using indirect jumps Eg: rpcrt4.dll::ObjectStubless()
-	//FIXME: For now, inserting 1 as the value. Changing to the struct bin_file * could be costly.
-	g_hash_table_insert(p->misc_whitelist, (gpointer) eip+insn_len, (gpointer) 11);
+	addr_set_add(&p->misc_whitelist, ret_addr);
 
 done:
 	return;
@@ -891,15 +875,11 @@ void do_dump_mod_wl(Monitor *mon, const QDict *qdict)
 #endif
 }
 
-static void print_mods(gpointer key, gpointer val, gpointer ud)
-{
-	struct bin_file *file = (struct bin_file *)val;
-	monitor_printf(default_mon, "%s, start: 0x%08x\n", file->name, file->image_base);
-}
 
 void do_dump_proc_modules(Monitor *mon, const QDict *qdict)
 {
 	uint32_t cr3 = 0;
+	int i;
 	if(qdict_haskey(qdict, "cr3")) {
 		cr3 = qdict_get_int(qdict, "cr3");
 	}
@@ -910,11 +890,15 @@ void do_dump_proc_modules(Monitor *mon, const QDict *qdict)
 		monitor_printf(default_mon, "proc not found.\n");
 		return;
 	}
-	if(p->mod_hashtable == NULL) {
-		monitor_printf(default_mon, "mod_hashtable is null for %s\n", p->name);
+	if(p->module_count == 0) {
+		monitor_printf(default_mon, "no modules for %s\n", p->name);
 		return;
 	}
-	g_hash_table_foreach(p->mod_hashtable, print_mods, NULL);
+	for(i = 0; i < p->module_count; i++) {
+		if(p->modules[i].file)
+			monitor_printf(default_mon, "%s, start: 0x%08x, entries: %d\n", p->modules[i].file->name,
+					p->modules[i].start, p->modules[i].file->whitelist.count);
+	}
 }
 
 
@@ -1113,8 +1097,6 @@ void do_dump_file_wl (Monitor *mon, const QDict *qdict)
 
 static unsigned int bin_file_write (FILE *fp, struct bin_file *file)
 {
-	uint32_t *temp = NULL;
-	int i = 0;
 	unsigned int size = 0;
 	unsigned int byte_count = 0;
 	fwrite((void *)file->name, NAME_SIZE, 1, fp);
@@ -1129,28 +1111,15 @@ static unsigned int bin_file_write (FILE *fp, struct bin_file *file)
 	fwrite((void *)&(file->exp_tbl_count), sizeof(unsigned int), 1, fp);
 	byte_count += sizeof(unsigned int);
 
-	size = g_hash_table_size(file->whitelist);
+	size = file->whitelist.count;
 	fwrite((void *)&(size), sizeof(unsigned int), 1, fp);
 	byte_count += sizeof(unsigned int);
 
-	temp = (uint32_t *) malloc (sizeof(uint32_t) * size);
-
-	GHashTableIter iter;
-	gpointer key, value;
-
-	g_hash_table_iter_init (&iter, file->whitelist);
-	while (g_hash_table_iter_next (&iter, &key, &value))
-	{
-		temp[i++] = (uint32_t)key;
-	}
-
-	assert(i == size);
-	fwrite((void *)temp, i * sizeof(uint32_t), 1, fp);
-	byte_count += i * sizeof(uint32_t);
+	fwrite((void *)file->whitelist.addrs, size * sizeof(uint32_t), 1, fp);
+	byte_count += size * sizeof(uint32_t);
 
-	free(temp);
-	monitor_printf(default_mon, "Written %s. Exp tbl: %d, reloc tbl: %d, Entries in ht: %d. Total bytes written = %d\n",
-					file->name, file->exp_tbl_count, file->reloc_tbl_count, g_hash_table_size(file->whitelist), byte_count);
+	monitor_printf(default_mon, "Written %s. Exp tbl: %d, reloc tbl: %d, Entries in wl: %d. Total bytes written = %d\n",
+					file->name, file->exp_tbl_count, file->reloc_tbl_count, file->whitelist.count, byte_count);
 
 	return byte_count;
 }
@@ -1159,7 +1128,7 @@ void load_file_wl(char *file)
 {
 	FILE *fp = fopen(file, "rb");
 	uint32_t ht_size;
-	int i, j;
+	int i;
 	uint32_t *temp = NULL;
 	unsigned int byte_count = 0;
 	unsigned int size = 0;
@@ -1188,18 +1157,144 @@ void load_file_wl(char *file)
 		fread((void *)temp, sizeof(uint32_t) * size, 1, fp);
 		byte_count += sizeof(uint32_t) * size;
 
-		f->whitelist = g_hash_table_new(0, 0);
-		for(j = 0; j < size; j++)
-			g_hash_table_insert(f->whitelist, temp[j], 1);
-		free(temp);
-		monitor_printf(default_mon, "Loaded %s. Exp tbl: %d, reloc tbl: %d, Entries in ht: %d. Total bytes read = %d\n",
-				f->name, f->exp_tbl_count, f->reloc_tbl_count, g_hash_table_size(f->whitelist), byte_count);
+		wl_array_build(&f->whitelist, temp, size);
+		monitor_printf(default_mon, "Loaded %s. Exp tbl: %d, reloc tbl: %d, Entries in wl: %d. Total bytes read = %d\n",
+				f->name, f->exp_tbl_count, f->reloc_tbl_count, f->whitelist.count, byte_count);
 		g_hash_table_insert(filemap_ht, f->name, f);
 	}
 	fclose(fp);
 	monitor_printf(default_mon, "Total entries loaded = %d\n", g_hash_table_size(filemap_ht));
 }
 
+/* Whitelist database from wl_compile, mapped for the whole run since the
+ * whitelists of the files point into it */
+static uint8_t *wl_db = NULL;
+static size_t wl_db_size = 0;
+
+static int wl_db_open(const char *filename)
+{
+	struct wl_db_header *h;
+	struct wl_db_image *img;
+	struct stat st;
+	uint8_t *db = MAP_FAILED;
+	const uint32_t *page_index;
+	uint32_t i, j;
+	int fd, ret = -1;
+
+	if(wl_db) {
+		monitor_printf(default_mon, "A whitelist database is already loaded\n");
+		return -1;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(*h))
+		goto done;
+	db = (uint8_t *) mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(db == MAP_FAILED)
+		goto done;
+
+	h = (struct wl_db_header *) db;
+	if(memcmp(h->magic, WL_DB_MAGIC, sizeof(WL_DB_MAGIC)) || h->version != WL_DB_VERSION
+			|| h->size != st.st_size
+			|| h->n_images > (st.st_size - sizeof(*h)) / sizeof(*img)) {
+		monitor_printf(default_mon, "%s is not a whitelist database of version %d\n", filename, WL_DB_VERSION);
+		goto done;
+	}
+	img = (struct wl_db_image *) (db + sizeof(*h));
+	for(i = 0; i < h->n_images; i++) {
+		if(img[i].addrs_off % 4 || img[i].addrs_off > st.st_size
+				|| img[i].n_addrs > (st.st_size - img[i].addrs_off) / sizeof(uint32_t)
+				|| (img[i].n_pages && (img[i].n_pages >= WL_MAX_PAGES
+						|| img[i].pages_off % 4 || img[i].pages_off > st.st_size
+						|| img[i].n_pages + 1 > (st.st_size - img[i].pages_off) / sizeof(uint32_t)))) {
+			monitor_printf(default_mon, "%s: bad image %d\n", filename, i);
+			goto done;
+		}
+		if(!img[i].n_pages)
+			continue;
+		//wl_array_contains searches between two entries of the index
+		page_index = (const uint32_t *) (db + img[i].pages_off);
+		for(j = 0; j <= img[i].n_pages; j++) {
+			if(page_index[j] > img[i].n_addrs) {
+				monitor_printf(default_mon, "%s: bad page index of image %d\n", filename, i);
+				goto done;
+			}
+		}
+	}
+
+	wl_db = db;
+	wl_db_size = st.st_size;
+	monitor_printf(default_mon, "Mapped %d whitelists from %s\n", h->n_images, filename);
+	ret = 0;
+
+done:
+	if(ret != 0 && db != MAP_FAILED)
+		munmap(db, st.st_size);
+	close(fd);
+	return ret;
+}
+
+static struct wl_db_image *wl_db_find(uint64_t key)
+{
+	struct wl_db_header *h = (struct wl_db_header *) wl_db;
+	struct wl_db_image *img = (struct wl_db_image *) (wl_db + sizeof(*h));
+	int low = 0, high = h->n_images - 1, mid;
+
+	while(low <= high) {
+		mid = (low + high)/2;
+		if(img[mid].key > key)
+			high = mid - 1;
+		else if(img[mid].key < key)
+			low = mid + 1;
+		else
+			return &img[mid];
+	}
+	return NULL;
+}
+
+/* Point the whitelist of file to the database, if the image at base is in
+ * it. The key is read from the headers in the guest, or from the file on
+ * the host if they are paged out. */
+static int wl_db_attach(struct bin_file *file, uint32_t cr3, uint32_t base, char *host_filename)
+{
+	CPUState *env = cpu_single_env ? cpu_single_env : first_cpu;
+	uint8_t hdr[4096];
+	struct wl_db_image *img;
+	uint64_t key = 0;
+	size_t len;
+	FILE *fp;
+
+	if(!wl_db)
+		return -1;
+
+	if(DECAF_read_mem_with_pgd(env, cr3, base, sizeof(hdr), hdr) == 0)
+		key = wl_db_image_key(hdr, sizeof(hdr));
+	if(!key && (fp = fopen(host_filename, "rb")) != NULL) {
+		len = fread(hdr, 1, sizeof(hdr), fp);
+		fclose(fp);
+		key = wl_db_image_key(hdr, len);
+	}
+	if(!key || (img = wl_db_find(key)) == NULL)
+		return -1;
+
+	file->image_base = img->image_base;
+	file->whitelist.addrs = (uint32_t *) (wl_db + img->addrs_off);
+	file->whitelist.count = img->n_addrs;
+	file->whitelist.pages = img->n_pages;
+	file->whitelist.page_index = img->n_pages ? (uint32_t *) (wl_db + img->pages_off) : NULL;
+	return 0;
+}
+
+void do_load_wl_db(Monitor *mon, const QDict *qdict)
+{
+	const char *filename = qdict_get_str(qdict, "filename");
+
+	if(wl_db_open(filename) != 0)
+		monitor_printf(mon, "Unable to load the whitelist database %s\n", filename);
+}
+
 void do_dump_file_wl(Monitor *mon, const QDict *qdict)
 {
 	GHashTableIter iter;
@@ -1256,6 +1351,7 @@ static int wl_init(void)
   vio_ht = g_hash_table_new(0, 0);
 
   load_file_wl("file_whitelist.dump");
+  wl_db_open("whitelist.db");
 
   return 0;
 }
@@ -1270,6 +1366,11 @@ static void cfi_cleanup(void)
    	DECAF_unregister_callback(DECAF_BLOCK_BEGIN_CB, hndl);
 
    recon_cleanup();
+
+   if(wl_db) {
+	   munmap(wl_db, wl_db_size);
+	   wl_db = NULL;
+   }
 }
 
 static mon_cmd_t wl_term_cmds[] = {
@@ -1292,7 +1393,7 @@ static void GetProcAddress_ret_hook(void *opaque)
 	}
 
 	if(env->eip != 0)
-		g_hash_table_insert(p->misc_whitelist, (gpointer) env->eip, (gpointer) 13);
+		addr_set_add(&p->misc_whitelist, env->eip);
 
 done:
 	hookapi_remove_hook(hook_handle->handle);
@@ -1523,7 +1624,7 @@ static void SwitchToFiber_hook(void *opaque)
 		goto done;
 	}
 
-	g_hash_table_insert(p->misc_whitelist, (gpointer) branch_addr, (gpointer) 14);
+	addr_set_add(&p->misc_whitelist, branch_addr);
 done:
 	return;
 }
@@ -1565,7 +1666,7 @@ static void setjmp_hook(void *opaque)
 		goto done;
 	}
 
-	g_hash_table_insert(p->misc_whitelist, (gpointer) retaddr, (gpointer) 1);
+	addr_set_add(&p->misc_whitelist, retaddr);
 
 done:
 	return;
@@ -1627,19 +1728,13 @@ done:
 	return;
 }
 
-static void insert_file_to_proc (struct proc_entry *p, struct bin_file *file, uint32_t load_addr)
+static void insert_file_to_proc (struct proc_entry *p, struct bin_file *file, uint32_t load_addr, uint32_t size)
 {
-	int i;
-	char wFileName[2048] = {'\0'};
-	char temp_str[16] = {'\0'};
-	uint32_t new_addr = 0;
-
-	if(file->exp_tbl_count == 0 && file->reloc_tbl_count == 0)
-		return;
-
-
-	g_hash_table_insert(p->mod_hashtable, file->image_base, (gpointer)file);
+	/* The whitelist holds offsets from the load address */
+	if(file->whitelist.count == 0)
+		file = NULL;
 
+	add_proc_module(p, load_addr, size, file);
 }
 
 static void insert_proc(uint32_t pid, uint32_t cr3, char *name)
@@ -1664,9 +1759,7 @@ static void insert_proc(uint32_t pid, uint32_t cr3, char *name)
 	e->cr3 = cr3;
 	strcpy(e->name, name);
 	e->pid = pid;
-	e->misc_whitelist = g_hash_table_new(0, 0);
-	e->mod_hashtable = g_hash_table_new(0,0);
-	e->threads[e->curr_tid] = alloc_thread(e->curr_tid);
+	e->curr_thread = add_thread(e, e->curr_tid);
 
 	g_hash_table_insert(cr3_pe_ht, (gpointer) cr3, (gpointer) e);
 	if(name[0] != '\0')
@@ -1889,6 +1982,10 @@ void wl_load_module_notify (
 		memset(file, 0, sizeof(*file));
 		strcpy(file->name, temp);
 		convert_to_host_filename(fullname, host_filename);
+		if(wl_db_attach(file, cr3, base, host_filename) == 0) {
+			monitor_printf(default_mon, "%d entries mapped for %s.\n", file->whitelist.count, fullname);
+			goto insert;
+		}
 		ret = enum_exp_table_reloc_table_to_wl (host_filename, base, name, file);
 		if(ret == -1) { //Unable to open file or invalid pe header. Try defaults
 			strcpy(name_lower, name);
@@ -1922,19 +2019,21 @@ void wl_load_module_notify (
 		monitor_printf(default_mon, "%d entries loaded from %s. ", ret, fullname);
 	}
 
-	if(file->whitelist == 0) { //Not initialized
-		file->whitelist = g_hash_table_new(0,0);
+	if(file->whitelist.addrs == NULL && (file->reloc_tbl || file->exp_tbl)) { //Not initialized
+		/* The tables have addresses in the image at its preferred base */
+		uint32_t *addrs = (uint32_t *) malloc ((file->reloc_tbl_count + file->exp_tbl_count + 1) * sizeof(uint32_t));
+		uint32_t count = 0;
 		for(i = 0; i < file->reloc_tbl_count; i++)
-			g_hash_table_insert(file->whitelist, (file->reloc_tbl)[i], 1);
+			if(file->reloc_tbl[i] - file->image_base < size)
+				addrs[count++] = file->reloc_tbl[i] - file->image_base;
 		for(i = 0; i < file->exp_tbl_count; i++)
-			g_hash_table_insert(file->whitelist, (file->exp_tbl)[i], 2);
+			if(file->exp_tbl[i] - file->image_base < size)
+				addrs[count++] = file->exp_tbl[i] - file->image_base;
+		wl_array_build(&file->whitelist, addrs, count);
 
-		monitor_printf(default_mon, "%d elements in ht.\n", g_hash_table_size(file->whitelist));
+		monitor_printf(default_mon, "%d elements in wl.\n", file->whitelist.count);
 	}
 
-	insert_file_to_proc(p, file, base);
-	add_proc_module(p, base, size);
-
 	//Free up the reloc table and the export table.
 	if(file->exp_tbl) {
 		free(file->exp_tbl);
@@ -1948,10 +2047,13 @@ void wl_load_module_notify (
 
 	WL_cleanUp();
 
+insert:
+	insert_file_to_proc(p, file, base, size);
+
 	if(!g_hash_table_lookup (filemap_ht, temp)) {
-		if(file->reloc_tbl_count > 0 || file->exp_tbl_count > 0) {
+		if(file->whitelist.count > 0) {
 			monitor_printf(default_mon, "Inserting to filemap temp: %s, fullname: %s\n", temp, fullname);
-			g_hash_table_insert(filemap_ht, temp, (gpointer)file);
+			g_hash_table_insert(filemap_ht, file->name, (gpointer)file);
 		}
 	}
 
@@ -1970,38 +2072,17 @@ static void wl_procexit(uint32_t pid, uint32_t cr3, char *name)
 		vm_stop(0);
 		goto done;
 	}
-	for(i = 0; i < MAX_THREADS; i++) {
-		if(p->threads[i]) {
-			if(p->threads[i]->kstack) {
-				if(p->threads[i]->kstack->data) {
-					free(p->threads[i]->kstack->data);
-					p->threads[i]->kstack->data = NULL;
-				}
-				g_hash_table_destroy(p->threads[i]->kstack->ht);
-				p->threads[i]->kstack->ht = NULL;
-				free(p->threads[i]->kstack);
-				p->threads[i]->kstack = NULL;
-			}
-			if(p->threads[i]->ustack) {
-				if(p->threads[i]->ustack->data) {
-					free(p->threads[i]->ustack->data);
-					p->threads[i]->ustack->data = NULL;
-				}
-				g_hash_table_destroy(p->threads[i]->ustack->ht);
-				p->threads[i]->ustack->ht = NULL;
-				free(p->threads[i]->ustack);
-				p->threads[i]->ustack = NULL;
-			}
-			free(p->threads[i]);
-			p->threads[i] = NULL;
-		}
+	for(i = 0; i < p->thread_hash_size; i++) {
+		if(p->threads[i])
+			free_thread(p->threads[i]);
 	}
-	if(p->mod_hashtable)
-		g_hash_table_destroy(p->mod_hashtable);
-
-	if(p->misc_whitelist)
-		g_hash_table_destroy(p->misc_whitelist);
+	free(p->threads);
+	free(p->modules);
+	free(p->dr.mem_regions);
+	addr_set_free(&p->misc_whitelist);
 
+	if(last_pe == p)
+		last_pe = NULL;
 	g_hash_table_remove(cr3_pe_ht, cr3);
 
 	free(p);
@@ -11,25 +11,20 @@
 #include <inttypes.h>
 #include <glib.h>
 
-#define MAX_THREADS 0xffff
-
 struct Data {
 	uint32_t data;
 	uint32_t esp;
 };
 
-/* Stack Impl */
+/* Stack Impl. The esp of the entries goes down from the bottom to the top,
+ * as on the guest stack, so that the entry pushed at an esp is found with a
+ * binary search, and most of the time at the top. */
 struct Stack {
     struct Data	*data;
     uint32_t     size;
     uint32_t max_size;
-    uint32_t start;
     uint32_t end;
     uint32_t tid;
-    uint32_t fiber_id;
-    GHashTable *ht;
-    struct Stack *next;
-    struct Stack *prev;
 };
 typedef struct Stack Stack;
 
@@ -42,24 +37,51 @@ struct thread {
 };
 typedef struct thread Thread;
 
+/* Set of addresses, with open addressing. 0 is never in the set. */
+struct addr_set {
+	uint32_t *slots;
+	uint32_t size; //power of 2
+	uint32_t count;
+};
+
+/* Sorted whitelist of a module. page_index[i] is the first entry of the
+ * page i, so that a lookup only searches the entries of one page. */
+struct wl_array {
+	uint32_t *addrs;
+	uint32_t count;
+	uint32_t *page_index;
+	uint32_t pages; //0 if there is no page index
+};
+
 #define MAX_REGIONS 30000
 struct dyn_region {
 	int mem_regions_count;
-	uint32_t mem_regions[2 * MAX_REGIONS];
+	int mem_regions_max;
+	uint32_t *mem_regions;
+};
+
+struct bin_file;
+struct module {
+	uint32_t start;
+	uint32_t end;
+	struct bin_file *file;
 };
 
 #define MAX_MODULES 1000
 struct proc_entry {
 	char name[128];
-	uint32_t modules[2 * MAX_MODULES];
+	struct module *modules; //sorted by start
 	uint32_t module_count;
+	uint32_t module_max;
 	uint32_t pid;
 	uint32_t cr3;
 	uint32_t curr_tid;
+	Thread *curr_thread;
 	uint32_t initialized;
-	GHashTable *mod_hashtable;
-	GHashTable *misc_whitelist;
-	Thread *threads[MAX_THREADS];
+	struct addr_set misc_whitelist;
+	Thread **threads; //open addressing on tid
+	uint32_t thread_hash_size;
+	uint32_t thread_count;
 	struct dyn_region dr;
 };
 
@@ -69,7 +91,7 @@ struct bin_file {
 	uint32_t image_base;
 	unsigned int reloc_tbl_count;
 	unsigned int exp_tbl_count;
-	GHashTable *whitelist;
+	struct wl_array whitelist;
 	uint32_t *reloc_tbl;
 	uint32_t *exp_tbl;
 };
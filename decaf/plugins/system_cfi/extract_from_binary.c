@@ -101,7 +101,11 @@ DWORD *getExportTable(IMAGE_NT_HEADERS *PeHeader, DWORD *numOfExport){
 	if(!edt_raw_offset)
 		return 0;
 	pedt = (IMAGE_EXPORT_DIRECTORY*)ptr_from_file(edt_raw_offset);
+	if(!pedt || edt_raw_offset + sizeof(*pedt) > file_sz)
+		return 0;
 	ptr_to_table = (DWORD*)ptr_from_file(virtualAddressToRawOffset(PeHeader, pedt->AddressOfFunctions));
+	if(!ptr_to_table || pedt->NumberOfFunctions > (file_sz - ((BYTE*)ptr_to_table - file_data_raw))/sizeof(DWORD))
+		return 0;
 	(*numOfExport) = pedt->NumberOfFunctions;
 
 	export_table = (DWORD*)malloc((*numOfExport)*sizeof(DWORD));
@@ -176,7 +180,7 @@ uint32_t* checkBinary(BYTE* data, DWORD CodeBase, DWORD CodeSize, uint32_t *wl_n
 {
 	uint32_t targetAddr, i = 0;
 	int size = 0;
-	uint32_t *textTable = (DWORD*)malloc(CodeSize);
+	uint32_t *textTable = (DWORD*)malloc(CodeSize*sizeof(DWORD));
 	for (i=0;i<CodeSize;i++)
 	{		
 		if(data[i]==0xeb || data[i]==0x70 || data[i]==0x71 || data[i]==0x72 || data[i]==0x73 || data[i]==0x74 || data[i]==0x75 || data[i]==0x76 || data[i]==0x77|| data[i]==0x78 || data[i]==0x79 || data[i]==0x7A || data[i]==0x7B || data[i]==0x7C || data[i]==0x7D || data[i]==0x7E || data[i]==0x7F)
@@ -227,8 +231,13 @@ uint32_t* handleTextSection (IMAGE_NT_HEADERS *PeHeader, uint32_t *wl_numOfEntri
 	}
 	imageBase = getImageBase(PeHeader);
 	text_data = (BYTE*)ptr_from_file(text_section->PointerToRawData);
+	if(!text_data)
+		return 0;
 	DWORD CodeBase = PeHeader->OptionalHeader.BaseOfCode;
 	DWORD CodeSize = PeHeader->OptionalHeader.SizeOfCode;
+	//the scan reads up to 4 bytes past an opcode
+	if(CodeSize + 4 > file_sz - text_section->PointerToRawData)
+		CodeSize = file_sz - text_section->PointerToRawData > 4 ? file_sz - text_section->PointerToRawData - 4 : 0;
 	
 	return checkBinary(text_data, CodeBase, CodeSize, wl_numOfEntries, imageBase);
 
@@ -247,8 +256,10 @@ uint32_t* getRelocTable(IMAGE_NT_HEADERS *PeHeader, uint32_t *wl_numOfEntries){
 	reloc_sz = reloc_section->SizeOfRawData;
 	reloc_data = (char *)ptr_from_file(reloc_section->PointerToRawData);
 
-//	if(!reloc_data)
-//		return handleTextSection(PeHeader,wl_numOfEntries);
+	if(!reloc_data)
+		return handleTextSection(PeHeader,wl_numOfEntries);
+	if(reloc_sz > file_sz - reloc_section->PointerToRawData)
+		reloc_sz = file_sz - reloc_section->PointerToRawData;
 
 	uint32_t block_base, block_sz;
 	uint32_t *reloc_table = 0;
@@ -275,6 +286,8 @@ uint32_t* getRelocTable(IMAGE_NT_HEADERS *PeHeader, uint32_t *wl_numOfEntries){
 			reloc_table[count] = block_base + (tmp & 0x0fff);
 			//printf("%d 0x%08x --> ", count, reloc_table[count]);
 			uint32_t raw_offset = virtualAddressToRawOffset(PeHeader, reloc_table[count]);
+			if(!raw_offset || raw_offset + sizeof(uint32_t) > file_sz)
+				continue;
 			reloc_table[count] = *(uint32_t*)ptr_from_file(raw_offset);
 			//printf("0x%08x\n", reloc_table[count]);
 			count++;
@@ -343,20 +356,3 @@ uint32_t* WL_ExportTableFromBinary(char *file, uint32_t* entries){
 		printf("R:0x%08x\n", relocTable[i]);
 	}
 }
-
-int main(int argc, char **argv){
-	uint32_t et_num, new_addr, image_base;
-	struct bin_file file;
-	uint32_t *et = WL_Extract(argv[1], &et_num, &image_base, &file);
-	int i;
-	if(et){
-		for(i=0;i<et_num;i++){
-			new_addr = et[i];
-			printf("M%d: 0x%08x\n", i, new_addr);
-		}
-		WL_cleanUp();
-	}
-	return 0;
-}
-
-
@@ -57,6 +57,13 @@
 		.help = "dump the whitelists corresponding to files",
 		.mhandler.cmd = do_dump_file_wl,
 },
+{
+		.name  = "load_wl_db",
+		.args_type = "filename:F",
+		.params = "filename",
+		.help = "map the whitelist database built by wl_compile",
+		.mhandler.cmd = do_load_wl_db,
+},
 {
 		.name  = "pslist",
 		.args_type = "",
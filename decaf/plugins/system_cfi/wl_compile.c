@@ -0,0 +1,292 @@
+/*
+ * wl_compile.c
+ *
+ * Precompiles the whitelists of a set of binaries into a whitelist database
+ * (see wl_db.h), that the plugin loads with load_wl_db.
+ *
+ * Usage: wl_compile [-o whitelist.db] file... ('-' reads the files from
+ * stdin, one per line, e.g. from gen_input.sh)
+ *
+ * The whitelist of a binary has its exports, the targets of its relocations
+ * and its call-preceded return sites.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "libdasm.h"
+#include "peheaders.h"
+#include "wl_db.h"
+
+#define SCN_CNT_CODE 0x00000020
+#define SCN_MEM_EXECUTE 0x20000000
+
+extern BYTE *file_data_raw;
+extern uint32_t file_sz;
+extern void* ptr_from_file(uint32_t raw_offset);
+extern IMAGE_NT_HEADERS* ReadHeaders(char *file_loc);
+extern IMAGE_SECTION_HEADER *getSectionHeader(IMAGE_NT_HEADERS *PeHeader, int i);
+extern uint32_t getImageBase(IMAGE_NT_HEADERS *PeHeader);
+extern DWORD *getExportTable(IMAGE_NT_HEADERS *PeHeader, DWORD *numOfExport);
+extern uint32_t* getRelocTable(IMAGE_NT_HEADERS *PeHeader, uint32_t *wl_numOfEntries);
+extern void WL_cleanUp();
+
+struct image {
+	struct wl_db_image hdr;
+	uint32_t *addrs;
+	uint32_t *page_index;
+};
+
+static struct image *images = NULL;
+static uint32_t n_images = 0, max_images = 0;
+
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_image(const void *a, const void *b)
+{
+	uint64_t x = ((const struct image *)a)->hdr.key;
+	uint64_t y = ((const struct image *)b)->hdr.key;
+	return (x > y) - (x < y);
+}
+
+struct addr_list {
+	uint32_t *addrs;
+	uint32_t count;
+	uint32_t max;
+};
+
+static void add_addr(struct addr_list *l, uint32_t addr)
+{
+	if(l->count == l->max) {
+		l->max = l->max ? 2 * l->max : 1024;
+		l->addrs = (uint32_t *) realloc (l->addrs, l->max * sizeof(uint32_t));
+		if(!l->addrs) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	l->addrs[l->count++] = addr;
+}
+
+/* Add the count addresses of table, relative to image_base, that are in
+ * the image */
+static void add_table(struct addr_list *l, uint32_t *table, uint32_t count,
+		uint32_t image_base, uint32_t size_of_image)
+{
+	uint32_t i;
+
+	for(i = 0; i < count; i++)
+		if(table[i] - image_base < size_of_image)
+			add_addr(l, table[i] - image_base);
+}
+
+/* Add the return sites of the calls in the code sections. The sections are
+ * disassembled linearly, skipping a byte when it is not an instruction. */
+static void add_return_sites(struct addr_list *l, IMAGE_NT_HEADERS *PeHeader)
+{
+	IMAGE_SECTION_HEADER *sh;
+	INSTRUCTION inst;
+	BYTE *code;
+	uint32_t size, off;
+	int i, len;
+
+	for(i = 0; (sh = getSectionHeader(PeHeader, i)) != NULL; i++) {
+		if(!(sh->Characteristics & (SCN_CNT_CODE | SCN_MEM_EXECUTE)))
+			continue;
+		if(sh->PointerToRawData >= file_sz)
+			continue;
+		size = sh->SizeOfRawData;
+		if(sh->Misc.VirtualSize && sh->Misc.VirtualSize < size)
+			size = sh->Misc.VirtualSize;
+		if(size > file_sz - sh->PointerToRawData)
+			size = file_sz - sh->PointerToRawData;
+
+		/* libdasm may read a whole instruction past the end */
+		code = (BYTE *) calloc (size + 16, 1);
+		if(!code)
+			continue;
+		memcpy(code, ptr_from_file(sh->PointerToRawData), size);
+		for(off = 0; off < size; off += len) {
+			len = get_instruction(&inst, code + off, MODE_32);
+			if(len <= 0) {
+				len = 1;
+				continue;
+			}
+			if(inst.type == INSTRUCTION_TYPE_CALL && off + len <= size)
+				add_addr(l, sh->VirtualAddress + off + len);
+		}
+		free(code);
+	}
+}
+
+static void compile_file(char *path)
+{
+	IMAGE_NT_HEADERS *PeHeader;
+	struct addr_list l = { NULL, 0, 0 };
+	struct image *img;
+	uint32_t *table, count, i, j, image_base, size_of_image;
+	uint64_t key;
+	char *name;
+
+	WL_cleanUp();
+	PeHeader = ReadHeaders(path);
+	if(!PeHeader)
+		goto done;
+	key = wl_db_image_key(file_data_raw, file_sz);
+	if(!key) {
+		fprintf(stderr, "%s: truncated PE headers\n", path);
+		goto done;
+	}
+	for(i = 0; i < n_images; i++) {
+		if(images[i].hdr.key == key) {
+			printf("%s: same image as %s\n", path, images[i].hdr.name);
+			goto done;
+		}
+	}
+
+	image_base = getImageBase(PeHeader);
+	size_of_image = PeHeader->OptionalHeader.SizeOfImage;
+
+	count = 0;
+	table = getRelocTable(PeHeader, &count);
+	if(table) {
+		add_table(&l, table, count, image_base, size_of_image);
+		free(table);
+	}
+	count = 0;
+	table = getExportTable(PeHeader, &count);
+	if(table) {
+		add_table(&l, table, count, image_base, size_of_image);
+		free(table);
+	}
+	add_return_sites(&l, PeHeader);
+
+	if(n_images == max_images) {
+		max_images = max_images ? 2 * max_images : 256;
+		images = (struct image *) realloc (images, max_images * sizeof(*images));
+		if(!images) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	img = &images[n_images++];
+	memset(img, 0, sizeof(*img));
+
+	if(l.count) {
+		qsort(l.addrs, l.count, sizeof(uint32_t), compare_uint32);
+		for(i = 1, j = 1; i < l.count; i++)
+			if(l.addrs[i] != l.addrs[j - 1])
+				l.addrs[j++] = l.addrs[i];
+		l.count = j;
+	}
+	img->addrs = l.addrs;
+	img->hdr.key = key;
+	img->hdr.image_base = image_base;
+	img->hdr.size_of_image = size_of_image;
+	img->hdr.n_addrs = l.count;
+	img->hdr.n_pages = wl_db_pages(l.addrs, l.count);
+	if(img->hdr.n_pages) {
+		img->page_index = (uint32_t *) malloc ((img->hdr.n_pages + 1) * sizeof(uint32_t));
+		if(!img->page_index) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		wl_db_page_index(l.addrs, l.count, img->page_index, img->hdr.n_pages);
+	}
+	name = strrchr(path, '/');
+	strncpy(img->hdr.name, name ? name + 1 : path, WL_DB_NAME_SIZE - 1);
+
+	printf("%s: %u entries\n", path, l.count);
+
+done:
+	WL_cleanUp();
+}
+
+static uint64_t align8(uint64_t off)
+{
+	return (off + 7) & ~7ULL;
+}
+
+static int write_db(const char *out)
+{
+	static const uint8_t zero[8];
+	struct wl_db_header h;
+	uint64_t off, pad;
+	uint32_t i;
+	FILE *fp;
+
+	qsort(images, n_images, sizeof(*images), compare_image);
+
+	off = sizeof(h) + n_images * sizeof(struct wl_db_image);
+	for(i = 0; i < n_images; i++) {
+		images[i].hdr.addrs_off = off;
+		off = align8(off + images[i].hdr.n_addrs * sizeof(uint32_t));
+		if(images[i].hdr.n_pages) {
+			images[i].hdr.pages_off = off;
+			off = align8(off + (images[i].hdr.n_pages + 1) * sizeof(uint32_t));
+		}
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, WL_DB_MAGIC, sizeof(WL_DB_MAGIC));
+	h.version = WL_DB_VERSION;
+	h.n_images = n_images;
+	h.size = off;
+
+	fp = fopen(out, "wb");
+	if(!fp) {
+		fprintf(stderr, "cannot open file %s\n", out);
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	for(i = 0; i < n_images; i++)
+		fwrite(&images[i].hdr, sizeof(images[i].hdr), 1, fp);
+	for(i = 0; i < n_images; i++) {
+		fwrite(images[i].addrs, sizeof(uint32_t), images[i].hdr.n_addrs, fp);
+		pad = align8(images[i].hdr.n_addrs * sizeof(uint32_t)) - images[i].hdr.n_addrs * sizeof(uint32_t);
+		fwrite(zero, 1, pad, fp);
+		if(images[i].hdr.n_pages) {
+			fwrite(images[i].page_index, sizeof(uint32_t), images[i].hdr.n_pages + 1, fp);
+			pad = align8((images[i].hdr.n_pages + 1) * sizeof(uint32_t)) - (images[i].hdr.n_pages + 1) * sizeof(uint32_t);
+			fwrite(zero, 1, pad, fp);
+		}
+	}
+	if(ferror(fp) || fclose(fp) != 0) {
+		fprintf(stderr, "cannot write file %s\n", out);
+		return -1;
+	}
+	printf("Written %u images to %s (%" PRIu64 " bytes)\n", n_images, out, off);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out = "whitelist.db";
+	char line[1024];
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out = argv[++i];
+		} else if(!strcmp(argv[i], "-")) {
+			while(fgets(line, sizeof(line), stdin)) {
+				line[strcspn(line, "\r\n")] = '\0';
+				if(line[0])
+					compile_file(line);
+			}
+		} else {
+			compile_file(argv[i]);
+		}
+	}
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s [-o whitelist.db] file... ('-' reads the files from stdin)\n", argv[0]);
+		return 1;
+	}
+
+	return write_db(out) ? 1 : 0;
+}
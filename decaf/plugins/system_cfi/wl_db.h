@@ -0,0 +1,104 @@
+/*
+ * wl_db.h
+ *
+ * Precompiled whitelists. wl_compile extracts the whitelist of each binary
+ * offline and writes them all to one file, that the plugin maps and uses as
+ * it is when a module is loaded, without reading or parsing the binary.
+ *
+ * Layout, all in host byte order, every part aligned on 8 bytes:
+ *   struct wl_db_header
+ *   struct wl_db_image[n_images], sorted by key
+ *   for each image: uint32_t addrs[n_addrs], sorted, then
+ *                   uint32_t page_index[n_pages + 1] if n_pages
+ *
+ * The addresses are offsets from the load address of the image. Images are
+ * keyed by a hash of the fields of their PE headers that the loader does not
+ * change, so the key is the same for the file and for the mapped module.
+ */
+
+#ifndef WL_DB_H_
+#define WL_DB_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define WL_DB_MAGIC "DECAFWL"
+#define WL_DB_VERSION 1
+
+/* Largest page index, 4MB for an image of 4GB */
+#define WL_MAX_PAGES (1 << 20)
+
+struct wl_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_images;
+	uint64_t size; //of the whole file
+};
+
+#define WL_DB_NAME_SIZE 64
+struct wl_db_image {
+	uint64_t key;
+	uint32_t image_base; //preferred
+	uint32_t size_of_image;
+	uint32_t n_addrs;
+	uint32_t n_pages; //0 if there is no page index
+	uint64_t addrs_off; //from the start of the file
+	uint64_t pages_off;
+	char name[WL_DB_NAME_SIZE]; //for the user only
+};
+
+/* Key of the image which headers are in hdr. Returns 0 if they are not
+ * valid PE headers. */
+static inline uint64_t wl_db_image_key(const uint8_t *hdr, size_t len)
+{
+	/* Machine, NumberOfSections, TimeDateStamp, SizeOfOptionalHeader,
+	 * Characteristics, SizeOfCode, AddressOfEntryPoint, SizeOfImage,
+	 * CheckSum. ImageBase is left out, it is updated when the image is
+	 * relocated. */
+	static const struct { uint16_t off, len; } fields[] = {
+		{ 4, 2 }, { 6, 2 }, { 8, 4 }, { 20, 2 }, { 22, 2 },
+		{ 28, 4 }, { 40, 4 }, { 80, 4 }, { 88, 4 },
+	};
+	uint64_t h = 0xcbf29ce484222325ULL; //FNV-1a
+	uint32_t pe;
+	int i, j;
+
+	if(len < 0x40 || hdr[0] != 'M' || hdr[1] != 'Z')
+		return 0;
+	pe = hdr[0x3c] | (hdr[0x3d] << 8) | (hdr[0x3e] << 16) | ((uint32_t)hdr[0x3f] << 24);
+	if(pe > len || len - pe < 92 || hdr[pe] != 'P' || hdr[pe + 1] != 'E'
+			|| hdr[pe + 2] != 0 || hdr[pe + 3] != 0)
+		return 0;
+
+	for(i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+		for(j = 0; j < fields[i].len; j++) {
+			h ^= hdr[pe + fields[i].off + j];
+			h *= 0x100000001b3ULL;
+		}
+	}
+	return h ? h : 1;
+}
+
+/* Number of pages in the page index of the count sorted addresses */
+static inline uint32_t wl_db_pages(const uint32_t *addrs, uint32_t count)
+{
+	if(count == 0 || (addrs[count - 1] >> 12) >= WL_MAX_PAGES)
+		return 0;
+	return (addrs[count - 1] >> 12) + 1;
+}
+
+/* Fill the pages + 1 entries of page_index: page_index[i] is the first
+ * address of the page i, so that a lookup only searches one page. */
+static inline void wl_db_page_index(const uint32_t *addrs, uint32_t count,
+		uint32_t *page_index, uint32_t pages)
+{
+	uint32_t i, page;
+
+	for(i = 0, page = 0; page <= pages; page++) {
+		while(i < count && (addrs[i] >> 12) < page)
+			i++;
+		page_index[page] = i;
+	}
+}
+
+#endif /* WL_DB_H_ */
@@ -32,6 +32,7 @@
 #include "network.h"
 
 #include "tracecap.h"
+#include "trace_records.h"
 
 #include "hookapi.h"
 #include "function_map.h"
@@ -43,11 +44,14 @@
 #include "trackproc.h" // AWH
 
 /* Plugin interface */
-static plugin_interface_t tracing_interface;
+plugin_interface_t tracing_interface;
 //to keep consistent
 static DECAF_Handle block_begin_cb_handle;
 static DECAF_Handle insn_begin_cb_handle;
 static DECAF_Handle insn_end_cb_handle;
+static DECAF_Handle block_end_cb_handle;
+static DECAF_Handle read_taint_cb_handle;
+static DECAF_Handle write_taint_cb_handle;
 static DECAF_Handle nic_rec_cb_handle;
 static DECAF_Handle nic_send_cb_handle;
 static DECAF_Handle keystroke_cb_handle;
@@ -90,6 +94,8 @@ static void do_tracing_by_name_internal(const char *progname,
 // AWH - Forward declarations of other funcs used below
 static int tracing_init(void);
 static void tracing_cleanup(void);
+static int filter_excludes(uint32_t eip);
+static void filter_set_pages(uint32_t base, uint32_t size);
 /* target-i386/op_helper.c */
 extern uint32_t helper_cc_compute_all(int op);
 
@@ -167,6 +173,13 @@ static void tracing_cleanup(void) {
 		DECAF_unregister_callback(DECAF_INSN_BEGIN_CB, insn_begin_cb_handle);
 	if (insn_end_cb_handle)
 		DECAF_unregister_callback(DECAF_INSN_END_CB, insn_end_cb_handle);
+	if (block_end_cb_handle)
+		DECAF_unregister_callback(DECAF_BLOCK_END_CB, block_end_cb_handle);
+	if (read_taint_cb_handle)
+		DECAF_unregister_callback(DECAF_READ_TAINTMEM_CB, read_taint_cb_handle);
+	if (write_taint_cb_handle)
+		DECAF_unregister_callback(DECAF_WRITE_TAINTMEM_CB, write_taint_cb_handle);
+	filter_set_pages(0, 0);
 	if (nic_rec_cb_handle)
 		DECAF_unregister_callback(DECAF_NIC_REC_CB, nic_rec_cb_handle);
 	if (nic_send_cb_handle)
@@ -257,6 +270,75 @@ static void do_tracing_by_name_internal(const char *progname,
 
 }
 
+/* Taint-sparse traces
+   Only the instructions that propagate taint are decoded and written.
+   An instruction is decoded at its beginning if a register is tainted,
+   and at its end if the taint helpers reported that it read tainted
+   memory or changed the taint of memory; its operands then only have
+   the values they were left with. The registers are written before the
+   next instruction once every conf_taint_sparse_snapshot instructions */
+static int sparse_decoded = 0;
+static int sparse_regs_pending = 0;
+static uint64_t sparse_regs_next = 0;
+static TraceRegsRecord sparse_regs;
+
+static void tracing_taint_mem(DECAF_Callback_Params* params) {
+	insn_tainted = 1;
+}
+
+static int sparse_regs_tainted(CPUState *env) {
+#ifdef CONFIG_TCG_TAINT
+	int i;
+
+	for (i = 0; i < CPU_NB_REGS; i++)
+		if (env->taint_regs[i])
+			return 1;
+#endif
+	return 0;
+}
+
+static void sparse_insn_begin(CPUState *env) {
+	/* keep the registers from before the next instruction written */
+	if (tstats.insn_counter_executed >= sparse_regs_next) {
+		sparse_regs.tid = current_tid;
+		sparse_regs.eip = env->eip;
+		sparse_regs.eflags = env->eflags | helper_cc_compute_all(env->cc_op)
+			| (env->df & DF_MASK);
+		memcpy(sparse_regs.regs, env->regs, sizeof(sparse_regs.regs));
+		sparse_regs.n_executed = tstats.insn_counter_executed;
+		sparse_regs_pending = 1;
+	}
+	tstats.insn_counter_executed++;
+
+	sparse_decoded = sparse_regs_tainted(env);
+	if (sparse_decoded)
+		decode_address(env->eip, &eh);
+	else
+		eh.address = env->eip;
+}
+
+/* Returns 1 if the instruction is not written */
+static int sparse_insn_end(void) {
+	if (!sparse_decoded) {
+		if (!insn_tainted)
+			return 1;
+		decode_address(eh.address, &eh);
+	}
+	return 0;
+}
+
+static void sparse_write_insn(void) {
+	if (!insn_tainted)
+		return;
+	if (sparse_regs_pending) {
+		write_regs_record(tracelog, &sparse_regs);
+		sparse_regs_pending = 0;
+		sparse_regs_next = tstats.insn_counter_executed
+			+ conf_taint_sparse_snapshot;
+	}
+	write_insn(tracelog, &eh);
+}
+
 void tracing_insn_begin(DECAF_Callback_Params* params) {
 	CPUState* env = NULL;
 #if 0 // AWH
@@ -281,6 +363,10 @@ void tracing_insn_begin(DECAF_Callback_Params* params) {
 	if(DECAF_getPGD(env) != tracecr3 && (!DECAF_is_in_kernel(env)))
 		return;
 
+	/* Other plugins can get us called outside of the traced module */
+	if (filter_excludes(env->eip))
+		return;
+
 	TRACE_KERNEL:
 	cpu_disable_ticks();
 	/* Get thread id */
@@ -302,12 +388,39 @@ void tracing_insn_begin(DECAF_Callback_Params* params) {
 	/* Disassemble the instruction */
 	insn_tainted = 0;
 	if (skip_decode_address == 0) {
-		decode_address(/* AWH cpu_single_*/ env->eip, &eh);
+		if (trace_taint_sparse)
+			sparse_insn_begin(env);
+		else
+			decode_address(/* AWH cpu_single_*/ env->eip, &eh);
 	}
 	cpu_enable_ticks();
 
 }
 
+/* Block traces, the same checks as tracing_insn_begin() for the whole
+   block. The block ran with the privilege level it was translated for,
+   env may already be past a change of it */
+static void tracing_block_end(DECAF_Callback_Params* params) {
+	CPUState *env = params->be.env;
+	TranslationBlock *tb = params->be.tb;
+	int in_kernel = ((tb->flags & HF_CPL_MASK) != 3);
+
+	if (in_kernel && should_trace_all_kernel)
+		goto TRACE_KERNEL;
+
+	if ((!tracing_start_condition) || (tracepid == 0))
+		return;
+	if (in_kernel && !tracing_kernel())
+		return;
+	if (DECAF_getPGD(env) != tracecr3 && !in_kernel)
+		return;
+	if (filter_excludes(tb->pc))
+		return;
+
+	TRACE_KERNEL:
+	bt_block(blocktrace, tracelog, env, tb, params->be.next_pc);
+}
+
 void tracing_insn_end(DECAF_Callback_Params* params) {
 	CPUState * env;
 
@@ -336,7 +449,12 @@ void tracing_insn_end(DECAF_Callback_Params* params) {
 	}
 	if(DECAF_getPGD(/* AWH cpu_single_*/ env) != tracecr3 && (!DECAF_is_in_kernel(env)))
 		return;
+	/* eip is already the next instruction, use the one decoded at begin */
+	if (filter_excludes(eh.address))
+		return;
 	TRACE_KERNEL:
+	if (trace_taint_sparse && sparse_insn_end())
+		return;
 
 	/* Update the eflags */
 	// eh.eflags = *DECAF_cpu_eflags;
@@ -386,7 +504,9 @@ void tracing_insn_end(DECAF_Callback_Params* params) {
 		return;
 
 	/* Write the disassembled instruction to the trace */
-	if (tracing_tainted_only()) {
+	if (trace_taint_sparse) {
+		sparse_write_insn();
+	} else if (tracing_tainted_only()) {
 #ifdef CONFIG_TCG_TAINT
 		if (insn_tainted)
 		write_insn(tracelog,&eh);
@@ -449,17 +569,135 @@ static void my_loadmodule_notify(VMI_Callback_Params *params) {
 
 	if (modname_is_set()) {
 		if (modname_match(name)
-				&& (decaf_plugin->monitored_cr3 == cpu_single_env->cr[3])) {
+				&& (tracing_interface.monitored_cr3 == cpu_single_env->cr[3])) {
 			tracing_start_condition = 1;
 			modname_clear();
+			tracing_filter_update();
 		}
 	}
+	/* The module to trace may just have been loaded */
+	if (modfilter_is_set() && (tracepid == params->lm.pid))
+		tracing_filter_update();
 }
 static void my_removeproc_notify(VMI_Callback_Params *params) {
 	if (tracepid == params->rp.pid)
 		tracing_stop();
 }
 
+/* The instruction callbacks are only registered while the conditions
+   allow something to be traced, for the pgd of the traced process and,
+   if only a module is traced, for the pages of that module. The checks
+   in tracing_insn_begin/end still apply to what gets through. */
+static int filter_type = -1; /* OCB_ALL, OCB_PAGE or -1 if not registered */
+static gva_t filter_pgd = INV_ADDR;
+static int filter_blocks = 0;
+static int filter_sparse = 0;
+static uint32_t filter_base = 0;
+static uint32_t filter_size = 0;
+
+static int filter_excludes(uint32_t eip)
+{
+	return ((filter_type == OCB_PAGE) && (eip - filter_base >= filter_size));
+}
+
+static void filter_set_pages(uint32_t base, uint32_t size)
+{
+	uint32_t page;
+
+	if ((base == filter_base) && (size == filter_size))
+		return;
+
+	/* add the new pages first, so the ones in both ranges are not flushed */
+	for (page = base & TARGET_PAGE_MASK; page < base + size; page += TARGET_PAGE_SIZE)
+		DECAF_addInsnCallbackPage(page);
+	for (page = filter_base & TARGET_PAGE_MASK; page < filter_base + filter_size; page += TARGET_PAGE_SIZE)
+		DECAF_removeInsnCallbackPage(page);
+
+	filter_base = base;
+	filter_size = size;
+}
+
+void tracing_filter_update(void)
+{
+	int type = OCB_ALL;
+	gva_t pgd = INV_ADDR;
+	uint32_t base = 0, size = 0;
+
+	if (((tracepid == 0) && !should_trace_all_kernel) || !tracing_start_condition) {
+		type = -1;
+	}
+	else if (!should_trace_all_kernel && (tracepid != (uint32_t)-1)
+			&& !tracing_kernel()) {
+		/* when tracing the kernel too, kernel code that runs under
+		   other address spaces is checked in the callbacks, and the
+		   module is ignored as kernel instructions are outside of it */
+		pgd = tracecr3;
+		if (modfilter_is_set()) {
+			/* nothing to trace until the module is loaded */
+			type = modfilter_get_range(&base, &size) ? OCB_PAGE : -1;
+		}
+	}
+
+	/* block traces need every block, the checks are in tracing_block_end */
+	if (blocktrace && (type != -1)) {
+		type = OCB_ALL;
+		pgd = INV_ADDR;
+		base = size = 0;
+	}
+
+	filter_set_pages(base, size);
+	if ((type == filter_type) && (pgd == filter_pgd)
+			&& ((blocktrace != NULL) == filter_blocks)
+			&& (trace_taint_sparse == filter_sparse))
+		return;
+
+	if (insn_begin_cb_handle) {
+		DECAF_unregister_callback(DECAF_INSN_BEGIN_CB, insn_begin_cb_handle);
+		insn_begin_cb_handle = DECAF_NULL_HANDLE;
+	}
+	if (insn_end_cb_handle) {
+		DECAF_unregister_callback(DECAF_INSN_END_CB, insn_end_cb_handle);
+		insn_end_cb_handle = DECAF_NULL_HANDLE;
+	}
+	if (block_end_cb_handle) {
+		DECAF_unregister_callback(DECAF_BLOCK_END_CB, block_end_cb_handle);
+		block_end_cb_handle = DECAF_NULL_HANDLE;
+	}
+	if (read_taint_cb_handle) {
+		DECAF_unregister_callback(DECAF_READ_TAINTMEM_CB, read_taint_cb_handle);
+		read_taint_cb_handle = DECAF_NULL_HANDLE;
+	}
+	if (write_taint_cb_handle) {
+		DECAF_unregister_callback(DECAF_WRITE_TAINTMEM_CB, write_taint_cb_handle);
+		write_taint_cb_handle = DECAF_NULL_HANDLE;
+	}
+	filter_type = type;
+	filter_pgd = pgd;
+	filter_blocks = (blocktrace != NULL);
+	filter_sparse = trace_taint_sparse;
+	if (type == -1)
+		return;
+
+	if (blocktrace) {
+		block_end_cb_handle = DECAF_registerOptimizedBlockEndCallback(
+				tracing_block_end, &should_monitor, INV_ADDR, INV_ADDR);
+		return;
+	}
+
+	if (trace_taint_sparse) {
+		read_taint_cb_handle = DECAF_register_callback(DECAF_READ_TAINTMEM_CB,
+				tracing_taint_mem, NULL);
+		write_taint_cb_handle = DECAF_register_callback(DECAF_WRITE_TAINTMEM_CB,
+				tracing_taint_mem, NULL);
+		sparse_regs_pending = 0;
+		sparse_regs_next = tstats.insn_counter_executed;
+	}
+	insn_begin_cb_handle = DECAF_registerOptimizedInsnCallback(DECAF_INSN_BEGIN_CB,
+			tracing_insn_begin, &should_monitor, pgd, type);
+	insn_end_cb_handle = DECAF_registerOptimizedInsnCallback(DECAF_INSN_END_CB,
+			tracing_insn_end, &should_monitor, pgd, type);
+}
+
 extern target_ulong VMI_guest_kernel_base;
 plugin_interface_t * init_plugin() {
 
@@ -475,12 +713,8 @@ plugin_interface_t * init_plugin() {
 	//for now, receive block begin callback globally
 	DECAF_stop_vm();
 
-	// register for insn begin/end
-	insn_begin_cb_handle = DECAF_register_callback(DECAF_INSN_BEGIN_CB,
-			tracing_insn_begin, &should_monitor);
-
-	insn_end_cb_handle = DECAF_register_callback(DECAF_INSN_END_CB,
-			tracing_insn_end, &should_monitor);
+	// insn begin/end are registered by tracing_filter_update() once
+	// there is something to trace
 #ifdef CONFIG_TCG_TAINT
 	//  //register taint nic callback
 	nic_rec_cb_handle = DECAF_register_callback(DECAF_NIC_REC_CB,
@@ -16,6 +16,8 @@
 #include "DECAF_target.h"
 #include "hookapi.h"
 #include "conf.h"
+#include "tracecap.h"
+#include "vmi_c_wrapper.h"
 
 int (*comparestring)(const char *, const char*);
 
@@ -86,6 +88,44 @@ int modname_is_set()
     return (cond_modulename[0] != 0);
 }
 
+/* trace only the code of a module */
+static char filter_modulename[64];
+
+void modfilter_clear()
+{
+    filter_modulename[0] = 0;
+}
+
+int modfilter_is_set()
+{
+    return (filter_modulename[0] != 0);
+}
+
+/* Range of the module to trace in the traced process, if it is loaded */
+int modfilter_get_range(uint32_t *base, uint32_t *size)
+{
+    tmodinfo_t tm;
+
+    if (!modfilter_is_set() || (tracepid == 0) || (tracepid == (uint32_t)-1))
+	return 0;
+    if (VMI_locate_module_byname_c(filter_modulename, tracepid, &tm) != 0)
+	return 0;
+
+    *base = tm.base;
+    *size = tm.size;
+    return (tm.size != 0);
+}
+
+/* without a module name, trace all the code of the process again */
+void tc_module(Monitor *mon, const QDict *qdict)
+{
+    modfilter_clear();
+    if (qdict_haskey(qdict, "modulename"))
+	strncpy(filter_modulename, qdict_get_str(qdict, "modulename"),
+	    sizeof(filter_modulename) - 1);
+    tracing_filter_update();
+}
+
 /* Start tracing on different conditions */
 static uint32_t tc_start_counter = 0;
 static uint32_t tc_start_at = 0;
@@ -102,12 +142,14 @@ void tc_modname(Monitor *mon, const QDict *qdict)
 {
     strncpy(cond_modulename, /*modname*/ qdict_get_str(qdict, "tc_modname"), 64);
     tracing_start_condition = 0;
+    tracing_filter_update();
 }
 
 /* AWH int */ void tc_address_hook(void *opaque)
 {
-  if (decaf_plugin->monitored_cr3 == cpu_single_env->cr[3]) {
+  if (tracing_interface.monitored_cr3 == cpu_single_env->cr[3]) {
     tracing_start_condition = 1;
+    tracing_filter_update();
     /* remove the hook */
     hookapi_remove_hook(cond_func_hook_handle);
    }
@@ -127,8 +169,9 @@ void tc_address(Monitor *mon, const QDict *qdict)
       "Disabling conf_trace_only_after_first_taint\n");
     conf_trace_only_after_first_taint = 0;
   }
-  /* add a hook at address */
+  /* add a hook at address, no instruction is instrumented until it is hit */
   tracing_start_condition = 0;
+  tracing_filter_update();
   cond_func_hook_handle = hookapi_hook_function(0, address, 0, tc_address_hook,
 		NULL, 0);
   cond_func_address = address;
@@ -138,10 +181,11 @@ void tc_address(Monitor *mon, const QDict *qdict)
 {
   monitor_printf(default_mon, "tc_address_start_hook(*) called\n");
   if ((tracing_kernel_all() ||
-    (decaf_plugin->monitored_cr3 == cpu_single_env->cr[3])) &&
+    (tracing_interface.monitored_cr3 == cpu_single_env->cr[3])) &&
     (tc_start_counter++ == tc_start_at))
   {
     tracing_start_condition = 1;
+    tracing_filter_update();
     tc_stop_counter = 0; // reset the tc_stop_counter at the execution saving
     /* remove the hook */
     hookapi_remove_hook(cond_func_hook_handle);
@@ -166,6 +210,7 @@ void tc_address_start(Monitor *mon, const QDict *qdict)
   }
   /* add a hook at address */
   tracing_start_condition = 0;
+  tracing_filter_update();
   tc_start_counter = 0;
   tc_start_at = at_counter;
   cond_func_hook_handle = hookapi_hook_function(0, address, 0,
@@ -177,7 +222,7 @@ void tc_address_start(Monitor *mon, const QDict *qdict)
 {
   monitor_printf(default_mon, "tc_address_stop_hook(*) called\n");
   if ((tracing_kernel_all() ||
-    (decaf_plugin->monitored_cr3 == cpu_single_env->cr[3])) &&
+    (tracing_interface.monitored_cr3 == cpu_single_env->cr[3])) &&
     (tc_stop_counter++ == tc_stop_at))
   {
     tracing_start_condition = 0;
@@ -30,6 +30,14 @@ extern void modname_set(const char *name);
 extern int modname_match(const char *name);
 extern int modname_is_set(void);
 
+extern void modfilter_clear(void);
+extern int modfilter_is_set(void);
+extern int modfilter_get_range(uint32_t *base, uint32_t *size);
+
+/* Registers the instruction callbacks for what the conditions allow to
+   be traced. Call it whenever a condition changes */
+extern void tracing_filter_update(void);
+
 
 extern int uint32_compare(const void* u1, const void* u2);
 #if 0 // AWH - Change in cmd interface
@@ -42,6 +50,7 @@ extern void tc_modname(Monitor *mon, const QDict *qdict);
 extern void tc_address(Monitor *mon, const QDict *qdict);
 extern void tc_address_start(Monitor *mon, const QDict *qdict);
 extern void tc_address_stop(Monitor *mon, const QDict *qdict);
+extern void tc_module(Monitor *mon, const QDict *qdict);
 #endif // AWH
 
 #ifdef __cplusplus
@@ -31,11 +31,16 @@ int conf_log_external_calls = 0;
 int conf_write_ops_at_insn_end = 0;
 int conf_save_state_at_trace_start = 0;
 int conf_save_state_at_trace_stop = 0;
+int conf_compress_trace = 0;
+int conf_compress_loops = 0;
+int conf_trace_blocks = 0;
+uint32_t conf_taint_sparse_snapshot = 100000;
 
 /* Environment variables */
 int tracing_table_lookup = 1;
 static int conf_ignore_dns = 0;
 static int conf_tainted_only = 0;
+static int conf_taint_sparse = 0;
 static int conf_single_thread_only = 0;
 static int conf_tracing_kernel_all = 0;
 static int conf_tracing_kernel_tainted = 0;
@@ -89,6 +94,35 @@ inline int tracing_tainted_only()
     return conf_tainted_only;
 }
 
+void set_taint_sparse(Monitor *mon, const QDict *qdict)
+{
+  if (qdict_get_int(qdict, "state")) {
+    conf_taint_sparse = 1;
+    monitor_printf(default_mon, "Taint-sparse flag on, for the next trace.\n");
+  }
+  else {
+    conf_taint_sparse = 0;
+    monitor_printf(default_mon, "Taint-sparse flag off, for the next trace.\n");
+  }
+}
+
+inline int tracing_taint_sparse()
+{
+    return conf_taint_sparse;
+}
+
+void set_trace_blocks(Monitor *mon, const QDict *qdict)
+{
+  if (qdict_get_int(qdict, "state")) {
+    conf_trace_blocks = 1;
+    monitor_printf(default_mon, "Block tracing on, for the next trace.\n");
+  }
+  else {
+    conf_trace_blocks = 0;
+    monitor_printf(default_mon, "Block tracing off, for the next trace.\n");
+  }
+}
+
 //void set_single_thread_only(int state)
 void set_single_thread_only(Monitor *mon, const QDict *qdict)
 {
@@ -172,15 +206,20 @@ void print_conf_vars()
 {
   monitor_printf(
 	default_mon,
-      "TABLE_LOOKUP: %d\nTRACE_AFTER_FIRST_TAINT: %d\nLOG_EXTERNAL_CALLS: %d\nWRITE_OPS_AT_INSN_END: %d\nSAVE_STATE_AT_TRACE_START: %d\nSAVE_STATE_AT_TRACE_STOP: %d\nPROTOS_IGNOREDNS: %d\nTAINTED_ONLY: %d\nSINGLE_THREAD_ONLY: %d\nTRACING_KERNEL_ALL: %d\nTRACING_KERNEL_TAINTED: %d\nTRACING_KERNEL_PARTIAL: %d\nDETECT_MEMORY_EXCEPTION: %d\nDETECT_NULL_POINTER: %d\nDETECT_PROCESS_EXIT: %d\nDETECT_TAINTED_EIP: %d\n",
+      "TABLE_LOOKUP: %d\nTRACE_AFTER_FIRST_TAINT: %d\nLOG_EXTERNAL_CALLS: %d\nWRITE_OPS_AT_INSN_END: %d\nSAVE_STATE_AT_TRACE_START: %d\nSAVE_STATE_AT_TRACE_STOP: %d\nCOMPRESS_TRACE: %d\nCOMPRESS_LOOPS: %d\nTRACE_BLOCKS: %d\nPROTOS_IGNOREDNS: %d\nTAINTED_ONLY: %d\nTAINT_SPARSE: %d\nTAINT_SPARSE_SNAPSHOT: %u\nSINGLE_THREAD_ONLY: %d\nTRACING_KERNEL_ALL: %d\nTRACING_KERNEL_TAINTED: %d\nTRACING_KERNEL_PARTIAL: %d\nDETECT_MEMORY_EXCEPTION: %d\nDETECT_NULL_POINTER: %d\nDETECT_PROCESS_EXIT: %d\nDETECT_TAINTED_EIP: %d\n",
       tracing_table_lookup,
       conf_trace_only_after_first_taint,
       conf_log_external_calls,
       conf_write_ops_at_insn_end,
       conf_save_state_at_trace_start,
       conf_save_state_at_trace_stop,
+      conf_compress_trace,
+      conf_compress_loops,
+      conf_trace_blocks,
       conf_ignore_dns, 
       conf_tainted_only,
+      conf_taint_sparse,
+      conf_taint_sparse_snapshot,
       conf_single_thread_only,
       conf_tracing_kernel_all,
       conf_tracing_kernel_tainted,
@@ -276,10 +315,21 @@ int check_ini(const char *path_ini)
     &conf_save_state_at_trace_start);
   set_bool_from_ini(cn_root, "general/save_state_at_trace_stop",
     &conf_save_state_at_trace_stop);
+  set_bool_from_ini(cn_root, "general/compress_trace",
+    &conf_compress_trace);
+  set_bool_from_ini(cn_root, "general/compress_loops",
+    &conf_compress_loops);
+  set_bool_from_ini(cn_root, "general/trace_blocks",
+    &conf_trace_blocks);
   set_bool_from_ini(cn_root, "tracing/tracing_table_lookup",
     &tracing_table_lookup);
   set_bool_from_ini(cn_root, "tracing/tracing_tainted_only",
     &conf_tainted_only);
+  set_bool_from_ini(cn_root, "tracing/tracing_taint_sparse",
+    &conf_taint_sparse);
+  cnf_res = cnf_find_entry(cn_root, "tracing/taint_sparse_snapshot");
+  if (cnf_res)
+    conf_taint_sparse_snapshot = strtoul(cnf_res->cnfnode->value, NULL, 0);
   set_bool_from_ini(cn_root, "tracing/tracing_single_thread_only",
     &conf_single_thread_only);
   set_bool_from_ini(cn_root, "tracing/tracing_kernel",
@@ -25,6 +25,10 @@ extern int conf_log_external_calls;
 extern int conf_write_ops_at_insn_end;
 extern int conf_save_state_at_trace_start;
 extern int conf_save_state_at_trace_stop;
+extern int conf_compress_trace;
+extern int conf_compress_loops;
+extern int conf_trace_blocks;
+extern uint32_t conf_taint_sparse_snapshot;
 extern int tracing_table_lookup;
 extern char hook_dirname[256];
 extern char hook_plugins_filename[256];
@@ -43,6 +47,10 @@ int tracing_ignore_dns(void);
 void set_tainted_only(Monitor *mon, const QDict *qdict);
 int tracing_tainted_only(void);
 
+void set_taint_sparse(Monitor *mon, const QDict *qdict);
+int tracing_taint_sparse(void);
+
+void set_trace_blocks(Monitor *mon, const QDict *qdict);
 //void set_single_thread_only(int state);
 void set_single_thread_only(Monitor *mon, const QDict *qdict);
 int tracing_single_thread_only(void);
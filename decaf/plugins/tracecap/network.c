@@ -28,18 +28,35 @@
 #include "tracecap.h"
 #include "conf.h" // AWH
 
-typedef struct tcpconn_record{
-  uint32_t id;
-  uint32_t origin;
-  uint32_t curr_seq;
-  LIST_ENTRY(tcpconn_record) link;
-} tcpconn_record_t;
+/* Flows are kept in a hash table of preallocated entries, keyed by their
+   5-tuple with the lower address first so that both directions of a flow
+   find the same entry. Once all entries are in use, the flow that saw no
+   packet for the longest time makes room for the new one */
+#define NET_FLOW_BUCKETS 1024 /* Power of 2 */
+#define NET_FLOW_MAX 4096
+
+typedef struct net_flow_key {
+  uint32_t addr[2];
+  uint16_t port[2];
+  uint8_t proto;
+} net_flow_key_t;
 
-typedef struct udpconn_record{
-  uint32_t id;
+typedef struct net_flow {
+  net_flow_key_t key;
+  uint32_t id;        /* compute_conn_id(), as written to the network log */
   uint32_t origin;
-  LIST_ENTRY(udpconn_record) link;
-} udpconn_record_t;
+  uint32_t curr_seq;  /* TCP: sequence number of the first data byte */
+  LIST_ENTRY(net_flow) hash_link;
+  TAILQ_ENTRY(net_flow) lru_link; /* In net_flow_lru, or the free list */
+} net_flow_t;
+
+static net_flow_t net_flows[NET_FLOW_MAX];
+static LIST_HEAD(net_flow_bucket, net_flow) net_flow_buckets[NET_FLOW_BUCKETS];
+static TAILQ_HEAD(net_flow_list, net_flow) net_flow_lru =
+		TAILQ_HEAD_INITIALIZER(net_flow_lru);
+static struct net_flow_list net_flow_free =
+		TAILQ_HEAD_INITIALIZER(net_flow_free);
+static int net_flows_initialized = 0;
 
 typedef struct {
   uint8_t enabled;
@@ -52,11 +69,6 @@ typedef struct {
 
 static pkt_filter_t pkt_filter;
 
-static LIST_HEAD(tcpconn_record_list_head, tcpconn_record) 
-		tcpconn_record_head = LIST_HEAD_INITIALIZER(&tcpconn_record_head);
-static LIST_HEAD(udpconn_record_list_head, udpconn_record) 
-		udpconn_record_head = LIST_HEAD_INITIALIZER(&udpconn_record_head);
-
 /* Taint receive traffic flag */
 static int taint_nic_state = 0;
 
@@ -229,98 +241,153 @@ static int compute_conn_id(struct ip *iph, struct tcphdr *tcph,
   return conn_id;
 }
 
-/* 
- * Returns the origin for connection, if ID those not exist it adds an UDP 
- *   connection to the list
-*/
-static int tracing_get_udp_origin(uint32_t conn_id)
+static void net_flow_init(void)
 {
-  static int udp_conn_ctr = TAINT_ORIGIN_START_UDP_NIC_IN;
+  int i;
 
-  /* If the connection already exists, return origin */
-  udpconn_record_t *udp;
-  LIST_FOREACH(udp, &udpconn_record_head, link) {
-    if (udp->id == conn_id) 
-      return udp->origin;
-  }
+  for (i = 0; i < NET_FLOW_BUCKETS; i++)
+    LIST_INIT(&net_flow_buckets[i]);
+  for (i = 0; i < NET_FLOW_MAX; i++)
+    TAILQ_INSERT_TAIL(&net_flow_free, &net_flows[i], lru_link);
+  net_flows_initialized = 1;
+}
 
-  /* Else, add new connection to list */
-  udpconn_record_t *udpconn = malloc(sizeof(udpconn_record_t));
-  if (udpconn) {
-    udpconn->id = conn_id;
-    udpconn->origin = udp_conn_ctr++;
+/* Key of the flow of a packet from saddr:sport to daddr:dport */
+static void net_flow_key(net_flow_key_t *key, uint8_t proto,
+  uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport)
+{
+  int swap = (saddr > daddr) || ((saddr == daddr) && (sport > dport));
+
+  memset(key, 0, sizeof(net_flow_key_t));
+  key->proto = proto;
+  key->addr[swap] = saddr;
+  key->port[swap] = sport;
+  key->addr[!swap] = daddr;
+  key->port[!swap] = dport;
+}
 
-    LIST_INSERT_HEAD(&udpconn_record_head, udpconn, link);
-    return udpconn->origin;
-  }
-  else return -1;
+static inline struct net_flow_bucket *net_flow_bucket(const net_flow_key_t *key)
+{
+  uint32_t h = key->addr[0] * 2654435761u;
 
+  h = (h ^ key->addr[1]) * 2654435761u;
+  h = (h ^ ((uint32_t)key->port[0] << 16) ^ key->port[1] ^ key->proto)
+    * 2654435761u;
+  return &net_flow_buckets[(h >> 16) & (NET_FLOW_BUCKETS - 1)];
 }
 
-/* Adds a new TCP connection if it does not exist */
-static int tracing_add_tcp_conn(uint32_t conn_id, uint32_t seq)
+/* Find the flow of key. NULL if it does not exist */
+static net_flow_t *net_flow_find(const net_flow_key_t *key)
 {
-  static int tcp_conn_ctr = TAINT_ORIGIN_START_TCP_NIC_IN;
+  net_flow_t *flow;
 
-  /* If the connection already exists, update seq and return */
-  tcpconn_record_t *tcp;
-  LIST_FOREACH(tcp, &tcpconn_record_head, link) {
-    if (tcp->id == conn_id) {
-      tcp->curr_seq = seq;
-      return 0;
+  if (!net_flows_initialized)
+    return NULL;
+
+  LIST_FOREACH(flow, net_flow_bucket(key), hash_link) {
+    if (memcmp(&flow->key, key, sizeof(net_flow_key_t)) == 0) {
+      /* most recently seen last */
+      TAILQ_REMOVE(&net_flow_lru, flow, lru_link);
+      TAILQ_INSERT_TAIL(&net_flow_lru, flow, lru_link);
+      return flow;
     }
   }
+  return NULL;
+}
+
+/* Add a flow for key, which must not exist yet */
+static net_flow_t *net_flow_add(const net_flow_key_t *key, uint32_t id,
+  uint32_t origin)
+{
+  net_flow_t *flow;
 
-  /* Else, add new connection to list */
-  tcpconn_record_t *tcpconn = malloc(sizeof(tcpconn_record_t));
-  if (tcpconn) {
-    tcpconn->id = conn_id;
-    tcpconn->origin = tcp_conn_ctr++;
-    tcpconn->curr_seq = seq;
+  if (!net_flows_initialized)
+    net_flow_init();
 
-    LIST_INSERT_HEAD(&tcpconn_record_head, tcpconn, link);
-    return 0;
+  flow = TAILQ_FIRST(&net_flow_free);
+  if (flow) {
+    TAILQ_REMOVE(&net_flow_free, flow, lru_link);
   }
-  else return -1;
+  else {
+    flow = TAILQ_FIRST(&net_flow_lru);
+    TAILQ_REMOVE(&net_flow_lru, flow, lru_link);
+    LIST_REMOVE(flow, hash_link);
+    if (tracenetlog)
+      fprintf(tracenetlog, "Flow table full, dropping flow. ID: %u Origin: %u\n",
+        flow->id, flow->origin);
+  }
+
+  flow->key = *key;
+  flow->id = id;
+  flow->origin = origin;
+  flow->curr_seq = 0;
+  LIST_INSERT_HEAD(net_flow_bucket(key), flow, hash_link);
+  TAILQ_INSERT_TAIL(&net_flow_lru, flow, lru_link);
+  return flow;
 }
 
-/* Find the seq number for the given connection. Zero if it does not exist */
-static uint32_t tracing_get_tcp_seq(uint32_t conn_id)
+static void net_flow_del(net_flow_t *flow)
 {
-  /* Find connection in list */
-  tcpconn_record_t *tcp;
-  LIST_FOREACH(tcp, &tcpconn_record_head, link) {
-    if (tcp->id == conn_id)
-      return tcp->curr_seq;
-  }
-  return 0;
+  LIST_REMOVE(flow, hash_link);
+  TAILQ_REMOVE(&net_flow_lru, flow, lru_link);
+  TAILQ_INSERT_HEAD(&net_flow_free, flow, lru_link);
 }
 
-/* Find the origin for the given connection. Zero if it does not exist */
-static uint32_t tracing_get_tcp_origin(uint32_t conn_id)
+/* Returns the flow of an UDP packet, adding it if it does not exist */
+static net_flow_t *tracing_get_udp_flow(const net_flow_key_t *key,
+  uint32_t conn_id)
 {
-  /* Find connection in list */
-  tcpconn_record_t *tcp;
-  LIST_FOREACH(tcp, &tcpconn_record_head, link) {
-    if (tcp->id == conn_id)
-      return tcp->origin;
-  }
-  return 0;
+  static int udp_conn_ctr = TAINT_ORIGIN_START_UDP_NIC_IN;
+  net_flow_t *flow = net_flow_find(key);
+
+  if (flow == NULL)
+    flow = net_flow_add(key, conn_id, udp_conn_ctr++);
+  return flow;
 }
 
-/* Deletes a tcp connection if it exists */
-static int tracing_del_tcp_conn(uint32_t conn_id)
+/* Adds a new TCP connection if it does not exist, and sets its sequence
+   number */
+static net_flow_t *tracing_add_tcp_conn(const net_flow_key_t *key,
+  uint32_t conn_id, uint32_t seq)
 {
-  /* Find connection in list and delete it */
-  tcpconn_record_t *tcp;
-  LIST_FOREACH(tcp, &tcpconn_record_head, link) {
-    if (tcp->id == conn_id) {
-      LIST_REMOVE(tcp, link);
-      free(tcp);
-      break;
+  static int tcp_conn_ctr = TAINT_ORIGIN_START_TCP_NIC_IN;
+  net_flow_t *flow = net_flow_find(key);
+
+  if (flow == NULL)
+    flow = net_flow_add(key, conn_id, tcp_conn_ctr++);
+  flow->curr_seq = seq;
+  return flow;
+}
+
+/* Clean the taint of the frame bytes [from, to), or taint them. The frame
+   starts at cur in the NIC ring buffer [start, stop) */
+static void net_ring_taint(int start, int stop, int cur, int from, int to,
+  int taint)
+{
+#ifdef CONFIG_TCG_TAINT
+  static uint8_t tainted[1024];
+  int pos = cur + from, len;
+
+  if (tainted[0] == 0)
+    memset(tainted, 0xff, sizeof(tainted));
+
+  while (pos >= stop)
+    pos -= stop - start;
+  while (from < to) {
+    len = min(to - from, stop - pos);
+    if (taint) {
+      int done;
+      for (done = 0; done < len; done += sizeof(tainted))
+        taintcheck_nic_writebuf(pos + done,
+          min(len - done, sizeof(tainted)), tainted);
     }
+    else {
+      taintcheck_nic_cleanbuf(pos, len);
+    }
+    from += len;
+    pos = start;
   }
-  return 0;
+#endif
 }
 
 void tracing_nic_recv(DECAF_Callback_Params* params)
@@ -337,43 +404,45 @@ void tracing_nic_recv(DECAF_Callback_Params* params)
 	struct ip *iph = (struct ip *) (buf + 14);
 	struct tcphdr *tcph = (struct tcphdr *) (buf + 34);
 	struct udphdr *udph = (struct udphdr *) (buf + 34);
-	uint32_t seq = 0;
-	int hlen = 0, tolen, len2 = 0, offset = 0, avail, len;
-	taint_record_t record;
+	uint32_t seq = 0, origin = 0;
+	int hlen = 0, len2 = 0, offset;
 	uint32_t conn_id = 0;
+	net_flow_key_t key;
+	net_flow_t *flow;
 
-#if 0
-	memset(&record, 0, sizeof(taint_record_t));
-	record.numRecords = 1;
-	record.taintBytes[0].source = TAINT_SOURCE_NIC_IN;
-#endif
 	//TODO: log the connection info in addition to set taint in nic buffer
 
+	/* At beginning clean the entire packet */
+	net_ring_taint(start, stop, index, 0, size, 0);
+
 	/* Check if we need to taint data */
 	if (!taint_nic_state || // Ignore if not tainting NIC
+			size < 34 || // Ignore runt frames
 			buf[12] != 0x08 || buf[13] != 0 || // Ignore non-IP packets
 			(iph->ip_p != 6 && iph->ip_p != 17) || // Ignore non TCP/UDP segments
+			size < 34 + ((iph->ip_p == 6) ? 20 : 8) || // Ignore truncated TCP/UDP headers
 			((iph->ip_p == 17) && (ntohs(udph->uh_sport) == 53)
 					&& tracing_ignore_dns()) // Ignore DNS if requested
 			)
-		goto L1;
+		return;
 	/* Filter packet */
 	if ((pkt_filter.enabled) && (0 == apply_nic_filter(iph, tcph, udph)))
-		goto L1;
+		return;
 
 	/* TCP */
 	if (6 == iph->ip_p) {
 		conn_id = compute_conn_id(iph, tcph, NULL );
+		net_flow_key(&key, 6, iph->ip_src.s_addr, tcph->th_sport,
+				iph->ip_dst.s_addr, tcph->th_dport);
 
 		/* If it is a SYN-ACK packet, create a new outbound connection */
 		if ((tcph->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
-			tracing_add_tcp_conn(conn_id, ntohl(tcph->th_seq) + 1);
+			flow = tracing_add_tcp_conn(&key, conn_id, ntohl(tcph->th_seq) + 1);
 
 			if (tracenetlog) {
-				uint32_t origin = tracing_get_tcp_origin(conn_id);
 				fprintf(tracenetlog,
 						"New outbound TCP flow. ID: %u Origin: %u %s:%d-->%s:%d\n",
-						conn_id, origin, inet_ntoa(iph->ip_dst),
+						conn_id, flow->origin, inet_ntoa(iph->ip_dst),
 						ntohs(tcph->th_dport), inet_ntoa(iph->ip_src),
 						ntohs(tcph->th_sport));
 				fflush(tracenetlog);
@@ -381,120 +450,80 @@ void tracing_nic_recv(DECAF_Callback_Params* params)
 		}
 		/* If the corresponding connection exists, grab sequence number and
 		 set length */
-		if ((seq = tracing_get_tcp_seq(conn_id))) {
+		if ((flow = net_flow_find(&key)) != NULL) {
+			seq = flow->curr_seq;
+			origin = flow->origin;
 			/* If it's a FIN packet, then no more data coming, delete connection */
 			/*   but handle packet normally since FIN packet can carry data */
 			if (tcph->th_flags & TH_FIN) {
-				tracing_del_tcp_conn(conn_id);
+				net_flow_del(flow);
 			}
-			tolen = ntohs(iph->ip_len) + 14;
 			hlen = 34 + tcph->th_off * 4;
-			len2 = tolen - hlen;
-		}
-		if (len2) {
-			record.taintBytes[0].origin = tracing_get_tcp_origin(conn_id);
-			DECAF_printf("Received new TCP data: %010u %s:%d-->%s:%d (%d)\n",
-					record.taintBytes[0].origin, inet_ntoa(iph->ip_src),
-					ntohs(tcph->th_sport), inet_ntoa(iph->ip_dst),
-					ntohs(tcph->th_dport), len2);
-			if (tracenetlog) {
-				fprintf(tracenetlog,
-						"Received new TCP data: %010u %s:%d-->%s:%d (%d)\n",
-						record.taintBytes[0].origin, inet_ntoa(iph->ip_src),
-						ntohs(tcph->th_sport), inet_ntoa(iph->ip_dst),
-						ntohs(tcph->th_dport), len2);
-				fflush(tracenetlog);
-			}
+			len2 = ntohs(iph->ip_len) + 14 - hlen;
 		}
 	}
 	/* UDP */
 	else if (17 == iph->ip_p) {
 		conn_id = compute_conn_id(iph, NULL, udph);
-		len2 = ntohs(iph->ip_len) - 20 - 8;
+		net_flow_key(&key, 17, iph->ip_src.s_addr, udph->uh_sport,
+				iph->ip_dst.s_addr, udph->uh_dport);
 		hlen = 34 + 8;
-		if (len2) {
-			record.taintBytes[0].origin = tracing_get_udp_origin(conn_id);
-			DECAF_printf("Received new UDP data: %010u %s:%d-->%s:%d (%d)\n",
-					record.taintBytes[0].origin, inet_ntoa(iph->ip_src),
-					ntohs(udph->uh_sport), inet_ntoa(iph->ip_dst),
-					ntohs(udph->uh_dport), len2);
-			/* Log received data */
-			if (tracenetlog) {
-				fprintf(tracenetlog,
-						"Received new UDP data: %010u %s:%d-->%s:%d (%d)\n",
-						record.taintBytes[0].origin, inet_ntoa(iph->ip_src),
-						ntohs(udph->uh_sport), inet_ntoa(iph->ip_dst),
-						ntohs(udph->uh_dport), len2);
-				fflush(tracenetlog);
-			}
-		}
+		len2 = ntohs(iph->ip_len) - 20 - 8;
+		flow = tracing_get_udp_flow(&key, conn_id);
+		origin = flow->origin;
 	}
 
-	L1: while (size > 0) {
-		avail = stop - index;
-		len = size;
-		if (len > avail)
-			len = avail;
-#ifdef CONFIG_TCG_TAINT //at beginning clean the entire packet
-		taintcheck_nic_cleanbuf(index, len);
-#endif
-		if (len2) {
-			if (!offset) {
-				if (len > hlen)
-					for (; offset < len - hlen; offset++) {
-						//TODO:	keeping taint info
-#ifdef CONFIG_TCG_TAINT
-						if (6 == iph->ip_p)
-							record.taintBytes[0].offset = ntohl(tcph->th_seq)
-									- seq + offset;
-						else
-							record.taintBytes[0].offset = offset;
-
-						uint8_t taint = 0xff;
-						taintcheck_nic_writebuf(index + hlen + offset, 1, &taint);
-//						DECAF_printf( "N %010u %04u \n",
-//								record.taintBytes[0].origin,
-//								record.taintBytes[0].offset);
-#endif
-						if (tracenetlog) {
-							uint8_t *dataPtr = buf + hlen + offset;
-							fprintf(tracenetlog, "Z %010u %04u 0x%02x\n",
-									record.taintBytes[0].origin,
-									record.taintBytes[0].offset, *dataPtr);
-							fflush(tracenetlog);
-						}
-					}
-			} else {
-				for (; offset < min(len2, offset + len); offset++) {
-					if (6 == iph->ip_p)
-						record.taintBytes[0].offset = ntohl(tcph->th_seq) - seq
-								+ offset;
-					else
-						record.taintBytes[0].offset = offset;
-#ifdef CONFIG_TCG_TAINT
-					uint8_t taint = 0xff;
-					taintcheck_nic_writebuf(index + offset, 1, &taint);
-//					DECAF_printf( "N %010u %04u \n",
-//							record.taintBytes[0].origin,
-//							record.taintBytes[0].offset);
-#endif
-					if (tracenetlog) {
-						uint8_t *dataPtr = buf + hlen + offset;
-						fprintf(tracenetlog, "N %010u %04u 0x%02x\n",
-								record.taintBytes[0].origin,
-								record.taintBytes[0].offset, *dataPtr);
-						fflush(tracenetlog);
-					}
-				}
-			}
-		}
+	/* Coalesced (GRO/TSO) frames may have no IP length, and the payload
+	   never goes past the frame */
+	if (hlen == 0)
+		return;
+	if ((len2 <= 0) && (iph->ip_len == 0))
+		len2 = size - hlen;
+	if (len2 > size - hlen)
+		len2 = size - hlen;
+	if (len2 <= 0)
+		return;
 
-		index += len;
-		if (index == stop)
-			index = start;
-		size -= len;
+	if (6 == iph->ip_p) {
+		DECAF_printf("Received new TCP data: %010u %s:%d-->%s:%d (%d)\n",
+				origin, inet_ntoa(iph->ip_src),
+				ntohs(tcph->th_sport), inet_ntoa(iph->ip_dst),
+				ntohs(tcph->th_dport), len2);
+		if (tracenetlog)
+			fprintf(tracenetlog,
+					"Received new TCP data: %010u %s:%d-->%s:%d (%d)\n",
+					origin, inet_ntoa(iph->ip_src),
+					ntohs(tcph->th_sport), inet_ntoa(iph->ip_dst),
+					ntohs(tcph->th_dport), len2);
+	}
+	else {
+		DECAF_printf("Received new UDP data: %010u %s:%d-->%s:%d (%d)\n",
+				origin, inet_ntoa(iph->ip_src),
+				ntohs(udph->uh_sport), inet_ntoa(iph->ip_dst),
+				ntohs(udph->uh_dport), len2);
+		/* Log received data */
+		if (tracenetlog)
+			fprintf(tracenetlog,
+					"Received new UDP data: %010u %s:%d-->%s:%d (%d)\n",
+					origin, inet_ntoa(iph->ip_src),
+					ntohs(udph->uh_sport), inet_ntoa(iph->ip_dst),
+					ntohs(udph->uh_dport), len2);
 	}
 
+	/* Taint the payload, wherever it is in the ring buffer */
+	net_ring_taint(start, stop, index, hlen, hlen + len2, 1);
+
+	/* The offset of each byte is its offset in the TCP stream, or in the
+	   UDP datagram. Bytes past the end of the ring buffer are logged as N */
+	if (tracenetlog) {
+		uint32_t base = (6 == iph->ip_p) ? ntohl(tcph->th_seq) - seq : 0;
+		int wrap = stop - index - hlen;
+		for (offset = 0; offset < len2; offset++)
+			fprintf(tracenetlog, "%c %010u %04u 0x%02x\n",
+					offset < wrap ? 'Z' : 'N', origin, base + offset,
+					buf[hlen + offset]);
+		fflush(tracenetlog);
+	}
 }
 
 void tracing_nic_send(DECAF_Callback_Params* params)
@@ -503,9 +532,11 @@ void tracing_nic_send(DECAF_Callback_Params* params)
 	int size = params->ns.size;
 	uint8_t * buf = params->ns.buf;
 	uint32_t conn_id = 0;
+	net_flow_key_t key;
+	net_flow_t *flow;
 
-	/* If no data, return */
-	if ((buf == NULL) || (size == 0))
+	/* If no IP header, return */
+	if ((buf == NULL) || (size < 34))
 		return;
 
 	struct ip *iph = (struct ip *) (buf + 14);
@@ -516,20 +547,21 @@ void tracing_nic_send(DECAF_Callback_Params* params)
 			buf[12] != 0x08 || buf[13] != 0x0) // Ignore non-IP packets
 		return;
 
-	/* TCP */
-	if (iph->ip_p == 6) {
+	/* TCP, with its header in the frame */
+	if ((iph->ip_p == 6) && (size >= 34 + 20)) {
 		/* If it is a SYN-ACK packet, create a new inbound connection */
 		/* This is slightly preferred over creating the connection when
         the SYN is received */
 		if ((tcph->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
 			conn_id = compute_conn_id(iph, tcph, NULL);
-			tracing_add_tcp_conn(conn_id, ntohl(tcph->th_ack));
+			net_flow_key(&key, 6, iph->ip_src.s_addr, tcph->th_sport,
+					iph->ip_dst.s_addr, tcph->th_dport);
+			flow = tracing_add_tcp_conn(&key, conn_id, ntohl(tcph->th_ack));
 
 			if (tracenetlog) {
-				uint32_t origin = tracing_get_tcp_origin(conn_id);
 				fprintf(tracenetlog,
 						"New inbound TCP flow. ID: %u Origin: %u %s:%d-->%s:%d\n",
-						conn_id, origin, inet_ntoa(iph->ip_dst), ntohs(tcph->th_dport),
+						conn_id, flow->origin, inet_ntoa(iph->ip_dst), ntohs(tcph->th_dport),
 						inet_ntoa(iph->ip_src), ntohs(tcph->th_sport));
 				fflush(tracenetlog);
 			}
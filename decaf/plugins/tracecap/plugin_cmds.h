@@ -29,6 +29,13 @@
 	.params		= "state",
 	.help		= "set flag to trace only tainted instructions"
 },
+{
+	.name		= "filter_taint_sparse",
+	.args_type	= "state:i",
+	.mhandler.cmd	= set_taint_sparse,
+	.params		= "state",
+	.help		= "set flag to only decode and trace the instructions that propagate taint, from the next trace on"
+},
 {
 	.name		= "filter_single_thread_only",
 	.args_type	= "state:i",
@@ -55,6 +62,13 @@
 #endif//CONFIG_TCG_TAINT
 
 
+{
+	.name		= "trace_blocks",
+	.args_type	= "state:i",
+	.mhandler.cmd	= set_trace_blocks,
+	.params		= "state",
+	.help		= "set flag to only trace the executed blocks, from the next trace on"
+},
 {
 	.name		= "trace",
 	.args_type	= "pid:i,filepath:F",
@@ -85,6 +99,41 @@
 	.params		= "", 
 	.help		= "stop tracing current process(es)"
 },
+{
+	.name		= "tc_modname",
+	.args_type	= "tc_modname:s",
+	.mhandler.cmd	= tc_modname,
+	.params		= "modulename",
+	.help		= "start tracing when the module is loaded in the traced process"
+},
+{
+	.name		= "tc_module",
+	.args_type	= "modulename:s?",
+	.mhandler.cmd	= tc_module,
+	.params		= "[modulename]",
+	.help		= "only trace the instructions of the module in the traced process, or all of them again without modulename"
+},
+{
+	.name		= "tc_address",
+	.args_type	= "codeaddress:i",
+	.mhandler.cmd	= tc_address,
+	.params		= "codeaddress",
+	.help		= "start tracing when the traced process executes codeaddress"
+},
+{
+	.name		= "tc_address_start",
+	.args_type	= "codeaddress:i,timehit:i",
+	.mhandler.cmd	= tc_address_start,
+	.params		= "codeaddress timehit",
+	.help		= "start tracing when codeaddress is executed for the timehit-th time"
+},
+{
+	.name		= "tc_address_stop",
+	.args_type	= "codeaddress:i,timehit:i",
+	.mhandler.cmd	= tc_address_stop,
+	.params		= "codeaddress timehit",
+	.help		= "stop tracing when codeaddress is executed for the timehit-th time"
+},
 
 
 
@@ -14,6 +14,8 @@
 #include <sys/resource.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "DECAF_main.h"
 #include "DECAF_target.h"
@@ -21,6 +23,7 @@
 
 #include "shared/tainting/taintcheck_opt.h" // AWH
 #include "trace.h"
+#include "trace_records.h"
 
 #include "operandinfo.h"
 #include <xed-interface.h>
@@ -29,7 +32,6 @@
 #include "vmi_callback.h"
 #include "vmi_c_wrapper.h"
 
-#define LOK
 /* Map to convert register numbers */
 int regmapping[] =
     { -1, -1, -1, -1, -1, -1, -1, -1, R_EAX, R_ECX, R_EDX, R_EBX, R_ESP, R_EBP,
@@ -106,9 +108,6 @@ init_xed2chris(void)
     x2c[XED_REG_GS][0] = gs_reg;
 }
 
-/* Buffer to store instructions */
-char filebuf[FILEBUFSIZE];
-
 /* Trace statistics */
 struct trace_stats tstats =
     { 0 };
@@ -168,12 +167,20 @@ print_trace_stats()
 {
 monitor_printf(default_mon, "Number of instructions decoded: %" PRIu64 "\n",
         tstats.insn_counter_decoded);
+monitor_printf(default_mon, "Number of instructions found in decode cache: %" PRIu64 "\n",
+        tstats.insn_counter_decode_hits);
 monitor_printf(default_mon, "Number of operands decoded: %" PRIu64 "\n",
         tstats.operand_counter);
 monitor_printf(default_mon, "Number of instructions written to trace: %" PRIu64 "\n",
         tstats.insn_counter_traced);
 monitor_printf(default_mon, "Number of tainted instructions written to trace: %" PRIu64 "\n",
         tstats.insn_counter_traced_tainted);
+monitor_printf(default_mon, "Number of blocks written to trace: %" PRIu64 "\n",
+        tstats.block_counter_traced);
+monitor_printf(default_mon, "Number of instructions executed in taint-sparse mode: %" PRIu64 "\n",
+        tstats.insn_counter_executed);
+monitor_printf(default_mon, "Number of register snapshots written to trace: %" PRIu64 "\n",
+        tstats.regs_counter_traced);
 }
 
 /* Clear trace statistics */
@@ -194,57 +201,95 @@ getOperandOffset(OperandVal *op)
     return 0;
 }
 
-/* This is the central function
- Given a memory address, reads a bunch of memory bytes and
- calls the disassembler to obtain the information
- Then it stores the information into the eh EntryHeader
+/* Decoded instruction cache
+ Running XED and laying out the operands only depends on the instruction
+ bytes, so it is done once per (pgd, address, rawbytes) and the result is
+ kept in a direct-mapped table. Each execution then only reads operand
+ values and taint. A hit requires the bytes in guest memory to still match,
+ so code rewritten after its TB was invalidated is decoded again.
  */
+#define DECODE_CACHE_BITS 12
+#define DECODE_CACHE_SIZE (1 << DECODE_CACHE_BITS)
+#define DECODE_CACHE_HASH(pgd, address) \
+    (((address) ^ ((address) >> DECODE_CACHE_BITS) ^ ((pgd) >> 5)) \
+            & (DECODE_CACHE_SIZE - 1))
+
+enum DecodedOpKind
+{
+    DOP_REG = 1, DOP_IMM, DOP_MEM, DOP_AGEN, DOP_JUMP, DOP_FPU
+};
 
+/* Memory operand flags */
+#define DOP_HAS_SEG   0x1 /* Non-default segment register */
+#define DOP_HAS_BASE  0x2
+#define DOP_HAS_INDEX 0x4
+
+/* Static part of one entry of EntryHeader.operand */
+typedef struct _decoded_op
+{
+    uint8_t kind;
+    uint8_t access;
+    uint8_t length;
+    uint8_t flags;
+    int8_t regnum;      /* Register: index in env->regs */
+    int8_t base_num;
+    int8_t index_num;
+    uint8_t scale;
+    int16_t reg;        /* Register: register id */
+    int16_t seg_reg;    /* Memory: register ids of the address components */
+    int16_t base_reg;
+    int16_t index_reg;
+    uint32_t value;     /* Immediate, branch or memory displacement */
+} DecodedOp;
+
+typedef struct _decoded_insn
+{
+    uint32_t pgd;
+    uint32_t address;
+    uint8_t inst_size;    /* 0 if the slot is empty */
+    uint8_t num_ops;      /* Entries used in ops[] */
+    uint8_t num_operands; /* EntryHeader.num_operands, memregs included */
+    char rawbytes[MAX_INSN_BYTES];
+    DecodedOp ops[MAX_NUM_OPERANDS];
+} DecodedInsn;
+
+static DecodedInsn decode_cache[DECODE_CACHE_SIZE];
+
+/* Drop all cached decodings */
 void
-decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
+decode_cache_flush()
+{
+    memset(decode_cache, 0, sizeof(decode_cache));
+}
+
+/* Disassemble the instruction in insn_buf and record the layout of its
+ operands in di. Returns -1 if XED cannot decode it.
+ */
+static int
+decode_insn(const unsigned char *insn_buf, DecodedInsn *di)
 {
-    unsigned char insn_buf[MAX_INSN_BYTES];
     unsigned int is_stackpush = 0, is_stackpop = 0;
     unsigned int stackpushpop_acc = 0;
-    int ignore_taint = 0;
-    if (xed2chris_regmapping[XED_REG_EAX][0] == 0)
-    {
-        init_xed2chris();
-        assert(xed2chris_regmapping[XED_REG_EAX][0] != 0);
-    }
-
-    /* Read memory from DECAF */
-    DECAF_read_mem(cpu_single_env, address, MAX_INSN_BYTES, insn_buf);
+    int i, op_idx = -1;
+    DecodedOp *dop;
 
     /* Disassemble instruction buffer */
     xed_decoded_inst_zero_set_mode(&xedd, &dstate);
     xed_error_enum_t xed_error =
         xed_decode(&xedd, XED_STATIC_CAST(const xed_uint8_t*,insn_buf), MAX_INSN_BYTES);
-    xed_bool_t okay = (xed_error == XED_ERROR_NONE);
-    if (!okay)
-        return;
-
-    // Increase counters
-    tstats.insn_counter_decoded++;
-
-    int i;
-
-    /* Clear out Entry header */
-    memset(eh, 0, sizeof(EntryHeader));
-
-    /* Copy the address and instruction size */
-    eh->address = address;
-    eh->inst_size = xed_decoded_inst_get_length(&xedd);
-    if (eh->inst_size > MAX_INSN_BYTES)
-        eh->inst_size = MAX_INSN_BYTES;
+    if (xed_error != XED_ERROR_NONE)
+        return -1;
 
-    /* Copy instruction rawbytes */
-    memcpy(eh->rawbytes, insn_buf, eh->inst_size);
+    /* Copy the instruction size and rawbytes */
+    di->inst_size = xed_decoded_inst_get_length(&xedd);
+    if (di->inst_size > MAX_INSN_BYTES)
+        di->inst_size = MAX_INSN_BYTES;
+    memcpy(di->rawbytes, insn_buf, di->inst_size);
+    di->num_operands = 0;
 
     /* Get the number of XED operands */
     const xed_inst_t* xi = xed_decoded_inst_inst(&xedd);
     int xed_ops = xed_inst_noperands(xi);
-    int op_idx = -1;
 
     /* Get the category of the instruction */
     xed_category_enum_t category = xed_decoded_inst_get_category(&xedd);
@@ -252,9 +297,8 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
     /* Iterate over the XED operands */
     for (i = 0; i < xed_ops; i++)
     {
-        if (op_idx >= MAX_NUM_OPERANDS)
+        if (op_idx + 1 >= MAX_NUM_OPERANDS)
             break;
-        //assert(op_idx < MAX_NUM_OPERANDS);
 
         /* Get operand */
         const xed_operand_t* op = xed_inst_operand(xi, i);
@@ -282,7 +326,6 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
             {
                 xed_reg_enum_t reg_id = xed_decoded_inst_get_reg(&xedd,
                         op_name);
-                int regnum = xed2chris_regmapping[reg_id][1];
 
                 // Special handling for Push
                 if (reg_id == XED_REG_STACKPUSH)
@@ -290,89 +333,57 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
                 else if (reg_id == XED_REG_STACKPOP)
                     is_stackpop = 1;
 
-                if (-1 == regnum)
+                if (-1 == xed2chris_regmapping[reg_id][1])
                     break;
-                else
-                {
-                    op_idx++;
-                    eh->num_operands++;
-                    eh->operand[op_idx].type = TRegister;
-                    eh->operand[op_idx].addr = xed2chris_regmapping[reg_id][0];
-                    eh->operand[op_idx].length =
-                            (uint8_t) xed_decoded_inst_operand_length(&xedd, i);
-                    eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
-                    eh->operand[op_idx].value = cpu_single_env->regs[regnum];
-                    switch (eh->operand[op_idx].addr)
-                    {
-                    case ax_reg:
-                    case bx_reg:
-                    case cx_reg:
-                    case dx_reg:
-                    case bp_reg:
-                    case sp_reg:
-                    case si_reg:
-                    case di_reg:
-                        eh->operand[op_idx].value &= 0xFFFF;
-                        break;
-                    case al_reg:
-                    case bl_reg:
-                    case cl_reg:
-                    case dl_reg:
-                        eh->operand[op_idx].value &= 0xFF;
-                        break;
-                    case ah_reg:
-                    case bh_reg:
-                    case ch_reg:
-                    case dh_reg:
-                        eh->operand[op_idx].value = (eh->operand[i].value
-                                & 0xFF00) >> 8;
-                        break;
-                    default:
-                        break;
-                    }
-                }
-                if (ignore_taint == 0)
-                    set_operand_data(&(eh->operand[op_idx]), 1);
+
+                dop = &di->ops[++op_idx];
+                memset(dop, 0, sizeof(DecodedOp));
+                di->num_operands++;
+                dop->kind = DOP_REG;
+                dop->reg = xed2chris_regmapping[reg_id][0];
+                dop->regnum = xed2chris_regmapping[reg_id][1];
+                dop->length =
+                        (uint8_t) xed_decoded_inst_operand_length(&xedd, i);
+                dop->access = (uint8_t) xed_operand_rw(op);
                 break;
             }
 
             /* Immediate */
         case XED_OPERAND_IMM0:
             {
-                op_idx++;
-                eh->num_operands++;
-                eh->operand[op_idx].type = TImmediate;
-                eh->operand[op_idx].length =
+                dop = &di->ops[++op_idx];
+                memset(dop, 0, sizeof(DecodedOp));
+                di->num_operands++;
+                dop->kind = DOP_IMM;
+                dop->length =
                         (uint8_t) xed_decoded_inst_operand_length(&xedd, i);
-                eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
-                //xed_uint_t width = xed_decoded_inst_get_immediate_width(&xedd);
+                dop->access = (uint8_t) xed_operand_rw(op);
                 if (xed_decoded_inst_get_immediate_is_signed(&xedd))
                 {
                     xed_int32_t signed_imm_val =
                             xed_decoded_inst_get_signed_immediate(&xedd);
-                    eh->operand[op_idx].value = (uint32_t) signed_imm_val;
+                    dop->value = (uint32_t) signed_imm_val;
                 }
                 else
                 {
                     xed_uint64_t unsigned_imm_val =
                             xed_decoded_inst_get_unsigned_immediate(&xedd);
-                    eh->operand[op_idx].value = (uint32_t) unsigned_imm_val;
+                    dop->value = (uint32_t) unsigned_imm_val;
                 }
                 break;
-                break;
             }
             /* Special immediate only used in ENTER instruction */
         case XED_OPERAND_IMM1:
             {
-                op_idx++;
-                eh->num_operands++;
-                eh->operand[op_idx].type = TImmediate;
-                eh->operand[op_idx].length =
+                dop = &di->ops[++op_idx];
+                memset(dop, 0, sizeof(DecodedOp));
+                di->num_operands++;
+                dop->kind = DOP_IMM;
+                dop->length =
                         (uint8_t) xed_decoded_inst_operand_length(&xedd, i);
-                eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
-                xed_uint8_t unsigned_imm_val =
-                        xed_decoded_inst_get_second_immediate(&xedd);
-                eh->operand[op_idx].value = (uint32_t) unsigned_imm_val;
+                dop->access = (uint8_t) xed_operand_rw(op);
+                dop->value =
+                        (uint32_t) xed_decoded_inst_get_second_immediate(&xedd);
                 break;
             }
 
@@ -381,11 +392,6 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
         case XED_OPERAND_MEM0:
         case XED_OPERAND_MEM1:
             {
-                unsigned long base = 0;
-                unsigned long index = 0;
-                unsigned long scale = 1;
-                unsigned long segbase = 0;
-                unsigned short segsel = 0;
                 unsigned long displacement = 0;
                 unsigned int j;
                 size_t remaining = 0;
@@ -399,24 +405,17 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
 
                 for (j = 0; j < memlen; j += 4)
                 {
-                    /* Initialization */
-                    base = 0;
-                    index = 0;
-                    scale = 1;
-                    segbase = 0;
-                    segsel = 0;
-                    displacement = 0;
+                    if (op_idx + 1 >= MAX_NUM_OPERANDS)
+                        break;
+                    dop = &di->ops[++op_idx];
+                    memset(dop, 0, sizeof(DecodedOp));
                     remaining = memlen - j;
 
-                    op_idx++;
-                    if (op_idx >= MAX_NUM_OPERANDS)
-                        break;
-                    //assert(op_idx < MAX_NUM_OPERANDS);
-                    eh->num_operands++;
-                    eh->operand[op_idx].type = TMemLoc;
-                    eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
-                    eh->operand[op_idx].length =
-                            remaining > 4 ? 4 : (uint8_t) remaining;
+                    di->num_operands++;
+                    dop->kind = (op_name == XED_OPERAND_AGEN) ? DOP_AGEN : DOP_MEM;
+                    dop->access = (uint8_t) xed_operand_rw(op);
+                    dop->length = remaining > 4 ? 4 : (uint8_t) remaining;
+                    dop->scale = 1;
 
                     // Get Segment register
                     xed_reg_enum_t seg_regid = xed_decoded_inst_get_seg_reg(
@@ -432,67 +431,10 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
 
                         if (!default_segment)
                         {
-                            eh->num_operands++;
-                            int segmentreg = xed2chris_regmapping[seg_regid][0]
-                                    - 100;
-
-                            segbase = cpu_single_env->segs[segmentreg].base;
-                            segsel = cpu_single_env->segs[segmentreg].selector;
-
-                            eh->memregs[op_idx][0].type = TRegister;
-                            eh->memregs[op_idx][0].length = 2;
-                            eh->memregs[op_idx][0].addr =
-                                    xed2chris_regmapping[seg_regid][0];
-                            eh->memregs[op_idx][0].access =
-                                    (uint8_t) XED_OPERAND_ACTION_R;
-                            eh->memregs[op_idx][0].value = segsel;
-                            eh->memregs[op_idx][0].usage = memsegment;
-                            if (ignore_taint == 0)
-                                set_operand_data(&(eh->memregs[op_idx][0]), 1);
-
-                            int dt;
-                            if (segsel & 0x4) // ldt
-                                dt = cpu_single_env->ldt.base;
-                            else
-                                //gdt
-                                dt = cpu_single_env->gdt.base;
-                            segsel = segsel >> 3;
-
-                            unsigned long segent = dt + 8 * segsel;
-                            unsigned char segdes[8];
-                            DECAF_read_mem(cpu_single_env, segent, 8, segdes);
-
-#if 0
-                            // debugging code to double check segbase value
-                            unsigned long segbasenew = segdes[2] + segdes[3] * 256 +
-                            segdes[4] * 256 * 256 + segdes[7] * 256 * 256 * 256;
-                            if (segbase != segbasenew)
-                            {
-                                monitor_printf("segbase unexpected: 0x%08lX v.s 0x%08lX\n",
-                                        segbase, segbasenew);
-                            }
-#endif
-                            /* Segment descriptor is stored as a memory operand */
-                            eh->num_operands += 2;
-                            eh->memregs[op_idx][3].type = TMemLoc;
-                            eh->memregs[op_idx][3].length = 4;
-                            eh->memregs[op_idx][3].addr = segent;
-                            eh->memregs[op_idx][3].access =
-                                    (uint8_t) XED_OPERAND_ACTION_INVALID;
-                            eh->memregs[op_idx][3].value =
-                                    *((uint32_t *) segdes);
-                            eh->memregs[op_idx][3].tainted_begin = 0;
-                            eh->memregs[op_idx][3].usage = memsegent0;
-
-                            eh->memregs[op_idx][4].type = TMemLoc;
-                            eh->memregs[op_idx][4].length = 4;
-                            eh->memregs[op_idx][4].addr = segent + 4;
-                            eh->memregs[op_idx][4].access =
-                                    (uint8_t) XED_OPERAND_ACTION_INVALID;
-                            eh->memregs[op_idx][4].value = *(uint32_t *) (segdes
-                                    + 4);
-                            eh->memregs[op_idx][4].tainted_begin = 0;
-                            eh->memregs[op_idx][4].usage = memsegent1;
+                            /* Segment register and both descriptor halves */
+                            di->num_operands += 3;
+                            dop->flags |= DOP_HAS_SEG;
+                            dop->seg_reg = xed2chris_regmapping[seg_regid][0];
                         }
                     }
 
@@ -501,43 +443,25 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
                             &xedd, mem_idx);
                     if (base_regid != XED_REG_INVALID)
                     {
-                        eh->num_operands++;
-                        int basereg = xed2chris_regmapping[base_regid][1];
-                        base = cpu_single_env->regs[basereg];
-                        eh->memregs[op_idx][1].type = TRegister;
-                        eh->memregs[op_idx][1].addr =
-                                xed2chris_regmapping[base_regid][0];
-                        eh->memregs[op_idx][1].length = 4;
-                        eh->memregs[op_idx][1].access =
-                                (uint8_t) XED_OPERAND_ACTION_R;
-                        eh->memregs[op_idx][1].value = base;
-                        eh->memregs[op_idx][1].usage = membase;
-                        if (ignore_taint == 0)
-                            set_operand_data(&(eh->memregs[op_idx][1]), 1);
+                        di->num_operands++;
+                        dop->flags |= DOP_HAS_BASE;
+                        dop->base_reg = xed2chris_regmapping[base_regid][0];
+                        dop->base_num = xed2chris_regmapping[base_regid][1];
                     }
                     // Get Index register and Scale
                     xed_reg_enum_t index_regid = xed_decoded_inst_get_index_reg(
                             &xedd, mem_idx);
                     if (mem_idx == 0 && index_regid != XED_REG_INVALID)
                     {
-                        eh->num_operands++;
-                        int indexreg = xed2chris_regmapping[index_regid][1];
-                        index = cpu_single_env->regs[indexreg];
-                        eh->memregs[op_idx][2].type = TRegister;
-                        eh->memregs[op_idx][2].addr =
-                                xed2chris_regmapping[index_regid][0];
-                        eh->memregs[op_idx][2].length = 4;
-                        eh->memregs[op_idx][2].access =
-                                (uint8_t) XED_OPERAND_ACTION_R;
-                        eh->memregs[op_idx][2].value = index;
-                        eh->memregs[op_idx][2].usage = memindex;
-                        if (ignore_taint == 0)
-                            set_operand_data(&(eh->memregs[op_idx][2]), 1);
+                        di->num_operands++;
+                        dop->flags |= DOP_HAS_INDEX;
+                        dop->index_reg = xed2chris_regmapping[index_regid][0];
+                        dop->index_num = xed2chris_regmapping[index_regid][1];
 
                         // Get Scale (AKA width) (only have a scale if the index exists)
                         if (xed_decoded_inst_get_scale(&xedd, i) != 0)
                         {
-                            scale = (unsigned long) xed_decoded_inst_get_scale(
+                            dop->scale = (uint8_t) xed_decoded_inst_get_scale(
                                     &xedd, mem_idx);
                         }
                     }
@@ -552,7 +476,7 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
                     //        Affects: ENTER,PUSH,PUSHA,PUSHF,CALL
                     if (is_stackpush)
                     {
-                        stackpushpop_acc += eh->operand[op_idx].length;
+                        stackpushpop_acc += dop->length;
                         displacement = displacement - stackpushpop_acc - j;
                     }
                     //   2) Pop instructions where the
@@ -563,42 +487,16 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
                     //      Affects: pop (%esp)
                     else if ((category == XED_CATEGORY_POP) && (!is_stackpop))
                     {
-                        if ((eh->memregs[op_idx][1].addr == esp_reg)
-                                || (eh->memregs[op_idx][2].addr == esp_reg))
+                        if (((dop->flags & DOP_HAS_BASE) && dop->base_reg == esp_reg)
+                                || ((dop->flags & DOP_HAS_INDEX)
+                                        && dop->index_reg == esp_reg))
                         {
-                            displacement = displacement
-                                    + eh->operand[op_idx].length;
+                            displacement = displacement + dop->length;
                         }
                     }
 
-                    // Calculate memory address accessed
-                    eh->operand[op_idx].addr = j + segbase + base
-                            + index * scale + displacement;
-
-                    // Special handling for LEA instructions
-                    if (op_name == XED_OPERAND_AGEN)
-                    {
-                        eh->operand[op_idx].type = TMemAddress;
-                        eh->operand[op_idx].length = 4;
-                        has_page_fault = 0; // LEA won't trigger page fault
-                    }
-                    else
-                    {
-                        has_page_fault = DECAF_read_mem(cpu_single_env,
-                                eh->operand[op_idx].addr,
-                                (int) (eh->operand[op_idx].length),
-                                (uint8_t *) &(eh->operand[op_idx].value));
-                    }
-
-                    // Check if instruction accesses user memory
-                    // kernel_mem_start defined in shared/read_linux.c
-                    if ((eh->operand[op_idx].addr < VMI_guest_kernel_base)
-                            && (op_name != XED_OPERAND_AGEN))
-                    {
-                        access_user_mem = 1;
-                    }
-                    if (ignore_taint == 0)
-                        set_operand_data(&(eh->operand[op_idx]), 1);
+                    /* Everything but the register values is known now */
+                    dop->value = (uint32_t) (j + displacement);
                 }
                 break;
             }
@@ -611,13 +509,14 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
                         &xedd);
                 /* Displacement is from instruction end */
                 /* Adjust displacement with instruction size */
-                disp = disp + eh->inst_size;
-                op_idx++;
-                eh->num_operands++;
-                eh->operand[op_idx].type = TJump;
-                eh->operand[op_idx].length = 4;
-                eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
-                eh->operand[op_idx].value = disp;
+                disp = disp + di->inst_size;
+                dop = &di->ops[++op_idx];
+                memset(dop, 0, sizeof(DecodedOp));
+                di->num_operands++;
+                dop->kind = DOP_JUMP;
+                dop->length = 4;
+                dop->access = (uint8_t) xed_operand_rw(op);
+                dop->value = disp;
                 break;
             }
 
@@ -629,11 +528,213 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
         case XED_REG_X87PUSH:
         case XED_REG_X87POP:
         case XED_REG_X87POP2:
-            op_idx++;
-            eh->num_operands++;
-            eh->operand[op_idx].type = TFloatRegister;
-            eh->operand[op_idx].length = 4;
-            eh->operand[op_idx].access = (uint8_t) xed_operand_rw(op);
+            dop = &di->ops[++op_idx];
+            memset(dop, 0, sizeof(DecodedOp));
+            di->num_operands++;
+            dop->kind = DOP_FPU;
+            dop->length = 4;
+            dop->access = (uint8_t) xed_operand_rw(op);
+        default:
+            break;
+        }
+    }
+
+    di->num_ops = op_idx + 1;
+    return 0;
+}
+
+/* Clear the EntryHeader fields used by the previous instruction.
+ Every operand and memreg slot written while decoding or splitting operands
+ is below num_operands, so the rest of the (large) structure is still zero.
+ */
+static inline void
+clear_entry(EntryHeader *eh)
+{
+    int n = eh->num_operands;
+    if (n > MAX_NUM_OPERANDS)
+        n = MAX_NUM_OPERANDS;
+
+    memset(eh, 0, offsetof(EntryHeader, operand));
+    memset(eh->operand, 0, n * sizeof(OperandVal));
+    memset(eh->memregs, 0, n * sizeof(eh->memregs[0]));
+}
+
+/* Read the current value of a register operand */
+static inline uint32_t
+read_register_value(int chris_reg, int regnum)
+{
+    uint32_t value = cpu_single_env->regs[regnum];
+
+    switch (chris_reg)
+    {
+    case ax_reg:
+    case bx_reg:
+    case cx_reg:
+    case dx_reg:
+    case bp_reg:
+    case sp_reg:
+    case si_reg:
+    case di_reg:
+        return value & 0xFFFF;
+    case al_reg:
+    case bl_reg:
+    case cl_reg:
+    case dl_reg:
+        return value & 0xFF;
+    case ah_reg:
+    case bh_reg:
+    case ch_reg:
+    case dh_reg:
+        return (value & 0xFF00) >> 8;
+    default:
+        return value;
+    }
+}
+
+/* Compute the address, value and memregs of a memory operand */
+static void
+fill_memory_operand(const DecodedOp *dop, OperandVal *op, OperandVal *memregs)
+{
+    uint32_t segbase = 0, base = 0, index = 0;
+
+    op->type = TMemLoc;
+
+    if (dop->flags & DOP_HAS_SEG)
+    {
+        int segmentreg = dop->seg_reg - 100;
+        unsigned short segsel = cpu_single_env->segs[segmentreg].selector;
+        unsigned char segdes[8];
+        uint32_t dt, segent;
+
+        segbase = cpu_single_env->segs[segmentreg].base;
+
+        memregs[0].type = TRegister;
+        memregs[0].length = 2;
+        memregs[0].addr = dop->seg_reg;
+        memregs[0].access = (uint8_t) XED_OPERAND_ACTION_R;
+        memregs[0].value = segsel;
+        memregs[0].usage = memsegment;
+        set_operand_data(&memregs[0], 1);
+
+        if (segsel & 0x4) // ldt
+            dt = cpu_single_env->ldt.base;
+        else
+            //gdt
+            dt = cpu_single_env->gdt.base;
+
+        segent = dt + 8 * (segsel >> 3);
+        DECAF_read_mem(cpu_single_env, segent, 8, segdes);
+
+        /* Segment descriptor is stored as a memory operand */
+        memregs[3].type = TMemLoc;
+        memregs[3].length = 4;
+        memregs[3].addr = segent;
+        memregs[3].access = (uint8_t) XED_OPERAND_ACTION_INVALID;
+        memregs[3].value = *((uint32_t *) segdes);
+        memregs[3].usage = memsegent0;
+
+        memregs[4].type = TMemLoc;
+        memregs[4].length = 4;
+        memregs[4].addr = segent + 4;
+        memregs[4].access = (uint8_t) XED_OPERAND_ACTION_INVALID;
+        memregs[4].value = *(uint32_t *) (segdes + 4);
+        memregs[4].usage = memsegent1;
+    }
+
+    if (dop->flags & DOP_HAS_BASE)
+    {
+        if (dop->base_num >= 0)
+            base = cpu_single_env->regs[dop->base_num];
+        memregs[1].type = TRegister;
+        memregs[1].addr = dop->base_reg;
+        memregs[1].length = 4;
+        memregs[1].access = (uint8_t) XED_OPERAND_ACTION_R;
+        memregs[1].value = base;
+        memregs[1].usage = membase;
+        set_operand_data(&memregs[1], 1);
+    }
+
+    if (dop->flags & DOP_HAS_INDEX)
+    {
+        if (dop->index_num >= 0)
+            index = cpu_single_env->regs[dop->index_num];
+        memregs[2].type = TRegister;
+        memregs[2].addr = dop->index_reg;
+        memregs[2].length = 4;
+        memregs[2].access = (uint8_t) XED_OPERAND_ACTION_R;
+        memregs[2].value = index;
+        memregs[2].usage = memindex;
+        set_operand_data(&memregs[2], 1);
+    }
+
+    // Calculate memory address accessed
+    op->addr = segbase + base + index * dop->scale + dop->value;
+
+    // Special handling for LEA instructions
+    if (dop->kind == DOP_AGEN)
+    {
+        op->type = TMemAddress;
+        op->length = 4;
+        has_page_fault = 0; // LEA won't trigger page fault
+    }
+    else
+    {
+        has_page_fault = DECAF_read_mem(cpu_single_env, op->addr,
+                (int) (op->length), (uint8_t *) &(op->value));
+
+        // Check if instruction accesses user memory
+        // kernel_mem_start defined in shared/read_linux.c
+        if (op->addr < VMI_guest_kernel_base)
+            access_user_mem = 1;
+    }
+    set_operand_data(op, 1);
+}
+
+/* Build the EntryHeader of a cached instruction from the current state */
+static void
+fill_entry(const DecodedInsn *di, EntryHeader *eh)
+{
+    int i;
+
+    clear_entry(eh);
+
+    /* Copy the address, instruction size and rawbytes */
+    eh->address = di->address;
+    eh->inst_size = di->inst_size;
+    eh->num_operands = di->num_operands;
+    memcpy(eh->rawbytes, di->rawbytes, di->inst_size);
+
+    for (i = 0; i < di->num_ops; i++)
+    {
+        const DecodedOp *dop = &di->ops[i];
+        OperandVal *op = &eh->operand[i];
+
+        op->access = dop->access;
+        op->length = dop->length;
+
+        switch (dop->kind)
+        {
+        case DOP_REG:
+            op->type = TRegister;
+            op->addr = dop->reg;
+            op->value = read_register_value(dop->reg, dop->regnum);
+            set_operand_data(op, 1);
+            break;
+        case DOP_IMM:
+            op->type = TImmediate;
+            op->value = dop->value;
+            break;
+        case DOP_MEM:
+        case DOP_AGEN:
+            fill_memory_operand(dop, op, eh->memregs[i]);
+            break;
+        case DOP_JUMP:
+            op->type = TJump;
+            op->value = dop->value;
+            break;
+        case DOP_FPU:
+            op->type = TFloatRegister;
+            break;
         default:
             break;
         }
@@ -647,93 +748,219 @@ decode_address(uint32_t address, EntryHeader *eh) //, int ignore_taint)
     eh->df = 0; /* Gets updated at insn_end */
 
     eh->cc_op = cpu_single_env->cc_op;
+}
+
+/* This is the central function
+ Given a memory address, finds the decoded instruction in the decode cache,
+ or reads the instruction bytes and calls the disassembler to obtain it.
+ Then it stores the information for the current execution into the eh
+ EntryHeader
+ */
+
+void
+decode_address(uint32_t address, EntryHeader *eh)
+{
+    unsigned char insn_buf[MAX_INSN_BYTES];
+    uint32_t pgd;
+    DecodedInsn *di;
+
+    if (xed2chris_regmapping[XED_REG_EAX][0] == 0)
+    {
+        init_xed2chris();
+        assert(xed2chris_regmapping[XED_REG_EAX][0] != 0);
+    }
+
+    pgd = DECAF_getPGD(cpu_single_env);
+    di = &decode_cache[DECODE_CACHE_HASH(pgd, address)];
+
+    if (di->inst_size != 0 && di->address == address && di->pgd == pgd
+            && DECAF_read_mem(cpu_single_env, address, di->inst_size, insn_buf) >= 0
+            && memcmp(insn_buf, di->rawbytes, di->inst_size) == 0)
+    {
+        tstats.insn_counter_decode_hits++;
+    }
+    else
+    {
+        /* Read memory from DECAF */
+        DECAF_read_mem(cpu_single_env, address, MAX_INSN_BYTES, insn_buf);
 
-//  free(inst);
+        if (decode_insn(insn_buf, di) < 0)
+        {
+            di->inst_size = 0;
+            return;
+        }
+        di->pgd = pgd;
+        di->address = address;
+    }
+
+    // Increase counters
+    tstats.insn_counter_decoded++;
 
+    fill_entry(di, eh);
 }
 
 #ifdef INSN_INFO
 long savedeip;
 #endif
 
+/* Append a field to an output buffer */
+#define ENCODE_FIELD(p, field) \
+    do { \
+        memcpy((p), &(field), sizeof(field)); \
+        (p) += sizeof(field); \
+    } while (0)
+
 /* Output function
- Writes an operand structure to the given file
+ Serializes an operand structure into p and returns the end of its encoding
  */
-unsigned int
-write_operand(FILE *stream, OperandVal op)
+static inline unsigned char *
+encode_operand(unsigned char *p, const OperandVal *op)
 {
     unsigned int i = 0;
-    unsigned int num_elems_written = 0;
-
-    if (stream == NULL)
-        return 0;
 
-#ifndef LOK
-    /* Write fixed part of operand */
-    num_elems_written += fwrite(&op, OPERAND_VAL_FIXED_SIZE, 1, stream);
-
-#else
-    /** LOK: Changed to write the operand field by field **/
-    num_elems_written += fwrite(&op.access, sizeof(op.access), 1, stream);
-    num_elems_written += fwrite(&op.length, sizeof(op.length), 1, stream);
-    num_elems_written += fwrite(&op.tainted_begin, sizeof(op.tainted_begin), 1,
-            stream);
-    num_elems_written += fwrite(&op.tainted_end, sizeof(op.tainted_end), 1,
-            stream);
-    num_elems_written += fwrite(&op.addr, sizeof(op.addr), 1, stream);
-    num_elems_written += fwrite(&op.value, sizeof(op.value), 1, stream);
-    /** LOK: END CHANGES **/
-
-#endif
+    /* Fixed part of operand, field by field */
+    ENCODE_FIELD(p, op->access);
+    ENCODE_FIELD(p, op->length);
+    ENCODE_FIELD(p, op->tainted_begin);
+    ENCODE_FIELD(p, op->tainted_end);
+    ENCODE_FIELD(p, op->addr);
+    ENCODE_FIELD(p, op->value);
 
     /* Write enums */
     //TODO: FIX THIS?
-    uint16_t enums = (((uint16_t) op.usage) << 8) | ((uint16_t) op.type);
-    num_elems_written += fwrite(&enums, OPERAND_VAL_ENUMS_REAL_SIZE, 1, stream);
+    uint16_t enums = (((uint16_t) op->usage) << 8) | ((uint16_t) op->type);
+    ENCODE_FIELD(p, enums);
 
     /* For each byte in the operand, check if tainted.
      If tainted, write taint record */
-    assert(op.length <= MAX_OPERAND_LEN);
-    for (i = 0; i < op.length; i++)
+    assert(op->length <= MAX_OPERAND_LEN);
+    for (i = 0; i < op->length; i++)
     {
-        if (op.tainted_begin & (1 << i))
-        // if (op.tainted_begin & (0xff << 4*i))
+        if (op->tainted_begin & (1 << i))
         {
-#ifdef LOK
-            /* Write fixed part of taint_record */
-            num_elems_written += fwrite(&(op.records[i]),
-                    TAINT_RECORD_FIXED_SIZE, 1, stream);
-
-#else
-            /** LOK: Changed to write it field by field **/
-            num_elems_written += fwrite(&(op.records[i].numRecords), sizeof(op.records[i].numRecords), 1, stream);
-            /** LOK: END CHANGES **/
-#endif
+            ENCODE_FIELD(p, op->records[i].numRecords);
 
             /* Write only the non-empty taint_byte_record */
-            assert(op.records[i].numRecords <= MAX_NUM_TAINTBYTE_RECORDS);
-            num_elems_written += fwrite(&(op.records[i].taintBytes),
-                    sizeof(TaintByteRecord), op.records[i].numRecords, stream);
-            //LOK: This sizeof TaintByteRecord is fine
+            assert(op->records[i].numRecords <= MAX_NUM_TAINTBYTE_RECORDS);
+            memcpy(p, op->records[i].taintBytes,
+                    op->records[i].numRecords * sizeof(TaintByteRecord));
+            p += op->records[i].numRecords * sizeof(TaintByteRecord);
+        }
+    }
+    return p;
+}
+
+/* Write the trace header and the process and module records.
+   Returns 0, or -1 if there is no memory for them */
+static int
+write_trace_header(TraceWriter *tw)
+{
+    unsigned char *tables, *p;
+
+    /* writing the trace header */
+    TraceHeader th;
+    th.magicnumber = MAGIC_NUMBER;
+    th.version = tw_trace_version(tw);
+    th.n_procs = 1;
+    th.gdt_base = cpu_single_env->gdt.base;
+    th.idt_base = cpu_single_env->idt.base;
+
+    /* for each process */
+    ProcRecord pr;
+    memset(&pr, 0, sizeof(ProcRecord));
+    VMI_find_process_by_cr3_c(tracecr3, pr.name, MAX_STRING_LEN, &pr.pid);
+    pr.n_mods = VMI_get_loaded_modules_count_c(pr.pid);
+    tmodinfo_t *pmr = (tmodinfo_t *) malloc(pr.n_mods * sizeof(tmodinfo_t));
+
+    if (pmr)
+    {
+        VMI_get_proc_modules_c(pr.pid, pr.n_mods, pmr);
+    }
+    else
+    {
+        pr.n_mods = -1;
+    }
+    pr.ldt_base = cpu_single_env->ldt.base;
+
+    /* The tables are handed to the writer in one piece, so that they are
+     * stored only once, ahead of the instructions */
+    tables = p = malloc(sizeof(th) + sizeof(pr)
+            + (pmr ? pr.n_mods * sizeof(ModuleRecord) : 0));
+    if (tables == NULL)
+    {
+        free(pmr);
+        return -1;
+    }
+    ENCODE_FIELD(p, th);
+    ENCODE_FIELD(p, pr);
+
+    if (pmr)
+    {
+        int i;
+        ModuleRecord mr;
+        for (i = 0; i < pr.n_mods; i++)
+        {
+            strncpy(mr.name, pmr[i].name, MAX_STRING_LEN);
+            mr.base = pmr[i].base;
+            mr.size = pmr[i].size;
+            ENCODE_FIELD(p, mr);
+        }
+        free(pmr);
+    }
+
+    tw_write_tables(tw, tables, p - tables);
+    free(tables);
+    return 0;
+}
+
+/* Write the trace header unless it is already written.
+   Returns 0, or -1 if it cannot be written, in which case nothing else
+   may be written to the trace yet */
+int
+write_trace_header_once(TraceWriter *tw)
+{
+    if (header_already_written == 0)
+    {
+        if (write_trace_header(tw) < 0)
+        {
+            fprintf(stderr, "write_trace_header_once: out of memory, "
+                    "the trace header is not written yet\n");
+            return -1;
         }
+
+        /* Set flag */
+        header_already_written = 1;
     }
-    return num_elems_written;
+    return 0;
+}
+
+/* Return the size of the instruction at the start of the len bytes of buf,
+ or 0 if XED cannot decode it */
+unsigned int
+insn_length(const unsigned char *buf, size_t len)
+{
+    xed_decoded_inst_zero_set_mode(&xedd, &dstate);
+    if (xed_decode(&xedd, XED_STATIC_CAST(const xed_uint8_t*,buf),
+            (len < MAX_INSN_BYTES) ? len : MAX_INSN_BYTES) != XED_ERROR_NONE)
+        return 0;
+    return xed_decoded_inst_get_length(&xedd);
 }
 
 /* Output function
- Writes an EntryHeader to the given file
+ Serializes an EntryHeader into the trace writer and returns the number
+ of bytes it takes
  */
 unsigned int
-write_insn(FILE *stream, EntryHeader *eh)
+write_insn(TraceWriter *tw, EntryHeader *eh)
 {
-    unsigned int num_elems_written = 0;
+    unsigned char *start, *p;
 
     /* If trace_do_not_write is set, ignore write */
     if (trace_do_not_write)
         return 0;
 
-    /* If no stream or no instruction, ignore write */
-    if ((stream == NULL) || (eh == NULL))
+    /* If no writer or no instruction, ignore write */
+    if ((tw == NULL) || (eh == NULL))
         return 0;
 
     /* If tid_to_trace is set, write only if we're in the thread tid */
@@ -743,110 +970,80 @@ write_insn(FILE *stream, EntryHeader *eh)
     /* If trace header still not written, write it
      * Delaying writing the header till here allows to get more module
      * information when tracing a process by name */
-    if (header_already_written == 0)
-    {
-        /* writing the trace header */
-        TraceHeader th;
-        th.magicnumber = MAGIC_NUMBER;
-        th.version = VERSION_NUMBER;
-        th.n_procs = 1;
-        th.gdt_base = cpu_single_env->gdt.base;
-        th.idt_base = cpu_single_env->idt.base;
-        num_elems_written += fwrite(&th, sizeof(th), 1, stream);
-
-        /* Set flag */
-        header_already_written = 1;
-
-        /* for each process */
-        ProcRecord pr;
-        memset(&pr, 0, sizeof(ProcRecord));
-        VMI_find_process_by_cr3_c(tracecr3, pr.name, MAX_STRING_LEN, &pr.pid);
-        pr.n_mods = VMI_get_loaded_modules_count_c(pr.pid);
-        tmodinfo_t *pmr = (tmodinfo_t *) malloc(pr.n_mods * sizeof(tmodinfo_t));
-
-        if (pmr)
-        {
-            VMI_get_proc_modules_c(pr.pid, pr.n_mods, pmr);
-        }
-        else
-        {
-            pr.n_mods = -1;
-        }
-        pr.ldt_base = cpu_single_env->ldt.base;
-
-        num_elems_written += fwrite(&pr, sizeof(pr), 1, stream);
+    if (write_trace_header_once(tw) < 0)
+        return 0;
 
-        if (pmr)
-        {
-            int i;
-            ModuleRecord mr;
-            for (i = 0; i < pr.n_mods; i++)
-            {
-                strncpy(mr.name, pmr[i].name, MAX_STRING_LEN);
-                mr.base = pmr[i].base;
-                mr.size = pmr[i].size;
-                num_elems_written += fwrite(&mr, sizeof(mr), 1, stream);
-            }
-            // free(pmr);
-        }
-        fflush (tracelog);
-    }
+    if (eh->inst_size == 0)
+        return 0;
 
-    if (stream && (eh->inst_size > 0))
+    /* Encode the whole instruction straight into the output chunk */
+    start = p = tw_reserve(tw, TRACE_MAX_ENTRY_SIZE);
+
+    /* Fixed part of entry header, field by field */
+    ENCODE_FIELD(p, eh->address);
+    ENCODE_FIELD(p, eh->tid);
+    ENCODE_FIELD(p, eh->inst_size);
+    ENCODE_FIELD(p, eh->num_operands);
+    ENCODE_FIELD(p, eh->tp);
+    ENCODE_FIELD(p, eh->eflags);
+    ENCODE_FIELD(p, eh->cc_op);
+    ENCODE_FIELD(p, eh->df);
+
+    /* Write rawbytes */
+    memcpy(p, eh->rawbytes, eh->inst_size);
+    p += eh->inst_size;
+
+    /* Write remaining operands */
+    int i = 0, j = 0;
+    while ((i < MAX_NUM_OPERANDS) && (eh->operand[i].type != TNone))
     {
+        p = encode_operand(p, &eh->operand[i]);
 
-#ifndef LOK
-        /* Write fixed part of entry header */
-        num_elems_written += fwrite(eh, ENTRY_HEADER_FIXED_SIZE, 1, stream);
-
-#else /** LOK: CHanged to write things field by field **/
-        num_elems_written += fwrite(&(eh->address), sizeof(eh->address), 1,
-                stream);
-        num_elems_written += fwrite(&(eh->tid), sizeof(eh->tid), 1, stream);
-        num_elems_written += fwrite(&(eh->inst_size), sizeof(eh->inst_size), 1,
-                stream);
-        num_elems_written += fwrite(&(eh->num_operands),
-                sizeof(eh->num_operands), 1, stream);
-        num_elems_written += fwrite(&(eh->tp), sizeof(eh->tp), 1, stream);
-        num_elems_written += fwrite(&(eh->eflags), sizeof(eh->eflags), 1,
-                stream);
-        num_elems_written += fwrite(&(eh->cc_op), sizeof(eh->cc_op), 1, stream);
-        num_elems_written += fwrite(&(eh->df), sizeof(eh->df), 1, stream);
-#endif 
-
-        /* Write rawbytes */
-        num_elems_written += fwrite(&(eh->rawbytes), eh->inst_size, 1, stream);
-
-        /* Write remaining operands */
-        int i = 0, j = 0;
-        while ((eh->operand[i].type != TNone) && (i < MAX_NUM_OPERANDS))
+        /* For Memory operands, need to write memregs and segent's */
+        if ((eh->operand[i].type == TMemLoc)
+                || (eh->operand[i].type == TMemAddress))
         {
-            write_operand(stream, eh->operand[i]);
-
-            /* For Memory operands, need to write memregs and segent's */
-            if ((eh->operand[i].type == TMemLoc)
-                    || (eh->operand[i].type == TMemAddress))
+            /* Write Memregs operands */
+            for (j = 0; j < MAX_NUM_MEMREGS; j++)
             {
-                /* Write Memregs operands */
-                for (j = 0; j < MAX_NUM_MEMREGS; j++)
+                if (eh->memregs[i][j].type != TNone)
                 {
-                    if (eh->memregs[i][j].type != TNone)
-                    {
-                        write_operand(stream, eh->memregs[i][j]);
-                    }
+                    p = encode_operand(p, &eh->memregs[i][j]);
                 }
             }
-            i++;
         }
+        i++;
+    }
+    tw_commit(tw, p - start, eh->address);
 
-        insn_already_written = 1;
-        tstats.insn_counter_traced++;
+    insn_already_written = 1;
+    tstats.insn_counter_traced++;
 #if CONFIG_TCG_TAINT
-        if (insn_tainted) tstats.insn_counter_traced_tainted++;
+    if (insn_tainted) tstats.insn_counter_traced_tainted++;
 #endif
-        /* Avoid flushing to improve performance */
-        //fflush(stream);
-    }
 
-    return num_elems_written;
+    return p - start;
+}
+
+/* Write the registers of rr as a TRACE_RECORD_REGS record */
+void
+write_regs_record(TraceWriter *tw, const TraceRegsRecord *rr)
+{
+    unsigned char buf[sizeof(TraceRecordHeader) + sizeof(TraceRegsRecord)];
+    TraceRecordHeader rh;
+
+    if (trace_do_not_write || (tw == NULL))
+        return;
+
+    if (write_trace_header_once(tw) < 0)
+        return;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.type = TRACE_RECORD_REGS;
+    rh.len = sizeof(TraceRegsRecord);
+    memcpy(buf, &rh, sizeof(rh));
+    memcpy(buf + sizeof(rh), rr, sizeof(TraceRegsRecord));
+    tw_record(tw, buf, sizeof(buf));
+
+    tstats.regs_counter_traced++;
 }
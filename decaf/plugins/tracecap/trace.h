@@ -17,12 +17,10 @@
 #endif /* INLINE */
 //#include "DECAF_lib.h"
 #include "DECAF_main.h" // AWH
+#include "tracewriter.h"
 
 
 
-/* Size of buffer to store instructions */
-#define FILEBUFSIZE 104857600
-
 /* Trace header values */
 #define VERSION_NUMBER 51 /*bit wise tainting*/
 #define MAGIC_NUMBER 0xFFFFFFFF
@@ -102,6 +100,14 @@ typedef struct _operand_val {
 
 #define ENTRY_HEADER_FIXED_SIZE 24
 
+/* Largest encoding of an operand and of an instruction */
+#define TRACE_MAX_OPERAND_SIZE \
+    (28 + MAX_OPERAND_LEN * (TAINT_RECORD_FIXED_SIZE \
+            + MAX_NUM_TAINTBYTE_RECORDS * sizeof(TaintByteRecord)))
+#define TRACE_MAX_ENTRY_SIZE \
+    (ENTRY_HEADER_FIXED_SIZE + MAX_INSN_BYTES \
+            + MAX_NUM_OPERANDS * (1 + MAX_NUM_MEMREGS) * TRACE_MAX_OPERAND_SIZE)
+
 /* Entry header description
   address:       Address where instruction is loaded in memory
   tid:           Thread identifier
@@ -160,9 +166,13 @@ typedef struct _trace_header {
 /* Structure to hold trace statistics */
 struct trace_stats {
   uint64_t insn_counter_decoded; // Number of instructions decoded
+  uint64_t insn_counter_decode_hits; // Decoded instructions taken from the decode cache
   uint64_t insn_counter_traced; // Number of instructions written to trace
   uint64_t insn_counter_traced_tainted; // Number of tainted instructions written to trace
   uint64_t operand_counter;      // Number of operands decoded
+  uint64_t block_counter_traced; // Number of blocks written to block traces
+  uint64_t insn_counter_executed; // Instructions executed while tracing only tainted ones
+  uint64_t regs_counter_traced; // Number of register snapshots written to trace
 };
 
 /* Exported variables */
@@ -172,7 +182,6 @@ extern int access_user_mem;
 extern int insn_already_written;
 extern int regmapping[];
 extern long insn_counter_traced; // Instruction counter in trace
-extern char filebuf[FILEBUFSIZE];
 extern int trace_do_not_write;
 extern unsigned int tid_to_trace;
 extern int header_already_written;
@@ -182,7 +191,11 @@ extern struct trace_stats tstats;
 int get_regnum(OperandVal op);
 int getOperandOffset (OperandVal *op);
 void decode_address(uint32_t address, EntryHeader *eh);//, int ignore_taint);
-unsigned int write_insn(FILE *stream, EntryHeader *eh);
+void decode_cache_flush(); // Drop all cached instruction decodings
+unsigned int write_insn(TraceWriter *tw, EntryHeader *eh);
+int write_trace_header_once(TraceWriter *tw);
+void write_regs_record(TraceWriter *tw, const struct _trace_regs_record *rr);
+unsigned int insn_length(const unsigned char *buf, size_t len);
 void print_trace_stats(); // Print trace statistics
 void clear_trace_stats(); // Clear trace statistics
 void xed2_init();   // Initialize disassembler
@@ -0,0 +1,76 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+/*
+ * trace_container.h
+ *
+ * Layout of compressed traces, shared by tracecap and trace_reader.
+ *
+ * A compressed trace holds the same records as a version 51 trace, split
+ * into independently zlib-compressed chunks that always start at an
+ * instruction boundary. All integers are little endian.
+ *
+ *   TraceContainerHeader
+ *   tables                  TraceHeader, ProcRecord, ModuleRecord[n_mods],
+ *                           stored once, uncompressed
+ *   { TraceChunkHeader, compressed records }*
+ *   TraceChunkIndex[n_chunks]
+ *   TraceContainerFooter    at the very end of the file
+ *
+ * Each chunk header repeats its index entry, so a trace that was not
+ * closed properly can still be read chunk by chunk from the start.
+ */
+#ifndef _TRACE_CONTAINER_H_
+#define _TRACE_CONTAINER_H_
+
+#include <inttypes.h>
+
+#define TRACE_CONTAINER_MAGIC "DECAFTZ"
+#define TRACE_CONTAINER_VERSION 1
+#define TRACE_CHUNK_MAGIC 0x4b4e4843 /* "CHNK" */
+
+/* Largest uncompressed chunk */
+#define TRACE_CHUNK_SIZE (16 << 20)
+
+typedef struct _trace_container_header {
+  char magic[8];           /* TRACE_CONTAINER_MAGIC */
+  uint32_t version;        /* TRACE_CONTAINER_VERSION */
+  uint32_t trace_version;  /* Version of the records, VERSION_NUMBER or
+                              TRACE_RECORDS_VERSION */
+  uint32_t tables_len;     /* Size of the tables that follow */
+  uint32_t reserved;
+} TraceContainerHeader;
+
+typedef struct _trace_chunk_header {
+  uint32_t magic;          /* TRACE_CHUNK_MAGIC */
+  uint32_t comp_len;       /* Size of the compressed records */
+  uint32_t raw_len;        /* Size of the records once uncompressed */
+  uint32_t n_insns;        /* Instructions in the chunk */
+  uint64_t first_insn;     /* Trace position of the first instruction */
+  uint32_t min_eip;        /* Address range of the instructions */
+  uint32_t max_eip;
+} TraceChunkHeader;
+
+typedef struct _trace_chunk_index {
+  uint64_t offset;         /* File offset of the TraceChunkHeader */
+  uint64_t first_insn;
+  uint32_t n_insns;
+  uint32_t min_eip;
+  uint32_t max_eip;
+  uint32_t comp_len;
+  uint32_t raw_len;
+  uint32_t reserved;
+} TraceChunkIndex;
+
+typedef struct _trace_container_footer {
+  uint64_t index_offset;   /* File offset of the chunk index */
+  uint64_t n_insns;        /* Instructions in the trace */
+  uint32_t n_chunks;
+  uint32_t reserved;
+  char magic[8];           /* TRACE_CONTAINER_MAGIC */
+} TraceContainerFooter;
+
+#endif // _TRACE_CONTAINER_H_
@@ -188,6 +188,39 @@ void MemoryBuilder::addItem(const uint32_t add, const uint8_t* ptr, const size_t
   //now we are done
 }
 
+void MemoryBuilder::merge(MemoryBuilder& later)
+{
+  map< uint32_t, RebuiltPage* >::iterator it;
+
+  for (it = later.memory.begin(); it != later.memory.end(); it++)
+  {
+    if ( (*it).second == NULL )
+    {
+      continue;
+    }
+
+    RebuiltPage*& pTemp = memory[(*it).first];
+    if (pTemp == NULL)
+    {
+      //take the page as is
+      pTemp = (*it).second;
+      (*it).second = NULL;
+      continue;
+    }
+
+    //the later bytes win
+    for (uint32_t i = 0; i < PAGE_SIZE; i++)
+    {
+      if ((*it).second->bitmap[i])
+      {
+        pTemp->page[i] = (*it).second->page[i];
+      }
+    }
+    pTemp->bitmap |= (*it).second->bitmap;
+    pTemp->dirtymap |= (*it).second->dirtymap;
+  }
+}
+
 void MemoryBuilder::removeItem(const uint32_t startAdd, const uint32_t endAdd)
 {
   addItem(startAdd, NULL, endAdd - startAdd, false);
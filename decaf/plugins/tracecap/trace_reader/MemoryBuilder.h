@@ -81,6 +81,13 @@ public:
    */
   int loadFiles(const std::string& strFileHeader, const std::string& strDirectory = ".");
 
+  /**
+   * Overlays the memory rebuilt from a later part of the trace onto this one. Pages that only
+   * exist in later are moved over, so later is left incomplete.
+   * @param later The memory rebuilt from the instructions that follow the ones of this builder.
+   */
+  void merge(MemoryBuilder& later);
+
   const std::map< uint32_t, RebuiltPage* >& getMemory() const { return (memory); }
   const RebuiltPage* getPage(uint32_t addr);
   size_t getNumPages() { return (memory.size());}
@@ -0,0 +1,59 @@
+/**
+ *  The <trace>.blocks table of block traces.
+ */
+#include "TraceBlockTableX86.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+int TraceBlockTableX86::load(const string& fileName)
+{
+  mData.clear();
+  mBlocks.clear();
+
+  ifstream ifs(fileName.c_str(), ifstream::in | ifstream::binary);
+  if (!ifs.good())
+  {
+    return (-1);
+  }
+  ostringstream oss;
+  oss << ifs.rdbuf();
+  mData = oss.str();
+
+  TraceBlocksHeader bh;
+  if ((mData.size() < sizeof(bh))
+      || (memcmp(mData.data(), TRACE_BLOCKS_MAGIC, sizeof(bh.magic)) != 0))
+  {
+    cerr << "[" << fileName << "] is not a block table" << endl;
+    return (-1);
+  }
+  memcpy(&bh, mData.data(), sizeof(bh));
+  if (bh.version != TRACE_BLOCKS_VERSION)
+  {
+    cerr << "Unsupported block table version [" << bh.version << "]" << endl;
+    return (-1);
+  }
+
+  size_t off = sizeof(bh);
+  while (off + sizeof(TraceBlockRecord) <= mData.size())
+  {
+    TraceBlockRecord br;
+    memcpy(&br, mData.data() + off, sizeof(br));
+    Block b;
+    b.pc = br.pc;
+    b.size = br.size;
+    b.icount = br.icount;
+    b.lenOff = off + sizeof(br);
+    b.codeOff = b.lenOff + br.icount;
+    if (b.codeOff + br.size > mData.size())
+    {
+      break;
+    }
+    mBlocks.push_back(b);
+    off = b.codeOff + br.size;
+  }
+  return (0);
+}
@@ -0,0 +1,40 @@
+/**
+ *  The <trace>.blocks table of block traces (see ../trace_records.h), the
+ *  code of every block the trace refers to.
+ */
+#ifndef TRACE_BLOCK_TABLE_X86_H
+#define TRACE_BLOCK_TABLE_X86_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include "../trace_records.h"
+
+class TraceBlockTableX86
+{
+public:
+  struct Block
+  {
+    uint32_t pc;
+    uint16_t size;    //0 if the code is unknown
+    uint16_t icount;
+    size_t lenOff;    //offsets of len[icount] and code[size] in mData
+    size_t codeOff;
+  };
+
+  //loads fileName, a table that was cut short is loaded up to its last
+  // complete block
+  int load(const std::string& fileName);
+  bool empty() const { return (mBlocks.empty()); }
+  size_t size() const { return (mBlocks.size()); }
+
+  const Block& block(uint32_t id) const { return (mBlocks[id]); }
+  const unsigned char* lens(uint32_t id) const { return ((const unsigned char*)mData.data() + mBlocks[id].lenOff); }
+  const unsigned char* code(uint32_t id) const { return ((const unsigned char*)mData.data() + mBlocks[id].codeOff); }
+
+protected:
+  std::string mData;
+  std::vector<Block> mBlocks;
+};
+
+#endif//TRACE_BLOCK_TABLE_X86_H
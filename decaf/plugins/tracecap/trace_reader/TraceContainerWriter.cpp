@@ -0,0 +1,138 @@
+/**
+ *  Writes compressed traces (see ../trace_container.h).
+ */
+#include "TraceContainerWriter.h"
+#include <cstring>
+#include <iostream>
+#include <zlib.h>
+
+using namespace std;
+
+TraceContainerWriter::TraceContainerWriter()
+{
+  mInsns = 0;
+  mOffset = 0;
+  memset(&mCurIndex, 0, sizeof(mCurIndex));
+}
+
+TraceContainerWriter::~TraceContainerWriter()
+{
+  if (ofs.is_open())
+  {
+    close();
+  }
+}
+
+int TraceContainerWriter::open(const string& fileName, const char* tables, size_t tablesLen, uint32_t traceVersion)
+{
+  ofs.open(fileName.c_str(), ofstream::out | ofstream::trunc | ofstream::binary);
+  if (!ofs.good())
+  {
+    cerr << "Could not open file [" << fileName << "] for write" << endl;
+    return (-1);
+  }
+
+  TraceContainerHeader th;
+  memset(&th, 0, sizeof(th));
+  memcpy(th.magic, TRACE_CONTAINER_MAGIC, sizeof(th.magic));
+  th.version = TRACE_CONTAINER_VERSION;
+  th.trace_version = traceVersion;
+  th.tables_len = tablesLen;
+  ofs.write((const char*)(&th), sizeof(th));
+  ofs.write(tables, tablesLen);
+  mOffset = sizeof(th) + tablesLen;
+
+  mChunk.reserve(TRACE_CHUNK_SIZE);
+  return (ofs.good() ? 0 : -1);
+}
+
+int TraceContainerWriter::addInstruction(const char* buf, size_t len, uint32_t eip)
+{
+  if (mChunk.size() + len > TRACE_CHUNK_SIZE)
+  {
+    if (flushChunk() != 0)
+    {
+      return (-1);
+    }
+  }
+
+  if (mCurIndex.n_insns == 0)
+  {
+    mCurIndex.first_insn = mInsns;
+    mCurIndex.min_eip = mCurIndex.max_eip = eip;
+  }
+  else if (eip < mCurIndex.min_eip)
+  {
+    mCurIndex.min_eip = eip;
+  }
+  else if (eip > mCurIndex.max_eip)
+  {
+    mCurIndex.max_eip = eip;
+  }
+  mCurIndex.n_insns++;
+  mInsns++;
+
+  mChunk.insert(mChunk.end(), buf, buf + len);
+  return (0);
+}
+
+int TraceContainerWriter::flushChunk()
+{
+  if (mChunk.empty())
+  {
+    return (0);
+  }
+
+  uLongf compLen = compressBound(mChunk.size());
+  vector<char> comp(compLen);
+  if (compress2((Bytef*)(&comp[0]), &compLen, (const Bytef*)(&mChunk[0]), mChunk.size(), 1) != Z_OK)
+  {
+    cerr << "Could not compress chunk" << endl;
+    return (-1);
+  }
+
+  mCurIndex.offset = mOffset;
+  mCurIndex.comp_len = compLen;
+  mCurIndex.raw_len = mChunk.size();
+
+  TraceChunkHeader ch;
+  ch.magic = TRACE_CHUNK_MAGIC;
+  ch.comp_len = mCurIndex.comp_len;
+  ch.raw_len = mCurIndex.raw_len;
+  ch.n_insns = mCurIndex.n_insns;
+  ch.first_insn = mCurIndex.first_insn;
+  ch.min_eip = mCurIndex.min_eip;
+  ch.max_eip = mCurIndex.max_eip;
+  ofs.write((const char*)(&ch), sizeof(ch));
+  ofs.write(&comp[0], compLen);
+  mOffset += sizeof(ch) + compLen;
+
+  mIndex.push_back(mCurIndex);
+  memset(&mCurIndex, 0, sizeof(mCurIndex));
+  mChunk.clear();
+  return (ofs.good() ? 0 : -1);
+}
+
+int TraceContainerWriter::close()
+{
+  int ret = flushChunk();
+
+  TraceContainerFooter tf;
+  memset(&tf, 0, sizeof(tf));
+  tf.index_offset = mOffset;
+  tf.n_insns = mInsns;
+  tf.n_chunks = mIndex.size();
+  memcpy(tf.magic, TRACE_CONTAINER_MAGIC, sizeof(tf.magic));
+  if (!mIndex.empty())
+  {
+    ofs.write((const char*)(&mIndex[0]), mIndex.size() * sizeof(TraceChunkIndex));
+  }
+  ofs.write((const char*)(&tf), sizeof(tf));
+
+  if (!ofs.good())
+  {
+    ret = -1;
+  }
+  ofs.close();
+  return (ret);
+}
@@ -0,0 +1,40 @@
+/**
+ *  Writes compressed traces (see ../trace_container.h). Used to convert
+ *  plain version 51 and 52 traces.
+ */
+#ifndef TRACE_CONTAINER_WRITER_H
+#define TRACE_CONTAINER_WRITER_H
+
+#include <inttypes.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../trace_container.h"
+
+class TraceContainerWriter
+{
+public:
+  TraceContainerWriter();
+  ~TraceContainerWriter();
+
+  //creates the file and stores the trace, process and module headers
+  int open(const std::string& fileName, const char* tables, size_t tablesLen, uint32_t traceVersion);
+  //appends the encoding of one instruction
+  int addInstruction(const char* buf, size_t len, uint32_t eip);
+  //writes the last chunk, the chunk index and the footer
+  int close();
+
+  uint64_t getInstructionCount() { return (mInsns); }
+
+protected:
+  int flushChunk();
+
+  std::ofstream ofs;
+  std::vector<char> mChunk;
+  std::vector<TraceChunkIndex> mIndex;
+  TraceChunkIndex mCurIndex;
+  uint64_t mInsns;
+  uint64_t mOffset;
+};
+
+#endif//TRACE_CONTAINER_WRITER_H
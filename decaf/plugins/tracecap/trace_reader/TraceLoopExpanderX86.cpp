@@ -0,0 +1,243 @@
+/**
+ *  Expands the loop and block records of version 52 traces.
+ */
+#include "TraceLoopExpanderX86.h"
+#include "TraceReaderMapX86.h"
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+TraceLoopExpanderX86::TraceLoopExpanderX86()
+{
+  mPos = 0;
+  mPeriod = 0;
+  mNumIters = 0;
+  mIter = 0;
+  mBodyLen = 0;
+  mType = 0;
+  mBlocks = NULL;
+  mPrevId = 0;
+  mTid = 0;
+}
+
+int TraceLoopExpanderX86::init(const TraceRecordHeader& rh, const char* payload, size_t len)
+{
+  mPeriod = 0;
+  mNumIters = 0;
+  mIter = 0;
+  mType = rh.type;
+  if (rh.type == TRACE_RECORD_BLOCKS)
+  {
+    if ((mBlocks == NULL) || mBlocks->empty())
+    {
+      cerr << "Block record without a block table" << endl;
+      return (-1);
+    }
+    mPayload.assign(payload, len);
+    mPos = 0;
+    mPrevId = 0;
+    mTid = 0;
+    mNumIters = rh.n_iters;
+    return (0);
+  }
+  if ((rh.type != TRACE_RECORD_LOOP) || (rh.period == 0) || (rh.n_iters == 0)
+      || (rh.n_insns != rh.period * rh.n_iters))
+  {
+    cerr << "Unsupported trace record [" << rh.type << "]" << endl;
+    return (-1);
+  }
+
+  mPayload.assign(payload, len);
+  mLens.resize(rh.period);
+  mWordOff.resize(rh.period);
+  mMapOff.resize(rh.period);
+
+  //the body is made of plain instructions
+  size_t off = 0;
+  uint32_t words = 0;
+  uint32_t mapLen = 0;
+  for (uint32_t j = 0; j < rh.period; j++)
+  {
+    size_t n = TraceEntryViewX86::parse(mPayload.data() + off, len - off);
+    if (n == 0)
+    {
+      cerr << "Bad loop body instruction [" << j << "]" << endl;
+      return (-1);
+    }
+    mLens[j] = n;
+    mWordOff[j] = words;
+    mMapOff[j] = mapLen;
+    words += (n + 3) / 4;
+    mapLen += ((n + 3) / 4 + 3) / 4;
+    off += n;
+  }
+  mBodyLen = off;
+
+  mPrev.assign(words, 0);
+  mStride.assign(words, 0);
+  mMaps.assign(mapLen, 0);
+  //the last word of every instruction is padded with zeros
+  off = 0;
+  for (uint32_t j = 0; j < rh.period; j++)
+  {
+    memcpy(&mPrev[mWordOff[j]], mPayload.data() + off, mLens[j]);
+    off += mLens[j];
+  }
+
+  mPos = 0;
+  mPeriod = rh.period;
+  mNumIters = rh.n_iters;
+  return (0);
+}
+
+int TraceLoopExpanderX86::nextIteration(string& out)
+{
+  if (done())
+  {
+    return (-1);
+  }
+  if (mType == TRACE_RECORD_BLOCKS)
+  {
+    return (nextBlock(out));
+  }
+
+  if (mIter == 0)
+  {
+    out.append(mPayload, 0, mBodyLen);
+    mPos = mBodyLen;
+    mIter++;
+    return (0);
+  }
+
+  const unsigned char* p = (const unsigned char*)mPayload.data();
+  size_t len = mPayload.size();
+  size_t repeatLen = (mPeriod + 7) / 8;
+  if (mPos + repeatLen > len)
+  {
+    cerr << "Truncated loop iteration [" << mIter << "]" << endl;
+    return (-1);
+  }
+  const unsigned char* repeat = p + mPos;
+  mPos += repeatLen;
+
+  for (uint32_t j = 0; j < mPeriod; j++)
+  {
+    uint32_t words = (mLens[j] + 3) / 4;
+    unsigned char* map = &mMaps[mMapOff[j]];
+    uint32_t* prev = &mPrev[mWordOff[j]];
+    uint32_t* stride = &mStride[mWordOff[j]];
+
+    if ((repeat[j / 8] & (1 << (j % 8))) == 0)
+    {
+      size_t mapLen = (words + 3) / 4;
+      if (mPos + mapLen > len)
+      {
+        cerr << "Truncated loop iteration [" << mIter << "]" << endl;
+        return (-1);
+      }
+      memcpy(map, p + mPos, mapLen);
+      mPos += mapLen;
+    }
+
+    for (uint32_t w = 0; w < words; w++)
+    {
+      uint32_t d = 0;
+      switch ((map[w / 4] >> (2 * (w % 4))) & 3)
+      {
+        case (TRACE_DELTA_SAME):
+          break;
+        case (TRACE_DELTA_STRIDE):
+          d = stride[w];
+          break;
+        case (TRACE_DELTA_NEW):
+          if (mPos + sizeof(d) > len)
+          {
+            cerr << "Truncated loop iteration [" << mIter << "]" << endl;
+            return (-1);
+          }
+          memcpy(&d, p + mPos, sizeof(d));
+          mPos += sizeof(d);
+          break;
+        default:
+          cerr << "Bad loop delta in iteration [" << mIter << "]" << endl;
+          return (-1);
+      }
+      prev[w] += d;
+      stride[w] = d;
+    }
+    out.append((const char*)prev, mLens[j]);
+  }
+
+  mIter++;
+  return (0);
+}
+
+bool TraceLoopExpanderX86::getVarint(uint32_t& v)
+{
+  v = 0;
+  for (int shift = 0; (shift < 35) && (mPos < mPayload.size()); shift += 7)
+  {
+    unsigned char c = mPayload[mPos++];
+    v |= (uint32_t)(c & 0x7f) << shift;
+    if ((c & 0x80) == 0)
+    {
+      return (true);
+    }
+  }
+  return (false);
+}
+
+int TraceLoopExpanderX86::nextBlock(string& out)
+{
+  uint32_t v, pgd, next;
+  if (!getVarint(v))
+  {
+    cerr << "Truncated block [" << mIter << "]" << endl;
+    return (-1);
+  }
+  //ids are zigzagged deltas, see ../trace_records.h
+  uint32_t delta = v >> 2;
+  uint32_t id = mPrevId + ((delta >> 1) ^ -(delta & 1));
+  if ((v & TRACE_BLOCK_CONTEXT) && (!getVarint(mTid) || !getVarint(pgd)))
+  {
+    cerr << "Truncated block [" << mIter << "]" << endl;
+    return (-1);
+  }
+  //where the block went is only kept for the tools that follow the
+  // control flow, the entries do not need it
+  if ((v & TRACE_BLOCK_GAP) && !getVarint(next))
+  {
+    cerr << "Truncated block [" << mIter << "]" << endl;
+    return (-1);
+  }
+  if (id >= mBlocks->size())
+  {
+    cerr << "Block [" << id << "] is not in the block table" << endl;
+    return (-1);
+  }
+  mPrevId = id;
+
+  const TraceBlockTableX86::Block& b = mBlocks->block(id);
+  const unsigned char* lens = mBlocks->lens(id);
+  const unsigned char* code = mBlocks->code(id);
+  //a one byte nop stands for the instructions of unknown blocks
+  static const unsigned char nop = 0x90;
+  uint32_t off = 0;
+  for (uint32_t i = 0; i < b.icount; i++)
+  {
+    uint32_t address = b.pc + off;
+    uint16_t instSize = b.size ? lens[i] : 1;
+    unsigned char eh[ENTRY_HEADER_FIXED_SIZE];
+    memset(eh, 0, sizeof(eh));
+    memcpy(eh, &address, sizeof(address));
+    memcpy(eh + 4, &mTid, sizeof(mTid));
+    memcpy(eh + 8, &instSize, sizeof(instSize));
+    out.append((const char*)eh, sizeof(eh));
+    out.append((const char*)(b.size ? code + off : &nop), instSize);
+    off += instSize;
+  }
+
+  mIter++;
+  return (0);
+}
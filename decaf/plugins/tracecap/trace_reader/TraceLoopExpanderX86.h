@@ -0,0 +1,57 @@
+/**
+ *  Expands the loop and block records of version 52 traces (see
+ *  ../trace_records.h) back into plain version 51 instructions.
+ */
+#ifndef TRACE_LOOP_EXPANDER_X86_H
+#define TRACE_LOOP_EXPANDER_X86_H
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include "../trace_records.h"
+#include "TraceBlockTableX86.h"
+
+class TraceLoopExpanderX86
+{
+public:
+  TraceLoopExpanderX86();
+
+  //block records need the block table of the trace
+  void setBlockTable(const TraceBlockTableX86* blocks) { mBlocks = blocks; }
+  //starts on the record with header rh, payload holds the rh.len bytes
+  // that follow the header
+  int init(const TraceRecordHeader& rh, const char* payload, size_t len);
+  //true once every iteration has been expanded
+  bool done() const { return (mIter >= mNumIters); }
+  //appends the instructions of the next iteration, or block, to out
+  int nextIteration(std::string& out);
+
+protected:
+  int nextBlock(std::string& out);
+  bool getVarint(uint32_t& v);
+
+  std::string mPayload;
+  size_t mPos;
+  uint32_t mType;
+  uint32_t mPeriod;
+  uint32_t mNumIters;
+  uint32_t mIter;
+
+  //per instruction of the body
+  std::vector<uint32_t> mLens;
+  std::vector<uint32_t> mWordOff;
+  std::vector<uint32_t> mMapOff;
+  size_t mBodyLen;
+
+  //per word of the body, see ../trace_records.h
+  std::vector<uint32_t> mPrev;
+  std::vector<uint32_t> mStride;
+  std::vector<unsigned char> mMaps;
+
+  //block records
+  const TraceBlockTableX86* mBlocks;
+  uint32_t mPrevId;
+  uint32_t mTid;
+};
+
+#endif//TRACE_LOOP_EXPANDER_X86_H
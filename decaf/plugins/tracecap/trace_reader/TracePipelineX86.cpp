@@ -0,0 +1,320 @@
+/**
+ *  Runs trace processors over a mapped trace in parallel.
+ */
+#include "TracePipelineX86.h"
+#include "TraceProcessorX86Chunked.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+TracePipelineX86::TracePipelineX86(TraceReaderMapX86& reader, unsigned numThreads, uint64_t chunkSize) :
+    mReader(reader)
+{
+  mNumThreads = numThreads ? numThreads : 1;
+  mChunkSize = chunkSize ? chunkSize : DEFAULT_CHUNK_SIZE;
+  mProto = NULL;
+  mBegin = 0;
+  mEnd = 0;
+  mNumChunks = 0;
+  mNextChunk = 0;
+  mMerged = 0;
+}
+
+int TracePipelineX86::processChunk(size_t k, TraceChunkProcessorX86* p, TRInstructionX86& insn)
+{
+  //chunks are aligned on mChunkSize so they match the checkpoints, only
+  // the first and last ones of a run can be shorter
+  uint64_t base = mBegin / mChunkSize + k;
+  uint64_t first = max(mBegin, base * mChunkSize);
+  uint64_t last = min(mEnd, (base + 1) * mChunkSize);
+  bool bDisasm = p->needsDisassembly();
+
+  if (p->needsCPUState())
+  {
+    X86CPUCheckpoint cp;
+    if (getCheckpoint(first, cp) != 0)
+    {
+      return (-1);
+    }
+    p->beginChunk(first, &cp);
+  }
+  else
+  {
+    p->beginChunk(first, NULL);
+  }
+
+  TraceCursorX86 cur(mReader);
+  for (uint64_t n = first; n < last; n++)
+  {
+    TraceEntryViewX86 entry = cur.at(n);
+    if (!p->isInterested(entry))
+    {
+      continue;
+    }
+    entry.decode(insn, bDisasm);
+    //processors return non-zero for the instructions they skip
+    p->processInstruction(n, insn);
+  }
+  return (0);
+}
+
+void* TracePipelineX86::workerThread(void* opaque)
+{
+  ((TracePipelineX86*)opaque)->worker();
+  return (NULL);
+}
+
+void TracePipelineX86::worker()
+{
+  //TRInstructionX86 is too big for the thread stack
+  TRInstructionX86* insn = new TRInstructionX86;
+
+  pthread_mutex_lock(&mLock);
+  for (;;)
+  {
+    //do not get too far ahead of the merge, every pending chunk holds
+    // its results in memory
+    while ((mNextChunk < mNumChunks) && (mNextChunk >= mMerged + 2 * mNumThreads))
+    {
+      pthread_cond_wait(&mFreeCond, &mLock);
+    }
+    if (mNextChunk >= mNumChunks)
+    {
+      break;
+    }
+    size_t k = mNextChunk++;
+    pthread_mutex_unlock(&mLock);
+
+    TraceChunkProcessorX86* p = mProto->create();
+    if (processChunk(k, p, *insn) != 0)
+    {
+      cerr << "Could not process chunk [" << k << "]" << endl;
+    }
+
+    pthread_mutex_lock(&mLock);
+    mResults[k].proc = p;
+    mResults[k].bDone = true;
+    pthread_cond_broadcast(&mDoneCond);
+  }
+  pthread_mutex_unlock(&mLock);
+
+  delete insn;
+}
+
+int TracePipelineX86::run(TraceChunkProcessorX86& proc, uint64_t begin, uint64_t end)
+{
+  if (end > mReader.getInstructionCount())
+  {
+    end = mReader.getInstructionCount();
+  }
+  if (begin >= end)
+  {
+    return (0);
+  }
+
+  //the checkpoints come from a run of their own
+  if (proc.needsCPUState() && mCheckpoints.empty())
+  {
+    string fileName = mReader.getFileName() + ".ckpt";
+    if (loadCheckpoints(fileName) != 0)
+    {
+      if (buildCheckpoints() != 0)
+      {
+        return (-1);
+      }
+      saveCheckpoints(fileName);
+    }
+  }
+
+  mProto = &proc;
+  mBegin = begin;
+  mEnd = end;
+  mNumChunks = (end - 1) / mChunkSize - begin / mChunkSize + 1;
+  mNextChunk = 0;
+  mMerged = 0;
+  mResults.assign(mNumChunks, ChunkResult());
+  for (size_t k = 0; k < mNumChunks; k++)
+  {
+    mResults[k].proc = NULL;
+    mResults[k].bDone = false;
+  }
+
+  pthread_mutex_init(&mLock, NULL);
+  pthread_cond_init(&mDoneCond, NULL);
+  pthread_cond_init(&mFreeCond, NULL);
+
+  vector<pthread_t> threads(mNumThreads);
+  unsigned numStarted = 0;
+  for (unsigned i = 0; i < mNumThreads; i++)
+  {
+    if (pthread_create(&threads[numStarted], NULL, workerThread, this) == 0)
+    {
+      numStarted++;
+    }
+  }
+  if (numStarted == 0)
+  {
+    cerr << "Could not start the pipeline threads" << endl;
+    return (-1);
+  }
+
+  //merge the chunks in order as they complete
+  int ret = 0;
+  for (size_t k = 0; k < mNumChunks; k++)
+  {
+    pthread_mutex_lock(&mLock);
+    while (!mResults[k].bDone)
+    {
+      pthread_cond_wait(&mDoneCond, &mLock);
+    }
+    TraceChunkProcessorX86* p = mResults[k].proc;
+    mResults[k].proc = NULL;
+    pthread_mutex_unlock(&mLock);
+
+    if (proc.merge(*p) != 0)
+    {
+      ret = -1;
+    }
+    delete p;
+
+    pthread_mutex_lock(&mLock);
+    mMerged++;
+    pthread_cond_broadcast(&mFreeCond);
+    pthread_mutex_unlock(&mLock);
+  }
+
+  for (unsigned i = 0; i < numStarted; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_cond_destroy(&mFreeCond);
+  pthread_cond_destroy(&mDoneCond);
+  pthread_mutex_destroy(&mLock);
+  mProto = NULL;
+  return (ret);
+}
+
+//the checkpoints are the merged cpu state of all the chunks that come
+// before. Record it right before each chunk gets merged in
+class CheckpointRecorder : public ChunkedCPUState
+{
+public:
+  CheckpointRecorder(vector<X86CPUCheckpoint>& v) : rCheckpoints(v) {}
+  int merge(TraceChunkProcessorX86& next)
+  {
+    X86CPUCheckpoint cp;
+    getCheckpoint(cp);
+    rCheckpoints.push_back(cp);
+    return (ChunkedCPUState::merge(next));
+  }
+
+protected:
+  vector<X86CPUCheckpoint>& rCheckpoints;
+};
+
+int TracePipelineX86::buildCheckpoints()
+{
+  vector<X86CPUCheckpoint> v;
+  CheckpointRecorder rec(v);
+
+  mCheckpoints.clear();
+  if (run(rec) != 0)
+  {
+    return (-1);
+  }
+  mCheckpoints.swap(v);
+  return (0);
+}
+
+int TracePipelineX86::getCheckpoint(uint64_t n, X86CPUCheckpoint& cp)
+{
+  uint64_t k = n / mChunkSize;
+  if (k >= mCheckpoints.size())
+  {
+    return (-1);
+  }
+  if (n == k * mChunkSize)
+  {
+    cp = mCheckpoints[k];
+    return (0);
+  }
+
+  //replay the instructions between the checkpoint and n
+  ChunkedCPUState cpu;
+  TraceCursorX86 cur(mReader);
+  TRInstructionX86* insn = new TRInstructionX86;
+  cpu.setCheckpoint(mCheckpoints[k]);
+  for (uint64_t i = k * mChunkSize; i < n; i++)
+  {
+    cur.at(i).decode(*insn, false);
+    cpu.processInstruction(i, *insn);
+  }
+  cpu.getCheckpoint(cp);
+  delete insn;
+  return (0);
+}
+
+int TracePipelineX86::loadCheckpoints(const string& fileName)
+{
+  TraceCheckpointHeader ch;
+  FILE* fp = fopen(fileName.c_str(), "rb");
+  if (fp == NULL)
+  {
+    return (-1);
+  }
+
+  int ret = -1;
+  if ((fread(&ch, sizeof(ch), 1, fp) == 1)
+      && (memcmp(ch.magic, TRACE_CHECKPOINT_MAGIC, sizeof(ch.magic)) == 0)
+      && (ch.version == TRACE_CHECKPOINT_VERSION)
+      && (ch.trace_size == mReader.getTraceSize())
+      && (ch.trace_mtime == mReader.getTraceMtime())
+      && (ch.chunk_size == mChunkSize)
+      && (ch.n_checkpoints == (mReader.getInstructionCount() + mChunkSize - 1) / mChunkSize))
+  {
+    mCheckpoints.resize(ch.n_checkpoints);
+    if ((ch.n_checkpoints == 0)
+        || (fread(&mCheckpoints[0], sizeof(X86CPUCheckpoint), ch.n_checkpoints, fp) == ch.n_checkpoints))
+    {
+      ret = 0;
+    }
+    else
+    {
+      mCheckpoints.clear();
+    }
+  }
+  fclose(fp);
+  return (ret);
+}
+
+int TracePipelineX86::saveCheckpoints(const string& fileName)
+{
+  TraceCheckpointHeader ch;
+  memset(&ch, 0, sizeof(ch));
+  memcpy(ch.magic, TRACE_CHECKPOINT_MAGIC, sizeof(ch.magic));
+  ch.version = TRACE_CHECKPOINT_VERSION;
+  ch.trace_size = mReader.getTraceSize();
+  ch.trace_mtime = mReader.getTraceMtime();
+  ch.chunk_size = mChunkSize;
+  ch.n_checkpoints = mCheckpoints.size();
+
+  string tmpFileName = fileName + ".tmp";
+  FILE* fp = fopen(tmpFileName.c_str(), "wb");
+  if (fp == NULL)
+  {
+    return (-1);
+  }
+  bool bOk = (fwrite(&ch, sizeof(ch), 1, fp) == 1)
+             && (mCheckpoints.empty()
+                 || (fwrite(&mCheckpoints[0], sizeof(X86CPUCheckpoint), mCheckpoints.size(), fp) == mCheckpoints.size()));
+  bOk = (fclose(fp) == 0) && bOk;
+  if (!bOk || (rename(tmpFileName.c_str(), fileName.c_str()) != 0))
+  {
+    unlink(tmpFileName.c_str());
+    return (-1);
+  }
+  return (0);
+}
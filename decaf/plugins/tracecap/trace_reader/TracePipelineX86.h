@@ -0,0 +1,119 @@
+/**
+ *  Runs trace processors over a mapped trace in parallel.
+ *
+ *  The trace is split into chunks of consecutive instructions. Every chunk
+ *  is handed to a fresh processor instance on a pool of worker threads, and
+ *  the per-chunk results are merged in trace order by the calling thread.
+ *  Processors that need the register values at the start of their chunk
+ *  get them from checkpoints taken at every chunk boundary, which are
+ *  computed once (in parallel too) and cached next to the trace as
+ *  <trace>.ckpt.
+ */
+#ifndef TRACE_PIPELINE_X86_H
+#define TRACE_PIPELINE_X86_H
+
+#include <inttypes.h>
+#include <vector>
+#include <pthread.h>
+
+#include "TraceReaderMapX86.h"
+#include "X86CPUState.h"
+
+#define TRACE_CHECKPOINT_MAGIC "DECAFCK"
+#define TRACE_CHECKPOINT_VERSION 1
+
+//the register values at some point of the trace. known has the bits of
+// cpu that were actually seen in the trace set
+struct X86CPUCheckpoint
+{
+  X86CPUState cpu;
+  X86CPUState known;
+};
+
+//header of the <trace>.ckpt files, followed by n_checkpoints
+// X86CPUCheckpoints, the i-th one for instruction i * chunk_size
+struct TraceCheckpointHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t trace_size;
+  uint64_t trace_mtime;
+  uint64_t chunk_size;
+  uint64_t n_checkpoints;
+};
+
+//a processor whose results for consecutive parts of a trace can be merged
+class TraceChunkProcessorX86
+{
+public:
+  virtual ~TraceChunkProcessorX86() {}
+
+  //a new, empty instance to process a chunk with
+  virtual TraceChunkProcessorX86* create() = 0;
+
+  //whether processInstruction needs the disassembly, and beginChunk the
+  // register values at the start of the chunk
+  virtual bool needsDisassembly() { return (true); }
+  virtual bool needsCPUState() { return (false); }
+
+  //called before the first instruction of the chunk, cpu is NULL unless
+  // needsCPUState()
+  virtual void beginChunk(uint64_t first, const X86CPUCheckpoint* cpu) {}
+  //cheap filter on the undecoded instruction
+  virtual bool isInterested(const TraceEntryViewX86& entry) { return (true); }
+  virtual int processInstruction(uint64_t n, const TRInstructionX86& insn) = 0;
+
+  //folds in the results of the chunk that directly follows the
+  // instructions processed so far
+  virtual int merge(TraceChunkProcessorX86& next) = 0;
+};
+
+class TracePipelineX86
+{
+public:
+  TracePipelineX86(TraceReaderMapX86& reader, unsigned numThreads, uint64_t chunkSize = DEFAULT_CHUNK_SIZE);
+
+  //processes the instructions [begin, end) and merges the results into
+  // proc, which should be an empty instance
+  int run(TraceChunkProcessorX86& proc, uint64_t begin = 0, uint64_t end = (uint64_t)-1);
+
+  //the register values right before instruction n
+  int getCheckpoint(uint64_t n, X86CPUCheckpoint& cp);
+
+  static const uint64_t DEFAULT_CHUNK_SIZE = 1 << 20;
+
+protected:
+  struct ChunkResult
+  {
+    TraceChunkProcessorX86* proc;
+    bool bDone;
+  };
+
+  static void* workerThread(void* opaque);
+  void worker();
+  int processChunk(size_t k, TraceChunkProcessorX86* p, TRInstructionX86& insn);
+
+  int loadCheckpoints(const std::string& fileName);
+  int buildCheckpoints();
+  int saveCheckpoints(const std::string& fileName);
+
+  TraceReaderMapX86& mReader;
+  unsigned mNumThreads;
+  uint64_t mChunkSize;
+  std::vector<X86CPUCheckpoint> mCheckpoints;
+
+  //state of the current run(), protected by mLock
+  pthread_mutex_t mLock;
+  pthread_cond_t mDoneCond;
+  pthread_cond_t mFreeCond;
+  TraceChunkProcessorX86* mProto;
+  uint64_t mBegin;
+  uint64_t mEnd;
+  size_t mNumChunks;
+  size_t mNextChunk;
+  size_t mMerged;
+  std::vector<ChunkResult> mResults;
+};
+
+#endif//TRACE_PIPELINE_X86_H
@@ -50,6 +50,18 @@ int TraceProcessorX86CPUState::processInstruction(const string& str)
   return (processInstruction(tc.getInsn()));
 }
 
+void TraceProcessorX86CPUState::setRegisters(const TraceRegsRecord& regs)
+{
+  //eax, ecx, edx, ebx, then esp, ebp, esi, edi
+  for (int i = 0; i < 4; i++)
+  {
+    cpu.gen.arr[i] = regs.regs[i];
+    cpu.stk.arr[i] = regs.regs[4 + i];
+  }
+  cpu.eip = regs.eip;
+  cpu.eflags = regs.eflags;
+}
+
 int TraceProcessorX86CPUState::writeRegister(uint32_t addr, uint32_t value, size_t size)
 {
   // general purpose registers
@@ -7,6 +7,7 @@
 #include "TraceProcessorX86.h"
 #include "TraceConverterX86.h"
 #include "X86CPUState.h"
+#include "../trace_records.h"
 
 class TraceProcessorX86CPUState : public TraceProcessorX86
 {
@@ -20,6 +21,9 @@ public:
   int writeRegister(uint32_t addr, uint32_t value, size_t size);
 
   const X86CPUState& getCPUState() { return (cpu); }
+  void setCPUState(const X86CPUState& newCPU) { cpu = newCPU; }
+  //picks the state up again from the registers of a taint-sparse trace
+  void setRegisters(const TraceRegsRecord& regs);
 
 private:
   TraceConverterX86 tc;
@@ -0,0 +1,156 @@
+/**
+ *  Versions of the trace processors that can run in a TracePipelineX86.
+ */
+#include "TraceProcessorX86Chunked.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+//dst takes the bytes of src that are known
+static void overlayRegs(uint32_t* dst, uint32_t* dstKnown, const uint32_t* src, const uint32_t* srcKnown, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    dst[i] = (dst[i] & ~srcKnown[i]) | (src[i] & srcKnown[i]);
+    dstKnown[i] |= srcKnown[i];
+  }
+}
+
+ChunkedCPUState::ChunkedCPUState()
+{
+  X86CPUState empty;
+  memset(&empty, 0, sizeof(empty));
+  cpu.setCPUState(empty);
+  known.setCPUState(empty);
+}
+
+int ChunkedCPUState::processInstruction(uint64_t n, const TRInstructionX86& insn)
+{
+  cpu.processInstruction(insn);
+
+  //the same registers as TraceProcessorX86CPUState::processInstruction
+  for (int i = 0; (i < MAX_NUM_OPERANDS) && (insn.eh.operand[i].type != TNone); i++)
+  {
+    if (insn.eh.operand[i].type == TRegister)
+    {
+      known.writeRegister(insn.eh.operand[i].addr, 0xFFFFFFFF, insn.eh.operand[i].length);
+    }
+  }
+  return (0);
+}
+
+void ChunkedCPUState::setCheckpoint(const X86CPUCheckpoint& cp)
+{
+  cpu.setCPUState(cp.cpu);
+  known.setCPUState(cp.known);
+}
+
+void ChunkedCPUState::getCheckpoint(X86CPUCheckpoint& cp)
+{
+  cp.cpu = cpu.getCPUState();
+  cp.known = known.getCPUState();
+}
+
+int ChunkedCPUState::merge(TraceChunkProcessorX86& next)
+{
+  X86CPUCheckpoint a;
+  X86CPUCheckpoint b;
+
+  getCheckpoint(a);
+  ((ChunkedCPUState&)next).getCheckpoint(b);
+  overlayRegs(a.cpu.gen.arr, a.known.gen.arr, b.cpu.gen.arr, b.known.gen.arr, 4);
+  overlayRegs(a.cpu.stk.arr, a.known.stk.arr, b.cpu.stk.arr, b.known.stk.arr, 4);
+  overlayRegs(a.cpu.segregs.arr, a.known.segregs.arr, b.cpu.segregs.arr, b.known.segregs.arr, 6);
+  setCheckpoint(a);
+  return (0);
+}
+
+bool ChunkedTaintSummary::isInterested(const TraceEntryViewX86& entry)
+{
+  TraceOperandViewX86 op = entry.firstOperand();
+  for (int i = 0; i < entry.numOperands(); i++, op = op.next())
+  {
+    if (op.isTainted())
+    {
+      return (true);
+    }
+  }
+  return (false);
+}
+
+int ChunkedTaintSummary::processInstruction(uint64_t n, const TRInstructionX86& insn)
+{
+  ts.setInstructionCount(n);
+  int ret = ts.processInstruction(insn);
+  result.append(ts.getResult());
+  return (ret);
+}
+
+int ChunkedTaintSummary::merge(TraceChunkProcessorX86& next)
+{
+  const string& s = ((ChunkedTaintSummary&)next).result;
+  if (pOut != NULL)
+  {
+    *pOut << s;
+  }
+  else
+  {
+    result.append(s);
+  }
+  return (0);
+}
+
+int ChunkedFunctions::processInstruction(uint64_t n, const TRInstructionX86& insn)
+{
+  if (fp.processInstruction(insn) != 0)
+  {
+    return (-1);
+  }
+  counts[fp.getResult()]++;
+  return (0);
+}
+
+int ChunkedFunctions::merge(TraceChunkProcessorX86& next)
+{
+  const map<string, uint64_t>& c = ((ChunkedFunctions&)next).counts;
+  for (map<string, uint64_t>::const_iterator it = c.begin(); it != c.end(); it++)
+  {
+    counts[it->first] += it->second;
+  }
+  return (0);
+}
+
+int ChunkedMemory::merge(TraceChunkProcessorX86& next)
+{
+  mp.merge(((ChunkedMemory&)next).mp);
+  return (0);
+}
+
+int ChunkedSyscallsLinux::processInstruction(uint64_t n, const TRInstructionX86& insn)
+{
+  //the system call number is in eax before the int 0x80 executes
+  int ret = ip.processInstruction(insn, cpu.getCPUState());
+  if (ret == 0)
+  {
+    char tempStr[128];
+    snprintf(tempStr, 127, "SYSCALL: (%llu) %08x : %s\n", (unsigned long long)n + 1, insn.eh.address, ip.getResult().c_str());
+    result.append(tempStr);
+  }
+  cpu.processInstruction(insn);
+  return (ret);
+}
+
+int ChunkedSyscallsLinux::merge(TraceChunkProcessorX86& next)
+{
+  const string& s = ((ChunkedSyscallsLinux&)next).result;
+  if (pOut != NULL)
+  {
+    *pOut << s;
+  }
+  else
+  {
+    result.append(s);
+  }
+  return (0);
+}
@@ -0,0 +1,109 @@
+/**
+ *  Versions of the trace processors that can run in a TracePipelineX86.
+ *  Each one wraps the regular processor and knows how to merge the results
+ *  of consecutive chunks.
+ */
+#ifndef TRACEPROCESSORX86CHUNKED_H
+#define TRACEPROCESSORX86CHUNKED_H
+
+#include <map>
+#include <ostream>
+#include <string>
+
+#include "TracePipelineX86.h"
+#include "TraceProcessorX86CPUState.h"
+#include "TraceProcessorX86Functions.h"
+#include "TraceProcessorX86InterruptLinux.h"
+#include "TraceProcessorX86Memory.h"
+#include "TraceProcessorX86TaintSummary.h"
+
+//register values seen in the trace. The merged result is the state at the
+// end of the processed range, as far as it is known
+class ChunkedCPUState : public TraceChunkProcessorX86
+{
+public:
+  ChunkedCPUState();
+  TraceChunkProcessorX86* create() { return (new ChunkedCPUState()); }
+  bool needsDisassembly() { return (false); }
+  int processInstruction(uint64_t n, const TRInstructionX86& insn);
+  int merge(TraceChunkProcessorX86& next);
+
+  void setCheckpoint(const X86CPUCheckpoint& cp);
+  void getCheckpoint(X86CPUCheckpoint& cp);
+
+protected:
+  TraceProcessorX86CPUState cpu;
+  TraceProcessorX86CPUState known;
+};
+
+//the TAINT: lines of TraceProcessorX86TaintSummary. The merged lines are
+// written to out if there is one
+class ChunkedTaintSummary : public TraceChunkProcessorX86
+{
+public:
+  ChunkedTaintSummary(std::ostream* out = NULL) : ts(true), pOut(out) {}
+  TraceChunkProcessorX86* create() { return (new ChunkedTaintSummary()); }
+  bool needsDisassembly() { return (false); }
+  bool isInterested(const TraceEntryViewX86& entry);
+  int processInstruction(uint64_t n, const TRInstructionX86& insn);
+  int merge(TraceChunkProcessorX86& next);
+  const std::string& getResult() { return (result); }
+
+protected:
+  TraceProcessorX86TaintSummary ts;
+  std::string result;
+  std::ostream* pOut;
+};
+
+//how many times each function of the symbol map is called or jumped to
+class ChunkedFunctions : public TraceChunkProcessorX86
+{
+public:
+  //sm is shared by all the chunks and must not change during the run
+  ChunkedFunctions(SymbolMap& sm) : fp(sm), rSM(sm) {}
+  TraceChunkProcessorX86* create() { return (new ChunkedFunctions(rSM)); }
+  int processInstruction(uint64_t n, const TRInstructionX86& insn);
+  int merge(TraceChunkProcessorX86& next);
+  const std::map<std::string, uint64_t>& getCounts() { return (counts); }
+
+protected:
+  TraceProcessorX86Functions fp;
+  SymbolMap& rSM;
+  std::map<std::string, uint64_t> counts;
+};
+
+//the memory rebuilt from the trace
+class ChunkedMemory : public TraceChunkProcessorX86
+{
+public:
+  TraceChunkProcessorX86* create() { return (new ChunkedMemory()); }
+  bool needsDisassembly() { return (false); }
+  int processInstruction(uint64_t n, const TRInstructionX86& insn) { return (mp.processInstruction(insn)); }
+  int merge(TraceChunkProcessorX86& next);
+  MemoryBuilder& getMemory() { return (mp); }
+
+protected:
+  TraceProcessorX86Memory mp;
+};
+
+//the linux system calls made with int 0x80, named from the value of eax.
+// The merged lines are written to out if there is one
+class ChunkedSyscallsLinux : public TraceChunkProcessorX86
+{
+public:
+  ChunkedSyscallsLinux(std::ostream* out = NULL) : pOut(out) {}
+  TraceChunkProcessorX86* create() { return (new ChunkedSyscallsLinux()); }
+  bool needsCPUState() { return (true); }
+  void beginChunk(uint64_t first, const X86CPUCheckpoint* cp) { cpu.setCPUState(cp->cpu); }
+  int processInstruction(uint64_t n, const TRInstructionX86& insn);
+  int merge(TraceChunkProcessorX86& next);
+  const std::string& getResult() { return (result); }
+
+protected:
+  TraceProcessorX86CPUState cpu;
+  TraceProcessorX86InterruptLinux ip;
+  std::string result;
+  std::ostream* pOut;
+};
+
+#endif//TRACEPROCESSORX86CHUNKED_H
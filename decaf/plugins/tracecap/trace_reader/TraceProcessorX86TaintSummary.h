@@ -30,6 +30,8 @@ public:
   bool isInterested(const std::string& s) { return (false); }
   bool isInterested(const TRInstructionX86& insn) { return (true); }
   const std::string& getResult() { return (prResult); }
+  //number of instructions processed so far, used to label the results
+  void setInstructionCount(uint32_t n) { prNumInsns = n; }
 
 private:
   bool isSameRegister(uint32_t regnum1, uint32_t regnum2);
@@ -10,6 +10,7 @@
 #include <list>
 #include <sstream>
 #include <assert.h>
+#include <zlib.h>
 
 using namespace std;
 
@@ -47,6 +48,13 @@ TraceReaderBinX86::TraceReaderBinX86()
   bCout = false;
   mbConvertString = true;
   mbVerbose = true;
+  mbCompressed = false;
+  mCurChunk = 0;
+  mNextInsn = 0;
+  mTotalInsns = 0;
+  mbRecords = false;
+  mbInLoop = false;
+  mbRegs = false;
 }
 
 TraceReaderBinX86::~TraceReaderBinX86()
@@ -86,6 +94,25 @@ int TraceReaderBinX86::init(string inFileName, string outFileName)
     }
   }
 
+  //compressed traces start with a container header, followed by the
+  // same headers as a plain trace
+  TraceContainerHeader tzh;
+  ifs.read((char*)(&tzh), sizeof(tzh));
+  if (ifs.good() && (memcmp(tzh.magic, TRACE_CONTAINER_MAGIC, sizeof(tzh.magic)) == 0))
+  {
+    if (tzh.version != TRACE_CONTAINER_VERSION)
+    {
+      cerr << "Unsupported compressed trace version [" << tzh.version << "]" << endl;
+      return (-1);
+    }
+    mbCompressed = true;
+  }
+  else
+  {
+    ifs.clear();
+    ifs.seekg(0);
+  }
+
   //read the first couple of headers
   ifs.read((char*)(&tch), sizeof(tch));
   if (!ifs.good())
@@ -94,11 +121,18 @@ int TraceReaderBinX86::init(string inFileName, string outFileName)
     return (-1);
   }
 
-  if (tch.version != 0x33) //if the version is not 51
+  //version 52 is version 51 with loop and block records
+  if ((tch.version != 0x33) && (tch.version != TRACE_RECORDS_VERSION))
   {
-    cerr << "The version number is incorrect. Looking for 0x33 or 50" << endl;
+    cerr << "The version number is incorrect. Looking for 0x33 or 0x34" << endl;
     return (-1);
   }
+  mbRecords = (tch.version == TRACE_RECORDS_VERSION);
+  //only block traces have a block table
+  if (mbRecords && (mBlockTable.load(inFileName + ".blocks") == 0))
+  {
+    mLoop.setBlockTable(&mBlockTable);
+  }
  
   ifs.read((char*)(&psr), sizeof(psr));
   if (!ifs.good())
@@ -123,10 +157,234 @@ int TraceReaderBinX86::init(string inFileName, string outFileName)
   }
 
   init_status = ifs.tellg();
+
+  if (mbCompressed)
+  {
+    if (readContainerIndex(sizeof(tzh) + tzh.tables_len) != 0)
+    {
+      return (-1);
+    }
+    if (!mChunkIndex.empty() && (loadChunk(0) != 0))
+    {
+      return (-1);
+    }
+  }
+
   bReady = true;
   return (0);
 }
 
+int TraceReaderBinX86::readContainerIndex(uint64_t tablesEnd)
+{
+  TraceContainerFooter tf;
+
+  mChunkIndex.clear();
+  mTotalInsns = 0;
+
+  //the footer points to the chunk index
+  ifs.seekg(0, ifstream::end);
+  uint64_t fileSize = ifs.tellg();
+  if (fileSize >= tablesEnd + sizeof(tf))
+  {
+    ifs.seekg(fileSize - sizeof(tf));
+    ifs.read((char*)(&tf), sizeof(tf));
+    if (ifs.good() && (memcmp(tf.magic, TRACE_CONTAINER_MAGIC, sizeof(tf.magic)) == 0)
+        && (tf.index_offset + (uint64_t)tf.n_chunks * sizeof(TraceChunkIndex) + sizeof(tf) == fileSize))
+    {
+      mChunkIndex.resize(tf.n_chunks);
+      if (tf.n_chunks > 0)
+      {
+        ifs.seekg(tf.index_offset);
+        ifs.read((char*)(&mChunkIndex[0]), tf.n_chunks * sizeof(TraceChunkIndex));
+        if (!ifs.good())
+        {
+          cerr << "Could not read the chunk index" << endl;
+          return (-1);
+        }
+      }
+      mTotalInsns = tf.n_insns;
+      return (0);
+    }
+  }
+
+  //no footer, the trace was not closed properly. Rebuild the index from
+  // the chunk headers
+  cerr << "No chunk index found, scanning the chunks" << endl;
+  ifs.clear();
+  uint64_t offset = tablesEnd;
+  while (offset + sizeof(TraceChunkHeader) <= fileSize)
+  {
+    TraceChunkHeader ch;
+    ifs.seekg(offset);
+    ifs.read((char*)(&ch), sizeof(ch));
+    if (!ifs.good() || (ch.magic != TRACE_CHUNK_MAGIC)
+        || (offset + sizeof(ch) + ch.comp_len > fileSize))
+    {
+      break;
+    }
+
+    TraceChunkIndex ci;
+    memset(&ci, 0, sizeof(ci));
+    ci.offset = offset;
+    ci.first_insn = ch.first_insn;
+    ci.n_insns = ch.n_insns;
+    ci.min_eip = ch.min_eip;
+    ci.max_eip = ch.max_eip;
+    ci.comp_len = ch.comp_len;
+    ci.raw_len = ch.raw_len;
+    mChunkIndex.push_back(ci);
+    mTotalInsns = ch.first_insn + ch.n_insns;
+
+    offset += sizeof(ch) + ch.comp_len;
+  }
+  ifs.clear();
+  return (0);
+}
+
+int TraceReaderBinX86::loadChunk(size_t n)
+{
+  if (n >= mChunkIndex.size())
+  {
+    return (-1);
+  }
+
+  const TraceChunkIndex& ci = mChunkIndex[n];
+  TraceChunkHeader ch;
+
+  ifs.clear();
+  ifs.seekg(ci.offset);
+  ifs.read((char*)(&ch), sizeof(ch));
+  if (!ifs.good() || (ch.magic != TRACE_CHUNK_MAGIC) || (ch.comp_len != ci.comp_len))
+  {
+    cerr << "Bad chunk header at offset [" << ci.offset << "]" << endl;
+    return (-1);
+  }
+
+  vector<char> comp(ch.comp_len);
+  ifs.read(&comp[0], ch.comp_len);
+  if (!ifs.good())
+  {
+    cerr << "Couldn't read chunk. Only [" << ifs.gcount() << "] bytes of [" << ch.comp_len << "] read" << endl;
+    return (-1);
+  }
+
+  string raw(ch.raw_len, '\0');
+  uLongf rawLen = ch.raw_len;
+  if ((uncompress((Bytef*)(&raw[0]), &rawLen, (const Bytef*)(&comp[0]), ch.comp_len) != Z_OK)
+      || (rawLen != ch.raw_len))
+  {
+    cerr << "Couldn't decompress the chunk at offset [" << ci.offset << "]" << endl;
+    return (-1);
+  }
+
+  mChunkStream.str(raw);
+  mChunkStream.clear();
+  mbInLoop = false;
+  mCurChunk = n;
+  mNextInsn = ci.first_insn;
+  return (0);
+}
+
+int TraceReaderBinX86::seekToInstruction(uint64_t n)
+{
+  if (!bReady || !mbCompressed)
+  {
+    return (-1);
+  }
+
+  //find the last chunk that starts at or before n
+  size_t lo = 0;
+  size_t hi = mChunkIndex.size();
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (mChunkIndex[mid].first_insn <= n)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  if ((lo == 0) || (n >= mChunkIndex[lo - 1].first_insn + mChunkIndex[lo - 1].n_insns))
+  {
+    return (-1);
+  }
+  if (loadChunk(lo - 1) != 0)
+  {
+    return (-1);
+  }
+
+  //skip over the instructions before n without converting them
+  bool bConvert = mbConvertString;
+  mbConvertString = false;
+  while (mNextInsn < n)
+  {
+    if (readNextInstruction() != 0)
+    {
+      mbConvertString = bConvert;
+      return (-1);
+    }
+  }
+  mbConvertString = bConvert;
+  return (0);
+}
+
+int TraceReaderBinX86::seekToEIP(uint32_t eip)
+{
+  if (!bReady || !mbCompressed || mChunkIndex.empty())
+  {
+    return (-1);
+  }
+
+  bool bConvert = mbConvertString;
+  bool bScan = (eip >= mChunkIndex[mCurChunk].min_eip) && (eip <= mChunkIndex[mCurChunk].max_eip);
+  int ret = -1;
+
+  mbConvertString = false;
+  for (;;)
+  {
+    //only decompress the chunks whose address range covers eip
+    if (!bScan || (!mbInLoop && (mChunkStream.peek() == EOF)))
+    {
+      size_t n = mCurChunk + 1;
+      while ((n < mChunkIndex.size())
+             && ((eip < mChunkIndex[n].min_eip) || (eip > mChunkIndex[n].max_eip)))
+      {
+        n++;
+      }
+      if ((n >= mChunkIndex.size()) || (loadChunk(n) != 0))
+      {
+        break;
+      }
+      bScan = true;
+    }
+
+    //peek at the address of the next instruction
+    if (nextEntry() != 0)
+    {
+      break;
+    }
+    streampos pos = in().tellg();
+    uint32_t address = 0;
+    in().read((char*)(&address), sizeof(address));
+    in().clear();
+    in().seekg(pos);
+    if (address == eip)
+    {
+      ret = 0;
+      break;
+    }
+    if (readNextInstruction() != 0)
+    {
+      break;
+    }
+  }
+  mbConvertString = bConvert;
+  return (ret);
+}
+
 
 
 int TraceReaderBinX86::seekTo(streampos loc)
@@ -146,10 +404,93 @@ int TraceReaderBinX86::reset()
   {
     return (-1);
   }
+  mbInLoop = false;
+  if (mbCompressed)
+  {
+    return (mChunkIndex.empty() ? 0 : loadChunk(0));
+  }
   ifs.seekg(init_status);
   return (0);
 }
 
+int TraceReaderBinX86::nextEntry()
+{
+  for (;;)
+  {
+    if (mbInLoop)
+    {
+      if (mLoopStream.peek() != EOF)
+      {
+        return (0);
+      }
+      mbInLoop = false;
+      if (!mLoop.done())
+      {
+        string iter;
+        if (mLoop.nextIteration(iter) != 0)
+        {
+          return (-1);
+        }
+        mLoopStream.str(iter);
+        mLoopStream.clear();
+        mbInLoop = true;
+        continue;
+      }
+    }
+
+    //compressed traces continue with the next chunk, chunks always start
+    // with a new instruction
+    if (mbCompressed && (mChunkStream.peek() == EOF))
+    {
+      if (loadChunk(mCurChunk + 1) != 0)
+      {
+        return (-1);
+      }
+    }
+    if (!mbRecords)
+    {
+      return (0);
+    }
+
+    //records have 0 where instructions have their size
+    TraceRecordHeader rh;
+    streampos pos = in().tellg();
+    in().read((char*)(&rh), sizeof(rh));
+    if (!in().good() || (rh.zero != 0))
+    {
+      in().clear();
+      in().seekg(pos);
+      return (0);
+    }
+
+    vector<char> payload(rh.len + 1);
+    in().read(&payload[0], rh.len);
+    if (!in().good())
+    {
+      cerr << "Couldn't read trace record. Only [" << in().gcount() << "] bytes of [" << rh.len << "] read" << endl;
+      return (-1);
+    }
+    if (rh.type == TRACE_RECORD_REGS)
+    {
+      if (rh.len != sizeof(mRegs))
+      {
+        cerr << "Bad registers record of [" << rh.len << "] bytes" << endl;
+        return (-1);
+      }
+      memcpy(&mRegs, &payload[0], sizeof(mRegs));
+      mbRegs = true;
+      continue;
+    }
+    if (mLoop.init(rh, &payload[0], rh.len) != 0)
+    {
+      return (-1);
+    }
+    mLoopStream.str("");
+    mLoopStream.clear();
+    mbInLoop = true;
+  }
+}
+
 int TraceReaderBinX86::readNextInstruction()
 {
   TRInstructionX86 insn;
@@ -163,30 +504,36 @@ int TraceReaderBinX86::readNextInstruction()
     return (-1);
   }
 
+  mbRegs = false;
+  if (nextEntry() != 0)
+  {
+    return (-1);
+  }
+
   //LOK: Added a line to keep track of the version number
   insn.version = 0x33;//51HU
 
 #ifndef LOK
-  ifs.read((char*)(&(insn.eh)), ENTRY_HEADER_FIXED_SIZE);
+  in().read((char*)(&(insn.eh)), ENTRY_HEADER_FIXED_SIZE);
 #else
-  ifs.read((char*)(&(insn.eh.address)), sizeof(insn.eh.address));
-  ifs.read((char*)(&(insn.eh.tid)), sizeof(insn.eh.tid));
-  ifs.read((char*)(&(insn.eh.inst_size)), sizeof(insn.eh.inst_size));
-  ifs.read((char*)(&(insn.eh.num_operands)), sizeof(insn.eh.num_operands));
-  ifs.read((char*)(&(insn.eh.tp)), sizeof(insn.eh.tp));
-  ifs.read((char*)(&(insn.eh.eflags)), sizeof(insn.eh.eflags));
-  ifs.read((char*)(&(insn.eh.cc_op)), sizeof(insn.eh.cc_op));
-  ifs.read((char*)(&(insn.eh.df)), sizeof(insn.eh.df));
+  in().read((char*)(&(insn.eh.address)), sizeof(insn.eh.address));
+  in().read((char*)(&(insn.eh.tid)), sizeof(insn.eh.tid));
+  in().read((char*)(&(insn.eh.inst_size)), sizeof(insn.eh.inst_size));
+  in().read((char*)(&(insn.eh.num_operands)), sizeof(insn.eh.num_operands));
+  in().read((char*)(&(insn.eh.tp)), sizeof(insn.eh.tp));
+  in().read((char*)(&(insn.eh.eflags)), sizeof(insn.eh.eflags));
+  in().read((char*)(&(insn.eh.cc_op)), sizeof(insn.eh.cc_op));
+  in().read((char*)(&(insn.eh.df)), sizeof(insn.eh.df));
 #endif 
   //if its the end of the file, then we are done
-  if (ifs.eof())
+  if (in().eof())
   {
     return (-1);
   }
 
-  if (!ifs.good())
+  if (!in().good())
   {
-    cerr << "Couln't read entry header. Only [" << ifs.gcount() << "] bytes of [" << ENTRY_HEADER_FIXED_SIZE << "] read" << endl;
+    cerr << "Couln't read entry header. Only [" << in().gcount() << "] bytes of [" << ENTRY_HEADER_FIXED_SIZE << "] read" << endl;
     return (-1);
   }
 
@@ -197,10 +544,10 @@ int TraceReaderBinX86::readNextInstruction()
     return (-1);
   }
 
-  ifs.read(insn.eh.rawbytes, insn.eh.inst_size);
-  if (!ifs.good())
+  in().read(insn.eh.rawbytes, insn.eh.inst_size);
+  if (!in().good())
   {
-    cerr << "Couln't read rawbytes. Only [" << ifs.gcount() << "] bytes of [" << insn.eh.inst_size << "] read" << endl;
+    cerr << "Couln't read rawbytes. Only [" << in().gcount() << "] bytes of [" << insn.eh.inst_size << "] read" << endl;
     return (-1);
   }
 
@@ -279,6 +626,7 @@ if (insn.eh.memregs[i][j].type == TRegister && insn.eh.memregs[i][j].addr == esp
   {
     insn.eh.operand[i].type = TNone;
   }
+  mNextInsn++;
 
 
   //disassemble the instruction
@@ -322,31 +670,31 @@ int TraceReaderBinX86::readOperand(OperandVal& op)
   op.usage = unknown;
 
 #ifndef LOK
-  ifs.read((char*)(&op), OPERAND_VAL_FIXED_SIZE);
+  in().read((char*)(&op), OPERAND_VAL_FIXED_SIZE);
 #else
-  ifs.read((char*)(&op.access), sizeof(op.access));
-  ifs.read((char*)(&op.length), sizeof(op.length));
-  //ifs.read((char*)(&op.tainted_begin), 6);
-  ifs.read((char*)(&op.tainted_begin), sizeof(op.tainted_begin));
-  ifs.read((char*)(&op.tainted_end), sizeof(op.tainted_end));
-  ifs.read((char*)(&op.addr), sizeof(op.addr));
-  ifs.read((char*)(&op.value), sizeof(op.value));
+  in().read((char*)(&op.access), sizeof(op.access));
+  in().read((char*)(&op.length), sizeof(op.length));
+  //in().read((char*)(&op.tainted_begin), 6);
+  in().read((char*)(&op.tainted_begin), sizeof(op.tainted_begin));
+  in().read((char*)(&op.tainted_end), sizeof(op.tainted_end));
+  in().read((char*)(&op.addr), sizeof(op.addr));
+  in().read((char*)(&op.value), sizeof(op.value));
 #endif
-  if (!ifs.good())
+  if (!in().good())
   {
-    cerr << "Error reading operand. [" << ifs.gcount() << "] of [" << OPERAND_VAL_FIXED_SIZE << "] bytes read" << endl;
+    cerr << "Error reading operand. [" << in().gcount() << "] of [" << OPERAND_VAL_FIXED_SIZE << "] bytes read" << endl;
     return(-1);
   }
 
-  ifs.read((char*)(&(op.type)), 1);
-  if (!ifs.good())
+  in().read((char*)(&(op.type)), 1);
+  if (!in().good())
   {
     cerr << "Error reading operand type" << endl;
     return (-1);
   }
 
-  ifs.read((char*)(&(op.usage)), 1);
-  if (!ifs.good())
+  in().read((char*)(&(op.usage)), 1);
+  if (!in().good())
   {
     cerr << "Error reading operand usage" << endl;
     return (-1);
@@ -367,17 +715,17 @@ int TraceReaderBinX86::readOperand(OperandVal& op)
     }
     //read in the records data structure
 #ifndef LOK
-    ifs.read((char*)(&(op.records[i])), TAINT_RECORD_FIXED_SIZE);
-    if (!ifs.good())
+    in().read((char*)(&(op.records[i])), TAINT_RECORD_FIXED_SIZE);
+    if (!in().good())
     {
-      cerr << "Error reading taint record. [" << ifs.gcount() << "] of [" << TAINT_RECORD_FIXED_SIZE << "] bytes read" << endl;
+      cerr << "Error reading taint record. [" << in().gcount() << "] of [" << TAINT_RECORD_FIXED_SIZE << "] bytes read" << endl;
       return (-1);
     }
 #else
-    ifs.read((char*)(&(op.records[i].numRecords)), sizeof(op.records[i].numRecords));
-    if (!ifs.good())
+    in().read((char*)(&(op.records[i].numRecords)), sizeof(op.records[i].numRecords));
+    if (!in().good())
     {
-      cerr << "Error reading taint record. [" << ifs.gcount() << "] of [" << TAINT_RECORD_FIXED_SIZE << "] bytes read" << endl;
+      cerr << "Error reading taint record. [" << in().gcount() << "] of [" << TAINT_RECORD_FIXED_SIZE << "] bytes read" << endl;
       return (-1);
     }
 
@@ -389,10 +737,10 @@ int TraceReaderBinX86::readOperand(OperandVal& op)
       return (-1);
     }
 
-    ifs.read((char*)(&(op.records[i].taintBytes)), sizeof(TaintByteRecord) * op.records[i].numRecords);
-    if (!ifs.good())
+    in().read((char*)(&(op.records[i].taintBytes)), sizeof(TaintByteRecord) * op.records[i].numRecords);
+    if (!in().good())
     {
-      cerr << "Error reading taintbyte record. [" << ifs.gcount() << "] of [" << sizeof(TaintByteRecord) * op.records[i].numRecords << "] bytes read" << endl;
+      cerr << "Error reading taintbyte record. [" << in().gcount() << "] of [" << sizeof(TaintByteRecord) * op.records[i].numRecords << "] bytes read" << endl;
       return (-1);
     }
   }
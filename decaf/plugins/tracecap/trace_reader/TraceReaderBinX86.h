@@ -6,7 +6,9 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 //#include "trace_x86.h"
 //#include "libdasm/libdasm.h"
@@ -15,6 +17,8 @@
 #include "TraceReader.h"
 #include "TRInstructionX86.h"
 #include "TraceConverterX86.h"
+#include "TraceLoopExpanderX86.h"
+#include "../trace_container.h"
 
 
 class TraceReaderBinX86 : public TraceReader
@@ -36,12 +40,23 @@ public:
   // and automatically turns it into a string
   int readNextInstruction();
 
+  //compressed traces only (see trace_container.h): position the reader so
+  // that the next instruction read is the n-th instruction of the trace,
+  // or the next one at address eip
+  int seekToInstruction(uint64_t n);
+  int seekToEIP(uint32_t eip);
+  bool isCompressed() { return (mbCompressed); }
+  uint64_t getInstructionCount() { return (mTotalInsns); }
+
   void disableStringConversion() { mbConvertString = false; }
   void enableStringConversion() { mbConvertString = true; }
   //insn_t getInstructionType();
 
   //a bunch of getters
   const TRInstructionX86& getCurInstruction() {return (mCurInsn);}
+  //taint-sparse traces: the registers from right before the current
+  // instruction, or NULL if the trace has none there
+  const TraceRegsRecord* getRegisters() { return (mbRegs ? &mRegs : NULL); }
   const TraceHeader& getTraceHeader() { return (tch); }
   const ProcessRecord& getProcessRecord() { return (psr); }
   const std::string& getInsnString() { if (!mbConvertString) {TraceConverterX86::convert(mCurStrInsn, mCurInsn, mbVerbose);} return (mCurStrInsn); }
@@ -67,6 +82,14 @@ protected:
   int readHeader();
   //helper for finding the next valid entry from the current file location
   int seekNextEntry();
+  //compressed traces: read the chunk index and decompress chunks
+  int readContainerIndex(uint64_t tablesEnd);
+  int loadChunk(size_t n);
+  //moves on to the next chunk and expands the loop and block records (see
+  // ../trace_records.h) so that in() is at the next instruction
+  int nextEntry();
+  //the stream instructions are read from
+  std::istream& in() { if (mbInLoop) return (mLoopStream); if (mbCompressed) return (mChunkStream); return (ifs); }
 
   bool bReady;
   bool bCout;
@@ -83,6 +106,22 @@ protected:
 
   std::ifstream::streampos init_status;
 
+  bool mbCompressed;
+  std::vector<TraceChunkIndex> mChunkIndex;
+  size_t mCurChunk;
+  std::istringstream mChunkStream;
+  uint64_t mNextInsn;
+  uint64_t mTotalInsns;
+
+  //version 52 traces: the loop or blocks being expanded
+  bool mbRecords;
+  bool mbInLoop;
+  TraceLoopExpanderX86 mLoop;
+  std::istringstream mLoopStream;
+  TraceBlockTableX86 mBlockTable;
+  bool mbRegs;
+  TraceRegsRecord mRegs;
+
   int historySize;
   History<TRInstructionX86> iHistory;
   History<std::string> sHistory;
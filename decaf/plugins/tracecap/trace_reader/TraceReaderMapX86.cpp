@@ -0,0 +1,926 @@
+/**
+ *  Memory mapped reader for version 51 and 52 traces.
+ */
+#include "TraceReaderMapX86.h"
+#include "TraceLoopExpanderX86.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "../trace_container.h"
+
+using namespace std;
+
+size_t TraceOperandViewX86::size() const
+{
+  size_t off = FIXED_SIZE;
+  uint64_t taint = taintedBegin();
+  for (int i = 0; i < length(); i++)
+  {
+    if ((taint & (1 << i)) != 0)
+    {
+      off += 1 + sizeof(TaintByteRecord) * (uint8_t)p[off];
+    }
+  }
+  return (off);
+}
+
+void TraceOperandViewX86::decode(OperandVal& op) const
+{
+  op.access = access();
+  op.length = length();
+  op.tainted_begin = taintedBegin();
+  op.tainted_end = taintedEnd();
+  op.addr = addr();
+  op.value = value();
+  op.type = type();
+  op.usage = usage();
+
+  const char* q = p + FIXED_SIZE;
+  for (int i = 0; i < op.length; i++)
+  {
+    if ((op.tainted_begin & (1 << i)) == 0)
+    {
+      continue;
+    }
+    op.records[i].numRecords = (uint8_t)*q++;
+    memcpy(op.records[i].taintBytes, q, sizeof(TaintByteRecord) * op.records[i].numRecords);
+    q += sizeof(TaintByteRecord) * op.records[i].numRecords;
+  }
+}
+
+int TraceEntryViewX86::decode(TRInstructionX86& insn, bool bDisasm) const
+{
+  int i = 0;
+  int j = 0;
+  int count = 0;
+  int num = numOperands();
+  TraceOperandViewX86 op = firstOperand();
+
+  insn.version = 0x33;
+  memcpy(&(insn.eh), p, ENTRY_HEADER_FIXED_SIZE);
+  memcpy(insn.eh.rawbytes, rawbytes(), instSize());
+
+  //regroup the memregs with their memory operand, exactly like
+  // TraceReaderBinX86::readNextInstruction
+  for (i = 0, j = 0; i < MAX_NUM_OPERANDS && count < num; i++)
+  {
+    op.decode(insn.eh.operand[i]);
+    op = op.next();
+    count++;
+    again:
+    if (insn.eh.operand[i].type != TMemLoc && insn.eh.operand[i].type != TMemAddress)
+    {
+      insn.eh.memregs[i][0].type = TNone;
+      continue;
+    }
+
+    for (j = 0; j < MAX_NUM_MEMREGS && count < num; j++)
+    {
+      op.decode(insn.eh.memregs[i][j]);
+      op = op.next();
+      count++;
+
+      if (insn.eh.memregs[i][j].usage > 2)
+      {
+        continue;
+      }
+      i++;
+      if (i < MAX_NUM_OPERANDS && (count - 1) < num)
+      {
+        insn.eh.operand[i] = insn.eh.memregs[i - 1][j];
+        insn.eh.memregs[i - 1][j].type = TNone;
+        goto again;
+      }
+    }
+
+    if (j < MAX_NUM_MEMREGS)
+    {
+      insn.eh.memregs[i][j].type = TNone;
+    }
+  }
+
+  if (i < MAX_NUM_OPERANDS)
+  {
+    insn.eh.operand[i].type = TNone;
+  }
+
+  if (bDisasm)
+  {
+    get_instruction(&(insn.insn), (uint8_t*)(insn.eh.rawbytes), MODE_32);
+  }
+  return (0);
+}
+
+size_t TraceEntryViewX86::parse(const char* p, size_t avail)
+{
+  if (avail < ENTRY_HEADER_FIXED_SIZE)
+  {
+    return (0);
+  }
+
+  uint16_t instSize;
+  memcpy(&instSize, p + 8, sizeof(instSize));
+  if (instSize > MAX_INSN_BYTES)
+  {
+    return (0);
+  }
+
+  size_t off = ENTRY_HEADER_FIXED_SIZE + instSize;
+  for (int n = 0; n < (uint8_t)p[10]; n++)
+  {
+    if (off + TraceOperandViewX86::FIXED_SIZE > avail)
+    {
+      return (0);
+    }
+    uint8_t length = (uint8_t)p[off + 1];
+    uint64_t taint;
+    memcpy(&taint, p + off + 2, sizeof(taint));
+    if (length > MAX_OPERAND_LEN)
+    {
+      return (0);
+    }
+    off += TraceOperandViewX86::FIXED_SIZE;
+
+    for (int i = 0; i < length; i++)
+    {
+      if ((taint & (1 << i)) == 0)
+      {
+        continue;
+      }
+      if ((off >= avail) || ((uint8_t)p[off] > MAX_NUM_TAINTBYTE_RECORDS))
+      {
+        return (0);
+      }
+      off += 1 + sizeof(TaintByteRecord) * (uint8_t)p[off];
+    }
+  }
+
+  return ((off <= avail) ? off : 0);
+}
+
+TraceReaderMapX86::TraceReaderMapX86()
+{
+  mFd = -1;
+  mMap = NULL;
+  mMapLen = 0;
+  mMtime = 0;
+  mCount = 0;
+  mEntries = NULL;
+  mEntriesLen = 0;
+  mOffsets = NULL;
+  mIdxMap = NULL;
+  mIdxMapLen = 0;
+  mRecords = false;
+  mHasBlocks = false;
+  mMRs = NULL;
+  memset(&tch, 0, sizeof(tch));
+  memset(&psr, 0, sizeof(psr));
+  pthread_mutex_init(&mLock, NULL);
+  pthread_cond_init(&mReadyCond, NULL);
+}
+
+TraceReaderMapX86::~TraceReaderMapX86()
+{
+  close();
+  pthread_cond_destroy(&mReadyCond);
+  pthread_mutex_destroy(&mLock);
+}
+
+//no cursor may be in use
+void TraceReaderMapX86::close()
+{
+  if (mIdxMap != NULL)
+  {
+    munmap((void*)mIdxMap, mIdxMapLen);
+    mIdxMap = NULL;
+  }
+  if (mMap != NULL)
+  {
+    munmap((void*)mMap, mMapLen);
+    mMap = NULL;
+  }
+  if (mFd >= 0)
+  {
+    ::close(mFd);
+    mFd = -1;
+  }
+  for (map<size_t, Expanded*>::iterator it = mExpanded.begin(); it != mExpanded.end(); it++)
+  {
+    delete it->second;
+  }
+  mExpanded.clear();
+  mLru.clear();
+  mSegments.clear();
+  mSegFirst.clear();
+  mBlocks = TraceBlockTableX86();
+  mRecords = false;
+  mHasBlocks = false;
+  mOffsetBuf.clear();
+  mOffsets = NULL;
+  mCount = 0;
+  mEntries = NULL;
+  mEntriesLen = 0;
+}
+
+int TraceReaderMapX86::init(const string& inFileName, bool bWriteIndex)
+{
+  struct stat st;
+
+  close();
+
+  mFileName = inFileName;
+  mFd = open(inFileName.c_str(), O_RDONLY);
+  if ((mFd < 0) || (fstat(mFd, &st) != 0))
+  {
+    cerr << "Could not open file [" << inFileName << "] for read" << endl;
+    return (-1);
+  }
+  mMapLen = st.st_size;
+  mMtime = st.st_mtime;
+
+  if (mMapLen < sizeof(tch) + sizeof(psr))
+  {
+    cerr << "[" << inFileName << "] is too small to be a trace" << endl;
+    return (-1);
+  }
+
+  mMap = (const char*)mmap(NULL, mMapLen, PROT_READ, MAP_SHARED, mFd, 0);
+  if (mMap == MAP_FAILED)
+  {
+    mMap = NULL;
+    cerr << "Could not map [" << inFileName << "]" << endl;
+    return (-1);
+  }
+
+  //the trace, process and module headers are never compressed
+  const char* tables = mMap;
+  size_t tablesLen = mMapLen;
+  if (memcmp(mMap, TRACE_CONTAINER_MAGIC, sizeof(TRACE_CONTAINER_MAGIC)) == 0)
+  {
+    const TraceContainerHeader* tzh = (const TraceContainerHeader*)mMap;
+    if ((tzh->version != TRACE_CONTAINER_VERSION)
+        || (sizeof(*tzh) + (uint64_t)tzh->tables_len > mMapLen))
+    {
+      cerr << "Unsupported compressed trace version [" << tzh->version << "]" << endl;
+      return (-1);
+    }
+    tables = mMap + sizeof(*tzh);
+    tablesLen = tzh->tables_len;
+  }
+
+  if (tablesLen < sizeof(tch) + sizeof(psr))
+  {
+    cerr << "Could not read the trace headers" << endl;
+    return (-1);
+  }
+  memcpy(&tch, tables, sizeof(tch));
+  memcpy(&psr, tables + sizeof(tch), sizeof(psr));
+  if ((tch.version != 0x33) && (tch.version != TRACE_RECORDS_VERSION))
+  {
+    cerr << "The version number is incorrect. Looking for 0x33 or 0x34" << endl;
+    return (-1);
+  }
+  if ((psr.n_mods < 0) || (psr.n_mods > MOD_MAX)
+      || (sizeof(tch) + sizeof(psr) + sizeof(ModuleRecord) * psr.n_mods > tablesLen))
+  {
+    cerr << "Too many modules [" << psr.n_mods << "]. Can't continue" << endl;
+    return (-2);
+  }
+  mMRs = (const ModuleRecord*)(tables + sizeof(tch) + sizeof(psr));
+
+  //from here on the trace reads like a version 51 one
+  if (tch.version == TRACE_RECORDS_VERSION)
+  {
+    mRecords = true;
+    //only block traces have a block table
+    mHasBlocks = (mBlocks.load(mFileName + ".blocks") == 0);
+    tch.version = 0x33;
+  }
+
+  if (tables != mMap)
+  {
+    return (loadSegments(tables - mMap + tablesLen));
+  }
+  size_t start = sizeof(tch) + sizeof(psr) + sizeof(ModuleRecord) * psr.n_mods;
+  if (mRecords)
+  {
+    return (scanSegments(start));
+  }
+
+  //plain version 51 traces are used in place
+  mEntries = mMap + start;
+  mEntriesLen = mMapLen - start;
+  string idxFileName = inFileName + ".idx";
+  if (loadIndex(idxFileName) == 0)
+  {
+    return (0);
+  }
+  if (buildIndex() != 0)
+  {
+    return (-1);
+  }
+  if (bWriteIndex)
+  {
+    saveIndex(idxFileName);
+  }
+  return (0);
+}
+
+int TraceReaderMapX86::loadSegments(uint64_t start)
+{
+  TraceContainerFooter tf;
+  TraceChunkHeader ch;
+  vector<TraceChunkIndex> index;
+
+  //the chunk index of traces that were closed properly saves reading the
+  // chunk headers one after the other, which also works for the others
+  if (mMapLen >= start + sizeof(tf))
+  {
+    memcpy(&tf, mMap + mMapLen - sizeof(tf), sizeof(tf));
+    if ((memcmp(tf.magic, TRACE_CONTAINER_MAGIC, sizeof(tf.magic)) == 0)
+        && (tf.index_offset >= start)
+        && (tf.index_offset + (uint64_t)tf.n_chunks * sizeof(TraceChunkIndex) + sizeof(tf) == mMapLen))
+    {
+      index.resize(tf.n_chunks);
+      if (tf.n_chunks > 0)
+      {
+        memcpy(&index[0], mMap + tf.index_offset, tf.n_chunks * sizeof(TraceChunkIndex));
+      }
+    }
+  }
+  if (index.empty())
+  {
+    for (uint64_t offset = start; offset + sizeof(ch) <= mMapLen; offset += sizeof(ch) + ch.comp_len)
+    {
+      memcpy(&ch, mMap + offset, sizeof(ch));
+      if ((ch.magic != TRACE_CHUNK_MAGIC) || (offset + sizeof(ch) + ch.comp_len > mMapLen))
+      {
+        break;
+      }
+      TraceChunkIndex ci;
+      memset(&ci, 0, sizeof(ci));
+      ci.offset = offset;
+      ci.comp_len = ch.comp_len;
+      ci.raw_len = ch.raw_len;
+      index.push_back(ci);
+    }
+  }
+
+  mCount = 0;
+  for (size_t i = 0; i < index.size(); i++)
+  {
+    //the chunk header has to agree with its index entry
+    const TraceChunkIndex& ci = index[i];
+    if ((ci.offset < start) || (ci.offset + sizeof(ch) > mMapLen))
+    {
+      cerr << "Bad chunk offset [" << ci.offset << "], ignoring the rest of the trace" << endl;
+      break;
+    }
+    memcpy(&ch, mMap + ci.offset, sizeof(ch));
+    if ((ch.magic != TRACE_CHUNK_MAGIC) || (ch.comp_len != ci.comp_len) || (ch.raw_len != ci.raw_len)
+        || (ci.offset + sizeof(ch) + ch.comp_len > mMapLen))
+    {
+      cerr << "Bad chunk at offset [" << ci.offset << "], ignoring the rest of the trace" << endl;
+      break;
+    }
+
+    Segment s;
+    s.first = mCount;
+    s.count = ch.n_insns;
+    s.offset = ci.offset + sizeof(ch);
+    s.compLen = ch.comp_len;
+    s.rawLen = ch.raw_len;
+    s.bRegsKnown = false;
+    mSegments.push_back(s);
+    mSegFirst.push_back(s.first);
+    mCount += s.count;
+  }
+  return (0);
+}
+
+int TraceReaderMapX86::scanSegments(uint64_t start)
+{
+  uint64_t off = start;
+  Segment s;
+  s.first = 0;
+  s.count = 0;
+  s.offset = start;
+  s.compLen = 0;
+  s.rawLen = 0;
+  s.bRegsKnown = false;
+
+  //only the record headers are read, the records are expanded with their
+  // segment
+  madvise((void*)mMap, mMapLen, MADV_SEQUENTIAL);
+  mCount = 0;
+  while (off < mMapLen)
+  {
+    size_t avail = mMapLen - off;
+    size_t len = 0;
+    uint64_t n = 0;
+    TraceRecordHeader rh;
+
+    //records have 0 where instructions have their size
+    if (avail >= sizeof(rh))
+    {
+      memcpy(&rh, mMap + off, sizeof(rh));
+    }
+    if ((avail >= sizeof(rh)) && (rh.zero == 0))
+    {
+      if ((sizeof(rh) + (uint64_t)rh.len > avail)
+          || ((rh.type == TRACE_RECORD_REGS) && (rh.len != sizeof(TraceRegsRecord)))
+          || ((rh.type != TRACE_RECORD_REGS) && (rh.type != TRACE_RECORD_LOOP) && (rh.type != TRACE_RECORD_BLOCKS)))
+      {
+        break;
+      }
+      len = sizeof(rh) + rh.len;
+      n = (rh.type == TRACE_RECORD_REGS) ? 0 : rh.n_insns;
+    }
+    else
+    {
+      len = TraceEntryViewX86::parse(mMap + off, avail);
+      if (len == 0)
+      {
+        break;
+      }
+      n = 1;
+    }
+
+    //segments end in between records once they are big enough
+    if ((s.rawLen > 0) && (s.rawLen + len > TRACE_CHUNK_SIZE))
+    {
+      mSegments.push_back(s);
+      mSegFirst.push_back(s.first);
+      s.first = mCount;
+      s.count = 0;
+      s.offset = off;
+      s.rawLen = 0;
+    }
+    s.rawLen += len;
+    s.count += n;
+    mCount += n;
+    off += len;
+  }
+  madvise((void*)mMap, mMapLen, MADV_NORMAL);
+
+  if (off < mMapLen)
+  {
+    cerr << "Invalid record at offset [" << off << "], ignoring the rest of the trace" << endl;
+  }
+  if (s.rawLen > 0)
+  {
+    mSegments.push_back(s);
+    mSegFirst.push_back(s.first);
+  }
+  return (0);
+}
+
+size_t TraceReaderMapX86::findSegment(uint64_t n) const
+{
+  //empty segments share their first instruction with the one that follows
+  vector<uint64_t>::const_iterator it = upper_bound(mSegFirst.begin(), mSegFirst.end(), n);
+  return ((it - mSegFirst.begin()) - 1);
+}
+
+TraceReaderMapX86::Expanded* TraceReaderMapX86::pin(size_t seg)
+{
+  pthread_mutex_lock(&mLock);
+  map<size_t, Expanded*>::iterator it = mExpanded.find(seg);
+  if (it != mExpanded.end())
+  {
+    Expanded* e = it->second;
+    if (e->refs++ == 0)
+    {
+      mLru.erase(e->lru);
+    }
+    //another cursor may still be expanding it
+    while (!e->bReady)
+    {
+      pthread_cond_wait(&mReadyCond, &mLock);
+    }
+    pthread_mutex_unlock(&mLock);
+    return (e);
+  }
+
+  Expanded* e = new Expanded;
+  e->seg = seg;
+  e->first = mSegments[seg].first;
+  e->refs = 1;
+  e->bReady = false;
+  mExpanded[seg] = e;
+  pthread_mutex_unlock(&mLock);
+
+  //cursors on the other segments go on in the meantime
+  vector<uint64_t> regsInsns;
+  vector<TraceRegsRecord> regs;
+  expandSegment(*e, regsInsns, regs);
+
+  pthread_mutex_lock(&mLock);
+  Segment& s = mSegments[seg];
+  if (!s.bRegsKnown)
+  {
+    s.regsInsns.swap(regsInsns);
+    s.regs.swap(regs);
+    s.bRegsKnown = true;
+  }
+  e->bReady = true;
+  pthread_cond_broadcast(&mReadyCond);
+  pthread_mutex_unlock(&mLock);
+  return (e);
+}
+
+void TraceReaderMapX86::unpin(Expanded* e)
+{
+  if (e == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&mLock);
+  if (--e->refs == 0)
+  {
+    mLru.push_front(e);
+    e->lru = mLru.begin();
+    while (mLru.size() > CACHED_SEGMENTS)
+    {
+      Expanded* old = mLru.back();
+      mLru.pop_back();
+      mExpanded.erase(old->seg);
+      delete old;
+    }
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+void TraceReaderMapX86::expandSegment(Expanded& e, vector<uint64_t>& regsInsns, vector<TraceRegsRecord>& regs)
+{
+  const Segment& s = mSegments[e.seg];
+  const char* p = mMap + s.offset;
+  size_t len = s.rawLen;
+  string raw;
+
+  if (s.compLen != 0)
+  {
+    //version 51 chunks are inflated straight into place
+    string& dst = mRecords ? raw : e.entries;
+    uLongf rawLen = s.rawLen;
+    dst.resize(s.rawLen);
+    if ((s.rawLen > 0)
+        && ((uncompress((Bytef*)&dst[0], &rawLen, (const Bytef*)p, s.compLen) != Z_OK) || (rawLen != s.rawLen)))
+    {
+      cerr << "Couldn't decompress the chunk at offset [" << s.offset - sizeof(TraceChunkHeader) << "]" << endl;
+      rawLen = 0;
+    }
+    dst.resize(rawLen);
+    p = dst.data();
+    len = dst.size();
+  }
+
+  if (mRecords)
+  {
+    expandRecords(p, len, s.first, e.entries, regsInsns, regs);
+  }
+  else if (s.compLen == 0)
+  {
+    e.entries.assign(p, len);
+  }
+
+  //index the instructions
+  uint64_t off = 0;
+  e.offsets.clear();
+  e.offsets.reserve(s.count);
+  while ((e.offsets.size() < s.count) && (off < e.entries.size()))
+  {
+    size_t n = TraceEntryViewX86::parse(e.entries.data() + off, e.entries.size() - off);
+    if (n == 0)
+    {
+      break;
+    }
+    e.offsets.push_back(off);
+    off += n;
+  }
+  e.entries.resize(off);
+
+  //the instruction count was known before the segment was expanded, make
+  // up for the instructions that could not be with one byte nops
+  if (e.offsets.size() < s.count)
+  {
+    cerr << "[" << s.count - e.offsets.size() << "] instructions are missing from the segment at offset ["
+         << s.offset << "], replacing them with nops" << endl;
+    char nop[ENTRY_HEADER_FIXED_SIZE + 1];
+    uint16_t instSize = 1;
+    memset(nop, 0, sizeof(nop));
+    memcpy(nop + 8, &instSize, sizeof(instSize));
+    nop[ENTRY_HEADER_FIXED_SIZE] = (char)0x90;
+    while (e.offsets.size() < s.count)
+    {
+      e.offsets.push_back(e.entries.size());
+      e.entries.append(nop, sizeof(nop));
+    }
+  }
+}
+
+int TraceReaderMapX86::expandRecords(const char* p, size_t len, uint64_t first, string& out,
+                                     vector<uint64_t>& regsInsns, vector<TraceRegsRecord>& regs)
+{
+  uint64_t off = 0;
+  uint64_t n = first;
+
+  out.reserve(len);
+  while (off < len)
+  {
+    size_t avail = len - off;
+    TraceRecordHeader rh;
+    bool bRecord = false;
+    if (avail >= sizeof(rh))
+    {
+      //records have 0 where instructions have their size
+      memcpy(&rh, p + off, sizeof(rh));
+      bRecord = (rh.zero == 0);
+    }
+
+    if (bRecord && (rh.type == TRACE_RECORD_REGS))
+    {
+      if ((rh.len != sizeof(TraceRegsRecord)) || (sizeof(rh) + (uint64_t)rh.len > avail))
+      {
+        return (-1);
+      }
+      TraceRegsRecord rr;
+      memcpy(&rr, p + off + sizeof(rh), sizeof(rr));
+      regsInsns.push_back(n);
+      regs.push_back(rr);
+      off += sizeof(rh) + rh.len;
+      continue;
+    }
+
+    if (bRecord)
+    {
+      TraceLoopExpanderX86 loop;
+      if (mHasBlocks)
+      {
+        loop.setBlockTable(&mBlocks);
+      }
+      if ((sizeof(rh) + (uint64_t)rh.len > avail)
+          || (loop.init(rh, p + off + sizeof(rh), rh.len) != 0))
+      {
+        return (-1);
+      }
+      while (!loop.done())
+      {
+        if (loop.nextIteration(out) != 0)
+        {
+          return (-1);
+        }
+      }
+      n += rh.n_insns;
+      off += sizeof(rh) + rh.len;
+      continue;
+    }
+
+    size_t entryLen = TraceEntryViewX86::parse(p + off, avail);
+    if (entryLen == 0)
+    {
+      return (-1);
+    }
+    out.append(p + off, entryLen);
+    off += entryLen;
+    n++;
+  }
+  return (0);
+}
+
+int TraceReaderMapX86::getRegistersBefore(uint64_t n, TraceRegsRecord& rr)
+{
+  //from the segment of n back to the first one that has registers
+  for (size_t k = mSegments.empty() ? 0 : findSegment(n) + 1; k-- > 0; )
+  {
+    pthread_mutex_lock(&mLock);
+    bool bKnown = mSegments[k].bRegsKnown;
+    pthread_mutex_unlock(&mLock);
+    if (!bKnown)
+    {
+      unpin(pin(k));
+    }
+
+    pthread_mutex_lock(&mLock);
+    const Segment& s = mSegments[k];
+    vector<uint64_t>::const_iterator it = upper_bound(s.regsInsns.begin(), s.regsInsns.end(), n);
+    bool bFound = (it != s.regsInsns.begin());
+    if (bFound)
+    {
+      rr = s.regs[(it - s.regsInsns.begin()) - 1];
+    }
+    pthread_mutex_unlock(&mLock);
+    if (bFound)
+    {
+      return (0);
+    }
+  }
+  return (-1);
+}
+
+int TraceReaderMapX86::loadIndex(const string& idxFileName)
+{
+  struct stat st;
+  int fd = open(idxFileName.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    return (-1);
+  }
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(TraceIndexHeader)))
+  {
+    ::close(fd);
+    return (-1);
+  }
+
+  mIdxMapLen = st.st_size;
+  mIdxMap = (const char*)mmap(NULL, mIdxMapLen, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mIdxMap == MAP_FAILED)
+  {
+    mIdxMap = NULL;
+    return (-1);
+  }
+
+  const TraceIndexHeader* ih = (const TraceIndexHeader*)mIdxMap;
+  if ((memcmp(ih->magic, TRACE_INDEX_MAGIC, sizeof(ih->magic)) != 0)
+      || (ih->version != TRACE_INDEX_VERSION)
+      || (ih->trace_size != mMapLen) || (ih->trace_mtime != mMtime)
+      || (sizeof(*ih) + ih->n_insns * sizeof(uint64_t) != mIdxMapLen))
+  {
+    cerr << "[" << idxFileName << "] is stale, rebuilding it" << endl;
+    munmap((void*)mIdxMap, mIdxMapLen);
+    mIdxMap = NULL;
+    return (-1);
+  }
+
+  mOffsets = (const uint64_t*)(mIdxMap + sizeof(*ih));
+  mCount = ih->n_insns;
+  if (mCount > 0)
+  {
+    //ignore whatever follows the last instruction, like buildIndex
+    uint64_t last = mOffsets[mCount - 1];
+    size_t len = (last < mEntriesLen) ? TraceEntryViewX86::parse(mEntries + last, mEntriesLen - last) : 0;
+    if (len == 0)
+    {
+      cerr << "[" << idxFileName << "] does not match the trace, rebuilding it" << endl;
+      munmap((void*)mIdxMap, mIdxMapLen);
+      mIdxMap = NULL;
+      mOffsets = NULL;
+      mCount = 0;
+      return (-1);
+    }
+    mEntriesLen = last + len;
+  }
+  return (0);
+}
+
+int TraceReaderMapX86::buildIndex()
+{
+  uint64_t off = 0;
+
+  madvise((void*)mMap, mMapLen, MADV_SEQUENTIAL);
+  mOffsetBuf.clear();
+  while (off < mEntriesLen)
+  {
+    size_t len = TraceEntryViewX86::parse(mEntries + off, mEntriesLen - off);
+    if (len == 0)
+    {
+      cerr << "Invalid instruction at offset [" << off << "], ignoring the rest of the trace" << endl;
+      break;
+    }
+    mOffsetBuf.push_back(off);
+    off += len;
+  }
+  madvise((void*)mMap, mMapLen, MADV_NORMAL);
+
+  //the last instruction ends where the next would begin
+  mEntriesLen = off;
+  mCount = mOffsetBuf.size();
+  mOffsets = mCount ? &mOffsetBuf[0] : NULL;
+  return (0);
+}
+
+int TraceReaderMapX86::saveIndex(const string& idxFileName)
+{
+  TraceIndexHeader ih;
+  memset(&ih, 0, sizeof(ih));
+  memcpy(ih.magic, TRACE_INDEX_MAGIC, sizeof(ih.magic));
+  ih.version = TRACE_INDEX_VERSION;
+  ih.trace_size = mMapLen;
+  ih.trace_mtime = mMtime;
+  ih.n_insns = mCount;
+
+  //write a temporary file so a concurrent reader never sees a partial index
+  string tmpFileName = idxFileName + ".tmp";
+  FILE* fp = fopen(tmpFileName.c_str(), "wb");
+  if (fp == NULL)
+  {
+    return (-1);
+  }
+  bool bOk = (fwrite(&ih, sizeof(ih), 1, fp) == 1)
+             && (fwrite(mOffsets, sizeof(uint64_t), mCount, fp) == mCount);
+  bOk = (fclose(fp) == 0) && bOk;
+  if (!bOk || (rename(tmpFileName.c_str(), idxFileName.c_str()) != 0))
+  {
+    unlink(tmpFileName.c_str());
+    return (-1);
+  }
+  return (0);
+}
+
+int TraceReaderMapX86::forEach(uint64_t begin, uint64_t end, TraceVisitorX86& visitor)
+{
+  if (end > mCount)
+  {
+    end = mCount;
+  }
+  TraceCursorX86 cur(*this);
+  for (uint64_t n = begin; n < end; n++)
+  {
+    int ret = visitor.visit(n, cur.at(n));
+    if (ret != 0)
+    {
+      return (ret);
+    }
+  }
+  return (0);
+}
+
+struct TraceRangeX86
+{
+  TraceReaderMapX86* reader;
+  TraceVisitorX86* visitor;
+  uint64_t begin;
+  uint64_t end;
+  int ret;
+};
+
+static void* forEachThread(void* opaque)
+{
+  TraceRangeX86* r = (TraceRangeX86*)opaque;
+  r->ret = r->reader->forEach(r->begin, r->end, *(r->visitor));
+  return (NULL);
+}
+
+int TraceReaderMapX86::forEach(uint64_t begin, uint64_t end, const vector<TraceVisitorX86*>& visitors)
+{
+  size_t n = visitors.size();
+  if (end > mCount)
+  {
+    end = mCount;
+  }
+  if ((n == 0) || (begin >= end))
+  {
+    return (0);
+  }
+
+  vector<TraceRangeX86> ranges(n);
+  vector<pthread_t> threads(n);
+  vector<bool> started(n, false);
+  uint64_t per = (end - begin) / n;
+  uint64_t extra = (end - begin) % n;
+  uint64_t cur = begin;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    ranges[i].reader = this;
+    ranges[i].visitor = visitors[i];
+    ranges[i].begin = cur;
+    cur += per + ((i < extra) ? 1 : 0);
+    ranges[i].end = cur;
+    ranges[i].ret = 0;
+  }
+
+  //the last range is visited in the calling thread
+  for (size_t i = 0; i + 1 < n; i++)
+  {
+    started[i] = (pthread_create(&threads[i], NULL, forEachThread, &ranges[i]) == 0);
+    if (!started[i])
+    {
+      forEachThread(&ranges[i]);
+    }
+  }
+  forEachThread(&ranges[n - 1]);
+
+  int ret = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (started[i])
+    {
+      pthread_join(threads[i], NULL);
+    }
+    if ((ret == 0) && (ranges[i].ret != 0))
+    {
+      ret = ranges[i].ret;
+    }
+  }
+  return (ret);
+}
@@ -0,0 +1,279 @@
+/**
+ *  Memory mapped reader for version 51 and 52 traces.
+ *
+ *  The trace is mmap()ed and an offset index of every instruction is built
+ *  on first open and cached next to the trace as <trace>.idx. Instructions
+ *  are then available in any order as TraceEntryViewX86s, which point into
+ *  the mapping and only decode the fields that are asked for.
+ *
+ *  Compressed traces (see ../trace_container.h) and version 52 traces (see
+ *  ../trace_records.h) cannot be used in place. They are split into
+ *  segments, the chunks of the container or ranges of about
+ *  TRACE_CHUNK_SIZE bytes of a plain trace, which are inflated and
+ *  expanded when an instruction of theirs is first asked for. The last few
+ *  segments used are kept in memory.
+ */
+#ifndef TRACE_READER_MAP_X86_H
+#define TRACE_READER_MAP_X86_H
+
+#include <inttypes.h>
+#include <cstring>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "TRInstructionX86.h"
+#include "../trace_records.h"
+#include "TraceBlockTableX86.h"
+
+#define TRACE_INDEX_MAGIC "DECAFIX"
+#define TRACE_INDEX_VERSION 1
+
+//header of the <trace>.idx files. It is followed by n_insns uint64_t
+// offsets relative to the first instruction
+struct TraceIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t trace_size; //size and modification time of the trace, the
+  uint64_t trace_mtime; // index is rebuilt if they do not match
+  uint64_t n_insns;
+};
+
+//a version 51 operand as it is stored in the trace
+class TraceOperandViewX86
+{
+public:
+  TraceOperandViewX86() : p(NULL) {}
+  explicit TraceOperandViewX86(const char* ptr) : p(ptr) {}
+
+  uint8_t access() const { return ((uint8_t)p[0]); }
+  uint8_t length() const { return ((uint8_t)p[1]); }
+  uint64_t taintedBegin() const { return (load<uint64_t>(2)); }
+  uint64_t taintedEnd() const { return (load<uint64_t>(10)); }
+  uint32_t addr() const { return (load<uint32_t>(18)); }
+  uint32_t value() const { return (load<uint32_t>(22)); }
+  OpType type() const { return ((OpType)(uint8_t)p[26]); }
+  OpUsage usage() const { return ((OpUsage)(uint8_t)p[27]); }
+  bool isTainted() const { return ((taintedBegin() != 0) || (taintedEnd() != 0)); }
+
+  //copies the operand and its taint records
+  void decode(OperandVal& op) const;
+  //size of the operand including its taint records
+  size_t size() const;
+  //the operand stored after this one
+  TraceOperandViewX86 next() const { return (TraceOperandViewX86(p + size())); }
+
+  static const size_t FIXED_SIZE = 28;
+
+private:
+  template <class T> T load(size_t off) const { T t; memcpy(&t, p + off, sizeof(T)); return (t); }
+  const char* p;
+};
+
+//a version 51 instruction as it is stored in the trace
+class TraceEntryViewX86
+{
+public:
+  TraceEntryViewX86() : p(NULL), len(0) {}
+  TraceEntryViewX86(const char* ptr, size_t size) : p(ptr), len(size) {}
+
+  uint32_t address() const { return (load<uint32_t>(0)); }
+  uint32_t tid() const { return (load<uint32_t>(4)); }
+  uint16_t instSize() const { return (load<uint16_t>(8)); }
+  uint8_t numOperands() const { return ((uint8_t)p[10]); }
+  uint8_t tp() const { return ((uint8_t)p[11]); }
+  uint32_t eflags() const { return (load<uint32_t>(12)); }
+  uint32_t ccOp() const { return (load<uint32_t>(16)); }
+  uint32_t df() const { return (load<uint32_t>(20)); }
+  const char* rawbytes() const { return (p + ENTRY_HEADER_FIXED_SIZE); }
+
+  //the first of the numOperands() operands, in the order they are stored
+  // (memregs follow their memory operand). Use next() to walk them
+  TraceOperandViewX86 firstOperand() const { return (TraceOperandViewX86(rawbytes() + instSize())); }
+
+  //the raw encoding of the instruction
+  const char* data() const { return (p); }
+  size_t size() const { return (len); }
+
+  //fills in insn the same way TraceReaderBinX86::readNextInstruction does,
+  // disassembling it if bDisasm is set
+  int decode(TRInstructionX86& insn, bool bDisasm = true) const;
+
+  //returns the size of the instruction at p, or 0 if it is invalid or
+  // does not fit within avail bytes
+  static size_t parse(const char* p, size_t avail);
+
+private:
+  template <class T> T load(size_t off) const { T t; memcpy(&t, p + off, sizeof(T)); return (t); }
+  const char* p;
+  size_t len;
+};
+
+//interface for parallel iteration, see TraceReaderMapX86::forEach
+class TraceVisitorX86
+{
+public:
+  virtual ~TraceVisitorX86() {}
+  //called for every instruction n of the range, a non-zero return stops
+  // the iteration of the range
+  virtual int visit(uint64_t n, const TraceEntryViewX86& entry) = 0;
+};
+
+class TraceReaderMapX86
+{
+public:
+  TraceReaderMapX86();
+  ~TraceReaderMapX86();
+
+  //maps the trace, and loads or builds its index. If bWriteIndex is set, a
+  // freshly built index is saved for the next time
+  int init(const std::string& inFileName, bool bWriteIndex = true);
+  void close();
+
+  uint64_t getInstructionCount() const { return (mCount); }
+
+  //visits [begin, end) by splitting it into visitors.size() consecutive
+  // ranges, the i-th visited by visitors[i] in its own thread. Returns the
+  // first non-zero visit() result
+  int forEach(uint64_t begin, uint64_t end, const std::vector<TraceVisitorX86*>& visitors);
+  //same thing in the calling thread
+  int forEach(uint64_t begin, uint64_t end, TraceVisitorX86& visitor);
+
+  //identify the trace for the files cached next to it
+  const std::string& getFileName() const { return (mFileName); }
+  uint64_t getTraceSize() const { return (mMapLen); }
+  uint64_t getTraceMtime() const { return (mMtime); }
+
+  const TraceHeader& getTraceHeader() const { return (tch); }
+  const ProcessRecord& getProcessRecord() const { return (psr); }
+  const ModuleRecord* getModuleRecords() const { return (mMRs); }
+
+  //taint-sparse traces: copies the last registers written at or before
+  // instruction n into rr. Returns -1 if there are none
+  int getRegistersBefore(uint64_t n, TraceRegsRecord& rr);
+
+  //segments kept in memory besides the ones cursors are on
+  static const size_t CACHED_SEGMENTS = 4;
+
+protected:
+  friend class TraceCursorX86;
+
+  //a part of a trace that has to be expanded before it can be used
+  struct Segment
+  {
+    uint64_t first;      //first instruction
+    uint64_t count;      //instructions, once expanded
+    uint64_t offset;     //file offset of the records
+    uint32_t compLen;    //compressed size, 0 if stored as is
+    uint32_t rawLen;
+    //the registers records of the segment, filled in on first expansion
+    bool bRegsKnown;
+    std::vector<uint64_t> regsInsns;
+    std::vector<TraceRegsRecord> regs;
+  };
+
+  //an expanded segment. Cursors pin the one they are on, and the others
+  // are evicted least recently used first
+  struct Expanded
+  {
+    size_t seg;
+    uint64_t first;
+    std::string entries;
+    std::vector<uint64_t> offsets;
+    int refs;
+    bool bReady;
+    std::list<Expanded*>::iterator lru;
+  };
+
+  TraceEntryViewX86 plainAt(uint64_t n) const
+  {
+    uint64_t end = (n + 1 < mCount) ? mOffsets[n + 1] : mEntriesLen;
+    return (TraceEntryViewX86(mEntries + mOffsets[n], end - mOffsets[n]));
+  }
+  size_t findSegment(uint64_t n) const;
+  Expanded* pin(size_t seg);
+  void unpin(Expanded* e);
+  void expandSegment(Expanded& e, std::vector<uint64_t>& regsInsns, std::vector<TraceRegsRecord>& regs);
+  int expandRecords(const char* p, size_t len, uint64_t first, std::string& out,
+                    std::vector<uint64_t>& regsInsns, std::vector<TraceRegsRecord>& regs);
+
+  int loadSegments(uint64_t start);
+  int scanSegments(uint64_t start);
+  int loadIndex(const std::string& idxFileName);
+  int buildIndex();
+  int saveIndex(const std::string& idxFileName);
+
+  std::string mFileName;
+  int mFd;
+  const char* mMap;
+  size_t mMapLen;
+  uint64_t mMtime;
+
+  uint64_t mCount;
+
+  //plain version 51 traces: the instructions in mMap, and the offset
+  // index, either mapped from the .idx file or in mOffsetBuf
+  const char* mEntries;
+  uint64_t mEntriesLen;
+  const uint64_t* mOffsets;
+  const char* mIdxMap;
+  size_t mIdxMapLen;
+  std::vector<uint64_t> mOffsetBuf;
+
+  //the other traces: their segments and the first instruction of each.
+  // The registers records of the segments and the expanded segments are
+  // protected by mLock
+  std::vector<Segment> mSegments;
+  std::vector<uint64_t> mSegFirst;
+  bool mRecords;
+  TraceBlockTableX86 mBlocks;
+  bool mHasBlocks;
+  pthread_mutex_t mLock;
+  pthread_cond_t mReadyCond;
+  std::map<size_t, Expanded*> mExpanded;
+  std::list<Expanded*> mLru;
+
+  TraceHeader tch;
+  ProcessRecord psr;
+  const ModuleRecord* mMRs;
+};
+
+//reads the instructions of a trace in any order. The views it returns stay
+// valid until it moves to an instruction of another segment, or is
+// destroyed. Use one cursor per thread
+class TraceCursorX86
+{
+public:
+  explicit TraceCursorX86(TraceReaderMapX86& reader) : mReader(reader), mCur(NULL) {}
+  ~TraceCursorX86() { mReader.unpin(mCur); }
+
+  //instruction n of the trace, n must be < getInstructionCount()
+  TraceEntryViewX86 at(uint64_t n)
+  {
+    if (mReader.mSegments.empty())
+    {
+      return (mReader.plainAt(n));
+    }
+    if ((mCur == NULL) || (n < mCur->first) || (n - mCur->first >= mCur->offsets.size()))
+    {
+      mReader.unpin(mCur);
+      mCur = mReader.pin(mReader.findSegment(n));
+    }
+    size_t i = n - mCur->first;
+    uint64_t end = (i + 1 < mCur->offsets.size()) ? mCur->offsets[i + 1] : mCur->entries.size();
+    return (TraceEntryViewX86(mCur->entries.data() + mCur->offsets[i], end - mCur->offsets[i]));
+  }
+
+private:
+  TraceCursorX86(const TraceCursorX86&);
+  TraceCursorX86& operator=(const TraceCursorX86&);
+
+  TraceReaderMapX86& mReader;
+  TraceReaderMapX86::Expanded* mCur;
+};
+
+#endif//TRACE_READER_MAP_X86_H
@@ -11,12 +11,17 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <vector>
 #include <boost/program_options.hpp>
 #include <boost/graph/graphviz.hpp>
 using namespace std;
 using namespace boost::program_options;
 
 #include "TraceReaderBinX86.h"
+#include "TraceReaderMapX86.h"
+#include "TracePipelineX86.h"
+#include "TraceProcessorX86Chunked.h"
+#include "TraceContainerWriter.h"
 #include "TraceProcessorX86Verify.h"
 #include "TraceProcessorX86TaintSummary.h"
 
@@ -114,16 +119,163 @@ private:
 };
 
 
-
 bool g_bVerbose;
 string g_sInFile;
 // string g_sOutFile;
+string g_sCompressFile;
+bool g_bStart;
+uint64_t g_uStart;
 bool g_bBAP;
 bool g_bSummary;
+unsigned g_uJobs;
+bool g_bSyscalls;
+string g_sMapFile;
+string g_sMemDump;
 
 int
 process_arg(int argc, char **argv);
 
+//converts a plain trace into a compressed one, copying every
+// instruction encoding as is
+int
+compress_trace(const string& inFile, const string& outFile)
+{
+    TraceReaderBinX86 tr;
+    if (0 != tr.init(inFile, ""))
+    {
+        return -1;
+    }
+    if (tr.isCompressed())
+    {
+        cerr << "[" << inFile << "] is already compressed" << endl;
+        return -1;
+    }
+    tr.disableStringConversion();
+
+    ifstream raw(inFile.c_str(), ifstream::in | ifstream::binary);
+    size_t start = tr.getFilePos();
+    vector<char> buf(start);
+    raw.read(&buf[0], start);
+
+    TraceContainerWriter tw;
+    if (!raw.good()
+        || (0 != tw.open(outFile, &buf[0], start, tr.getTraceHeader().version)))
+    {
+        return -1;
+    }
+
+    //the loop and block records of version 52 traces are copied as they
+    // are, with the first of their instructions. The others take no bytes,
+    // so they stay in the same chunk
+    while (tr.readNextInstruction() == 0)
+    {
+        size_t end = tr.getFilePos();
+        buf.resize(end - start);
+        if (!buf.empty())
+        {
+            raw.read(&buf[0], end - start);
+        }
+        if (!raw.good())
+        {
+            cerr << "Could not read the instruction at [" << start << "]" << endl;
+            return -1;
+        }
+
+        uint32_t eip = tr.getCurInstruction().eh.address;
+        uint16_t inst_size = 0;
+        if (buf.size() >= ENTRY_HEADER_FIXED_SIZE)
+        {
+            memcpy(&inst_size, &buf[8], sizeof(inst_size));
+        }
+        if (inst_size != 0)
+        {
+            memcpy(&eip, &buf[0], sizeof(eip));
+        }
+        if (0 != tw.addInstruction(buf.empty() ? NULL : &buf[0], end - start, eip))
+        {
+            return -1;
+        }
+        start = end;
+    }
+
+    if (0 != tw.close())
+    {
+        return -1;
+    }
+
+    //block traces keep the code of their blocks next to the trace
+    ifstream blocks((inFile + ".blocks").c_str(), ifstream::in | ifstream::binary);
+    if (blocks.good())
+    {
+        ofstream outBlocks((outFile + ".blocks").c_str(), ofstream::out | ofstream::trunc | ofstream::binary);
+        outBlocks << blocks.rdbuf();
+        if (!outBlocks.good())
+        {
+            cerr << "Could not write [" << outFile << ".blocks]" << endl;
+            return -1;
+        }
+    }
+    printf("[%lu] Instructions Compressed\n", (unsigned long)tw.getInstructionCount());
+    return 0;
+}
+
+//runs the requested analyses on a mapped trace, each one split across
+// g_uJobs threads. The results are printed in trace order
+int
+run_pipeline(const string& inFile)
+{
+    TraceReaderMapX86 tr;
+    if (0 != tr.init(inFile))
+    {
+        return -1;
+    }
+
+    TracePipelineX86 pipeline(tr, g_uJobs);
+    uint64_t begin = g_bStart ? g_uStart : 0;
+    int ret = 0;
+
+    if (g_bSummary)
+    {
+        ChunkedTaintSummary sum(&cout);
+        ret |= pipeline.run(sum, begin);
+    }
+
+    if (g_bSyscalls)
+    {
+        ChunkedSyscallsLinux sys(&cout);
+        ret |= pipeline.run(sys, begin);
+    }
+
+    if (!g_sMapFile.empty())
+    {
+        SymbolMap sm;
+        if (0 != sm.readMapFromFile(g_sMapFile))
+        {
+            cerr << "Could not read the symbol map [" << g_sMapFile << "]" << endl;
+            return -1;
+        }
+        ChunkedFunctions funcs(sm);
+        ret |= pipeline.run(funcs, begin);
+
+        const map<string, uint64_t>& counts = funcs.getCounts();
+        for (map<string, uint64_t>::const_iterator it = counts.begin(); it != counts.end(); it++)
+        {
+            cout << "FUNCTION: " << it->first << " " << it->second << endl;
+        }
+    }
+
+    if (!g_sMemDump.empty())
+    {
+        ChunkedMemory mem;
+        ret |= pipeline.run(mem, begin);
+        mem.getMemory().dumpMemory(g_sMemDump);
+    }
+
+    uint64_t count = tr.getInstructionCount();
+    printf("[%lu] Instructions Decoded\n", (unsigned long)((count > begin) ? count - begin : 0));
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -132,6 +284,16 @@ main(int argc, char **argv)
         return -1;
     }
 
+    if (!g_sCompressFile.empty())
+    {
+        return compress_trace(g_sInFile, g_sCompressFile);
+    }
+
+    if (g_uJobs > 0)
+    {
+        return run_pipeline(g_sInFile);
+    }
+
     TraceReaderBinX86 tr;
     // TraceProcessorX86Verify bapVerifier(false, true);
     // TraceProcessorX86TaintSummary taintSummary(true);
@@ -154,6 +316,12 @@ main(int argc, char **argv)
 
     //tr.seekTo(startInterest);
 
+    if (g_bStart && (0 != tr.seekToInstruction(g_uStart)))
+    {
+        cerr << "Could not seek to instruction [" << g_uStart << "]" << endl;
+        return -1;
+    }
+
     tr.setVerbose(g_bVerbose);
     // bapVerifier.setVerbose(g_bVerbose);
 
@@ -206,8 +374,14 @@ process_arg(int argc, char **argv)
     ("input,i", value<string>(),"input filename")
     // ("output,o", value<string>(), "output filename")
     ("verbose,v", "print verbose messages")
+    ("compress,c", value<string>(), "write the input trace as a compressed trace to this file")
+    ("start,s", value<uint64_t>(), "start at this instruction (compressed traces or --jobs only)")
     ("bap", "TODO: modify this")
     ("sum", "print summary")
+    ("jobs,j", value<unsigned>(), "map the trace and analyze it with this many threads")
+    ("syscalls", "print the linux system calls (with --jobs)")
+    ("functions", value<string>(), "count the calls to the functions of this symbol map (with --jobs)")
+    ("memdump", value<string>(), "rebuild the memory and dump it to files with this prefix (with --jobs)")
     ;
     variables_map vm;
     store(parse_command_line(argc, argv, opts), vm);
@@ -230,9 +404,30 @@ process_arg(int argc, char **argv)
     //     g_sOutFile = vm["output"].as<string>();
     // }
 
+    if (vm.count("compress"))
+    {
+        g_sCompressFile = vm["compress"].as<string>();
+    }
+
+    g_bStart = (0 != vm.count("start"));
+    if (g_bStart)
+    {
+        g_uStart = vm["start"].as<uint64_t>();
+    }
+
     g_bVerbose = (0 != vm.count("verbose"));
     g_bBAP = (0 != vm.count("bap"));
     g_bSummary = (0 != vm.count("sum"));
+    g_uJobs = vm.count("jobs") ? vm["jobs"].as<unsigned>() : 0;
+    g_bSyscalls = (0 != vm.count("syscalls"));
+    if (vm.count("functions"))
+    {
+        g_sMapFile = vm["functions"].as<string>();
+    }
+    if (vm.count("memdump"))
+    {
+        g_sMemDump = vm["memdump"].as<string>();
+    }
 
     return 0;
 }
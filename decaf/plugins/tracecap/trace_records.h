@@ -0,0 +1,136 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+/*
+ * trace_records.h
+ *
+ * Records that a trace can hold in between its instruction entries, shared
+ * by tracecap and trace_reader. Traces that may contain them have
+ * TRACE_RECORDS_VERSION in their header instead of VERSION_NUMBER; the
+ * entries themselves are unchanged.
+ *
+ * Entries never have an inst_size of 0, so a record starts with a 24-byte
+ * header (ENTRY_HEADER_FIXED_SIZE) that has 0 where entries keep inst_size.
+ * All integers are little endian.
+ *
+ * TRACE_RECORD_LOOP stands for n_iters iterations of a loop whose body is
+ * period instructions long:
+ *
+ *   body                    the period entries of the first iteration,
+ *                           encoded as usual
+ *   iteration[n_iters - 1]  the following iterations, as deltas
+ *
+ * Every entry of an iteration has the same address, size and static
+ * encoding as the body entry at the same position. The entry is seen as
+ * (size + 3) / 4 32-bit words, the last one padded with zeros, and every
+ * word is coded against its value in the previous iteration:
+ *
+ *   TRACE_DELTA_SAME    unchanged
+ *   TRACE_DELTA_STRIDE  changed by as much as in the previous iteration
+ *   TRACE_DELTA_NEW     changed by a stored 32-bit delta (modulo 2^32)
+ *
+ * The change of a word in the body iteration is 0. An iteration is
+ *
+ *   repeat[(period + 7) / 8]  bit j set if entry j uses the same map as
+ *                             in the previous iteration (all
+ *                             TRACE_DELTA_SAME for the first one)
+ *   { map[(words + 3) / 4] unless repeated, delta[number of NEW words] }
+ *                             for every entry j of the body
+ *
+ * where a map holds 2 bits per word, four words per byte starting with the
+ * low bits.
+ *
+ * TRACE_RECORD_BLOCKS stands for n_iters translation blocks executed one
+ * after the other (block traces, see traceblocks.h). The instructions of
+ * the blocks are not in the trace but in <trace>.blocks, which starts with
+ * a TraceBlocksHeader followed by every block the trace refers to, in the
+ * order they were first executed (block ids start at 0):
+ *
+ *   TraceBlockRecord
+ *   uint8_t len[icount]     size of every instruction of the block
+ *   uint8_t code[size]      the instructions, or nothing if size is 0
+ *                           because the code could not be read
+ *
+ * A block record is a sequence of varints (7 bits per byte, low bits
+ * first, high bit set on all bytes but the last), one per block:
+ *
+ *   ((id - previous id) zigzag encoded << 2) | TRACE_BLOCK_* flags
+ *   tid, pgd                 if TRACE_BLOCK_CONTEXT
+ *   next_pc - pc zigzagged   if TRACE_BLOCK_GAP
+ *
+ * The previous id of the first block is 0 and the first block always has
+ * TRACE_BLOCK_CONTEXT. Without TRACE_BLOCK_GAP, the block continued at
+ * the block that follows it in the trace. Expanded, a block gives icount
+ * entries without operands, and one byte nops if its code is unknown.
+ *
+ * TRACE_RECORD_REGS is a TraceRegsRecord, the registers right before the
+ * entry that follows. It stands for no instruction. Traces that skip
+ * instructions (tracing_taint_sparse) write one every so often, so that the
+ * register state can be picked up again after the gaps.
+ */
+#ifndef _TRACE_RECORDS_H_
+#define _TRACE_RECORDS_H_
+
+#include <inttypes.h>
+
+#define TRACE_RECORDS_VERSION 52
+
+#define TRACE_RECORD_LOOP 1
+#define TRACE_RECORD_BLOCKS 2
+#define TRACE_RECORD_REGS 3
+
+#define TRACE_DELTA_SAME 0
+#define TRACE_DELTA_STRIDE 1
+#define TRACE_DELTA_NEW 2
+
+/* Limits of the loop records written by tracecap */
+#define TRACE_LOOP_MAX_PERIOD 64          /* Instructions in the body */
+#define TRACE_LOOP_MAX_BODY (64 << 10)    /* Bytes of the body entries */
+#define TRACE_LOOP_MAX_LEN (1 << 20)      /* Bytes after which a record is closed */
+
+#define TRACE_BLOCK_CONTEXT 1
+#define TRACE_BLOCK_GAP 2
+
+/* Bytes after which a block record is closed */
+#define TRACE_BLOCKS_MAX_LEN (64 << 10)
+
+#define TRACE_BLOCKS_MAGIC "DECAFBT"
+#define TRACE_BLOCKS_VERSION 1
+
+typedef struct _trace_record_header {
+  uint32_t type;       /* TRACE_RECORD_*, where entries have address */
+  uint32_t len;        /* Bytes that follow the header */
+  uint16_t zero;       /* Always 0, where entries have inst_size */
+  uint16_t reserved;
+  uint32_t n_insns;    /* Instructions the record stands for */
+  uint32_t period;     /* TRACE_RECORD_LOOP: instructions in the body */
+  uint32_t n_iters;    /* TRACE_RECORD_LOOP: iterations, with the body
+                          TRACE_RECORD_BLOCKS: blocks */
+} TraceRecordHeader;
+
+typedef struct _trace_blocks_header {
+  char magic[8];       /* TRACE_BLOCKS_MAGIC */
+  uint32_t version;    /* TRACE_BLOCKS_VERSION */
+  uint32_t reserved;
+} TraceBlocksHeader;
+
+typedef struct _trace_block_record {
+  uint32_t pc;
+  uint16_t size;       /* Bytes of code */
+  uint16_t icount;     /* Instructions */
+} TraceBlockRecord;
+
+typedef struct _trace_regs_record {
+  uint32_t tid;
+  uint32_t eip;
+  uint32_t eflags;
+  uint32_t regs[8];    /* eax, ecx, edx, ebx, esp, ebp, esi, edi */
+  uint32_t reserved;
+  uint64_t n_executed; /* Instructions executed since the trace started,
+                          written or not */
+} TraceRegsRecord;
+
+#endif // _TRACE_RECORDS_H_
@@ -0,0 +1,344 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "DECAF_target.h"
+#include "vmi_c_wrapper.h"
+#include "trace.h"
+#include "trace_records.h"
+#include "traceblocks.h"
+
+/* Initial size of the translation block table, a power of 2 */
+#define BT_HASH_SIZE 4096
+#define BT_HASH(tb) ((uint32_t)(((uintptr_t)(tb) >> 4) * 2654435761u))
+
+/* Largest encoding of a block: a varint for the id and the flags, and
+   three more for the context and the next pc */
+#define BT_MAX_BLOCK (4 * 5)
+
+/* A translation block and its id in the block table. A block is only
+   saved again if QEMU gives its TranslationBlock to other code */
+typedef struct _bt_entry {
+    struct TranslationBlock *tb;   /* NULL if free */
+    uint32_t pc;
+    uint16_t size;
+    uint16_t icount;
+    uint32_t id;
+} BTEntry;
+
+struct _block_trace {
+    FILE *table;
+    BTEntry *hash;
+    uint32_t hash_size;
+    uint32_t n_used;
+    uint32_t n_ids;
+
+    /* Last block, held back until the next one tells where it went */
+    int pending;
+    BTEntry p_block;
+    uint32_t p_next_pc;
+    uint32_t p_tid;
+    uint32_t p_pgd;
+
+    /* Record being built */
+    unsigned char rec[sizeof(TraceRecordHeader) + TRACE_BLOCKS_MAX_LEN
+            + BT_MAX_BLOCK];
+    size_t rec_len;
+    uint32_t n_insns;
+    uint32_t n_blocks;
+    uint32_t prev_id;
+    uint32_t tid;
+    uint32_t pgd;
+    uint32_t min_eip;
+    uint32_t max_eip;
+};
+
+static inline unsigned char *
+bt_put_varint(unsigned char *p, uint32_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline uint32_t
+bt_zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+/* Save the code of tb in the block table */
+static int
+bt_save_block(BlockTrace *bt, CPUState *env, BTEntry *e)
+{
+    TraceBlockRecord br;
+    unsigned char code[TARGET_PAGE_SIZE];
+    unsigned char len[TARGET_PAGE_SIZE];
+    uint32_t i, off;
+
+    br.pc = e->pc;
+    br.size = e->size;
+    br.icount = e->icount;
+    if (br.size > sizeof(code) || br.icount > sizeof(len)
+            || DECAF_read_mem(env, br.pc, br.size, code) != 0)
+        br.size = 0;
+
+    /* the instruction boundaries are kept, so that the reader does not
+       have to disassemble the blocks to expand them */
+    for (i = 0, off = 0; i < br.icount; i++) {
+        len[i] = 0;
+        if (off < br.size) {
+            len[i] = insn_length(code + off, br.size - off);
+            if (len[i] == 0 || i == br.icount - 1 || off + len[i] > br.size)
+                len[i] = (br.size - off < MAX_INSN_BYTES)
+                        ? br.size - off : MAX_INSN_BYTES;
+            off += len[i];
+        }
+    }
+    /* every instruction must have some of the code */
+    if (off != br.size || (br.icount && len[br.icount - 1] == 0))
+        br.size = 0;
+    if (br.size == 0)
+        memset(len, 0, br.icount);
+
+    if (fwrite(&br, sizeof(br), 1, bt->table) != 1
+            || fwrite(len, 1, br.icount, bt->table) != br.icount
+            || fwrite(code, 1, br.size, bt->table) != br.size)
+        return -1;
+    return 0;
+}
+
+static int
+bt_grow(BlockTrace *bt)
+{
+    BTEntry *old = bt->hash;
+    uint32_t i, old_size = bt->hash_size;
+
+    bt->hash = calloc(2 * old_size, sizeof(BTEntry));
+    if (bt->hash == NULL) {
+        bt->hash = old;
+        return -1;
+    }
+    bt->hash_size = 2 * old_size;
+
+    for (i = 0; i < old_size; i++) {
+        uint32_t h;
+        if (old[i].tb == NULL)
+            continue;
+        for (h = BT_HASH(old[i].tb); bt->hash[h & (bt->hash_size - 1)].tb;
+                h++)
+            ;
+        bt->hash[h & (bt->hash_size - 1)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* The table entry of tb, saving it if it is new. Returns NULL on error */
+static BTEntry *
+bt_lookup(BlockTrace *bt, CPUState *env, struct TranslationBlock *tb)
+{
+    uint32_t h, mask = bt->hash_size - 1;
+    BTEntry *e;
+
+    for (h = BT_HASH(tb); (e = &bt->hash[h & mask])->tb; h++) {
+        if (e->tb == tb) {
+            if (e->pc == tb->pc && e->size == tb->size
+                    && e->icount == tb->icount)
+                return e;
+            break;
+        }
+    }
+
+    /* keep at least half of the table free */
+    if (e->tb == NULL) {
+        if (2 * (bt->n_used + 1) > bt->hash_size) {
+            if (bt_grow(bt) != 0)
+                return NULL;
+            return bt_lookup(bt, env, tb);
+        }
+        bt->n_used++;
+    }
+
+    e->tb = tb;
+    e->pc = tb->pc;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->id = bt->n_ids++;
+    if (bt_save_block(bt, env, e) != 0)
+        return NULL;
+    return e;
+}
+
+/* Write out the record as it is */
+static void
+bt_write_record(BlockTrace *bt, TraceWriter *tw)
+{
+    TraceRecordHeader rh;
+
+    if (bt->n_blocks == 0)
+        return;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.type = TRACE_RECORD_BLOCKS;
+    rh.len = bt->rec_len - sizeof(rh);
+    rh.n_insns = bt->n_insns;
+    rh.n_iters = bt->n_blocks;
+    memcpy(bt->rec, &rh, sizeof(rh));
+
+    /* without its header the trace would be unreadable, drop the record */
+    if (write_trace_header_once(tw) == 0)
+        tw_append(tw, bt->rec, bt->rec_len, bt->n_insns, bt->min_eip, bt->max_eip);
+
+    bt->rec_len = sizeof(rh);
+    bt->n_insns = 0;
+    bt->n_blocks = 0;
+    bt->prev_id = 0;
+}
+
+/* Add the pending block to the record */
+static void
+bt_emit(BlockTrace *bt, TraceWriter *tw, int gap)
+{
+    const BTEntry *e = &bt->p_block;
+    unsigned char *p = bt->rec + bt->rec_len;
+    uint32_t last = e->pc + (e->size ? e->size - 1 : 0);
+    int context = (bt->n_blocks == 0)
+            || (bt->p_tid != bt->tid) || (bt->p_pgd != bt->pgd);
+
+    p = bt_put_varint(p, (bt_zigzag(e->id - bt->prev_id) << 2)
+            | (context ? TRACE_BLOCK_CONTEXT : 0) | (gap ? TRACE_BLOCK_GAP : 0));
+    if (context) {
+        p = bt_put_varint(p, bt->p_tid);
+        p = bt_put_varint(p, bt->p_pgd);
+        bt->tid = bt->p_tid;
+        bt->pgd = bt->p_pgd;
+    }
+    if (gap)
+        p = bt_put_varint(p, bt_zigzag(bt->p_next_pc - e->pc));
+    bt->rec_len = p - bt->rec;
+    bt->prev_id = e->id;
+
+    if (bt->n_blocks == 0) {
+        bt->min_eip = e->pc;
+        bt->max_eip = last;
+    }
+    else {
+        if (e->pc < bt->min_eip)
+            bt->min_eip = e->pc;
+        if (last > bt->max_eip)
+            bt->max_eip = last;
+    }
+    bt->n_insns += e->icount;
+    bt->n_blocks++;
+    bt->pending = 0;
+
+    if (bt->rec_len >= sizeof(TraceRecordHeader) + TRACE_BLOCKS_MAX_LEN)
+        bt_write_record(bt, tw);
+}
+
+BlockTrace *
+bt_open(const char *filename)
+{
+    char tablename[256];
+    TraceBlocksHeader bh;
+    BlockTrace *bt;
+
+    bt = calloc(1, sizeof(BlockTrace));
+    if (bt == NULL)
+        return NULL;
+    bt->hash_size = BT_HASH_SIZE;
+    bt->hash = calloc(bt->hash_size, sizeof(BTEntry));
+    bt->rec_len = sizeof(TraceRecordHeader);
+
+    snprintf(tablename, sizeof(tablename), "%s.blocks", filename);
+    bt->table = fopen(tablename, "w");
+
+    memset(&bh, 0, sizeof(bh));
+    memcpy(bh.magic, TRACE_BLOCKS_MAGIC, sizeof(bh.magic));
+    bh.version = TRACE_BLOCKS_VERSION;
+    if (bt->hash == NULL || bt->table == NULL
+            || fwrite(&bh, sizeof(bh), 1, bt->table) != 1) {
+        if (bt->table)
+            fclose(bt->table);
+        free(bt->hash);
+        free(bt);
+        return NULL;
+    }
+    return bt;
+}
+
+void
+bt_block(BlockTrace *bt, TraceWriter *tw, CPUState *env,
+        struct TranslationBlock *tb, uint32_t next_pc)
+{
+    uint32_t pgd = DECAF_getPGD(env);
+    uint32_t tid;
+    int gap = 0;
+    BTEntry *e;
+
+    if (trace_do_not_write || bt == NULL || tw == NULL)
+        return;
+
+    /* a thread switch goes through the kernel, so the thread is only
+       looked up when the previous block did not lead to this one */
+    if (bt->pending)
+        gap = (bt->p_next_pc != tb->pc);
+    if (!bt->pending || gap || pgd != bt->p_pgd || tid_to_trace != -1)
+        tid = VMI_get_current_tid_c(env);
+    else
+        tid = bt->p_tid;
+
+    if (tid_to_trace != -1 && tid_to_trace != tid)
+        return;
+
+    e = bt_lookup(bt, env, tb);
+    if (e == NULL)
+        return;
+
+    if (bt->pending)
+        bt_emit(bt, tw, gap);
+
+    bt->pending = 1;
+    bt->p_block = *e;
+    bt->p_next_pc = next_pc;
+    bt->p_tid = tid;
+    bt->p_pgd = pgd;
+
+    tstats.insn_counter_traced += e->icount;
+    tstats.block_counter_traced++;
+}
+
+void
+bt_flush(BlockTrace *bt, TraceWriter *tw)
+{
+    if (bt == NULL || tw == NULL)
+        return;
+
+    /* nothing came after the last block yet */
+    if (bt->pending)
+        bt_emit(bt, tw, 1);
+    bt_write_record(bt, tw);
+    fflush(bt->table);
+}
+
+void
+bt_close(BlockTrace *bt, TraceWriter *tw)
+{
+    if (bt == NULL)
+        return;
+
+    bt_flush(bt, tw);
+    fclose(bt->table);
+    free(bt->hash);
+    free(bt);
+}
@@ -0,0 +1,45 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+/*
+ * traceblocks.h
+ *
+ * Block traces. Instead of an entry per instruction, the trace only gets
+ * the sequence of translation blocks that were executed, as
+ * TRACE_RECORD_BLOCKS records (see trace_records.h). The code of each block
+ * is saved once, in <trace>.blocks, and trace_reader expands the blocks
+ * back into their instructions, without operands.
+ */
+#ifndef _TRACEBLOCKS_H_
+#define _TRACEBLOCKS_H_
+
+#include <inttypes.h>
+#include "trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct _block_trace BlockTrace;
+
+/* Create the block table of the trace in filename. Returns NULL on error */
+BlockTrace *bt_open(const char *filename);
+
+/* Add the execution of tb, which continued at next_pc */
+void bt_block(BlockTrace *bt, TraceWriter *tw, CPUState *env,
+        struct TranslationBlock *tb, uint32_t next_pc);
+
+/* Write out the blocks held back */
+void bt_flush(BlockTrace *bt, TraceWriter *tw);
+
+/* Flush and close the block table */
+void bt_close(BlockTrace *bt, TraceWriter *tw);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _TRACEBLOCKS_H_
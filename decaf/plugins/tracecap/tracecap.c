@@ -22,7 +22,9 @@
 #include "conditions.h" // AWH
 
 
-FILE *tracelog = 0;
+TraceWriter *tracelog = 0;
+BlockTrace *blocktrace = 0;
+int trace_taint_sparse = 0;
 FILE *tracenetlog = 0;
 FILE *tracehooklog = 0;
 FILE *calllog = 0;
@@ -62,20 +64,36 @@ int tracing_start(uint32_t pid, const char *filename)
   /* If previous trace did not close properly, close files now */
   if (tracelog){
  //   close_trace(tracelog); //update to tracereader version 50
-  fclose(tracelog);
+  bt_close(blocktrace, tracelog);
+  blocktrace = 0;
+  tw_close(tracelog);
 }
   if (tracenetlog)
     fclose(tracenetlog);
 
   /* Initialize trace file */
-  tracelog = fopen(filename, "w");
+  tracelog = tw_open(filename, (conf_compress_trace ? TW_COMPRESS : 0)
+      | (conf_compress_loops ? TW_LOOPS : 0)
+      | ((conf_trace_blocks || tracing_taint_sparse()) ? TW_RECORDS : 0));
   if (0 == tracelog) {
     perror("tracing_start");
     tracepid = 0;
     tracecr3 = 0;
     return -1;
   }
-  setvbuf(tracelog, filebuf, _IOFBF, FILEBUFSIZE);
+
+  /* Block traces only get the executed blocks, see traceblocks.h */
+  if (conf_trace_blocks) {
+    blocktrace = bt_open(filename);
+    if (0 == blocktrace) {
+      perror("tracing_start");
+      tw_close(tracelog);
+      tracelog = 0;
+      tracepid = 0;
+      tracecr3 = 0;
+      return -1;
+    }
+  }
 
   /* Initialize netlog file */
   char netname[128];
@@ -106,7 +124,6 @@ int tracing_start(uint32_t pid, const char *filename)
       tracecr3 = 0;
       return -1;
     }
-    setvbuf(calllog, filebuf, _IOFBF, FILEBUFSIZE);
   }
 
   /* Set PID and CR3 of the process to be traced */
@@ -125,6 +142,7 @@ int tracing_start(uint32_t pid, const char *filename)
 
   /* Initialize disassembler */
   xed2_init();
+  decode_cache_flush();
 
   /* Clear trace statistics */
   clear_trace_stats();
@@ -134,7 +152,13 @@ int tracing_start(uint32_t pid, const char *filename)
   //init_st();
 
   /* Initialize hooks only for this process */
-  decaf_plugin->monitored_cr3 = tracecr3;
+  tracing_interface.monitored_cr3 = tracecr3;
+
+  /* Block traces have no instructions to skip */
+  trace_taint_sparse = tracing_taint_sparse() && (blocktrace == 0);
+
+  /* Only instrument what can be traced */
+  tracing_filter_update();
 
   /* Get system start usage */
   if (getrusage(RUSAGE_SELF, &startUsage) != 0)
@@ -151,7 +175,9 @@ void tracing_stop()
 
   if (tracelog) {
     //close_trace(tracelog); //update to tracereader version 50
-   fclose(tracelog);
+    bt_close(blocktrace, tracelog);
+    blocktrace = 0;
+    tw_close(tracelog);
     tracelog = 0;
   }
 
@@ -159,7 +185,10 @@ void tracing_stop()
   print_trace_stats();
   should_trace_all_kernel=0;
   procname_clear();
+  modfilter_clear();
   tracepid=0;
+  trace_taint_sparse = 0;
+  tracing_filter_update();
   /* Get system stop usage */
   struct rusage stopUsage;
   if (getrusage(RUSAGE_SELF, &stopUsage) == 0) {
@@ -14,6 +14,7 @@
 #include <inttypes.h>
 #include <sys/user.h>
 #include "trace.h"
+#include "traceblocks.h"
 #include "../shared/hookapi.h"
 
 
@@ -41,13 +42,16 @@ extern "C" {
 #endif // __cplusplus
 
 /* External Variables */
-extern FILE *tracelog;
+extern TraceWriter *tracelog;
+extern BlockTrace *blocktrace; // Set while tracing blocks only
+extern int trace_taint_sparse; // Set while tracing taint-propagating instructions only
 extern FILE *tracenetlog;
 extern FILE *tracehooklog;
 extern FILE *calllog;
 extern FILE *alloclog;
 extern uint32_t tracepid;
 extern uint32_t tracecr3;
+extern plugin_interface_t tracing_interface;
 extern EntryHeader eh;
 
 extern uint32_t current_tid; // Current thread id
@@ -0,0 +1,412 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "trace_records.h"
+#include "traceloop.h"
+
+/* Recent entries kept to find loops, enough for two iterations */
+#define TL_HISTORY (2 * TRACE_LOOP_MAX_PERIOD)
+/* Last entry seen at each (hashed) address */
+#define TL_HASH_SIZE 256
+#define TL_HASH(address) (((address) ^ ((address) >> 8)) & (TL_HASH_SIZE - 1))
+
+/* Words of the body entries. Entries are rounded up to words, so a body
+   within TRACE_LOOP_MAX_BODY bytes can still have more */
+#define TL_MAX_WORDS (TRACE_LOOP_MAX_BODY / 4)
+/* Bytes of the maps of the body, each entry rounds its map up to a byte */
+#define TL_MAX_MAPS (TL_MAX_WORDS / 4 + TRACE_LOOP_MAX_PERIOD)
+/* Largest encoding of an iteration: repeat flags, maps and deltas */
+#define TL_MAX_ITERATION \
+    ((TRACE_LOOP_MAX_PERIOD + 7) / 8 + TL_MAX_MAPS + 4 * TL_MAX_WORDS)
+
+/* What has to match for two entries to be the same loop instruction */
+typedef struct _tl_key {
+    uint32_t address;
+    uint32_t len;
+    uint16_t inst_size;
+    uint8_t num_operands;
+    unsigned char rawbytes[MAX_INSN_BYTES];
+} TLKey;
+
+struct _trace_loop {
+    /* Loop detection. match counts the last entries that are the same as
+       the entry period positions before */
+    TLKey history[TL_HISTORY];
+    uint64_t n_seen;
+    uint64_t last[TL_HASH_SIZE];   /* 1 + index of the entry, 0 if none */
+    uint32_t period;
+    uint32_t match;
+
+    /* Loop being compressed, active is 0 while looking for one */
+    int active;
+    uint32_t body_len;             /* Instructions in the body */
+    TLKey body[TRACE_LOOP_MAX_PERIOD];
+    uint32_t word_off[TRACE_LOOP_MAX_PERIOD];
+    uint32_t map_off[TRACE_LOOP_MAX_PERIOD];
+    uint32_t entry_off[TRACE_LOOP_MAX_PERIOD];
+    uint32_t pos;                  /* Body position of the next entry */
+    int in_body;                   /* Still collecting the first iteration */
+    uint32_t n_iters;              /* Iterations in rec */
+    uint32_t min_eip;
+    uint32_t max_eip;
+
+    uint32_t prev[TL_MAX_WORDS];   /* Words of the last iteration */
+    uint32_t stride[TL_MAX_WORDS]; /* And how much they changed */
+    unsigned char maps[TL_MAX_MAPS];
+    unsigned char map[TL_MAX_WORDS / 4 + 1];
+
+    unsigned char *rec;            /* Record header, body and iterations */
+    size_t rec_len;
+    unsigned char *iter;           /* Iteration being encoded */
+    size_t iter_len;
+    unsigned char *entry;          /* Copy of the entry being committed */
+};
+
+static inline uint32_t
+tl_words(uint32_t len)
+{
+    return (len + 3) / 4;
+}
+
+/* Word w of an entry, zero padded at the end */
+static inline uint32_t
+tl_load_word(const unsigned char *p, size_t len, uint32_t w)
+{
+    uint32_t v = 0;
+    size_t off = 4 * w;
+
+    memcpy(&v, p + off, (len - off < 4) ? len - off : 4);
+    return v;
+}
+
+static void
+tl_key_fill(TLKey *k, const unsigned char *p, size_t len)
+{
+    memcpy(&k->address, p, sizeof(k->address));
+    memcpy(&k->inst_size, p + 8, sizeof(k->inst_size));
+    k->num_operands = p[10];
+    k->len = len;
+    memset(k->rawbytes, 0, sizeof(k->rawbytes));
+    memcpy(k->rawbytes, p + ENTRY_HEADER_FIXED_SIZE,
+            (k->inst_size < MAX_INSN_BYTES) ? k->inst_size : MAX_INSN_BYTES);
+}
+
+static inline int
+tl_key_equal(const TLKey *a, const TLKey *b)
+{
+    return (a->address == b->address) && (a->len == b->len)
+            && (a->inst_size == b->inst_size)
+            && (a->num_operands == b->num_operands)
+            && (memcmp(a->rawbytes, b->rawbytes, sizeof(a->rawbytes)) == 0);
+}
+
+static void
+tl_reset_detection(TraceLoop *tl)
+{
+    tl->n_seen = 0;
+    tl->period = 0;
+    tl->match = 0;
+    memset(tl->last, 0, sizeof(tl->last));
+}
+
+/* Add an entry to the history. Returns 1 once the last 2 * period entries
+   are two iterations of the same loop */
+static int
+tl_detect(TraceLoop *tl, const TLKey *k)
+{
+    uint64_t t = tl->n_seen++;
+    uint32_t h = TL_HASH(k->address);
+
+    if (tl->period && t >= tl->period
+            && tl_key_equal(&tl->history[(t - tl->period) % TL_HISTORY], k)) {
+        tl->match++;
+    }
+    else {
+        tl->period = 0;
+        tl->match = 0;
+        if (tl->last[h]) {
+            uint64_t prev = tl->last[h] - 1;
+            if ((t - prev <= TRACE_LOOP_MAX_PERIOD)
+                    && tl_key_equal(&tl->history[prev % TL_HISTORY], k)) {
+                tl->period = t - prev;
+                tl->match = 1;
+            }
+        }
+    }
+
+    tl->history[t % TL_HISTORY] = *k;
+    tl->last[h] = t + 1;
+
+    return tl->period && (tl->match >= tl->period);
+}
+
+/* Start compressing the loop of the last period entries, the next entry
+   is expected to be the first one of the body */
+static void
+tl_start(TraceLoop *tl)
+{
+    uint64_t first = tl->n_seen - tl->period;
+    uint32_t j, body_bytes = 0, words = 0, map_bytes = 0;
+
+    for (j = 0; j < tl->period; j++) {
+        tl->body[j] = tl->history[(first + j) % TL_HISTORY];
+        body_bytes += tl->body[j].len;
+        words += tl_words(tl->body[j].len);
+        map_bytes += (tl_words(tl->body[j].len) + 3) / 4;
+    }
+    /* keep the limits on the body and the room for its words, and look
+       for another loop. The entries stay plain ones */
+    if ((body_bytes > TRACE_LOOP_MAX_BODY) || (words > TL_MAX_WORDS)
+            || (map_bytes > sizeof(tl->maps))) {
+        tl->period = 0;
+        tl->match = 0;
+        return;
+    }
+
+    tl->active = 1;
+    tl->body_len = tl->period;
+    tl->pos = 0;
+    tl->in_body = 1;
+    tl->n_iters = 0;
+    tl->rec_len = sizeof(TraceRecordHeader);
+}
+
+/* The entries of the body, written out as plain entries */
+static void
+tl_write_body(TraceLoop *tl, TraceWriter *tw, uint32_t n)
+{
+    uint32_t j;
+
+    for (j = 0; j < n; j++) {
+        tw_append(tw, tl->rec + tl->entry_off[j], tl->body[j].len, 1,
+                tl->body[j].address, tl->body[j].address);
+    }
+}
+
+/* Write out the record as it is */
+static void
+tl_write_record(TraceLoop *tl, TraceWriter *tw)
+{
+    TraceRecordHeader rh;
+
+    /* a lone body is not worth a record */
+    if (tl->n_iters < 2) {
+        tl_write_body(tl, tw, tl->body_len);
+        return;
+    }
+
+    memset(&rh, 0, sizeof(rh));
+    rh.type = TRACE_RECORD_LOOP;
+    rh.len = tl->rec_len - sizeof(rh);
+    rh.n_insns = tl->body_len * tl->n_iters;
+    rh.period = tl->body_len;
+    rh.n_iters = tl->n_iters;
+    memcpy(tl->rec, &rh, sizeof(rh));
+
+    tw_append(tw, tl->rec, tl->rec_len, rh.n_insns, tl->min_eip, tl->max_eip);
+}
+
+/* Write out everything held back and look for a new loop */
+static void
+tl_stop(TraceLoop *tl, TraceWriter *tw)
+{
+    uint32_t j, w;
+
+    if (tl->in_body) {
+        tl_write_body(tl, tw, tl->pos);
+    }
+    else {
+        tl_write_record(tl, tw);
+
+        /* the entries of an unfinished iteration are in prev, rebuild them
+           in the (now unused) iteration buffer */
+        for (j = 0; j < tl->pos; j++) {
+            for (w = 0; w < tl_words(tl->body[j].len); w++)
+                memcpy(tl->iter + 4 * w, &tl->prev[tl->word_off[j] + w], 4);
+            tw_append(tw, tl->iter, tl->body[j].len, 1,
+                    tl->body[j].address, tl->body[j].address);
+        }
+    }
+
+    tl->active = 0;
+    tl_reset_detection(tl);
+}
+
+/* Add entry j of the body */
+static void
+tl_add_body_entry(TraceLoop *tl, uint32_t j, const unsigned char *p)
+{
+    uint32_t len = tl->body[j].len;
+    uint32_t w, words = tl_words(len);
+
+    if (j == 0) {
+        tl->word_off[0] = 0;
+        tl->map_off[0] = 0;
+        tl->min_eip = tl->max_eip = tl->body[0].address;
+    }
+    else {
+        tl->word_off[j] = tl->word_off[j - 1] + tl_words(tl->body[j - 1].len);
+        tl->map_off[j] = tl->map_off[j - 1]
+                + (tl_words(tl->body[j - 1].len) + 3) / 4;
+        if (tl->body[j].address < tl->min_eip)
+            tl->min_eip = tl->body[j].address;
+        else if (tl->body[j].address > tl->max_eip)
+            tl->max_eip = tl->body[j].address;
+    }
+
+    tl->entry_off[j] = tl->rec_len;
+    memcpy(tl->rec + tl->rec_len, p, len);
+    tl->rec_len += len;
+
+    for (w = 0; w < words; w++) {
+        tl->prev[tl->word_off[j] + w] = tl_load_word(p, len, w);
+        tl->stride[tl->word_off[j] + w] = 0;
+    }
+    memset(tl->maps + tl->map_off[j], 0, (words + 3) / 4);
+}
+
+/* Encode entry j of the current iteration */
+static void
+tl_add_delta_entry(TraceLoop *tl, uint32_t j, const unsigned char *p)
+{
+    uint32_t len = tl->body[j].len;
+    uint32_t w, words = tl_words(len), map_len = (words + 3) / 4;
+    uint32_t *prev = tl->prev + tl->word_off[j];
+    uint32_t *stride = tl->stride + tl->word_off[j];
+    unsigned char *q;
+
+    memset(tl->map, 0, map_len);
+    for (w = 0; w < words; w++) {
+        uint32_t d = tl_load_word(p, len, w) - prev[w];
+        int code = (d == 0) ? TRACE_DELTA_SAME
+                : (d == stride[w]) ? TRACE_DELTA_STRIDE : TRACE_DELTA_NEW;
+        tl->map[w / 4] |= code << (2 * (w % 4));
+    }
+
+    if (memcmp(tl->map, tl->maps + tl->map_off[j], map_len) == 0) {
+        tl->iter[j / 8] |= 1 << (j % 8);
+    }
+    else {
+        memcpy(tl->iter + tl->iter_len, tl->map, map_len);
+        memcpy(tl->maps + tl->map_off[j], tl->map, map_len);
+        tl->iter_len += map_len;
+    }
+
+    q = tl->iter + tl->iter_len;
+    for (w = 0; w < words; w++) {
+        uint32_t d = tl_load_word(p, len, w) - prev[w];
+        if (((tl->map[w / 4] >> (2 * (w % 4))) & 3) == TRACE_DELTA_NEW) {
+            memcpy(q, &d, 4);
+            q += 4;
+        }
+        prev[w] += d;
+        stride[w] = d;
+    }
+    tl->iter_len = q - tl->iter;
+}
+
+static void
+tl_start_iteration(TraceLoop *tl)
+{
+    tl->iter_len = (tl->body_len + 7) / 8;
+    memset(tl->iter, 0, tl->iter_len);
+}
+
+TraceLoop *
+tl_new(void)
+{
+    TraceLoop *tl = calloc(1, sizeof(TraceLoop));
+
+    if (tl == NULL)
+        return NULL;
+
+    tl->rec = malloc(TRACE_LOOP_MAX_LEN + TL_MAX_ITERATION);
+    tl->iter = malloc(TL_MAX_ITERATION);
+    tl->entry = malloc(TRACE_MAX_ENTRY_SIZE);
+    if (tl->rec == NULL || tl->iter == NULL || tl->entry == NULL) {
+        tl_free(tl);
+        return NULL;
+    }
+    return tl;
+}
+
+void
+tl_free(TraceLoop *tl)
+{
+    if (tl == NULL)
+        return;
+    free(tl->rec);
+    free(tl->iter);
+    free(tl->entry);
+    free(tl);
+}
+
+int
+tl_commit(TraceLoop *tl, TraceWriter *tw, const unsigned char *entry,
+        size_t len, uint32_t eip)
+{
+    TLKey k;
+
+    tl_key_fill(&k, entry, len);
+
+    if (!tl->active) {
+        if (tl_detect(tl, &k))
+            tl_start(tl);
+        return 0;
+    }
+
+    /* the loop is over, the entry is written after what was held back.
+       Writing may reuse the chunk it is in, so copy it first */
+    if (!tl_key_equal(&tl->body[tl->pos], &k)) {
+        memcpy(tl->entry, entry, len);
+        tl_stop(tl, tw);
+        tw_append(tw, tl->entry, len, 1, eip, eip);
+        tl_detect(tl, &k);
+        return 1;
+    }
+
+    if (tl->in_body) {
+        tl_add_body_entry(tl, tl->pos, entry);
+        if (++tl->pos == tl->body_len) {
+            tl->in_body = 0;
+            tl->pos = 0;
+            tl->n_iters = 1;
+            tl_start_iteration(tl);
+        }
+        return 1;
+    }
+
+    tl_add_delta_entry(tl, tl->pos, entry);
+    if (++tl->pos == tl->body_len) {
+        memcpy(tl->rec + tl->rec_len, tl->iter, tl->iter_len);
+        tl->rec_len += tl->iter_len;
+        tl->n_iters++;
+        tl->pos = 0;
+
+        /* the next iteration starts a new record */
+        if (tl->rec_len >= TRACE_LOOP_MAX_LEN) {
+            tl_write_record(tl, tw);
+            tl->in_body = 1;
+            tl->n_iters = 0;
+            tl->rec_len = sizeof(TraceRecordHeader);
+        }
+        else {
+            tl_start_iteration(tl);
+        }
+    }
+    return 1;
+}
+
+void
+tl_flush(TraceLoop *tl, TraceWriter *tw)
+{
+    if (tl->active)
+        tl_stop(tl, tw);
+}
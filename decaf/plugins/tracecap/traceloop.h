@@ -0,0 +1,46 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+/*
+ * traceloop.h
+ *
+ * Online loop compression for the trace writer. Every committed entry is
+ * compared with the recent ones; once the last two iterations of a loop
+ * had the same instructions, the following iterations are held back and
+ * stored as TRACE_RECORD_LOOP records (see trace_records.h) that only keep
+ * the values that change.
+ */
+#ifndef _TRACELOOP_H_
+#define _TRACELOOP_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "tracewriter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct _trace_loop TraceLoop;
+
+TraceLoop *tl_new(void);
+void tl_free(TraceLoop *tl);
+
+/* Called by tw_commit() with the len bytes of the entry at eip. Returns 0
+   if the entry must be committed as usual, or 1 if the loop compressor
+   took it. In that case the entry may already have been written out with
+   tw_append() */
+int tl_commit(TraceLoop *tl, TraceWriter *tw, const unsigned char *entry,
+        size_t len, uint32_t eip);
+
+/* Write out everything held back */
+void tl_flush(TraceLoop *tl, TraceWriter *tw);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _TRACELOOP_H_
@@ -0,0 +1,399 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "utils/SlotQueue.h"
+#include "trace.h"
+#include "trace_container.h"
+#include "trace_records.h"
+#include "traceloop.h"
+#include "tracewriter.h"
+
+typedef struct _trace_chunk {
+    unsigned char *buf;
+    size_t len;
+    uint32_t n_insns;
+    uint64_t first_insn;
+    uint32_t min_eip;
+    uint32_t max_eip;
+} TraceChunk;
+
+/* Chunks are used in ring order: the emulation thread fills the chunk of
+   the queue's fill slot and the writer thread stores the submitted ones */
+struct _trace_writer {
+    int fd;
+    int compress;
+    int records;
+    TraceLoop *loop;
+    off_t offset;
+    uint64_t n_insns;
+    int tables_written;
+    TraceChunk chunks[TRACE_WRITER_CHUNKS];
+    SlotQueue_t *queue;
+    int error;
+
+    /* Compressed mode, owned by the writer thread */
+    unsigned char *zbuf;
+    size_t zbuf_size;
+    TraceChunkIndex *index;
+    uint32_t n_chunks;
+    uint32_t index_size;
+};
+
+/* Store len bytes at the current file offset */
+static void
+tw_pwrite(TraceWriter *tw, const void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (!tw->error && done < len) {
+        ssize_t ret = pwrite(tw->fd, (const char *)buf + done,
+                len - done, tw->offset + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("tracewriter");
+            tw->error = 1;
+            break;
+        }
+        done += ret;
+    }
+    tw->offset += len;
+}
+
+/* Deflate a chunk, store it and record it in the index */
+static void
+tw_store_compressed(TraceWriter *tw, TraceChunk *chunk)
+{
+    TraceChunkHeader *ch = (TraceChunkHeader *)tw->zbuf;
+    TraceChunkIndex *ci;
+    uLongf comp_len = tw->zbuf_size - sizeof(TraceChunkHeader);
+
+    if (compress2(tw->zbuf + sizeof(TraceChunkHeader), &comp_len,
+            chunk->buf, chunk->len, 1) != Z_OK) {
+        fprintf(stderr, "tracewriter: could not compress chunk\n");
+        tw->error = 1;
+        return;
+    }
+
+    if (tw->n_chunks == tw->index_size) {
+        uint32_t size = tw->index_size ? 2 * tw->index_size : 256;
+        ci = realloc(tw->index, size * sizeof(TraceChunkIndex));
+        if (ci == NULL) {
+            fprintf(stderr, "tracewriter: out of memory for chunk index\n");
+            tw->error = 1;
+            return;
+        }
+        tw->index = ci;
+        tw->index_size = size;
+    }
+
+    ci = &tw->index[tw->n_chunks++];
+    memset(ci, 0, sizeof(TraceChunkIndex));
+    ci->offset = tw->offset;
+    ci->first_insn = chunk->first_insn;
+    ci->n_insns = chunk->n_insns;
+    ci->min_eip = chunk->min_eip;
+    ci->max_eip = chunk->max_eip;
+    ci->comp_len = comp_len;
+    ci->raw_len = chunk->len;
+
+    ch->magic = TRACE_CHUNK_MAGIC;
+    ch->comp_len = ci->comp_len;
+    ch->raw_len = ci->raw_len;
+    ch->n_insns = ci->n_insns;
+    ch->first_insn = ci->first_insn;
+    ch->min_eip = ci->min_eip;
+    ch->max_eip = ci->max_eip;
+
+    tw_pwrite(tw, tw->zbuf, sizeof(TraceChunkHeader) + comp_len);
+}
+
+/* Store a chunk, in the writer thread */
+static void
+tw_store(void *opaque, int slot)
+{
+    TraceWriter *tw = opaque;
+    TraceChunk *chunk = &tw->chunks[slot];
+
+    if (tw->error)
+        ;
+    else if (tw->compress)
+        tw_store_compressed(tw, chunk);
+    else
+        tw_pwrite(tw, chunk->buf, chunk->len);
+    chunk->len = 0;
+    chunk->n_insns = 0;
+}
+
+/* The chunk being filled */
+static inline TraceChunk *
+tw_chunk(TraceWriter *tw)
+{
+    return &tw->chunks[SlotQueue_fill_slot(tw->queue)];
+}
+
+TraceWriter *
+tw_open(const char *filename, int flags)
+{
+    TraceWriter *tw;
+    int i;
+
+    tw = calloc(1, sizeof(TraceWriter));
+    if (tw == NULL)
+        return NULL;
+
+    tw->compress = (flags & TW_COMPRESS) != 0;
+    tw->records = (flags & (TW_LOOPS | TW_RECORDS)) != 0;
+    if (tw->compress) {
+        tw->zbuf_size = sizeof(TraceChunkHeader) + compressBound(TRACE_CHUNK_SIZE);
+        tw->zbuf = malloc(tw->zbuf_size);
+        if (tw->zbuf == NULL) {
+            free(tw);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    if (flags & TW_LOOPS) {
+        tw->loop = tl_new();
+        if (tw->loop == NULL) {
+            free(tw->zbuf);
+            free(tw);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    tw->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tw->fd < 0) {
+        tl_free(tw->loop);
+        free(tw->zbuf);
+        free(tw);
+        return NULL;
+    }
+
+    for (i = 0; i < TRACE_WRITER_CHUNKS; i++) {
+        tw->chunks[i].buf = malloc(TRACE_CHUNK_SIZE);
+        if (tw->chunks[i].buf == NULL) {
+            while (i-- > 0)
+                free(tw->chunks[i].buf);
+            close(tw->fd);
+            tl_free(tw->loop);
+            free(tw->zbuf);
+            free(tw);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    tw->queue = SlotQueue_new(TRACE_WRITER_CHUNKS, tw_store, tw);
+    if (tw->queue == NULL) {
+        for (i = 0; i < TRACE_WRITER_CHUNKS; i++)
+            free(tw->chunks[i].buf);
+        close(tw->fd);
+        tl_free(tw->loop);
+        free(tw->zbuf);
+        free(tw);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return tw;
+}
+
+int
+tw_trace_version(TraceWriter *tw)
+{
+    return tw->records ? TRACE_RECORDS_VERSION : VERSION_NUMBER;
+}
+
+/* Hand the current chunk to the writer thread and wait for a free one */
+static void
+tw_submit(TraceWriter *tw)
+{
+    if (tw_chunk(tw)->len == 0)
+        return;
+
+    SlotQueue_submit(tw->queue);
+}
+
+/* Append len bytes, splitting them across chunks if needed */
+static void
+tw_write(TraceWriter *tw, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        TraceChunk *chunk = tw_chunk(tw);
+        size_t n = TRACE_CHUNK_SIZE - chunk->len;
+
+        if (n == 0) {
+            tw_submit(tw);
+            continue;
+        }
+        if (n > len)
+            n = len;
+        memcpy(chunk->buf + chunk->len, p, n);
+        chunk->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void
+tw_write_tables(TraceWriter *tw, const void *buf, size_t len)
+{
+    TraceContainerHeader th;
+
+    if (!tw->compress) {
+        tw_write(tw, buf, len);
+        tw_flush(tw);
+        return;
+    }
+
+    /* No chunk has been submitted yet, so the file offset is still ours */
+    memset(&th, 0, sizeof(th));
+    memcpy(th.magic, TRACE_CONTAINER_MAGIC, sizeof(th.magic));
+    th.version = TRACE_CONTAINER_VERSION;
+    th.trace_version = tw_trace_version(tw);
+    th.tables_len = len;
+
+    tw->offset = 0;
+    tw_pwrite(tw, &th, sizeof(th));
+    tw_pwrite(tw, buf, len);
+    tw->tables_written = 1;
+}
+
+void
+tw_close(TraceWriter *tw)
+{
+    int i;
+
+    if (tw == NULL)
+        return;
+
+    if (tw->compress && !tw->tables_written)
+        tw_write_tables(tw, NULL, 0);
+
+    if (tw->loop)
+        tl_flush(tw->loop, tw);
+    tw_submit(tw);
+
+    SlotQueue_delete(tw->queue);
+
+    /* Append the chunk index and the footer */
+    if (tw->compress) {
+        TraceContainerFooter tf;
+
+        memset(&tf, 0, sizeof(tf));
+        tf.index_offset = tw->offset;
+        tf.n_insns = tw->n_insns;
+        tf.n_chunks = tw->n_chunks;
+        memcpy(tf.magic, TRACE_CONTAINER_MAGIC, sizeof(tf.magic));
+        tw_pwrite(tw, tw->index, tw->n_chunks * sizeof(TraceChunkIndex));
+        tw_pwrite(tw, &tf, sizeof(tf));
+    }
+
+    close(tw->fd);
+    for (i = 0; i < TRACE_WRITER_CHUNKS; i++)
+        free(tw->chunks[i].buf);
+    free(tw->index);
+    free(tw->zbuf);
+    tl_free(tw->loop);
+    free(tw);
+}
+
+unsigned char *
+tw_reserve(TraceWriter *tw, size_t len)
+{
+    TraceChunk *chunk = tw_chunk(tw);
+
+    if (chunk->len + len > TRACE_CHUNK_SIZE) {
+        tw_submit(tw);
+        chunk = tw_chunk(tw);
+    }
+    return chunk->buf + chunk->len;
+}
+
+/* Account for len bytes of the current chunk */
+static void
+tw_advance(TraceWriter *tw, size_t len, uint32_t n_insns,
+        uint32_t min_eip, uint32_t max_eip)
+{
+    TraceChunk *chunk = tw_chunk(tw);
+
+    if (chunk->len == 0) {
+        chunk->first_insn = tw->n_insns;
+        chunk->min_eip = chunk->max_eip = 0;
+    }
+
+    /* records without instructions have no eip range */
+    if (n_insns == 0) {
+        chunk->len += len;
+        return;
+    }
+
+    if (chunk->n_insns == 0) {
+        chunk->min_eip = min_eip;
+        chunk->max_eip = max_eip;
+    }
+    else {
+        if (min_eip < chunk->min_eip)
+            chunk->min_eip = min_eip;
+        if (max_eip > chunk->max_eip)
+            chunk->max_eip = max_eip;
+    }
+
+    chunk->n_insns += n_insns;
+    chunk->len += len;
+    tw->n_insns += n_insns;
+}
+
+void
+tw_commit(TraceWriter *tw, size_t len, uint32_t eip)
+{
+    TraceChunk *chunk = tw_chunk(tw);
+
+    if (tw->loop && tl_commit(tw->loop, tw, chunk->buf + chunk->len, len, eip))
+        return;
+
+    tw_advance(tw, len, 1, eip, eip);
+}
+
+void
+tw_append(TraceWriter *tw, const void *buf, size_t len,
+        uint32_t n_insns, uint32_t min_eip, uint32_t max_eip)
+{
+    unsigned char *p = tw_reserve(tw, len);
+
+    memcpy(p, buf, len);
+    tw_advance(tw, len, n_insns, min_eip, max_eip);
+}
+
+void
+tw_record(TraceWriter *tw, const void *buf, size_t len)
+{
+    if (tw->loop)
+        tl_flush(tw->loop, tw);
+    tw_append(tw, buf, len, 0, 0, 0);
+}
+
+void
+tw_flush(TraceWriter *tw)
+{
+    if (tw->loop)
+        tl_flush(tw->loop, tw);
+    tw_submit(tw);
+}
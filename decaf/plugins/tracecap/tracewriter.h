@@ -0,0 +1,77 @@
+/*
+   Tracecap is owned and copyright (C) BitBlaze, 2007-2010.
+   All rights reserved.
+   Do not copy, disclose, or distribute without explicit written
+   permission.
+*/
+/*
+ * tracewriter.h
+ *
+ * Block-buffered trace output. The emulation thread serializes trace
+ * records into a preallocated chunk; full chunks are queued to a writer
+ * thread that stores them with large pwrite()s. The emulation thread only
+ * waits when every chunk is queued.
+ *
+ * In compressed mode the writer thread deflates each chunk and the file
+ * uses the container layout described in trace_container.h. With
+ * TW_LOOPS, repeated loop iterations are stored as the records described
+ * in trace_records.h (see traceloop.h).
+ */
+#ifndef _TRACEWRITER_H_
+#define _TRACEWRITER_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "trace_container.h"
+
+/* Number of TRACE_CHUNK_SIZE chunks of a trace writer */
+#define TRACE_WRITER_CHUNKS 3
+
+/* tw_open() flags */
+#define TW_COMPRESS 1   /* Write a compressed container */
+#define TW_LOOPS 2      /* Compress loops at capture time */
+#define TW_RECORDS 4    /* The trace holds other records (trace_records.h) */
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+typedef struct _trace_writer TraceWriter;
+
+/* Create filename and start its writer thread. Returns NULL on error */
+TraceWriter *tw_open(const char *filename, int flags);
+
+/* Trace version of the records the writer stores */
+int tw_trace_version(TraceWriter *tw);
+
+/* Write out all pending data, stop the writer thread and close the file */
+void tw_close(TraceWriter *tw);
+
+/* Write the trace, process and module headers. Must come before the
+   first instruction */
+void tw_write_tables(TraceWriter *tw, const void *buf, size_t len);
+
+/* Return a pointer to len contiguous bytes in the current chunk.
+   len must not exceed TRACE_CHUNK_SIZE. Nothing is written until
+   tw_commit() is called with the number of bytes actually used by the
+   instruction at eip */
+unsigned char *tw_reserve(TraceWriter *tw, size_t len);
+void tw_commit(TraceWriter *tw, size_t len, uint32_t eip);
+
+/* Append len bytes that stand for n_insns instructions between min_eip
+   and max_eip. The bytes must not come from tw_reserve() */
+void tw_append(TraceWriter *tw, const void *buf, size_t len,
+        uint32_t n_insns, uint32_t min_eip, uint32_t max_eip);
+
+/* Append a record that stands for no instruction, after everything the
+   loop compressor holds back */
+void tw_record(TraceWriter *tw, const void *buf, size_t len);
+
+/* Queue the current chunk even if it is not full */
+void tw_flush(TraceWriter *tw);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif // _TRACEWRITER_H_
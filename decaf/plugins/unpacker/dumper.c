@@ -0,0 +1,185 @@
+/*
+ Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+
+ DECAF is based on QEMU, a whole-system emulator. You can redistribute
+ and modify it under the terms of the GNU GPL, version 3 or later,
+ but it is made available WITHOUT ANY WARRANTY. See the top-level
+ README file for more details.
+
+ For more information about DECAF and other softwares, see our
+ web site at:
+ http://sycurelab.ecs.syr.edu/
+
+ If you have any questions about DECAF,please post it on
+ http://code.google.com/p/decaf-platform/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "utils/SlotQueue.h"
+
+#include "DECAF_main.h"
+#include "DECAF_target.h"
+#include "dumper.h"
+
+typedef struct _layer {
+	uint8_t *buf;
+	int version;
+	uint32_t eip;
+	uint32_t start;
+	uint32_t end;
+	uint32_t missing; //pages that could not be read
+} Layer;
+
+/* Layers are used in ring order: the emulation thread fills the layer of
+   the queue's fill slot and the dumper thread writes the submitted ones */
+struct _dumper {
+	FILE *log;
+	Layer layers[DUMPER_QUEUE_LAYERS];
+	SlotQueue_t *queue;
+
+	/* owned by the dumper thread: digest of every layer written -> its
+	   version */
+	GHashTable *digests;
+};
+
+/* Returns the version of the identical layer already dumped, or 0 */
+static int dumper_seen(Dumper *d, const Layer *l)
+{
+	GChecksum *sum;
+	gchar *digest;
+	gpointer version;
+
+	/* the same bytes somewhere else are another layer */
+	sum = g_checksum_new(G_CHECKSUM_SHA1);
+	g_checksum_update(sum, (const guchar *)&l->start, sizeof(l->start));
+	g_checksum_update(sum, l->buf, l->end - l->start);
+	digest = g_strdup(g_checksum_get_string(sum));
+	g_checksum_free(sum);
+
+	version = g_hash_table_lookup(d->digests, digest);
+	if (version) {
+		g_free(digest);
+		return GPOINTER_TO_INT(version);
+	}
+	g_hash_table_insert(d->digests, digest, GINT_TO_POINTER(l->version));
+	return 0;
+}
+
+static void dumper_write(Dumper *d, const Layer *l)
+{
+	char filename[128];
+	gzFile gz;
+	int same;
+
+	same = dumper_seen(d, l);
+	if (same) {
+		fprintf(d->log, "layer %d: eip=%08x, %08x-%08x is the same as layer %d\n",
+				l->version, l->eip, l->start, l->end - 1, same);
+		fflush(d->log);
+		return;
+	}
+
+	snprintf(filename, sizeof(filename), "dump-%d-%08x-%08x-%08x.bin.gz",
+			l->version, l->eip, l->start, l->end - 1);
+	gz = gzopen(filename, "wb1");
+	if (gz == NULL) {
+		fprintf(d->log, "layer %d: cannot open %s\n", l->version, filename);
+		fflush(d->log);
+		return;
+	}
+	if (gzwrite(gz, l->buf, l->end - l->start) != (int)(l->end - l->start))
+		fprintf(d->log, "layer %d: cannot write %s\n", l->version, filename);
+	gzclose(gz);
+
+	fprintf(d->log, "layer %d: eip=%08x, %08x-%08x dumped to %s",
+			l->version, l->eip, l->start, l->end - 1, filename);
+	if (l->missing)
+		fprintf(d->log, " (%u pages not mapped, left as zeros)", l->missing);
+	fprintf(d->log, "\n");
+	fflush(d->log);
+}
+
+/* Hash, compress and write a layer, in the dumper thread */
+static void dumper_process(void *opaque, int slot)
+{
+	Dumper *d = opaque;
+	Layer *l = &d->layers[slot];
+
+	dumper_write(d, l);
+	free(l->buf);
+	l->buf = NULL;
+}
+
+Dumper *dumper_open(FILE *log)
+{
+	Dumper *d;
+
+	d = calloc(1, sizeof(Dumper));
+	if (d == NULL)
+		return NULL;
+	d->log = log;
+	d->digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	d->queue = SlotQueue_new(DUMPER_QUEUE_LAYERS, dumper_process, d);
+	if (d->queue == NULL) {
+		g_hash_table_destroy(d->digests);
+		free(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+void dumper_capture(Dumper *d, CPUState *env, int version, uint32_t eip,
+		uint32_t start, uint32_t end)
+{
+	Layer *l;
+	uint32_t va;
+
+	if (d == NULL || end <= start)
+		return;
+	if (end - start > DUMPER_MAX_PAGES * TARGET_PAGE_SIZE)
+		end = start + DUMPER_MAX_PAGES * TARGET_PAGE_SIZE;
+
+	/* the layer being filled is always free */
+	l = &d->layers[SlotQueue_fill_slot(d->queue)];
+	l->buf = malloc(end - start);
+	if (l->buf == NULL) {
+		fprintf(d->log, "layer %d: out of memory for %u bytes\n",
+				version, end - start);
+		return;
+	}
+	l->version = version;
+	l->eip = eip;
+	l->start = start;
+	l->end = end;
+	l->missing = 0;
+
+	/* the guest is stopped while we copy, the layer is its own copy from
+	   then on */
+	for (va = start; va < end; va += TARGET_PAGE_SIZE) {
+		if (DECAF_memory_rw(env, va, l->buf + (va - start),
+				TARGET_PAGE_SIZE, 0) < 0) {
+			memset(l->buf + (va - start), 0, TARGET_PAGE_SIZE);
+			l->missing++;
+		}
+	}
+
+	SlotQueue_submit(d->queue);
+}
+
+void dumper_close(Dumper *d)
+{
+	if (d == NULL)
+		return;
+
+	SlotQueue_delete(d->queue);
+	g_hash_table_destroy(d->digests);
+	free(d);
+}
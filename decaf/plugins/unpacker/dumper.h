@@ -0,0 +1,52 @@
+/*
+ Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+
+ DECAF is based on QEMU, a whole-system emulator. You can redistribute
+ and modify it under the terms of the GNU GPL, version 3 or later,
+ but it is made available WITHOUT ANY WARRANTY. See the top-level
+ README file for more details.
+
+ For more information about DECAF and other softwares, see our
+ web site at:
+ http://sycurelab.ecs.syr.edu/
+
+ If you have any questions about DECAF,please post it on
+ http://code.google.com/p/decaf-platform/
+ */
+/*
+ * dumper.h
+ *
+ * Asynchronous dumps of the unpacked layers. The emulation thread only
+ * copies the pages of the region into a layer buffer; a dumper thread
+ * hashes the layer, drops it if an identical one was already dumped, and
+ * writes it compressed to dump-<version>-<eip>-<start>-<end>.bin.gz.
+ */
+#ifndef DUMPER_H_INCLUDED
+#define DUMPER_H_INCLUDED
+
+#include <stdio.h>
+#include <inttypes.h>
+
+/* Largest region of a layer, in pages */
+#define DUMPER_MAX_PAGES 1024
+
+/* Number of layers, one is being filled while the others wait for the
+   dumper thread */
+#define DUMPER_QUEUE_LAYERS 9
+
+typedef struct _dumper Dumper;
+
+/* Start the dumper thread. log gets a line for every layer. Returns NULL
+   on error */
+Dumper *dumper_open(FILE *log);
+
+/* Capture the region [start, end) of the current address space as layer
+   version, run from eip. Waits only when DUMPER_QUEUE_LAYERS - 1 layers
+   are already queued */
+void dumper_capture(Dumper *d, CPUState *env, int version, uint32_t eip,
+		uint32_t start, uint32_t end);
+
+/* Write out the queued layers and stop the dumper thread */
+void dumper_close(Dumper *d);
+
+#endif /* DUMPER_H_INCLUDED */
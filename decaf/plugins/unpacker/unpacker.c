@@ -38,20 +38,20 @@
 #include "shared/vmi_callback.h"
 #include "shared/hookapi.h"
 #include "unpacker.h"
-#include "mem_mark.h"
+#include "dumper.h"
 
 
 #define size_to_mask(size) ((1u << (size)) - 1u) //size<=4
 static plugin_interface_t unpacker_interface;
 //change begin
 /* Callback handles */
-DECAF_Handle block_begin_cb_handle = 0;
-DECAF_Handle mem_write_cb_handle=0;
+DECAF_Handle write_exec_cb_handle = 0;
 DECAF_Handle proc_loadmodule_cb_handle=0;
 DECAF_Handle proc_loadmainmodule_cb_handle=0;
 DECAF_Handle proc_processend_cb_handle=0;
 //change end
 static FILE *unpacker_log = NULL;
+static Dumper *unpacker_dumper = NULL;
 
 
 static int max_rounds = 100;
@@ -137,6 +137,10 @@ void do_trace_process(Monitor *mon, const QDict *qdict)
 }
 void do_stop_unpack(Monitor *mon, const QDict *qdict)
 {
+	  if(write_exec_cb_handle){
+		  DECAF_unregister_callback(DECAF_WRITE_EXEC_CB,write_exec_cb_handle);
+		  write_exec_cb_handle=0;
+	  }
 	  unpack_cr3 = 0;
 	  unpack_basename[0] = 0;
 	  //For DECAF taint check need to be completed
@@ -158,90 +162,48 @@ void do_guest_procs(Monitor *mon, const QDict *qdict)
 
 
 /*
-	1. Search backward of virtual address from EIP for clean pages, and dump them
-	2. Search forward of virtual address from EIP for clean pages, and dump them
-	3. Search stops when we meet a clean page or all tainted bytes are already dumpped
-	4. When dump a page, set "dumpped" flag to 1
+	Dump the region of the code that runs from a page written by the process:
+	the page of eip, and the pages written around it that no code ran from
+	yet. The engine cleans the page of eip before calling us, so the region
+	is dumped again once it is written and run from another time.
 */
-//will change it !!!!!!!!!!!!!!!!!!!!!!
-static void dump_unpacked_code()
+static void dump_unpacked_code(CPUState *env, uint32_t eip)
 {
-  uint32_t start_va, end_va, i, j, eip, cr3;
-  uint8_t buf[TARGET_PAGE_SIZE];
-  char filename[128];
-  taint_record_t records[4];
-
-  eip = DECAF_getPC(cpu_single_env);
-  cr3 = DECAF_getPGD(cpu_single_env);
+  uint32_t start_va, end_va;
 
-  //we just dump one page
   start_va = (eip & TARGET_PAGE_MASK);
   end_va = start_va + TARGET_PAGE_SIZE;
-  sprintf(filename, "dump-%d-%08x-%08x-%08x.bin\n", cur_version, eip, start_va, end_va + TARGET_PAGE_SIZE - 1);
-  FILE *fp = fopen(filename, "wb");
-  assert(fp);
-
-  for (i = 0; i < 4; i++) {
-    records[i].version = cur_version;
-  }
-
-  for (i = start_va; i < end_va; i += TARGET_PAGE_SIZE) {
-    bzero(buf, sizeof(buf));
-    for (j = 0; j < TARGET_PAGE_SIZE; j+=4) {
-    	set_mem_mark(i+j,4,0);
-    	//taintcheck_taint_virtmem(i+j, 4, 0, records);//Need change for DECAF
-    }
-    if(DECAF_memory_rw(NULL,i,buf,TARGET_PAGE_SIZE,0)<0)
-    	DECAF_printf(default_mon,"Cannot dump this page %08x!!! \n", i);
-    else
-    	fwrite(buf, TARGET_PAGE_SIZE, 1, fp);
-  }
-  fclose(fp);
-  // printf("OK after taintcheck_taint_virtmem()\n");
+  while (start_va >= TARGET_PAGE_SIZE
+		  && DECAF_isWriteExecPageDirty(start_va - TARGET_PAGE_SIZE)
+		  && end_va - start_va < DUMPER_MAX_PAGES * TARGET_PAGE_SIZE)
+	  start_va -= TARGET_PAGE_SIZE;
+  while (end_va != 0 && DECAF_isWriteExecPageDirty(end_va)
+		  && end_va - start_va < DUMPER_MAX_PAGES * TARGET_PAGE_SIZE)
+	  end_va += TARGET_PAGE_SIZE;
+
+  dumper_capture(unpacker_dumper, env, cur_version, eip, start_va, end_va);
 }
 
-int inContext = 0;
-static void unpacker_block_begin(DECAF_Callback_Params*dcp)
+static void unpacker_write_exec(DECAF_Callback_Params*dcp)
 {
-	CPUState *env = dcp->bb.env;
-	/*
-	 * check current instruction:
-	 * if it belongs to the examined process, and
-	 * if it is clean, dump the region
-	*/
-	uint32_t eip, cr3; 
-	if(unpack_basename[0] == '\0')
-		return ;
-
-	cr3 = DECAF_getPGD(env);
-	if(unpack_cr3 == 0) {
-		char current_proc[256];
-		uint32_t pid;
-
-		VMI_find_process_by_cr3_c(cr3, current_proc, sizeof(current_proc), &pid);
-		if(strcasecmp(current_proc, unpack_basename) != 0)
-		  return ;
-		unpack_cr3 = cr3;
+	CPUState *env = dcp->we.env;
+	uint32_t eip = dcp->we.pc;
+
+	DECAF_printf("will dump this region: eip=%08x \n", eip);
+	DECAF_printf("Suspicious activity!\n");
+	fprintf(unpacker_log, "suspcious instruction: eip=%08x \n", eip);
+	fflush(unpacker_log);
+	dump_unpacked_code(env, eip);
+	cur_version++;
+
+	//a page that keeps on writing itself would be dumped forever
+	if(cur_version > max_rounds) {
+		DECAF_printf("Reached the maximum unpacking rounds (%d), stop unpacking\n", max_rounds);
+		fprintf(unpacker_log, "stop after %d rounds\n", max_rounds);
+		do_stop_unpack(NULL,NULL);
 	}
-	inContext = (unpack_cr3 == cr3) && (!DECAF_is_in_kernel(dcp->ib.env)); 
-	eip = DECAF_getPC(env);
-	if (!inContext)
-		return ;
-
-/* Changed by Aravind: arprakas@syr.edu */
-    	uint64_t mybitmap=0;
-    	mybitmap=check_mem_mark(eip,1);
-    	if(mybitmap>0){
-    		DECAF_printf("will dump this region: eip=%08x \n", eip);
-    		DECAF_printf("Suspicious activity!\n");
-    		fprintf(unpacker_log, "suspcious instruction: eip=%08x \n", eip);
-    		fflush(unpacker_log);
-    		dump_unpacked_code();
-    		cur_version++;
-    	}
-
-    	return ;
 }
+
 //change add
 static void unpacker_module_loaded(VMI_Callback_Params *pcp)
 //change end
@@ -250,47 +212,22 @@ static void unpacker_module_loaded(VMI_Callback_Params *pcp)
 	//char *name=pcp->lm.name;
 	uint32_t base=pcp->lm.base;
 	uint32_t size=pcp->lm.size;
-    uint32_t virt_page, i;
-    for (virt_page = base; virt_page < base + size;
-    		virt_page += TARGET_PAGE_SIZE) {
-      for (i = 0; i < TARGET_PAGE_SIZE; i+=4) {
-    	  //taint check needed
-    	  set_mem_mark(i+virt_page,4,0);
-      }
-   }
-   fprintf(unpacker_log, "clean virt_page=%08x, size = %d \n", virt_page, size);
+
+	//the loader writes the module, which is not unpacked code
+	if(!write_exec_cb_handle || pcp->lm.cr3 != unpack_cr3)
+		return;
+	DECAF_cleanWriteExecPages(base, size);
+	fprintf(unpacker_log, "clean virt_page=%08x, size = %d \n", base, size);
 }
 
 
-static void unpacker_mem_write(DECAF_Callback_Params*dcp)
-{
-	// DECAF change
-	uint32_t virt_addr;//,phys_addr;
-	int size;
-	//phys_addr=dcp->mw.phy_addr;
-	virt_addr=dcp->mw.vaddr;
-	size=dcp->mw.dt;
-	//end
-    /* Changed by Aravind: arprakas@syr.edu */
-	if(inContext) {
-		set_mem_mark(virt_addr,size,(1<<size)-1);
-	} else {
-	//clean memory 
-		//taintcheck_clean_memory(phys_addr, size);  //Need change for DECAF
-		set_mem_mark(virt_addr,size,0);
-	}
-/*	END	*/
-}
 void unregister_callbacks()
 {
 	DECAF_printf(default_mon,"Unregister_callbacks\n");
-	if(block_begin_cb_handle){
-		DECAF_printf(default_mon,"DECAF_unregister_callback(DECAF_BLOCK_BEGIN_CB,block_begin_cb_handle);\n");
-		DECAF_unregister_callback(DECAF_BLOCK_BEGIN_CB,block_begin_cb_handle);
-	}
-	if(mem_write_cb_handle){
-		DECAF_printf(default_mon,"DECAF_unregister_callback(DECAF_MEM_WRITE_CB,mem_write_cb_handle);\n");
-		DECAF_unregister_callback(DECAF_MEM_WRITE_CB,mem_write_cb_handle);
+	if(write_exec_cb_handle){
+		DECAF_printf(default_mon,"DECAF_unregister_callback(DECAF_WRITE_EXEC_CB,write_exec_cb_handle);\n");
+		DECAF_unregister_callback(DECAF_WRITE_EXEC_CB,write_exec_cb_handle);
+		write_exec_cb_handle=0;
 	}
 	if(proc_loadmodule_cb_handle){
 		DECAF_printf(default_mon,"VMI_unregister_callback(VMI_LOADMODULE_CB)\n");
@@ -312,6 +249,9 @@ static void unpacker_cleanup()
 
 	unregister_callbacks();
 	//DECAF end
+	//the queued layers are written before the log is closed
+	dumper_close(unpacker_dumper);
+	unpacker_dumper = NULL;
 	if(unpacker_log) fclose(unpacker_log);
 }
 
@@ -328,13 +268,11 @@ static void unpacker_loadmainmodule_notify(VMI_Callback_Params *vcp)
 				monitored_pid = pid;
 				//unpack_cr3=find_cr3(pid);
 				unpack_cr3 = VMI_find_cr3_by_pid_c(pid);
-				if(!block_begin_cb_handle){
-					block_begin_cb_handle=DECAF_register_callback(DECAF_BLOCK_BEGIN_CB,unpacker_block_begin,NULL);
-					DECAF_printf(default_mon,"DECAF_register_callback(DECAF_BLOCK_BEGIN_CB) pid=%d\n",pid);
-				}
-				if(!mem_write_cb_handle){
-					mem_write_cb_handle=DECAF_register_callback(DECAF_MEM_WRITE_CB,unpacker_mem_write,NULL);
-					DECAF_printf(default_mon,"DECAF_register_callback(DECAF_MEM_WRITE_CB) pid=%d\n",pid);
+				if(!write_exec_cb_handle){
+					//the pages written in user mode by the process are watched,
+					// until code runs from them
+					write_exec_cb_handle=DECAF_registerWriteExecCallback(unpacker_write_exec,NULL,unpack_cr3);
+					DECAF_printf(default_mon,"DECAF_registerWriteExecCallback() pid=%d\n",pid);
 				}
 				start = clock();
 			}
@@ -362,7 +300,11 @@ plugin_interface_t * init_plugin()
 	printf("Unable to open unpack.log for writing!\n");
 	return NULL;
   }
-  mem_mark_init();
+  if (!(unpacker_dumper = dumper_open(unpacker_log))) {
+	printf("Unable to start the dumper thread!\n");
+	fclose(unpacker_log);
+	return NULL;
+  }
 
   //change to
   unpacker_interface.mon_cmds=unpacker_term_cmds;
@@ -2319,12 +2319,14 @@ ETEXI
 
 DEF("load-plugin", HAS_ARG, QEMU_OPTION_load_plugin, \
     "-load-plugin [path to plugin]\n" \
-    "                load the specified plugin at startup\n", \
+    "                load the specified plugin at startup (can be repeated)\n", \
     QEMU_ARCH_ALL)
 STEXI
 @item -load-plugin @var{file}
 @findex -load-plugin
 Load the specified plugin immediately upon startup of QEMU. 
+The option can be given several times to run several plugins on the same
+execution.
 ETEXI
 
 #ifndef _WIN32
@@ -14,4 +14,7 @@ struct QemuThread {
     pthread_t thread;
 };
 
+/* Wait for a thread made by qemu_thread_create to return */
+void *qemu_thread_join(QemuThread *thread);
+
 #endif
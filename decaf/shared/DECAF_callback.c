@@ -25,6 +25,7 @@ http://code.google.com/p/decaf-platform/
 #include "qemu-common.h"
 #include "cpu-all.h"
 #include "shared/DECAF_main.h"
+#include "DECAF_target.h"
 #include "shared/DECAF_callback.h"
 #include "shared/DECAF_callback_to_QEMU.h"
 #include "shared/utils/HashtableWrapper.h"
@@ -161,6 +162,32 @@ static CountingHashtable* pOBEToPageTable;
 // addresses. The hashmap maps the "from" page to a hashtable of "to" pages
 static CountingHashmap* pOBEPageMap;
 
+//Instruction begin and end callbacks can be optimized at the page
+// level too. Callbacks registered with OCB_ALL (which is what
+// DECAF_register_callback does) need every instruction, while OCB_PAGE
+// callbacks only need the instructions in the pages of pOIPageTable.
+// Just like for the blocks, the pages are flushed at the 0 to 1
+// and 1 to 0 transitions.
+static CountingHashtable* pOIPageTable;
+static int enableAllInsnCallbacksCount[2] = {0, 0};
+static int enablePageInsnCallbacksCount[2] = {0, 0};
+
+#define INSN_CB_INDEX(_type) ((_type) == DECAF_INSN_END_CB ? 1 : 0)
+
+//Write-then-execute callbacks watch the user pages of one address space,
+// wxPgd. A page is dirty once it is written in user mode, until code runs
+// from it. The user TLB entries of the clean pages are filled with
+// TLB_NOTDIRTY, so that their first write goes through notdirty_mem_write,
+// which marks the page dirty and invalidates its blocks. The blocks
+// translated from a dirty page then start with
+// helper_DECAF_invoke_write_exec_callback, which cleans the page again and
+// flushes its TLB entry. The dirty bits are kept for the 32-bit address
+// space, in 1024 lazily allocated chunks of 1024 pages.
+#define WX_CHUNK_BITS 10
+#define WX_CHUNK_PAGES (1 << WX_CHUNK_BITS)
+static gva_t wxPgd = INV_ADDR;
+static uint32_t* wxDirty[1 << (32 - TARGET_PAGE_BITS - WX_CHUNK_BITS)];
+
 
 //data structures for storing the userspace callbacks (stage 2)
 typedef struct callback_struct{
@@ -171,6 +198,9 @@ typedef struct callback_struct{
 	gva_t from;
 	gva_t to;
 	OCB_t ocb_type;
+	//insn begin and end callbacks are only invoked for this pgd,
+	// unless it is INV_ADDR
+	gva_t pgd;
 
 	DECAF_callback_func_t callback;
 	LIST_ENTRY(callback_struct) link;
@@ -224,6 +254,128 @@ int DECAF_is_BlockBeginCallback_needed(gva_t pc)
   return 0;
 }
 
+int DECAF_is_InsnCallback_needed(DECAF_callback_type_t cb_type, gva_t pc)
+{
+  int i = INSN_CB_INDEX(cb_type);
+
+  if (enableAllInsnCallbacksCount[i] > 0)
+  {
+    return (1);
+  }
+
+  if (enablePageInsnCallbacksCount[i] > 0)
+  {
+    return (CountingHashtable_exist(pOIPageTable, pc & TARGET_PAGE_MASK));
+  }
+
+  return 0;
+}
+
+static inline int wx_is_dirty(gva_t vaddr)
+{
+  uint32_t page;
+  uint32_t* chunk;
+
+  if ((uint64_t)vaddr >> 32)
+  {
+    return (0);
+  }
+  page = (uint32_t)vaddr >> TARGET_PAGE_BITS;
+  chunk = wxDirty[page >> WX_CHUNK_BITS];
+  page &= WX_CHUNK_PAGES - 1;
+  return (chunk && ((chunk[page >> 5] >> (page & 31)) & 1));
+}
+
+static inline void wx_set_dirty(gva_t vaddr)
+{
+  uint32_t page;
+  uint32_t** chunk;
+
+  if ((uint64_t)vaddr >> 32)
+  {
+    return;
+  }
+  page = (uint32_t)vaddr >> TARGET_PAGE_BITS;
+  chunk = &wxDirty[page >> WX_CHUNK_BITS];
+  if (*chunk == NULL)
+  {
+    *chunk = g_malloc0(WX_CHUNK_PAGES / 8);
+  }
+  page &= WX_CHUNK_PAGES - 1;
+  (*chunk)[page >> 5] |= 1u << (page & 31);
+}
+
+//Returns 1 if the page was dirty
+static inline int wx_clean(gva_t vaddr)
+{
+  uint32_t page;
+  uint32_t* chunk;
+
+  if (!wx_is_dirty(vaddr))
+  {
+    return (0);
+  }
+  page = (uint32_t)vaddr >> TARGET_PAGE_BITS;
+  chunk = wxDirty[page >> WX_CHUNK_BITS];
+  page &= WX_CHUNK_PAGES - 1;
+  chunk[page >> 5] &= ~(1u << (page & 31));
+  return (1);
+}
+
+//The TLB entries of the page are dropped, the next ones get TLB_NOTDIRTY
+static void wx_flush_page(gva_t vaddr)
+{
+  CPUState* env;
+
+  for (env = first_cpu; env != NULL; env = env->next_cpu)
+  {
+    tlb_flush_page(env, vaddr);
+  }
+}
+
+static void wx_reset(void)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(wxDirty); i++)
+  {
+    g_free(wxDirty[i]);
+    wxDirty[i] = NULL;
+  }
+  wxPgd = INV_ADDR;
+}
+
+int DECAF_is_WriteExecWatch_needed(CPUState* env, gva_t vaddr, int mmu_idx)
+{
+  return ((wxPgd != INV_ADDR) && (mmu_idx == MMU_USER_IDX)
+      && (DECAF_getPGD(env) == wxPgd) && !wx_is_dirty(vaddr));
+}
+
+void DECAF_write_exec_notdirty(CPUState* env, gva_t vaddr, ram_addr_t ram_addr)
+{
+  ram_addr_t start = ram_addr & TARGET_PAGE_MASK;
+
+  if ((wxPgd == INV_ADDR) || (env == NULL) || DECAF_is_in_kernel(env)
+      || (DECAF_getPGD(env) != wxPgd) || wx_is_dirty(vaddr))
+  {
+    return;
+  }
+
+  wx_set_dirty(vaddr);
+  //The blocks translated while the page was clean must go. The current
+  // block may be one of them: it runs to its end, since the code that it
+  // really modifies was already handled by notdirty_mem_write
+  tb_invalidate_phys_page_range(start, start + TARGET_PAGE_SIZE, 0);
+}
+
+int DECAF_is_WriteExecCallback_needed(CPUState* env, gva_t pc)
+{
+  //a block that runs into the next page is only checked for its first
+  // page, which is enough for unpacked code that is jumped to
+  return ((wxPgd != INV_ADDR) && !DECAF_is_in_kernel(env)
+      && (DECAF_getPGD(env) == wxPgd) && wx_is_dirty(pc));
+}
+
 int DECAF_is_BlockEndCallback_needed(gva_t from, gva_t to)
 {
   if (bEnableAllBlockEndCallbacks)
@@ -339,6 +491,161 @@ DECAF_Handle DECAF_registerOptimizedBlockBeginCallback(
   return ((DECAF_Handle)cb_struct);
 }
 
+DECAF_Handle DECAF_registerOptimizedInsnCallback(
+    DECAF_callback_type_t cb_type,
+    DECAF_callback_func_t cb_func,
+    int *cb_cond,
+    gva_t pgd,
+    OCB_t type)
+{
+  int i;
+
+  if ((cb_type != DECAF_INSN_BEGIN_CB) && (cb_type != DECAF_INSN_END_CB))
+  {
+    return (DECAF_NULL_HANDLE);
+  }
+
+  callback_struct_t * cb_struct = (callback_struct_t *)g_malloc(sizeof(callback_struct_t));
+  if (cb_struct == NULL)
+  {
+    return (DECAF_NULL_HANDLE);
+  }
+
+  //only whole pages are supported for instructions
+  if (type != OCB_PAGE) type = OCB_ALL;
+
+  cb_struct->callback = cb_func;
+  cb_struct->enabled = cb_cond;
+  cb_struct->from = INV_ADDR;
+  cb_struct->to = INV_ADDR;
+  cb_struct->ocb_type = type;
+  cb_struct->pgd = pgd;
+
+  i = INSN_CB_INDEX(cb_type);
+  if (type == OCB_ALL)
+  {
+    enableAllInsnCallbacksCount[i]++;
+    if (enableAllInsnCallbacksCount[i] == 1)
+    {
+      DECAF_flushTranslationCache(ALL_CACHE,0);
+    }
+  }
+  else
+  {
+    //the pages may already be in the table, so the blocks translated
+    // without the callback must go
+    enablePageInsnCallbacksCount[i]++;
+    if (enablePageInsnCallbacksCount[i] == 1)
+    {
+      DECAF_flushTranslationCache(ALL_CACHE,0);
+    }
+  }
+
+  LIST_INSERT_HEAD(&callback_list_heads[cb_type], cb_struct, link);
+
+  return ((DECAF_Handle)cb_struct);
+}
+
+int DECAF_addInsnCallbackPage(gva_t page)
+{
+  if (pOIPageTable == NULL)
+  {
+    return (NULL_POINTER_ERROR);
+  }
+
+  page &= TARGET_PAGE_MASK;
+  //This is not necessarily thread-safe
+  if (CountingHashtable_add(pOIPageTable, page) == 1)
+  {
+    DECAF_flushTranslationCache(PAGE_LEVEL, page);
+  }
+  return (0);
+}
+
+int DECAF_removeInsnCallbackPage(gva_t page)
+{
+  if (pOIPageTable == NULL)
+  {
+    return (NULL_POINTER_ERROR);
+  }
+
+  page &= TARGET_PAGE_MASK;
+  if (CountingHashtable_remove(pOIPageTable, page) == 0)
+  {
+    DECAF_flushTranslationCache(PAGE_LEVEL, page);
+  }
+  return (0);
+}
+
+DECAF_Handle DECAF_registerWriteExecCallback(
+    DECAF_callback_func_t cb_func,
+    int *cb_cond,
+    gva_t pgd)
+{
+  CPUState* env;
+
+  if ((pgd == INV_ADDR) || ((wxPgd != INV_ADDR) && (wxPgd != pgd)))
+  {
+    return (DECAF_NULL_HANDLE);
+  }
+
+  callback_struct_t * cb_struct = (callback_struct_t *)g_malloc(sizeof(callback_struct_t));
+  if (cb_struct == NULL)
+  {
+    return (DECAF_NULL_HANDLE);
+  }
+
+  cb_struct->callback = cb_func;
+  cb_struct->enabled = cb_cond;
+  cb_struct->from = INV_ADDR;
+  cb_struct->to = INV_ADDR;
+  cb_struct->ocb_type = OCB_ALL;
+  cb_struct->pgd = pgd;
+
+  if (wxPgd == INV_ADDR)
+  {
+    wxPgd = pgd;
+    //all of the pages start clean, so the TLB entries filled so far,
+    // which let the writes through, must go
+    for (env = first_cpu; env != NULL; env = env->next_cpu)
+    {
+      tlb_flush(env, 1);
+    }
+  }
+
+  LIST_INSERT_HEAD(&callback_list_heads[DECAF_WRITE_EXEC_CB], cb_struct, link);
+
+  return ((DECAF_Handle)cb_struct);
+}
+
+void DECAF_cleanWriteExecPages(gva_t vaddr, uint32_t size)
+{
+  gva_t page;
+
+  if (wxPgd == INV_ADDR)
+  {
+    return;
+  }
+
+  for (page = vaddr & TARGET_PAGE_MASK; page - (vaddr & TARGET_PAGE_MASK) < size;
+      page += TARGET_PAGE_SIZE)
+  {
+    if (wx_clean(page))
+    {
+      wx_flush_page(page);
+    }
+    if (page + TARGET_PAGE_SIZE == 0)
+    {
+      break;
+    }
+  }
+}
+
+int DECAF_isWriteExecPageDirty(gva_t vaddr)
+{
+  return ((wxPgd != INV_ADDR) && wx_is_dirty(vaddr));
+}
+
 //Aravind - Function to register cb handlers for instruction ranges
 DECAF_Handle DECAF_registerOpcodeRangeCallbacks (
 		DECAF_callback_func_t handler,
@@ -592,7 +899,18 @@ DECAF_Handle DECAF_register_callback(
     return(DECAF_registerOptimizedBlockEndCallback(cb_func, cb_cond, INV_ADDR, INV_ADDR));
   }
 
-  //if we are here then that means its either insn begin or end - this is the old logic no changes
+  if ((cb_type == DECAF_INSN_BEGIN_CB) || (cb_type == DECAF_INSN_END_CB))
+  {
+    return(DECAF_registerOptimizedInsnCallback(cb_type, cb_func, cb_cond, INV_ADDR, OCB_ALL));
+  }
+
+  //it needs the address space to watch
+  if (cb_type == DECAF_WRITE_EXEC_CB)
+  {
+    return (DECAF_NULL_HANDLE);
+  }
+
+  //if we are here then that means its one of the other callbacks - this is the old logic no changes
 
   callback_struct_t * cb_struct =
       (callback_struct_t *)g_malloc(sizeof(callback_struct_t));
@@ -602,6 +920,7 @@ DECAF_Handle DECAF_register_callback(
 
   cb_struct->callback = cb_func;
   cb_struct->enabled = cb_cond;
+  cb_struct->pgd = INV_ADDR;
 
 #ifdef CONFIG_VMI_ENABLE
   if(cb_type == DECAF_TLB_EXEC_CB)
@@ -751,6 +1070,55 @@ int DECAF_unregisterOptimizedBlockEndCallback(DECAF_Handle handle)
   return (-1);
 }
 
+int DECAF_unregisterOptimizedInsnCallback(DECAF_callback_type_t cb_type, DECAF_Handle handle)
+{
+  callback_struct_t *cb_struct, *cb_temp;
+  int i = INSN_CB_INDEX(cb_type);
+
+  if ((cb_type != DECAF_INSN_BEGIN_CB) && (cb_type != DECAF_INSN_END_CB))
+  {
+    return (-1);
+  }
+
+  //FIXME: not thread safe
+  LIST_FOREACH_SAFE(cb_struct, &callback_list_heads[cb_type], link, cb_temp) {
+    if((DECAF_Handle)cb_struct != handle)
+      continue;
+
+    if (cb_struct->ocb_type == OCB_PAGE)
+    {
+      enablePageInsnCallbacksCount[i]--;
+      if (enablePageInsnCallbacksCount[i] == 0)
+      {
+        DECAF_flushTranslationCache(ALL_CACHE,0);
+      }
+      else if (enablePageInsnCallbacksCount[i] < 0)
+      {
+        enablePageInsnCallbacksCount[i] = 0;
+      }
+    }
+    else
+    {
+      enableAllInsnCallbacksCount[i]--;
+      if (enableAllInsnCallbacksCount[i] == 0)
+      {
+        DECAF_flushTranslationCache(ALL_CACHE,0);
+      }
+      else if (enableAllInsnCallbacksCount[i] < 0)
+      {
+        enableAllInsnCallbacksCount[i] = 0;
+      }
+    }
+
+    LIST_REMOVE(cb_struct, link);
+    g_free(cb_struct);
+
+    return 0;
+  }
+
+  return -1;
+}
+
 int DECAF_unregister_callback(DECAF_callback_type_t cb_type, DECAF_Handle handle)
 {
   if (cb_type == DECAF_BLOCK_BEGIN_CB)
@@ -761,6 +1129,10 @@ int DECAF_unregister_callback(DECAF_callback_type_t cb_type, DECAF_Handle handle
   {
     return (DECAF_unregisterOptimizedBlockEndCallback(handle));
   }
+  else if ((cb_type == DECAF_INSN_BEGIN_CB) || (cb_type == DECAF_INSN_END_CB))
+  {
+    return (DECAF_unregisterOptimizedInsnCallback(cb_type, handle));
+  }
 
   callback_struct_t *cb_struct, *cb_temp;
   //FIXME: not thread safe
@@ -771,6 +1143,13 @@ int DECAF_unregister_callback(DECAF_callback_type_t cb_type, DECAF_Handle handle
     LIST_REMOVE(cb_struct, link);
     g_free(cb_struct);
 
+    //the blocks that start with the helper find no dirty page
+    if (cb_type == DECAF_WRITE_EXEC_CB) {
+        if (LIST_EMPTY(&callback_list_heads[cb_type]))
+            wx_reset();
+        return 0;
+    }
+
 #ifdef CONFIG_VMI_ENABLE
     if(cb_type == DECAF_TLB_EXEC_CB) {
 		goto done;
@@ -988,6 +1367,8 @@ PUSH_ALL()
 	LIST_FOREACH_SAFE(cb_struct, &callback_list_heads[DECAF_INSN_BEGIN_CB], link, cb_temp) {
 		// If it is a global callback or it is within the execution context,
 		// invoke this callback
+		if((cb_struct->pgd != INV_ADDR) && (DECAF_getPGD(env) != cb_struct->pgd))
+			continue;
         params.cbhandle = (DECAF_Handle)cb_struct;
 		if(!cb_struct->enabled || *cb_struct->enabled)
 			cb_struct->callback(&params);
@@ -1007,6 +1388,8 @@ PUSH_ALL()
 	LIST_FOREACH_SAFE(cb_struct, &callback_list_heads[DECAF_INSN_END_CB], link,cb_temp) {
 		// If it is a global callback or it is within the execution context,
 		// invoke this callback
+		if((cb_struct->pgd != INV_ADDR) && (DECAF_getPGD(env) != cb_struct->pgd))
+			continue;
 	    params.cbhandle = (DECAF_Handle)cb_struct;
 		if(!cb_struct->enabled || *cb_struct->enabled)
 			cb_struct->callback(&params);
@@ -1015,6 +1398,30 @@ POP_ALL()
 }
 
 
+void helper_DECAF_invoke_write_exec_callback(CPUState* env, target_ulong pc)
+{
+	callback_struct_t *cb_struct, *cb_temp;
+	DECAF_Callback_Params params;
+	gva_t page = pc & TARGET_PAGE_MASK;
+
+	//the page can be cleaned by an earlier block
+	if ((env == NULL) || (wxPgd == INV_ADDR) || (DECAF_getPGD(env) != wxPgd)
+			|| !wx_clean(page))
+		return;
+
+	//so that the next write to the page is seen
+	wx_flush_page(page);
+
+	params.we.env = env;
+	params.we.page = page;
+	params.we.pc = pc;
+	LIST_FOREACH_SAFE(cb_struct, &callback_list_heads[DECAF_WRITE_EXEC_CB], link, cb_temp) {
+		params.cbhandle = (DECAF_Handle)cb_struct;
+		if(!cb_struct->enabled || *cb_struct->enabled)
+			cb_struct->callback(&params);
+	}
+}
+
 void helper_DECAF_invoke_eip_check_callback(gva_t source_eip, gva_t target_eip, gva_t target_eip_taint)
 {
 	static callback_struct_t *cb_struct, *cb_temp;
@@ -1231,8 +1638,16 @@ void DECAF_callback_init(void)
   pOBEToPageTable = CountingHashtable_new();
   pOBEPageMap = CountingHashmap_new();
 
+  pOIPageTable = CountingHashtable_new();
+
   bEnableAllBlockBeginCallbacks = 0;
   enableAllBlockBeginCallbacksCount = 0;
   bEnableAllBlockEndCallbacks = 0;
   enableAllBlockEndCallbacksCount = 0;
+  for (i = 0; i < 2; i++)
+  {
+    enableAllInsnCallbacksCount[i] = 0;
+    enablePageInsnCallbacksCount[i] = 0;
+  }
+  wx_reset();
 }
@@ -67,6 +67,45 @@ extern DECAF_Handle DECAF_registerOptimizedBlockEndCallback(
     gva_t from,
     gva_t to);
 
+/// Registers an instruction begin or end callback that is only instrumented
+/// where it is needed. With OCB_ALL every instruction is instrumented, with
+/// OCB_PAGE only the instructions in the pages added with
+/// DECAF_addInsnCallbackPage. Other instruction callbacks can still cause
+/// it to be invoked outside of those pages.
+/// @param pgd if not INV_ADDR, the callback is only invoked while this
+/// page directory is loaded
+extern DECAF_Handle DECAF_registerOptimizedInsnCallback(
+    DECAF_callback_type_t cb_type,
+    DECAF_callback_func_t cb_func,
+    int *cb_cond,
+    gva_t pgd,
+    OCB_t type);
+
+extern int DECAF_unregisterOptimizedInsnCallback(DECAF_callback_type_t cb_type, DECAF_Handle handle);
+
+/// The pages where OCB_PAGE instruction callbacks are instrumented. Pages are
+/// reference counted, so every add needs a matching remove.
+extern int DECAF_addInsnCallbackPage(gva_t page);
+extern int DECAF_removeInsnCallbackPage(gva_t page);
+
+/// Registers a DECAF_WRITE_EXEC_CB callback, invoked the first time code
+/// runs from a user page of the address space pgd that was written in user
+/// mode since it last ran. The writes and the execution are caught through
+/// the softmmu TLB, so there is no per-access callback: only the first
+/// write to a clean page and the first block of a dirty page pay anything.
+/// All the callbacks must watch the same pgd.
+extern DECAF_Handle DECAF_registerWriteExecCallback(
+    DECAF_callback_func_t cb_func,
+    int *cb_cond,
+    gva_t pgd);
+
+/// Forgets the writes to the pages in [vaddr, vaddr + size), for instance
+/// when a module is mapped there
+extern void DECAF_cleanWriteExecPages(gva_t vaddr, uint32_t size);
+
+/// Whether the page of vaddr was written since code last ran from it
+extern int DECAF_isWriteExecPageDirty(gva_t vaddr);
+
 extern int DECAF_unregisterOptimizedBlockBeginCallback(DECAF_Handle handle);
 
 extern int DECAF_unregisterOptimizedBlockEndCallback(DECAF_Handle handle);
@@ -76,6 +115,7 @@ extern void helper_DECAF_invoke_block_begin_callback(CPUState* env, TranslationB
 extern void helper_DECAF_invoke_block_end_callback(CPUState* env, TranslationBlock* tb, gva_t from);
 extern void helper_DECAF_invoke_insn_begin_callback(CPUState* env);
 extern void helper_DECAF_invoke_insn_end_callback(CPUState* env);
+extern void helper_DECAF_invoke_write_exec_callback(CPUState* env, target_ulong pc);
 extern void helper_DECAF_invoke_eip_check_callback(gva_t source_eip, gva_t target_eip, gva_t target_eip_taint);
 extern void helper_DECAF_invoke_opcode_range_callback(
   CPUState *env,
@@ -54,6 +54,7 @@ typedef enum {
         DECAF_TLB_EXEC_CB,
         DECAF_READ_TAINTMEM_CB,
         DECAF_WRITE_TAINTMEM_CB,
+        DECAF_WRITE_EXEC_CB, //code run from a page written since it last ran
 #ifdef CONFIG_MEM_READ_CB
 		DECAF_MEM_READ_CB,
 #endif
@@ -111,6 +112,13 @@ typedef struct _DECAF_Tlb_Exec_Params
 	gva_t vaddr;  //Address loaded to tlb exec cache
 } DECAF_Tlb_Exec_Params;
 
+typedef struct _DECAF_Write_Exec_Params
+{
+	CPUState *env;
+	gva_t page; //the page that was written
+	gva_t pc;   //where the code run from it starts
+} DECAF_Write_Exec_Params;
+
 typedef struct _DECAF_Opcode_Range_Params
 {
 	CPUState *env;
@@ -222,6 +230,7 @@ typedef struct _DECAF_Callback_Params
 		DECAF_Nic_Send_Params ns;
 		DECAF_Opcode_Range_Params op;
 		DECAF_Tlb_Exec_Params tx;
+		DECAF_Write_Exec_Params we;
 		DECAF_Read_Taint_Mem rt;
 		DECAF_Write_Taint_Mem wt;
 #ifdef CONFIG_TCG_LLVM
@@ -36,6 +36,15 @@ int DECAF_is_callback_needed(DECAF_callback_type_t cb_type);
 int DECAF_is_callback_needed_for_opcode(int op);
 int DECAF_is_BlockBeginCallback_needed(gva_t pc);
 int DECAF_is_BlockEndCallback_needed(gva_t from, gva_t to);
+int DECAF_is_InsnCallback_needed(DECAF_callback_type_t cb_type, gva_t pc);
+
+//The write-then-execute watch, see DECAF_registerWriteExecCallback.
+// The TLB entry of vaddr must make its writes go through notdirty_mem_write
+int DECAF_is_WriteExecWatch_needed(CPUState *env, gva_t vaddr, int mmu_idx);
+//Called by notdirty_mem_write for every write it sees
+void DECAF_write_exec_notdirty(CPUState *env, gva_t vaddr, ram_addr_t ram_addr);
+//The block starting at pc must begin with the write-exec helper
+int DECAF_is_WriteExecCallback_needed(CPUState *env, gva_t pc);
 
 //This is needed since tlb_exec_cb doesn't go into tb and therefore not in helper.h
 #ifdef CONFIG_VMI_ENABLE
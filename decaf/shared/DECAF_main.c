@@ -58,9 +58,11 @@ extern void VMI_init(void);
 
 int DECAF_kvm_enabled = 0;
 
-plugin_interface_t *decaf_plugin = NULL;
-static void *plugin_handle = NULL;
-static char decaf_plugin_path[PATH_MAX] = "";
+/* Loaded plugins. A slot is free when its path is empty */
+plugin_interface_t *decaf_plugins[DECAF_MAX_PLUGINS];
+static void *plugin_handles[DECAF_MAX_PLUGINS];
+static char decaf_plugin_paths[DECAF_MAX_PLUGINS][PATH_MAX];
+static int nb_plugins = 0;
 static FILE *decaflog = NULL;
 
 int should_monitor = 1;
@@ -68,6 +70,8 @@ int should_monitor = 1;
 static int devices=0;
 
 struct __flush_list flush_list_internal;
+/* Flushes requested, by level */
+static uint64_t flush_counts[ALL_CACHE + 1];
 
 
 
@@ -364,9 +368,16 @@ void DECAF_perform_flush(CPUState* env)
 
 void DECAF_flushTranslationCache(int type,target_ulong addr)
 {
+	if(type >= PAGE_LEVEL && type <= ALL_CACHE)
+		flush_counts[type]++;
 	flush_list_insert(&flush_list_internal,type,addr);
 }
 
+void DECAF_getFlushCounts(uint64_t counts[3])
+{
+	memcpy(counts, flush_counts, sizeof(flush_counts));
+}
+
 
 int do_load_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data) {
 	do_load_plugin_internal(mon, qdict_get_str(qdict, "filename"));
@@ -375,10 +386,22 @@ int do_load_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data) {
 
 void do_load_plugin_internal(Monitor *mon, const char *plugin_path) {
 	plugin_interface_t *(*init_plugin)(void);
+	void *plugin_handle;
 	char *error;
-
-	if (decaf_plugin_path[0]) {
-		monitor_printf(mon, "%s has already been loaded! \n", plugin_path);
+	int i, slot = -1;
+
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++) {
+		if (!decaf_plugin_paths[i][0]) {
+			if (slot == -1)
+				slot = i;
+		} else if (strcmp(decaf_plugin_paths[i], plugin_path) == 0) {
+			monitor_printf(mon, "%s has already been loaded! \n", plugin_path);
+			return;
+		}
+	}
+	if (slot == -1) {
+		monitor_printf(mon, "%s cannot be loaded, %d plugins are loaded "
+				"already!\n", plugin_path, DECAF_MAX_PLUGINS);
 		return;
 	}
 
@@ -394,22 +417,30 @@ void do_load_plugin_internal(Monitor *mon, const char *plugin_path) {
 		return;
 	}
 
+	/* the same library under another path would share its state */
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++) {
+		if (decaf_plugin_paths[i][0] && plugin_handles[i] == plugin_handle) {
+			monitor_printf(mon, "%s has already been loaded as %s! \n",
+					plugin_path, decaf_plugin_paths[i]);
+			dlclose(plugin_handle);
+			return;
+		}
+	}
+
 	dlerror();
 
 	init_plugin = dlsym(plugin_handle, "init_plugin");
 	if ((error = dlerror()) != NULL ) {
 		fprintf(stderr, "%s\n", error);
 		dlclose(plugin_handle);
-		plugin_handle = NULL;
 		return;
 	}
 
-	decaf_plugin = init_plugin();
+	decaf_plugins[slot] = init_plugin();
 
-	if (NULL == decaf_plugin) {
+	if (NULL == decaf_plugins[slot]) {
 		monitor_printf(mon, "fail to initialize the plugin!\n");
 		dlclose(plugin_handle);
-		plugin_handle = NULL;
 		return;
 	}
 #if defined(_REPLAY_) && !defined(_RECORD_)
@@ -418,36 +449,84 @@ void do_load_plugin_internal(Monitor *mon, const char *plugin_path) {
 #if 0 // AWH TAINT_ENABLED
 	plugin_taint_record_size = decaf_plugin->taint_record_size;
 #endif
-	decaflog = fopen("decaf.log", "w");
-	assert(decaflog != NULL);
+	if (nb_plugins++ == 0) {
+		decaflog = fopen("decaf.log", "w");
+		assert(decaflog != NULL);
+	}
 
-	strncpy(decaf_plugin_path, plugin_path, PATH_MAX);
+	plugin_handles[slot] = plugin_handle;
+	strncpy(decaf_plugin_paths[slot], plugin_path, PATH_MAX - 1);
 	monitor_printf(mon, "%s is loaded successfully!\n", plugin_path);
 }
 
-int do_unload_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data) {
-	if (decaf_plugin_path[0]) {
-		decaf_plugin->plugin_cleanup();
+static void unload_plugin(int slot) {
+	decaf_plugins[slot]->plugin_cleanup();
+
+	//Flush all the callbacks that the plugin might have registered for
+	hookapi_flush_hooks(decaf_plugin_paths[slot]);
+
+	dlclose(plugin_handles[slot]);
+	plugin_handles[slot] = NULL;
+	decaf_plugins[slot] = NULL;
+
+	if (--nb_plugins == 0) {
 		fclose(decaflog);
 		decaflog = NULL;
+	}
+
+	monitor_printf(default_mon, "%s is unloaded!\n", decaf_plugin_paths[slot]);
+	decaf_plugin_paths[slot][0] = 0;
+}
 
-		//Flush all the callbacks that the plugin might have registered for
-		hookapi_flush_hooks(decaf_plugin_path);
+/* Unload the plugin given by its path or file name, or all of them */
+int do_unload_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data) {
+	const char *name = NULL;
+	int i, found = 0;
 
-		dlclose(plugin_handle);
-		plugin_handle = NULL;
-		decaf_plugin = NULL;
+	if (qdict && qdict_haskey(qdict, "filename"))
+		name = qdict_get_str(qdict, "filename");
 
-		monitor_printf(default_mon, "%s is unloaded!\n", decaf_plugin_path);
-		decaf_plugin_path[0] = 0;
-	} else {
-		monitor_printf(default_mon,
-				"Can't unload plugin because no plugin was loaded!\n");
+	/* the last loaded first */
+	for (i = DECAF_MAX_PLUGINS - 1; i >= 0; i--) {
+		const char *base;
+
+		if (!decaf_plugin_paths[i][0])
+			continue;
+		base = strrchr(decaf_plugin_paths[i], '/');
+		base = base ? base + 1 : decaf_plugin_paths[i];
+		if (name && strcmp(name, decaf_plugin_paths[i]) != 0
+				&& strcmp(name, base) != 0)
+			continue;
+		unload_plugin(i);
+		found = 1;
+	}
+
+	if (!found) {
+		if (name)
+			monitor_printf(default_mon,
+					"Can't unload plugin because %s was not loaded!\n", name);
+		else
+			monitor_printf(default_mon,
+					"Can't unload plugin because no plugin was loaded!\n");
 	}
 
 	return (0);
 }
 
+void do_list_plugins(Monitor *mon) {
+	int i;
+
+	if (nb_plugins == 0) {
+		monitor_printf(mon, "No plugin is loaded\n");
+		return;
+	}
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++) {
+		if (decaf_plugin_paths[i][0])
+			monitor_printf(mon, "%d: %s cr3=0x%08x\n", i, decaf_plugin_paths[i],
+					decaf_plugins[i]->monitored_cr3);
+	}
+}
+
 /* AWH - Fix for bugzilla bug #9 */
 void DECAF_stop_vm(void) {
 	if (runstate_is_running()) {
@@ -484,14 +563,30 @@ void DECAF_loadvm(void *opaque) {
 
 FILE *guestlog = NULL;
 
+/* The paths of the loaded plugins are saved one after the other, each with
+   its terminating NUL, or as a single NUL if there is none */
 static void DECAF_save(QEMUFile * f, void *opaque) {
-	uint32_t len = strlen(decaf_plugin_path) + 1;
-	qemu_put_be32(f, len);
-	qemu_put_buffer(f, (const uint8_t *) decaf_plugin_path, len); // AWH - cast
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++)
+		if (decaf_plugin_paths[i][0])
+			len += strlen(decaf_plugin_paths[i]) + 1;
+	if (len == 0) {
+		qemu_put_be32(f, 1);
+		qemu_put_byte(f, 0);
+	}
+	else {
+		qemu_put_be32(f, len);
+		for (i = 0; i < DECAF_MAX_PLUGINS; i++)
+			if (decaf_plugin_paths[i][0])
+				qemu_put_buffer(f, (const uint8_t *) decaf_plugin_paths[i],
+						strlen(decaf_plugin_paths[i]) + 1); // AWH - cast
+	}
 
 	//save guest.log
 	//we only save guest.log when no plugin is loaded
-	if (len == 1) {
+	if (len == 0) {
 		FILE *fp = fopen("guest.log", "r");
 		uint32_t size;
 		if (!fp) {
@@ -524,11 +619,14 @@ static void DECAF_save(QEMUFile * f, void *opaque) {
 
 static int DECAF_load(QEMUFile * f, void *opaque, int version_id) {
 	uint32_t len = qemu_get_be32(f);
-	char tmp_plugin_path[PATH_MAX];
+	static char tmp_plugin_path[DECAF_MAX_PLUGINS * PATH_MAX];
+	uint32_t off;
 
-	if (plugin_handle) {
+	if (nb_plugins) {
 		do_unload_plugin(NULL, NULL, NULL ); // AWH - Added NULLs
 	}
+	if (len == 0 || len > sizeof(tmp_plugin_path))
+		return -EINVAL;
 	qemu_get_buffer(f, (uint8_t *) tmp_plugin_path, len); // AWH - cast
 	if (tmp_plugin_path[len - 1] != 0)
 		return -EINVAL;
@@ -561,8 +659,8 @@ static int DECAF_load(QEMUFile * f, void *opaque, int version_id) {
 		fflush(guestlog);
 	}
 
-	if (len > 1)
-		do_load_plugin_internal(default_mon, tmp_plugin_path);
+	for (off = 0; len > 1 && off < len; off += strlen(tmp_plugin_path + off) + 1)
+		do_load_plugin_internal(default_mon, tmp_plugin_path + off);
 
 	uint32_t terminator = qemu_get_be32(f);
 	if (terminator != 0x12345678)
@@ -632,8 +730,11 @@ void DECAF_virtdev_init(void) {
 }
 
 void DECAF_after_loadvm(const char *param) {
-	if (decaf_plugin && decaf_plugin->after_loadvm)
-		decaf_plugin->after_loadvm(param);
+	int i;
+
+	for (i = 0; i < DECAF_MAX_PLUGINS; i++)
+		if (decaf_plugins[i] && decaf_plugins[i]->after_loadvm)
+			decaf_plugins[i]->after_loadvm(param);
 }
 
 
@@ -91,11 +91,18 @@ typedef struct _plugin_interface {
   };
 } plugin_interface_t;
 
-extern plugin_interface_t *decaf_plugin;
+/// Maximum number of plugins loaded at the same time
+#define DECAF_MAX_PLUGINS 8
+
+/// Loaded plugins, NULL for the free slots. Every plugin has its own
+/// commands and monitored_cr3, and registers its own callbacks.
+/// A plugin should use the interface returned by its init_plugin().
+extern plugin_interface_t *decaf_plugins[DECAF_MAX_PLUGINS];
 
 void do_load_plugin_internal(Monitor *mon, const char *plugin_path);
 int do_load_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_unload_plugin(Monitor *mon, const QDict *qdict, QObject **ret_data);
+void do_list_plugins(Monitor *mon);
 
 /*************************************************************************
  * The Virtual Machine control
@@ -245,6 +252,12 @@ static inline void DECAF_flushTranslationPage(uint32_t addr)
 //Iterates through all virtual cpus and flushes the pages
 void DECAF_flushTranslationCache(int type,target_ulong addr);
 
+/**
+ * Number of flushes requested with DECAF_flushTranslationCache since the start,
+ * indexed by PAGE_LEVEL, BLOCK_LEVEL and ALL_CACHE.
+ */
+void DECAF_getFlushCounts(uint64_t counts[3]);
+
 /* Static in monitor.c for QEMU, but we use it for plugins: */
 ///send a keystroke into the guest system
 extern void do_send_key(const char *string);
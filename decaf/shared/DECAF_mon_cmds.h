@@ -24,10 +24,18 @@ http://code.google.com/p/decaf-platform/
 
 {
 .name       = "unload_plugin",
+.args_type  = "filename:s?",
+.params     = "[filename]",
+.help       = "Unload a DECAF plugin, or all of them if no filename is given",
+.mhandler.cmd_new = do_unload_plugin,
+},
+
+{
+.name       = "list_plugins",
 .args_type  = "",
 .params     = "",
-.help       = "Unload the current DECAF plugin",
-.mhandler.cmd_new = do_unload_plugin,
+.help       = "List the loaded DECAF plugins",
+.mhandler.info = do_list_plugins,
 },
 
 
@@ -42,6 +42,7 @@ http://code.google.com/p/decaf-platform/
 #include "DECAF_callback.h"
 #include "DECAF_types.h"
 #include "DECAF_target.h"
+#include "qemu-timer.h"
 
 //LOK: Since the old interface registered for ALL possible basic blocks,
 // the addition of the optimized basic block callback means that
@@ -59,8 +60,31 @@ http://code.google.com/p/decaf-platform/
 // which does not seem like a good idea. A delayed flush or usage count would
 // help make this better - however it also has overhead.
 
+//The hooks at the same eip now share one block begin callback, which is
+//registered for the first of them and unregistered with the last, so
+//hooking a return address that is already hooked does not flush anything.
+
 using namespace std;
 
+//A hook is named by its handle: the index of its record in the record table
+//and the generation of that slot, which changes when the slot is freed. So a
+//handle is checked without a search, a stale handle is caught, and a handle
+//is never 0.
+#define HOOKAPI_INDEX_BITS 20
+#define HOOKAPI_MAX_RECORDS (1 << HOOKAPI_INDEX_BITS)
+#define HOOKAPI_INDEX_MASK (HOOKAPI_MAX_RECORDS - 1)
+#define HOOKAPI_GEN_MASK ((uint32_t)(~(uintptr_t)0 >> HOOKAPI_INDEX_BITS))
+
+//The records are allocated in chunks that never move, since a hook may add
+//hooks, and so grow the table, while it is invoked.
+#define HOOKAPI_CHUNK_BITS 8
+#define HOOKAPI_CHUNK_SIZE (1 << HOOKAPI_CHUNK_BITS)
+#define HOOKAPI_MAX_CHUNKS (HOOKAPI_MAX_RECORDS / HOOKAPI_CHUNK_SIZE)
+
+//values of next_free for the records in use
+#define HOOKAPI_RECORD_HOOKED -2 //in the index
+#define HOOKAPI_RECORD_UNRESOLVED -3 //in fun_to_hook, waiting for its module
+
 typedef struct hookapi_record{
   uint32_t eip;
   int is_global;
@@ -69,85 +93,331 @@ typedef struct hookapi_record{
   hook_proc_t fnhook;
   void *opaque;
   uint32_t sizeof_opaque;
-  //LOK: Added an entry for the DECAF callback handle
-  DECAF_Handle cbhandle;
-  QLIST_ENTRY(hookapi_record) link;
+  uint32_t gen; //generation of this slot, never 0
+  int next_free; //next free slot, -1 for none, or HOOKAPI_RECORD_*
 } hookapi_record_t;
 
-typedef struct hookapi_handle{
-  uintptr_t handle;
-  QLIST_ENTRY(hookapi_handle) link;
-} hookapi_handle_t;
-
 typedef struct {
   string module;
   string function;
-  hookapi_record_t* record;
+  uintptr_t handle;
 }fnhook_info_t;
 
 static list<fnhook_info_t> fun_to_hook;
 
-#define HOOKAPI_HTAB_SIZE 256
-QLIST_HEAD(hookapi_record_list_head, hookapi_record) 
-	hookapi_record_heads[HOOKAPI_HTAB_SIZE];
+static hookapi_record_t *hookapi_chunks[HOOKAPI_MAX_CHUNKS];
+static uint32_t hookapi_n_slots = 0; //slots of the allocated chunks
+static int hookapi_free_slot = -1;
+static uint32_t hookapi_n_hooked = 0;
+
+//What a dispatch needs of a hook. A record does not change while it is in
+//the index, so these are copied next to its handle, and the hooks at an eip
+//are invoked without going to their records.
+typedef struct hookapi_entry{
+  uintptr_t handle;
+  hook_proc_t fnhook;
+  void *opaque;
+  uint32_t esp;
+  int is_global;
+} hookapi_entry_t;
+
+//The index maps an eip and a cr3 to the entries of the hooks there, stored
+//together in the order they were added; cr3 is 0 for the hooks of all the
+//memory spaces. It is an open addressing table with linear probing, which
+//is kept at most half full.
+typedef struct hookapi_bucket{
+  uint32_t eip;
+  uint32_t cr3;
+  uint32_t count;
+  uint32_t size;
+  hookapi_entry_t *hooks; //NULL for an empty bucket
+} hookapi_bucket_t;
+
+#define HOOKAPI_INDEX_MIN 256
+
+static hookapi_bucket_t *hookapi_index = NULL;
+static uint32_t hookapi_index_size = 0;
+static uint32_t hookapi_index_used = 0;
+
+//bumped each time a hook leaves the index, so that a dispatch knows when
+//the entries it copied may be stale
+static uint32_t hookapi_unhooks = 0;
+
+//the block begin callback shared by the hooks at an eip
+typedef struct {
+  DECAF_Handle cbhandle;
+  uint32_t refs;
+} hookapi_eip_t;
+
+static map<uint32_t, hookapi_eip_t> hookapi_eips;
+
+//Hooks copied on the stack by a dispatch, more take an allocation
+#define HOOKAPI_DISPATCH_LOCAL 16
+
+//dispatch counters, see hookapi_get_stats
+static uint64_t hookapi_dispatches = 0;
+static uint64_t hookapi_probes = 0;
+static uint64_t hookapi_visited = 0;
+static uint64_t hookapi_invoked = 0;
+static uint64_t hookapi_dispatch_ns = 0;
+static uint64_t hookapi_timed = 0;
+static int hookapi_timing = 0;
 
-QLIST_HEAD(hookapi_handle_list_head, hookapi_handle) hookapi_handle_head = 
-	QLIST_HEAD_INITIALIZER(&hookapi_handle_head);
+static void hookapi_check_hook(DECAF_Callback_Params* params);
 
-static inline void hookapi_insert(hookapi_record_t *record)
+static inline hookapi_record_t *hookapi_slot(uint32_t idx)
 {
-  struct hookapi_record_list_head *head =
-      &hookapi_record_heads[record->eip & (HOOKAPI_HTAB_SIZE - 1)];
-  
-  QLIST_INSERT_HEAD(head, record, link); 
-  
-  hookapi_handle_t *handle_info = (hookapi_handle_t *)g_malloc(sizeof(hookapi_handle_t));
-  if(handle_info) {
-    handle_info->handle = (uintptr_t)record;
-    QLIST_INSERT_HEAD(&hookapi_handle_head, handle_info, link);
+  return &hookapi_chunks[idx >> HOOKAPI_CHUNK_BITS][idx & (HOOKAPI_CHUNK_SIZE - 1)];
+}
+
+static inline uintptr_t hookapi_handle(uint32_t idx, hookapi_record_t *record)
+{
+  return ((uintptr_t)record->gen << HOOKAPI_INDEX_BITS) | idx;
+}
+
+//Returns the record of a hook, or NULL if the handle is not valid
+static inline hookapi_record_t *hookapi_get_record(uintptr_t handle)
+{
+  uint32_t idx = handle & HOOKAPI_INDEX_MASK;
+  hookapi_record_t *record;
+
+  if(idx >= hookapi_n_slots)
+    return NULL;
+  record = hookapi_slot(idx);
+  if(record->next_free >= -1 || record->gen != (uint32_t)(handle >> HOOKAPI_INDEX_BITS))
+    return NULL;
+  return record;
+}
+
+static hookapi_record_t *hookapi_alloc_record(uint32_t *idx)
+{
+  hookapi_record_t *chunk, *record;
+  int i;
+
+  if(hookapi_free_slot == -1) {
+    if(hookapi_n_slots == HOOKAPI_MAX_RECORDS) {
+      fprintf(stderr, "ERROR: in hookapi_alloc_record: There are already %d hooks\n", HOOKAPI_MAX_RECORDS);
+      return NULL;
+    }
+    chunk = (hookapi_record_t *)g_malloc0(HOOKAPI_CHUNK_SIZE * sizeof(hookapi_record_t));
+    hookapi_chunks[hookapi_n_slots >> HOOKAPI_CHUNK_BITS] = chunk;
+    for(i = 0; i < HOOKAPI_CHUNK_SIZE; i++) {
+      chunk[i].gen = 1;
+      chunk[i].next_free = (i == HOOKAPI_CHUNK_SIZE - 1) ? -1 : (int)hookapi_n_slots + i + 1;
+    }
+    hookapi_free_slot = hookapi_n_slots;
+    hookapi_n_slots += HOOKAPI_CHUNK_SIZE;
+  }
+
+  *idx = hookapi_free_slot;
+  record = hookapi_slot(*idx);
+  hookapi_free_slot = record->next_free;
+  return record;
+}
+
+static void hookapi_free_record(uint32_t idx, hookapi_record_t *record)
+{
+  //the handles of this slot are stale from now on
+  record->gen = (record->gen + 1) & HOOKAPI_GEN_MASK;
+  if(record->gen == 0)
+    record->gen = 1;
+  record->next_free = hookapi_free_slot;
+  hookapi_free_slot = idx;
+}
+
+static inline uint32_t hookapi_hash(uint32_t eip, uint32_t cr3)
+{
+  uint32_t h = eip * 0x9e3779b1 ^ cr3 * 0x85ebca77;
+  return h ^ (h >> 16);
+}
+
+//Returns the bucket of eip and cr3, or NULL. The buckets probed are added to
+//probes if it is not NULL
+static inline hookapi_bucket_t *hookapi_find(uint32_t eip, uint32_t cr3, uint64_t *probes)
+{
+  uint32_t mask = hookapi_index_size - 1;
+  uint32_t i = hookapi_hash(eip, cr3) & mask;
+  hookapi_bucket_t *bucket;
+
+  for(;; i = (i + 1) & mask) {
+    bucket = &hookapi_index[i];
+    if(probes)
+      (*probes)++;
+    if(bucket->hooks == NULL)
+      return NULL;
+    if(bucket->eip == eip && bucket->cr3 == cr3)
+      return bucket;
+  }
+}
+
+static void hookapi_index_resize(uint32_t size)
+{
+  hookapi_bucket_t *old = hookapi_index;
+  uint32_t old_size = hookapi_index_size, i, j;
+
+  hookapi_index = (hookapi_bucket_t *)g_malloc0(size * sizeof(hookapi_bucket_t));
+  hookapi_index_size = size;
+  for(i = 0; i < old_size; i++) {
+    if(old[i].hooks == NULL)
+      continue;
+    j = hookapi_hash(old[i].eip, old[i].cr3) & (size - 1);
+    while(hookapi_index[j].hooks)
+      j = (j + 1) & (size - 1);
+    hookapi_index[j] = old[i];
+  }
+  g_free(old);
+}
+
+static void hookapi_index_add(uintptr_t handle, hookapi_record_t *record)
+{
+  uint32_t eip = record->eip, cr3 = record->cr3;
+  hookapi_bucket_t *bucket = hookapi_find(eip, cr3, NULL);
+  hookapi_entry_t *entry;
+  uint32_t i;
+
+  if(bucket == NULL) {
+    if(2 * (hookapi_index_used + 1) > hookapi_index_size)
+      hookapi_index_resize(2 * hookapi_index_size);
+    i = hookapi_hash(eip, cr3) & (hookapi_index_size - 1);
+    while(hookapi_index[i].hooks)
+      i = (i + 1) & (hookapi_index_size - 1);
+    bucket = &hookapi_index[i];
+    bucket->eip = eip;
+    bucket->cr3 = cr3;
+    bucket->count = 0;
+    bucket->size = 2;
+    bucket->hooks = g_new(hookapi_entry_t, bucket->size);
+    hookapi_index_used++;
+  } else if(bucket->count == bucket->size) {
+    bucket->size *= 2;
+    bucket->hooks = g_renew(hookapi_entry_t, bucket->hooks, bucket->size);
+  }
+  entry = &bucket->hooks[bucket->count++];
+  entry->handle = handle;
+  entry->fnhook = record->fnhook;
+  entry->opaque = record->opaque;
+  entry->esp = record->esp;
+  entry->is_global = record->is_global;
+}
+
+static void hookapi_index_remove(uint32_t eip, uint32_t cr3, uintptr_t handle)
+{
+  hookapi_bucket_t *bucket = hookapi_find(eip, cr3, NULL);
+  uint32_t i, j, home, mask;
+
+  if(bucket == NULL)
+    return;
+  for(i = 0; i < bucket->count && bucket->hooks[i].handle != handle; i++)
+    ;
+  if(i == bucket->count)
+    return;
+  memmove(&bucket->hooks[i], &bucket->hooks[i + 1],
+          (bucket->count - i - 1) * sizeof(hookapi_entry_t));
+  if(--bucket->count)
+    return;
+
+  //the bucket is empty: move back the buckets after it that were probed past it
+  g_free(bucket->hooks);
+  hookapi_index_used--;
+  mask = hookapi_index_size - 1;
+  i = bucket - hookapi_index;
+  for(j = (i + 1) & mask; hookapi_index[j].hooks; j = (j + 1) & mask) {
+    home = hookapi_hash(hookapi_index[j].eip, hookapi_index[j].cr3) & mask;
+    //it stays if its home is between the hole and itself
+    if(((j - home) & mask) < ((j - i) & mask))
+      continue;
+    hookapi_index[i] = hookapi_index[j];
+    i = j;
+  }
+  memset(&hookapi_index[i], 0, sizeof(hookapi_bucket_t));
+}
+
+static int hookapi_eip_ref(uint32_t eip)
+{
+  hookapi_eip_t &info = hookapi_eips[eip];
+
+  if(info.refs == 0) {
+    info.cbhandle = DECAF_registerOptimizedBlockBeginCallback(&hookapi_check_hook, NULL, eip, OCB_CONST);
+    if(info.cbhandle == DECAF_NULL_HANDLE) {
+      hookapi_eips.erase(eip);
+      return -1;
+    }
+  }
+  info.refs++;
+  return 0;
+}
+
+static void hookapi_eip_unref(uint32_t eip)
+{
+  map<uint32_t, hookapi_eip_t>::iterator iter = hookapi_eips.find(eip);
+
+  if(iter == hookapi_eips.end()) {
+    fprintf(stderr, "ERROR: in hookapi_eip_unref: There is no callback at 0x%08x\n", eip);
+    return;
+  }
+  if(--iter->second.refs == 0) {
+    DECAF_unregisterOptimizedBlockBeginCallback(iter->second.cbhandle);
+    hookapi_eips.erase(iter);
+  }
+}
+
+//Puts a record in the index. Returns its handle, or 0 if the callback
+//cannot be registered
+static uintptr_t hookapi_insert(uint32_t idx, hookapi_record_t *record)
+{
+  uintptr_t handle;
+
+  if(hookapi_eip_ref(record->eip) < 0)
+    return 0;
+  record->next_free = HOOKAPI_RECORD_HOOKED;
+  handle = hookapi_handle(idx, record);
+  hookapi_index_add(handle, record);
+  hookapi_n_hooked++;
+  return handle;
+}
+
+//Takes a record out of the index and frees it, but not its opaque
+static void hookapi_unhook(uint32_t idx, hookapi_record_t *record)
+{
+  hookapi_index_remove(record->eip, record->cr3, hookapi_handle(idx, record));
+  hookapi_eip_unref(record->eip);
+  hookapi_n_hooked--;
+  hookapi_unhooks++;
+  hookapi_free_record(idx, record);
+}
+
+static void hookapi_remove_unresolved(uintptr_t handle)
+{
+  list<fnhook_info_t>::iterator iter;
+
+  for(iter = fun_to_hook.begin(); iter != fun_to_hook.end(); iter++) {
+    if(iter->handle == handle) {
+      fun_to_hook.erase(iter);
+      return;
+    }
   }
 }
 
 static void hookapi_remove_all(void)
 {
-	hookapi_record_t *hrec;
-	int i;
-
-	for(i = 0; i<HOOKAPI_HTAB_SIZE; i++) {
-		struct hookapi_record_list_head * head = &hookapi_record_heads[i];
-		while(!QLIST_EMPTY(head)) {
-			hrec = QLIST_FIRST(head);
-			//LOK: Before we remove the record we must first unregister the bb callback
-			if (hrec->cbhandle == DECAF_NULL_HANDLE)
-			{
-				fprintf(stderr, "ERROR: in hookapi_remove_all: We have a NULL handle for a bb callback\n");
-			}
-			DECAF_unregisterOptimizedBlockBeginCallback(hrec->cbhandle);
-			QLIST_REMOVE(hrec, link);
-			if(hrec->opaque != 0 && (uintptr_t)(hrec->opaque) != 1)
-			{
-				//Normally, it is up to the user to free this opaque record. However, here we need to clean up
-				//all the hooks, which the user forgets to remove or does not get a chance to.
-				g_free(hrec->opaque);
-			}
-			g_free(hrec);
+	hookapi_record_t *record;
+	uint32_t idx;
+
+	for(idx = 0; idx < hookapi_n_slots; idx++) {
+		record = hookapi_slot(idx);
+		if(record->next_free >= -1)
+			continue;
+		if(record->sizeof_opaque)
+		{
+			//Normally, it is up to the user to free this opaque record. However, here we need to clean up
+			//all the hooks, which the user forgets to remove or does not get a chance to.
+			//An opaque of size 0 is an integer.
+			g_free(record->opaque);
 		}
-	}
-  
-	hookapi_handle_t *handle_info;
-	while(!QLIST_EMPTY(&hookapi_handle_head)) {
-		handle_info = QLIST_FIRST(&hookapi_handle_head);
-		QLIST_REMOVE(handle_info, link);
-		g_free(handle_info);
-	}
-
-	//LOK: We can no longer just do clear - must first free the temporary records that we created before
-	list<fnhook_info_t>::iterator iter = fun_to_hook.begin();
-	while (iter != fun_to_hook.end())
-	{
-		g_free(iter->record);
-		iter->record = NULL;
-		iter = fun_to_hook.erase(iter);
+		if(record->next_free == HOOKAPI_RECORD_HOOKED)
+			hookapi_unhook(idx, record);
+		else
+			hookapi_free_record(idx, record);
 	}
 
 	fun_to_hook.clear();
@@ -156,12 +426,15 @@ static void hookapi_remove_all(void)
 static void hookapi_save(QEMUFile *f, void *opaque)
 {
   hookapi_record_t *hrec;
-  int i;
+  uint32_t idx;
   Dl_info info;
   uint32_t len;
   
-  for(i = 0; i < HOOKAPI_HTAB_SIZE; i++) {
-    QLIST_FOREACH(hrec, &hookapi_record_heads[i], link) {
+  for(idx = 0; idx < hookapi_n_slots; idx++) {
+      hrec = hookapi_slot(idx);
+      if(hrec->next_free != HOOKAPI_RECORD_HOOKED)
+        continue;
+
       qemu_put_be32(f, hrec->eip);
       
       if(dladdr((void *)hrec->fnhook, &info) == 0) {
@@ -184,7 +457,6 @@ static void hookapi_save(QEMUFile *f, void *opaque)
       //LOK: We do not save the handle since it must be registered again at load
       qemu_put_be32(f, 0);
       qemu_put_byte(f, 0xff); //separator
-    }
   }
 
   qemu_put_be32(f, 0); //terminator
@@ -204,39 +476,73 @@ static void hookapi_check_hook(DECAF_Callback_Params* params)
         target_ulong pc = DECAF_getPC(cpu_single_env);
         target_ulong pgd = DECAF_getPGD(cpu_single_env);
 
-    struct hookapi_record_list_head *head =
-              &hookapi_record_heads[pc & (HOOKAPI_HTAB_SIZE - 1)];
-        hookapi_record_t *record, *tmp;
+        hookapi_bucket_t *bucket, *any_bucket = NULL;
+        hookapi_entry_t local[HOOKAPI_DISPATCH_LOCAL], *hooks = local, *entry;
+        uint32_t i, n = 0, unhooks = hookapi_unhooks;
+
+        int64_t start = 0, hook_ns = 0, t = 0;
+
+        hookapi_dispatches++;
+        if(hookapi_timing)
+                start = get_clock();
+
+        //the hooks for this memory space, then the hooks for all of them
+        bucket = hookapi_find(pc, pgd, &hookapi_probes);
+        if(pgd != 0)
+                any_bucket = hookapi_find(pc, 0, &hookapi_probes);
+
+        //A hook may add or remove hooks, so we work on a copy of the entries.
+        //The hooks added are not invoked this time.
+        i = (bucket ? bucket->count : 0) + (any_bucket ? any_bucket->count : 0);
+        if(i > HOOKAPI_DISPATCH_LOCAL)
+                hooks = g_new(hookapi_entry_t, i);
+        if(bucket) {
+                memcpy(hooks, bucket->hooks, bucket->count * sizeof(hookapi_entry_t));
+                n = bucket->count;
+        }
+        if(any_bucket) {
+                memcpy(hooks + n, any_bucket->hooks, any_bucket->count * sizeof(hookapi_entry_t));
+                n += any_bucket->count;
+        }
 
-        //NOTE: this is a safe version of QLIST_FOREACH
-        for(record = head->lh_first; record;  record = tmp) {
-                tmp = record->link.le_next;
+        for(i = 0; i < n; i++) {
+            entry = &hooks[i];
 
-            if(record->eip != pc)
-                continue;
-            
-            //On the same execution point, there might be multiple callbacks registered.
-            //So we have to check the handle to make sure we act on the same callback
-            if(record->cbhandle != params->cbhandle)
-                continue;    
-
-            //check if this hook is only for a specific memory space
-            if(record->cr3 != 0 && record->cr3!=pgd)
+            //it is gone if a hook invoked before removed it
+            if(unhooks != hookapi_unhooks && hookapi_get_record(entry->handle) == NULL)
                 continue;
 
+            hookapi_visited++;
+
             //check if this is a global hook
             //if it is a local hook, then should_monitor must be true
-            if(!record->is_global && ! should_monitor)
+            if(!entry->is_global && ! should_monitor)
                 continue;
 
             //check if this is a return hook.
             //the recorded ESP must be close enough to the current ESP.
             //otherwise, it must be a return hook for the same function call in a different thread.
             //The threshold 80 is based on that normally no function has more than 20 arguments.
-            if(record->esp && DECAF_getESP(cpu_single_env) - record->esp > 80)
+            if(entry->esp && DECAF_getESP(cpu_single_env) - entry->esp > 80)
                 continue;
 
-            record->fnhook(record->opaque);
+            hookapi_invoked++;
+            if(hookapi_timing) {
+                t = get_clock();
+                entry->fnhook(entry->opaque);
+                hook_ns += get_clock() - t;
+            } else {
+                entry->fnhook(entry->opaque);
+            }
+        }
+
+        if(hooks != local)
+                g_free(hooks);
+
+        //the time of the hooks themselves is not counted
+        if(hookapi_timing && start) {
+                hookapi_dispatch_ns += get_clock() - start - hook_ns;
+                hookapi_timed++;
         }
 }
 
@@ -244,7 +550,7 @@ static int hookapi_load(QEMUFile *f, void *opaque, int version_id)
 {
   hookapi_remove_all();
   
-  uint32_t eip, len;
+  uint32_t eip, len, idx;
   uintptr_t base = 0, relative_addr;
   hookapi_record_t *record;
   
@@ -275,9 +581,8 @@ static int hookapi_load(QEMUFile *f, void *opaque, int version_id)
    
 	relative_addr = qemu_get_be32(f);
 
-    record = (hookapi_record_t *)g_malloc(sizeof(hookapi_record_t));
+    record = hookapi_alloc_record(&idx);
     if(record == NULL) {
-      fprintf(stderr, "out of memory!\n");
       dlclose(handle);
       return -EINVAL;
     }    
@@ -293,39 +598,21 @@ static int hookapi_load(QEMUFile *f, void *opaque, int version_id)
       if(NULL == (record->opaque = g_malloc(record->sizeof_opaque))) {
         fprintf(stderr, "out of memory: size=%d\n", record->sizeof_opaque);
         dlclose(handle);
-        g_free(record);
+        hookapi_free_record(idx, record);
         return -EINVAL;
       }
       qemu_get_buffer(f, (uint8_t *)record->opaque, record->sizeof_opaque);
     }      
     uint32_t cb = qemu_get_be32(f);
-    if (cb != 0)
-    {
-      dlclose(handle);
-      g_free(record->opaque);
-      g_free(record);
-      return(-EINVAL);
-    }
-
     uint8_t separator = qemu_get_byte(f);
-    if(separator != 0xff) {
+    if(cb != 0 || separator != 0xff || hookapi_insert(idx, record) == 0) {
       dlclose(handle);
-      g_free(record->opaque);
-      g_free(record);
+      if(record->sizeof_opaque)
+        g_free(record->opaque);
+      hookapi_free_record(idx, record);
       return -EINVAL; 
     } 
 
-    record->cbhandle = DECAF_registerOptimizedBlockBeginCallback(&hookapi_check_hook, NULL, record->eip, OCB_CONST);
-    if (record->cbhandle == DECAF_NULL_HANDLE)
-    {
-      dlclose(handle);
-      g_free(record->opaque);
-      g_free(record);
-      return(-EINVAL);
-    }
-
-    hookapi_insert(record);
-
     dlclose(handle);
   }
 
@@ -337,32 +624,112 @@ static int hookapi_load(QEMUFile *f, void *opaque, int version_id)
 
 
 
+void hookapi_get_stats(hookapi_stats_t *stats)
+{
+  hookapi_bucket_t *bucket;
+  uint32_t i, count, probe;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->records = hookapi_n_hooked;
+  stats->buckets = hookapi_index_size;
+  stats->used_buckets = hookapi_index_used;
+  for(i = 0; i < hookapi_index_size; i++) {
+    bucket = &hookapi_index[i];
+    count = bucket->hooks ? bucket->count : 0;
+    if(count > stats->max_chain)
+      stats->max_chain = count;
+    stats->chains[count < HOOKAPI_STATS_CHAINS ? count : HOOKAPI_STATS_CHAINS - 1]++;
+    if(count) {
+      probe = ((i - hookapi_hash(bucket->eip, bucket->cr3)) & (hookapi_index_size - 1)) + 1;
+      if(probe > stats->max_probe)
+        stats->max_probe = probe;
+    }
+  }
+  stats->unresolved = fun_to_hook.size();
+
+  stats->dispatches = hookapi_dispatches;
+  stats->probes = hookapi_probes;
+  stats->visited = hookapi_visited;
+  stats->invoked = hookapi_invoked;
+  stats->dispatch_ns = hookapi_dispatch_ns;
+  stats->timed = hookapi_timed;
+}
+
+void hookapi_reset_stats(int timing)
+{
+  hookapi_dispatches = 0;
+  hookapi_probes = 0;
+  hookapi_visited = 0;
+  hookapi_invoked = 0;
+  hookapi_dispatch_ns = 0;
+  hookapi_timed = 0;
+  hookapi_timing = timing;
+}
+
+int hookapi_save_file(const char *filename)
+{
+  QEMUFile *f = qemu_fopen(filename, "wb");
+  if(f == NULL)
+    return -1;
+  hookapi_save(f, NULL);
+  return qemu_fclose(f) < 0 ? -1 : 0;
+}
+
+int hookapi_load_file(const char *filename)
+{
+  int ret;
+  QEMUFile *f = qemu_fopen(filename, "rb");
+  if(f == NULL)
+    return -1;
+  ret = hookapi_load(f, NULL, 0);
+  qemu_fclose(f);
+  return ret < 0 ? -1 : 0;
+}
+
+/* Load base of the plugin at plugin_path, or NULL if it is not loaded */
+static void *hookapi_plugin_base(const char *plugin_path)
+{
+	void *handle, *sym, *base = NULL;
+	Dl_info dl;
+
+	handle = dlopen(plugin_path, RTLD_LAZY | RTLD_NOLOAD);
+	if(handle == NULL)
+		return NULL;
+	//every plugin has init_plugin
+	sym = dlsym(handle, "init_plugin");
+	if(sym != NULL && dladdr(sym, &dl) != 0)
+		base = dl.dli_fbase;
+	dlclose(handle);
+	return base;
+}
+
 /* This function flushes the hooks that a plugin might have registered during plugin unload */
 void hookapi_flush_hooks(char *plugin_path)
 {
-	hookapi_handle_t *handle_info, *next;
-//	hookapi_record_t *record, *tmp;
-	const char *name;
-//	int i = 0;
+	hookapi_record_t *record;
+	uint32_t idx;
+	void *base;
 	Dl_info dl;
 
-//	struct hookapi_record_list_head *head;
+	//plugins are told apart by where they are loaded, their names may
+	//be the same or contain one another
+	base = hookapi_plugin_base(plugin_path);
+	if(base == NULL)
+		return;
 
-	QLIST_FOREACH_SAFE(handle_info, &hookapi_handle_head, link, next) {
-		hookapi_record_t *record = (hookapi_record_t *)(handle_info->handle);
+	for(idx = 0; idx < hookapi_n_slots; idx++) {
+		record = hookapi_slot(idx);
+		if(record->next_free >= -1)
+			continue;
 		if(dladdr((void *)(((uintptr_t)(record->fnhook))+1), &dl) != 0) { //does not return error
-			name = strrchr(dl.dli_fname, '/') ?
-					strrchr(dl.dli_fname, '/')+1 : dl.dli_fname;
-			if(strstr(plugin_path, name) != NULL) { //this hook belongs to the plugin being unloaded
-				//we found this handle
-		//		monitor_printf(default_mon, "Unregistering hook: %s, %s\n", dl.dli_fname, dl.dli_sname);
-				QLIST_REMOVE(handle_info, link); //remove the handle from the hook_handle_table
-				g_free(handle_info);
-
-				DECAF_unregisterOptimizedBlockBeginCallback(record->cbhandle);
-				QLIST_REMOVE(record, link); //Remove the record
+			if(dl.dli_fbase == base) { //this hook belongs to the plugin being unloaded
 				//here, we do not g_free record->opaque, because caller should g_free it
-				g_free(record);
+				if(record->next_free == HOOKAPI_RECORD_HOOKED) {
+					hookapi_unhook(idx, record);
+				} else {
+					hookapi_remove_unresolved(hookapi_handle(idx, record));
+					hookapi_free_record(idx, record);
+				}
 			}
 		}
 	}
@@ -372,9 +739,7 @@ void hookapi_flush_hooks(char *plugin_path)
 
 void init_hookapi(void)
 {
-  int i;
-  for (i = 0; i < HOOKAPI_HTAB_SIZE; i++)
-    QLIST_INIT(&hookapi_record_heads[i]);
+  hookapi_index_resize(HOOKAPI_INDEX_MIN);
 
   //LOK: We no longer register for ALL basic block callbacks
   //block_begin_handle = DECAF_register_callback(DECAF_BLOCK_BEGIN_CB, hookapi_check_hook, NULL);
@@ -403,7 +768,9 @@ uintptr_t hookapi_hook_function(
                uint32_t sizeof_opaque
                )
 {
-  hookapi_record_t *record = (hookapi_record_t *)g_malloc(sizeof(hookapi_record_t));
+  uint32_t idx;
+  uintptr_t handle;
+  hookapi_record_t *record = hookapi_alloc_record(&idx);
 
   if (record == NULL)
     return 0;
@@ -415,15 +782,11 @@ uintptr_t hookapi_hook_function(
   record->sizeof_opaque = sizeof_opaque;
   record->opaque = opaque;
   record->esp = 0; //esp is only used for return hook
-  record->cbhandle = DECAF_registerOptimizedBlockBeginCallback(&hookapi_check_hook, NULL, pc, OCB_CONST);
-  if (record->cbhandle == DECAF_NULL_HANDLE)
-  {
-    g_free(record);
-    return (0);
-  }
 
-  hookapi_insert(record);
-  return (uintptr_t)record;
+  handle = hookapi_insert(idx, record);
+  if (handle == 0)
+    hookapi_free_record(idx, record);
+  return handle;
 }
 
 uintptr_t 
@@ -434,7 +797,10 @@ hookapi_hook_return(
                uint32_t sizeof_opaque
                )
 {
-  hookapi_record_t *record = (hookapi_record_t *)g_malloc(sizeof(hookapi_record_t));
+  uint32_t idx;
+  uintptr_t handle;
+  hookapi_record_t *record = hookapi_alloc_record(&idx);
+
   if (record == NULL)
     return 0;
 
@@ -448,69 +814,37 @@ hookapi_hook_return(
   record->sizeof_opaque = sizeof_opaque;
   record->opaque = opaque;
 
-  record->cbhandle = DECAF_registerOptimizedBlockBeginCallback(&hookapi_check_hook, NULL, pc, OCB_CONST);
-  if (record->cbhandle == DECAF_NULL_HANDLE)
-  {
-    g_free(record);
-    return (0);
-  }
-
-  hookapi_insert(record);
-  return (uintptr_t)record;
+  handle = hookapi_insert(idx, record);
+  if (handle == 0)
+    hookapi_free_record(idx, record);
+  return handle;
 }
 
 
 void hookapi_remove_hook(uintptr_t handle)
 {
   //we need to sanitize this handle. 
-  //check if this handle exists in our handle list
-  hookapi_handle_t *handle_info;
+  //the generation in the handle tells if it is still in use
+  hookapi_record_t *record = hookapi_get_record(handle);
+  uint32_t idx = handle & HOOKAPI_INDEX_MASK;
 
   //FIXME: not safe for multi-threading
-  QLIST_FOREACH(handle_info, &hookapi_handle_head, link) {
-    if(handle_info->handle != handle)
-      continue;
-
-    //we found this handle
-    QLIST_REMOVE(handle_info, link);
-    g_free(handle_info);
-    hookapi_record_t *record = (hookapi_record_t *)handle;
-    //LOK: Before we remove it, we need to unregister the handle
-    if (record->cbhandle != DECAF_NULL_HANDLE)
-    {
-      DECAF_unregisterOptimizedBlockBeginCallback(record->cbhandle);
-    }
-    else
-    {
-      fprintf(stderr, "ERROR: in hookapi_remove_hook: The callback handle is NULL - it should not be!\n");
-    }
-
-    QLIST_REMOVE(record, link);
-    //here, we do not g_free record->opaque, because caller should g_free it
-    g_free(record);
+  if (record == NULL)
+  {
+    assert(0); //this handle is invalid
     return;
   }
 
-  //In the case that the handle is still waiting to be hooked
-  list<fnhook_info_t>::iterator iter = fun_to_hook.begin();
-  for ( ; iter != fun_to_hook.end(); iter++)
+  if (record->next_free == HOOKAPI_RECORD_HOOKED)
   {
-    if (handle == (uintptr_t)iter->record)
-    {
-      //LOK: In this case the callback should never have been registered in the first place
-      // so there is no reason to free it. We can double check though
-      if (iter->record->cbhandle != DECAF_NULL_HANDLE)
-      {
-        fprintf(stderr, "ERROR: in hookapi_remove_hook: A record for a function waiting to be hooked already has a handle\n");
-      }
-      g_free(iter->record);
-      iter->record = NULL;
-      iter = fun_to_hook.erase(iter);
-      return;
-    }
+    //here, we do not g_free record->opaque, because caller should g_free it
+    hookapi_unhook(idx, record);
+    return;
   }
 
-  assert(0); //this handle is invalid
+  //In the case that the handle is still waiting to be hooked
+  hookapi_remove_unresolved(handle);
+  hookapi_free_record(idx, record);
 }
 
 
@@ -523,7 +857,8 @@ static uintptr_t add_unresolved_hook(const char *module_name,
                      uint32_t sizeof_opaque)
 {
   //LOK: Preallocating the hook handle so we can return the handler as part of this function
-  hookapi_record_t *record = (hookapi_record_t *)g_malloc(sizeof(hookapi_record_t));
+  uint32_t idx;
+  hookapi_record_t *record = hookapi_alloc_record(&idx);
   if (record == NULL)
     return 0;
 
@@ -534,45 +869,45 @@ static uintptr_t add_unresolved_hook(const char *module_name,
   record->fnhook = hookfn;
   record->sizeof_opaque = sizeof_opaque;
   record->opaque = opaque;
-  //LOK: Make sure that the callback handle is NULL
-  record->cbhandle = DECAF_NULL_HANDLE;
+  record->next_free = HOOKAPI_RECORD_UNRESOLVED;
 
   fnhook_info_t info;
   info.module = module_name;
   info.function = function_name;
-  info.record = record;
+  info.handle = hookapi_handle(idx, record);
   fun_to_hook.push_back(info);
 
-  return (uintptr_t)record;
+  return info.handle;
 }
 
 
 void check_unresolved_hooks()
 {
-	list<fnhook_info_t>::iterator iter;
-	for(iter=fun_to_hook.begin(); iter!=fun_to_hook.end(); iter++) {
-		target_ulong pc = funcmap_get_pc(iter->module.c_str(), iter->function.c_str(), iter->record->cr3);
-		if (pc == 0) continue;
-
-		//since the entry is found - we update the eip
-                iter->record->eip = pc;
-                //LOK: We also register for the new optimized block begin callback
-                iter->record->cbhandle = DECAF_registerOptimizedBlockBeginCallback(&hookapi_check_hook, NULL, pc, OCB_CONST);
-                if (iter->record->cbhandle == DECAF_NULL_HANDLE)
-                {
-                  //if for some reason we couldn't register it - it is probably a realy bad sign
-                  //Should we continue?
-                  fprintf(stderr, "ERROR: in check_unresolved_hooks: Could not register the new block begin callback\n");
-                  iter->record->eip = 0;
-                  continue;
-                }
-                hookapi_insert(iter->record); 
+	list<fnhook_info_t>::iterator iter = fun_to_hook.begin();
+	while(iter != fun_to_hook.end()) {
+		uint32_t idx = iter->handle & HOOKAPI_INDEX_MASK;
+		hookapi_record_t *record = hookapi_slot(idx);
+		target_ulong pc = funcmap_get_pc(iter->module.c_str(), iter->function.c_str(), record->cr3);
+		if (pc == 0) {
+			iter++;
+			continue;
+		}
+
+		//since the entry is found - we update the eip, the handle stays the same
+		record->eip = pc;
+		if (hookapi_insert(idx, record) == 0)
+		{
+			//if for some reason we couldn't register it - it is probably a realy bad sign
+			//Should we continue?
+			fprintf(stderr, "ERROR: in check_unresolved_hooks: Could not register the new block begin callback\n");
+			record->eip = 0;
+			iter++;
+			continue;
+		}
 
 		monitor_printf(default_mon, "Hooking %s::%s at 0x%08x\n",
 				iter->module.c_str(), iter->function.c_str(), pc);
-//LOK: We can still just do an erase here since the remove will free the record
 		iter = fun_to_hook.erase(iter);
-		iter--;
 	}
 }
 
@@ -97,8 +97,8 @@ void hookapi_remove_hook(uintptr_t handle);
 /// @param opaque address of an opaque structure provided by caller (has to be globally allocated)
 //  @param sizeof_opaque size of the opaque structure (if opaque is an integer, not a pointer to a structure, sizeof_opaque must be zero) 
 /// @return a handle that uniquely identifies this hook
-/// Note that the handle that is returned, might not actually be active yet - you can check the eip value of the handle to find out
-/// the default value is 0.
+/// Note that the handle that is returned, might not actually be active yet - it is hooked, with the same handle,
+/// once the module is loaded.
 uintptr_t hookapi_hook_function_byname(
 		const char *mod,
 		const char *func,
@@ -108,6 +108,47 @@ uintptr_t hookapi_hook_function_byname(
 		void *opaque,
 		uint32_t sizeof_opaque);
 
+/// number of chain lengths counted in hookapi_stats_t.chains
+#define HOOKAPI_STATS_CHAINS 17
+
+/// @ingroup hookapi
+/// statistics of the hook table, for benchmarks and tests
+typedef struct hookapi_stats {
+  uint32_t records; ///< hooks in the table, on function entries and returns
+  uint32_t unresolved; ///< hooks by name waiting for their module
+  uint32_t buckets; ///< buckets of the index, a used one holds the hooks of an eip and cr3
+  uint32_t used_buckets; ///< buckets that hold at least one hook
+  uint32_t max_chain; ///< hooks in the fullest bucket
+  uint32_t chains[HOOKAPI_STATS_CHAINS]; ///< buckets by number of hooks, the last one counts the fuller buckets
+  uint32_t max_probe; ///< most buckets probed to find a used bucket
+  uint64_t dispatches; ///< hooked blocks executed
+  uint64_t probes; ///< buckets probed by those dispatches
+  uint64_t visited; ///< hooks compared by those dispatches
+  uint64_t invoked; ///< hooks invoked by those dispatches
+  uint64_t dispatch_ns; ///< time spent finding the hooks, when timed
+  uint64_t timed; ///< dispatches that were timed
+} hookapi_stats_t;
+
+/// @ingroup hookapi
+/// get the statistics of the hook table
+void hookapi_get_stats(hookapi_stats_t *stats);
+
+/// @ingroup hookapi
+/// reset the dispatch counters
+/// @param timing nonzero to time the dispatches from now on, which has a cost
+void hookapi_reset_stats(int timing);
+
+/// @ingroup hookapi
+/// save all of the hooks to filename, as in a snapshot
+/// @return 0, or -1 on error
+int hookapi_save_file(const char *filename);
+
+/// @ingroup hookapi
+/// replace all of the hooks with those saved in filename, as when loading
+/// a snapshot. The handles of the hooks are not the same afterwards.
+/// @return 0, or -1 on error
+int hookapi_load_file(const char *filename);
+
 //Below are functions called internally within the framework
 void check_unresolved_hooks(void);
 
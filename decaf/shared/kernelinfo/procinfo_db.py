@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+#
+# procinfo_db.py
+#
+# Compile procinfo.ini into procinfo.db, the binary kernel profile database
+# that linux_procinfo.cpp maps into memory at VMI bring-up.
+#
+# The record layout is taken from PROCINFO_DB_FIELDS in linux_procinfo_db.h,
+# so adding a field only requires touching that header.
+#
+# Usage: procinfo_db.py linux_procinfo_db.h procinfo.ini procinfo.db
+
+import re
+import struct
+import sys
+
+MAGIC = b"DECAFPI\0"
+VERSION = 1
+NAME_LEN = 32
+INVALID = 0xffffffffffffffff
+HEADER_FMT = "<8sIIIIIIII"
+
+
+def read_fields(header):
+    text = open(header).read()
+    body = re.search(r"#define PROCINFO_DB_FIELDS\(X\)(.*?)\n\n", text, re.S)
+    if not body:
+        sys.exit("%s: PROCINFO_DB_FIELDS not found" % header)
+    return re.findall(r"X\((\w+)\)", body.group(1))
+
+
+def read_ini(path):
+    sections = {}
+    cur = None
+    for lineno, line in enumerate(open(path), 1):
+        line = line.split(";", 1)[0].strip()
+        if not line:
+            continue
+        if line.startswith("["):
+            cur = sections.setdefault(line.strip("[]").strip(), {})
+        elif "=" in line and cur is not None:
+            key, val = line.split("=", 1)
+            cur[key.strip()] = val.strip()
+        else:
+            sys.exit("%s:%d: cannot parse '%s'" % (path, lineno, line))
+    return sections
+
+
+def main(argv):
+    if len(argv) != 4:
+        sys.exit("usage: %s linux_procinfo_db.h procinfo.ini procinfo.db" % argv[0])
+
+    fields = read_fields(argv[1])
+    sections = read_ini(argv[2])
+    total = int(sections.get("info", {}).get("total", "0"))
+
+    records = []
+    for i in range(1, total + 1):
+        sec = sections.get(str(i))
+        if sec is None:
+            sys.exit("%s: section [%d] is missing" % (argv[2], i))
+        name = sec.get("strName", "").encode("ascii")[:NAME_LEN - 1]
+        values = []
+        for f in fields:
+            v = sec.get(f)
+            values.append(INVALID if v is None else int(v, 0) & INVALID)
+        records.append((values[0], name, values))
+
+    records.sort(key=lambda r: (r[0], r[1]))
+    rec_fmt = "<%ds%dQ" % (NAME_LEN, len(fields))
+    rec_size = struct.calcsize(rec_fmt)
+
+    name_index = sorted(range(len(records)), key=lambda n: records[n][1])
+    ti_task = sorted(set(r[2][fields.index("ti_task")] for r in records) - set([INVALID]))
+
+    hdr_size = struct.calcsize(HEADER_FMT)
+    name_off = hdr_size + rec_size * len(records)
+    ti_off = name_off + 4 * len(records)
+    ti_off = (ti_off + 7) & ~7
+
+    out = open(argv[3], "wb")
+    out.write(struct.pack(HEADER_FMT, MAGIC, VERSION, len(fields), len(records),
+                          rec_size, name_off, len(ti_task), ti_off, 0))
+    for addr, name, values in records:
+        out.write(struct.pack(rec_fmt, name, *values))
+    out.write(struct.pack("<%dI" % len(name_index), *name_index))
+    out.write(b"\0" * (ti_off - name_off - 4 * len(records)))
+    out.write(struct.pack("<%dQ" % len(ti_task), *ti_task))
+    out.close()
+
+
+if __name__ == "__main__":
+    main(sys.argv)
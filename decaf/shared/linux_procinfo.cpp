@@ -24,6 +24,7 @@
 #include <string>
 #include <list>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
@@ -41,6 +42,9 @@
 #include <signal.h>
 #include <queue>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <math.h>
 #include <glib.h>
 #include <mcheck.h>
@@ -58,6 +62,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include "linux_procinfo.h"
+#include "linux_procinfo_db.h"
 #include "hookapi.h"
 #include "function_map.h"
 #include "shared/vmi.h"
@@ -1626,198 +1631,398 @@ void get_procinfo_directory(string &sPath)
   return;
 }
 
-// given the section number, load the offset values
-#define FILL_TARGET_ULONG_FIELD(field) pi.field = pt.get(sSectionNum + #field, INVALID_VAL)
-void _load_one_section(const boost::property_tree::ptree &pt, int iSectionNum, ProcInfo &pi)
+// The kernel profiles, sorted by init_task_addr. They come from procinfo.db,
+// mmap()ed as is, or, if there is no up-to-date procinfo.db, are compiled from
+// procinfo.ini into g_ini_records. Either way a lookup is a binary search and
+// nothing is parsed once the table is loaded.
+static const procinfo_db_record *g_db_records = NULL;
+static const uint32_t *g_db_name_index = NULL;
+static uint32_t g_db_count = 0;
+static vector<procinfo_db_record> g_ini_records;
+static vector<uint32_t> g_ini_name_index;
+// distinct thread_info->task offsets used by the profiles
+static vector<target_ulong> g_ti_task_offsets;
+// a profile without ti_task forces us to search for the task_struct
+static bool g_need_task_search = false;
+
+static bool record_addr_less(const procinfo_db_record &rec, uint64_t addr)
 {
-    string sSectionNum;
+  return rec.fields[PROCINFO_DB_init_task_addr] < addr;
+}
+
+static bool record_less(const procinfo_db_record &a, const procinfo_db_record &b)
+{
+  if (a.fields[PROCINFO_DB_init_task_addr] != b.fields[PROCINFO_DB_init_task_addr])
+    return a.fields[PROCINFO_DB_init_task_addr] < b.fields[PROCINFO_DB_init_task_addr];
+  return strncmp(a.strName, b.strName, PROCINFO_DB_NAME_LEN) < 0;
+}
+
+struct record_name_less
+{
+  bool operator()(uint32_t a, uint32_t b) const
+  {
+    return strncmp(g_db_records[a].strName, g_db_records[b].strName, PROCINFO_DB_NAME_LEN) < 0;
+  }
+  bool operator()(uint32_t a, const char *name) const
+  {
+    return strncmp(g_db_records[a].strName, name, PROCINFO_DB_NAME_LEN) < 0;
+  }
+};
+
+#define COPY_PROCINFO_FIELD(field) pi.field = (target_ulong)rec.fields[PROCINFO_DB_##field];
+static void record_to_procinfo(const procinfo_db_record &rec, ProcInfo &pi)
+{
+  strncpy(pi.strName, rec.strName, sizeof(pi.strName));
+  pi.strName[sizeof(pi.strName)-1] = '\0';
 
-    sSectionNum = boost::lexical_cast<string>(iSectionNum);
-    sSectionNum += ".";
-
-    // fill strName field
-    string sName;
-    const int SIZE_OF_STR_NAME = 32;
-    sName = pt.get<string>(sSectionNum + "strName");
-    strncpy(pi.strName, sName.c_str(), SIZE_OF_STR_NAME);
-    pi.strName[SIZE_OF_STR_NAME-1] = '\0';
-
-    const target_ulong INVALID_VAL = -1;
-
-    // fill other fields
-    FILL_TARGET_ULONG_FIELD(init_task_addr  );
-    FILL_TARGET_ULONG_FIELD(init_task_size  );
-    FILL_TARGET_ULONG_FIELD(ts_tasks        );
-    FILL_TARGET_ULONG_FIELD(ts_pid          );
-    FILL_TARGET_ULONG_FIELD(ts_tgid         );
-    FILL_TARGET_ULONG_FIELD(ts_group_leader );
-    FILL_TARGET_ULONG_FIELD(ts_thread_group );
-    FILL_TARGET_ULONG_FIELD(ts_real_parent  );
-    FILL_TARGET_ULONG_FIELD(ts_mm           );
-    FILL_TARGET_ULONG_FIELD(ts_stack        );
-    FILL_TARGET_ULONG_FIELD(ts_real_cred    );
-    FILL_TARGET_ULONG_FIELD(ts_cred         );
-    FILL_TARGET_ULONG_FIELD(ts_comm         );
-
-	FILL_TARGET_ULONG_FIELD(modules         );
-	FILL_TARGET_ULONG_FIELD(module_name     );
-	FILL_TARGET_ULONG_FIELD(module_init     );
-	FILL_TARGET_ULONG_FIELD(module_size     );
-	FILL_TARGET_ULONG_FIELD(module_list     );
-			    
-    FILL_TARGET_ULONG_FIELD(cred_uid        );
-    FILL_TARGET_ULONG_FIELD(cred_gid        );
-    FILL_TARGET_ULONG_FIELD(cred_euid       );
-    FILL_TARGET_ULONG_FIELD(cred_egid       );
-    FILL_TARGET_ULONG_FIELD(mm_mmap         );
-    FILL_TARGET_ULONG_FIELD(mm_pgd          );
-    FILL_TARGET_ULONG_FIELD(mm_arg_start    );
-    FILL_TARGET_ULONG_FIELD(mm_start_brk    );
-    FILL_TARGET_ULONG_FIELD(mm_brk          );
-    FILL_TARGET_ULONG_FIELD(mm_start_stack  );
-    FILL_TARGET_ULONG_FIELD(vma_vm_start    );
-    FILL_TARGET_ULONG_FIELD(vma_vm_end      );
-    FILL_TARGET_ULONG_FIELD(vma_vm_next     );
-    FILL_TARGET_ULONG_FIELD(vma_vm_file     );
-    FILL_TARGET_ULONG_FIELD(vma_vm_flags    );
-    FILL_TARGET_ULONG_FIELD(vma_vm_pgoff    );
-    FILL_TARGET_ULONG_FIELD(file_dentry     );
-	FILL_TARGET_ULONG_FIELD(file_inode		);
-    FILL_TARGET_ULONG_FIELD(dentry_d_name   );
-    FILL_TARGET_ULONG_FIELD(dentry_d_iname  );
-    FILL_TARGET_ULONG_FIELD(dentry_d_parent );
-    FILL_TARGET_ULONG_FIELD(ti_task         );
-	FILL_TARGET_ULONG_FIELD(inode_ino);
-
-	FILL_TARGET_ULONG_FIELD(proc_fork_connector);
-	FILL_TARGET_ULONG_FIELD(proc_exit_connector);
-	FILL_TARGET_ULONG_FIELD(proc_exec_connector);
-	FILL_TARGET_ULONG_FIELD(vma_link);
-	FILL_TARGET_ULONG_FIELD(remove_vma);
-	FILL_TARGET_ULONG_FIELD(vma_adjust);
-
-	FILL_TARGET_ULONG_FIELD(trim_init_extable);
-#ifdef TARGET_MIPS
-    FILL_TARGET_ULONG_FIELD(mips_pgd_current);
+  PROCINFO_DB_FIELDS(COPY_PROCINFO_FIELD)
+#ifndef TARGET_MIPS
+  pi.mips_pgd_current = 0;
 #endif
 }
 
-// find the corresponding section for the current os and return the section number
-int find_match_section(const boost::property_tree::ptree &pt, target_ulong tulInitTaskAddr)
+// map procinfo.db, and check that it was generated for this ProcInfo layout
+static int map_profile_db(const string &sPath)
 {
-    int cntSection = pt.get("info.total", 0);
+  struct stat st;
+  const procinfo_db_header *hdr;
+  void *p;
+  int fd;
 
-    string sSectionNum;
-    vector<int> vMatchNum;
+  if ((fd = open(sPath.c_str(), O_RDONLY)) < 0)
+    return -1;
 
-    monitor_printf(default_mon, "Total Sections: %d\n", cntSection);
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(procinfo_db_header))
+  {
+    close(fd);
+    return -1;
+  }
 
-    for(int i = 1; i<=cntSection; ++i)
-    {
-      sSectionNum = boost::lexical_cast<string>(i);
-      target_ulong tulAddr = pt.get<target_ulong>(sSectionNum + ".init_task_addr");
-      if(tulAddr == tulInitTaskAddr)
-      {
-        vMatchNum.push_back(i);
-      }
-    }
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  hdr = (const procinfo_db_header *)p;
+  if (memcmp(hdr->magic, PROCINFO_DB_MAGIC, sizeof(PROCINFO_DB_MAGIC))
+      || hdr->version != PROCINFO_DB_VERSION
+      || hdr->field_count != PROCINFO_DB_NUM_FIELDS
+      || hdr->record_size != sizeof(procinfo_db_record)
+      || sizeof(procinfo_db_header) + (uint64_t)hdr->record_count * hdr->record_size > hdr->name_index_offset
+      || hdr->name_index_offset + (uint64_t)hdr->record_count * sizeof(uint32_t) > (uint64_t)st.st_size
+      || hdr->ti_task_offset + (uint64_t)hdr->ti_task_count * sizeof(uint64_t) > (uint64_t)st.st_size)
+  {
+    monitor_printf(default_mon, "%s does not match this build of DECAF, please regenerate it\n", sPath.c_str());
+    munmap(p, st.st_size);
+    return -1;
+  }
+
+  g_db_records = (const procinfo_db_record *)(hdr + 1);
+  g_db_name_index = (const uint32_t *)((const char *)p + hdr->name_index_offset);
+  g_db_count = hdr->record_count;
+
+  const uint64_t *ti_task = (const uint64_t *)((const char *)p + hdr->ti_task_offset);
+  for (uint32_t i = 0; i < hdr->ti_task_count; i++)
+    g_ti_task_offsets.push_back((target_ulong)ti_task[i]);
 
-    if(vMatchNum.size() > 1)
+  // profiles without ti_task are not listed in the ti_task table
+  for (uint32_t i = 0; i < g_db_count && !g_need_task_search; i++)
+    g_need_task_search = (g_db_records[i].fields[PROCINFO_DB_ti_task] == PROCINFO_DB_INVALID);
+
+  return 0;
+}
+
+// compile procinfo.ini into the same sorted layout as procinfo.db
+#define FILL_DB_FIELD(field) rec.fields[PROCINFO_DB_##field] = pt.get<uint64_t>(sSectionNum + #field, PROCINFO_DB_INVALID);
+static int load_profile_ini(const string &sPath)
+{
+  boost::property_tree::ptree pt;
+  boost::property_tree::ini_parser::read_ini(sPath, pt);
+
+  int cntSection = pt.get("info.total", 0);
+  monitor_printf(default_mon, "Total Sections: %d\n", cntSection);
+
+  g_ini_records.resize(cntSection);
+  for(int i = 0; i < cntSection; ++i)
+  {
+    procinfo_db_record &rec = g_ini_records[i];
+    string sSectionNum = boost::lexical_cast<string>(i + 1) + ".";
+
+    string sName = pt.get<string>(sSectionNum + "strName");
+    memset(rec.strName, 0, sizeof(rec.strName));
+    strncpy(rec.strName, sName.c_str(), sizeof(rec.strName) - 1);
+
+    PROCINFO_DB_FIELDS(FILL_DB_FIELD)
+
+    target_ulong ti_task = (target_ulong)rec.fields[PROCINFO_DB_ti_task];
+    if (rec.fields[PROCINFO_DB_ti_task] == PROCINFO_DB_INVALID)
+      g_need_task_search = true;
+    else if (find(g_ti_task_offsets.begin(), g_ti_task_offsets.end(), ti_task) == g_ti_task_offsets.end())
+      g_ti_task_offsets.push_back(ti_task);
+  }
+  sort(g_ini_records.begin(), g_ini_records.end(), record_less);
+
+  g_db_records = g_ini_records.empty() ? NULL : &g_ini_records[0];
+  g_db_count = g_ini_records.size();
+
+  for (uint32_t i = 0; i < g_db_count; i++)
+    g_ini_name_index.push_back(i);
+  sort(g_ini_name_index.begin(), g_ini_name_index.end(), record_name_less());
+  g_db_name_index = g_ini_name_index.empty() ? NULL : &g_ini_name_index[0];
+
+  return 0;
+}
+
+// load procinfo.db, falling back to procinfo.ini if the db is missing or older
+static int load_profile_table()
+{
+  string sDir, sIniPath, sDbPath;
+  struct stat st_ini, st_db;
+  bool bHaveIni, bHaveDb;
+
+  get_procinfo_directory(sDir);
+  sIniPath = sDir + "procinfo.ini";
+  sDbPath = sDir + "procinfo.db";
+
+  bHaveIni = (stat(sIniPath.c_str(), &st_ini) == 0);
+  bHaveDb = (stat(sDbPath.c_str(), &st_db) == 0);
+
+  if (bHaveDb && (!bHaveIni || st_db.st_mtime >= st_ini.st_mtime))
+  {
+    monitor_printf(default_mon, "\nProcinfo path: %s\n", sDbPath.c_str());
+    if (0 == map_profile_db(sDbPath))
     {
-      monitor_printf(default_mon, "Too many match sections in procinfo.ini\n");
+      monitor_printf(default_mon, "Total Sections: %u\n", g_db_count);
       return 0;
-      // for(int i=0;i<vMatchNum.size();++i)
-      // {
-      //   monitor_printf(default_mon, "[%d] ", vMatchNum[i]);
-      // }
-      // monitor_printf(default_mon, "\nPlease input the corresponding section number for the operating system\n");
-      // int iNum = 100;
-      // // cin >> iNum;
-      // DECAF_stop_vm();
-      // scanf("%d", &iNum);
-
-      // cout << "iNum" << iNum << endl;
-      // DECAF_start_vm();
-      // bool bMatch = false;
-      // for(int i=0;i<vMatchNum.size();++i)
-      // {
-      //   if(iNum == vMatchNum[i])
-      //   {
-      //     bMatch = true;
-      //   }
-      // }
-
-      // if(bMatch)
-      // {
-      //   return iNum;
-      // }
-      // else
-      // {
-      //   monitor_printf(default_mon, "Invalid section number\n");
-      //   return 0;
-      // }
-    }
-    
-    if(vMatchNum.size() <= 0)
-    {
-      monitor_printf(default_mon, "No match in procinfo.ini\n");
-      return 0;        
     }
+  }
+
+  if (!bHaveIni)
+  {
+    monitor_printf(default_mon, "can't open %s\n", sIniPath.c_str());
+    return -1;
+  }
+
+  if (bHaveDb)
+    monitor_printf(default_mon, "%s is out of date, run make to regenerate it\n", sDbPath.c_str());
+  monitor_printf(default_mon, "\nProcinfo path: %s\n", sIniPath.c_str());
+  return load_profile_ini(sIniPath);
+}
+
+// whether tulTask is a swapper, with comm at offset ts_comm
+static bool is_swapper(CPUState * env, target_ulong tulTask, target_ulong ts_comm)
+{
+  const uint32_t intSWAP = 0x70617773; //p, a, w, s
+  const uint32_t intPER = 0x2f726570; ///, r, e, p
+  uint32_t comm[2];
 
-    return vMatchNum[0];
+  if (DECAF_read_mem(env, tulTask + ts_comm, sizeof(comm), comm) < 0)
+    return false;
+  return comm[0] == intSWAP && (comm[1] & 0x00FFFFFF) == (intPER & 0x00FFFFFF);
 }
 
+// look up the profile whose init_task is tulTask, and make sure the task
+// really is the swapper. Returns the record number, -1 if there is
+// no such profile, or -2 if the match is ambiguous.
+static int match_profile(CPUState * env, target_ulong tulTask)
+{
+  const procinfo_db_record *end = g_db_records + g_db_count;
+  const procinfo_db_record *rec = lower_bound(g_db_records, end, (uint64_t)tulTask, record_addr_less);
+  if (rec == end || rec->fields[PROCINFO_DB_init_task_addr] != (uint64_t)tulTask)
+    return -1;
+
+  if (rec + 1 != end && rec[1].fields[PROCINFO_DB_init_task_addr] == (uint64_t)tulTask)
+    return -2;
+
+  if (!is_swapper(env, tulTask, (target_ulong)rec->fields[PROCINFO_DB_ts_comm]))
+    return -1;
 
+  return rec - g_db_records;
+}
+
+// look up the profile of a kernel release, e.g. "3.5.0-23-generic".
+// Returns the record number, or -1.
+static int find_profile_by_name(const char *strName)
+{
+  const uint32_t *end = g_db_name_index + g_db_count;
+  const uint32_t *idx = lower_bound(g_db_name_index, end, strName, record_name_less());
+  if (idx == end || strncmp(g_db_records[*idx].strName, strName, PROCINFO_DB_NAME_LEN) != 0)
+    return -1;
+  return *idx;
+}
+
+// physical memory searched for the kernel banner
+#define BANNER_SCAN_SIZE (64 * 1024 * 1024)
+// the banner is searched for at most once every this many calls
+#define BANNER_SCAN_INTERVAL 64
+
+// read the release of the guest kernel from its "Linux version " banner.
+// The kernel image sits low in physical memory, and is decompressed by the
+// time there are tasks to match, but we may be called before that: the
+// scan is retried now and then until it finds the banner.
+static const char *get_kernel_release(CPUState * env)
+{
+  static const char strBanner[] = "Linux version ";
+  static char strRelease[PROCINFO_DB_NAME_LEN];
+  static uint32_t uiCalls = 0;
+  uint8_t buf[TARGET_PAGE_SIZE + sizeof(strBanner) + PROCINFO_DB_NAME_LEN];
+  uint8_t *p;
+  gpa_t addr, end;
+  size_t i;
+
+  if (strRelease[0] != '\0')
+    return strRelease;
+  if (uiCalls++ % BANNER_SCAN_INTERVAL != 0)
+    return NULL;
+
+  end = (ram_size < BANNER_SCAN_SIZE) ? ram_size : BANNER_SCAN_SIZE;
+  for (addr = 0; addr + sizeof(buf) <= end; addr += TARGET_PAGE_SIZE)
+  {
+    DECAF_physical_memory_read(env, addr, buf, sizeof(buf));
+    p = (uint8_t *)memmem(buf, TARGET_PAGE_SIZE + sizeof(strBanner) - 1, strBanner, sizeof(strBanner) - 1);
+    if (p == NULL)
+      continue;
+
+    p += sizeof(strBanner) - 1;
+    for (i = 0; i < sizeof(strRelease) - 1 && p[i] > ' ' && p[i] < 0x7f; i++)
+      strRelease[i] = p[i];
+    strRelease[i] = '\0';
+    if (i != 0)
+      return strRelease;
+  }
+  return NULL;
+}
+
+// fall back on the release of the guest kernel when no profile matches the
+// init_task, either because the kernel was relocated or because profiles of
+// several releases share its address. The profile of that release is used if
+// the current task is its swapper, and *ptulDelta is set to how far the
+// kernel was moved from the profile's addresses.
+// Returns the record number, or -1.
+static int match_profile_by_release(CPUState * env, gva_t threadinfo, target_ulong *ptulDelta)
+{
+  const char *strRelease;
+  target_ulong tulTask;
+  int iProfile;
+
+  if ((strRelease = get_kernel_release(env)) == NULL
+      || (iProfile = find_profile_by_name(strRelease)) < 0)
+    return -1;
+
+  const procinfo_db_record &rec = g_db_records[iProfile];
+  if (rec.fields[PROCINFO_DB_ti_task] == PROCINFO_DB_INVALID
+      || DECAF_read_ptr(env, threadinfo + (target_ulong)rec.fields[PROCINFO_DB_ti_task], &tulTask) < 0
+      || !isKernelAddress(tulTask)
+      || !is_swapper(env, tulTask, (target_ulong)rec.fields[PROCINFO_DB_ts_comm]))
+    return -1;
+
+  *ptulDelta = tulTask - (target_ulong)rec.fields[PROCINFO_DB_init_task_addr];
+  return iProfile;
+}
+
+// the fields of ProcInfo that are kernel addresses rather than offsets
+#define RELOCATE_PROCINFO_FIELD(field) \
+  if (pi.field != 0 && pi.field != (target_ulong)PROCINFO_DB_INVALID) \
+    pi.field += tulDelta;
+static void relocate_procinfo(ProcInfo &pi, target_ulong tulDelta)
+{
+  RELOCATE_PROCINFO_FIELD(init_task_addr)
+  RELOCATE_PROCINFO_FIELD(modules)
+  RELOCATE_PROCINFO_FIELD(proc_fork_connector)
+  RELOCATE_PROCINFO_FIELD(proc_exit_connector)
+  RELOCATE_PROCINFO_FIELD(proc_exec_connector)
+  RELOCATE_PROCINFO_FIELD(vma_link)
+  RELOCATE_PROCINFO_FIELD(remove_vma)
+  RELOCATE_PROCINFO_FIELD(vma_adjust)
+  RELOCATE_PROCINFO_FIELD(trim_init_extable)
+  RELOCATE_PROCINFO_FIELD(mips_pgd_current)
+}
 
-// infer init_task_addr, use the init_task_addr to search for the corresponding
-// section in procinfo.ini. If found, fill the fields in ProcInfo struct.
+// infer the current task_struct from threadinfo, and see if it is the init_task
+// of one of the kernel profiles. If found, fill the fields in ProcInfo struct.
 int load_proc_info(CPUState * env, gva_t threadinfo, ProcInfo &pi)
 {
+  static bool bProcinfoLoaded = false;
   static bool bProcinfoMisconfigured = false;
   const int CANNOT_FIND_INIT_TASK_STRUCT = -1;
   const int CANNOT_OPEN_PROCINFO = -2;
   const int CANNOT_MATCH_PROCINFO_SECTION = -3;
-  target_ulong tulInitTaskAddr;
+  target_ulong tulTask;
+  target_ulong tulDelta = 0;
+  int iProfile = -1;
 
   if(bProcinfoMisconfigured)
   {
    return CANNOT_MATCH_PROCINFO_SECTION;
   }
 
-  // find init_task_addr
-  tulInitTaskAddr = findTaskStructFromThreadInfo(env, threadinfo, &pi, 0);
-  // tulInitTaskAddr = 2154330880;
-  if (INV_ADDR == tulInitTaskAddr)
+  if(!bProcinfoLoaded)
   {
-    return CANNOT_FIND_INIT_TASK_STRUCT;
+    if(0 != load_profile_table())
+    {
+      bProcinfoMisconfigured = true;
+      return CANNOT_OPEN_PROCINFO;
+    }
+    bProcinfoLoaded = true;
   }
 
-  string sProcInfoPath;
-  boost::property_tree::ptree pt;
-  get_procinfo_directory(sProcInfoPath);
-  sProcInfoPath += "procinfo.ini";
-  monitor_printf(default_mon, "\nProcinfo path: %s\n",sProcInfoPath.c_str());
-  // read procinfo.ini
-  if (0 != access(sProcInfoPath.c_str(), 0))
+  // the common case: thread_info points to its task at a known offset
+  for(size_t i = 0; i < g_ti_task_offsets.size() && iProfile == -1; ++i)
   {
-      monitor_printf(default_mon, "can't open %s\n", sProcInfoPath.c_str());
-      return CANNOT_OPEN_PROCINFO;
+    if (DECAF_read_ptr(env, threadinfo + g_ti_task_offsets[i], &tulTask) < 0)
+      continue;
+    iProfile = match_profile(env, tulTask);
+  }
+
+  if(iProfile == -1 && g_need_task_search)
+  {
+    tulTask = findTaskStructFromThreadInfo(env, threadinfo, &pi, 0);
+    if (INV_ADDR != tulTask)
+      iProfile = match_profile(env, tulTask);
+  }
+
+  if(iProfile < 0)
+  {
+    int iByRelease = match_profile_by_release(env, threadinfo, &tulDelta);
+    if (iByRelease >= 0)
+      iProfile = iByRelease;
   }
-  boost::property_tree::ini_parser::read_ini(sProcInfoPath, pt);
 
-  // find the match section using previously found init_task_addr
-  int iSectionNum = find_match_section(pt, tulInitTaskAddr);
-  // no match or too many match sections
-  if(0 == iSectionNum)
+  if(iProfile == -1)
   {
+    return CANNOT_FIND_INIT_TASK_STRUCT;
+  }
+
+  if(iProfile == -2)
+  {
+    monitor_printf(default_mon, "Too many match sections in procinfo.ini\n");
     monitor_printf(default_mon, "VMI won't work.\nPlease configure procinfo.ini and restart DECAF.\n");
-    // exit(0);
     bProcinfoMisconfigured = true;
     return CANNOT_MATCH_PROCINFO_SECTION;
   }
 
-  _load_one_section(pt, iSectionNum, pi);
-  monitor_printf(default_mon, "Match %s\n", pi.strName);
+  record_to_procinfo(g_db_records[iProfile], pi);
+  if (tulDelta != 0)
+  {
+    relocate_procinfo(pi, tulDelta);
+    monitor_printf(default_mon, "Match %s, relocated by 0x%"T_FMT"x\n", pi.strName, tulDelta);
+  }
+  else
+    monitor_printf(default_mon, "Match %s\n", pi.strName);
+  return 0;
+}
+
+// find a kernel profile by its version string, e.g. "3.5.0-23-generic"
+int find_proc_info_by_name(const char *strName, ProcInfo &pi)
+{
+  if (g_db_records == NULL && 0 != load_profile_table())
+    return -1;
+
+  int iProfile = find_profile_by_name(strName);
+  if (iProfile < 0)
+    return -1;
+
+  record_to_procinfo(g_db_records[iProfile], pi);
   return 0;
 }
 
@@ -83,6 +83,7 @@ typedef struct _ProcInfo
 
 int printProcInfo(ProcInfo* pPI);
 int load_proc_info(CPUState * env, gva_t threadinfo, ProcInfo &pi);
+int find_proc_info_by_name(const char *strName, ProcInfo &pi);
 void load_library_info(const char *strName);
 
 #ifdef __cplusplus
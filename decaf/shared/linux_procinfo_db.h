@@ -0,0 +1,119 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+
+DECAF is based on QEMU, a whole-system emulator. You can redistribute
+and modify it under the terms of the GNU GPL, version 3 or later,
+but it is made available WITHOUT ANY WARRANTY. See the top-level
+README file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * linux_procinfo_db.h
+ *
+ * On-disk layout of procinfo.db, the precompiled form of procinfo.ini.
+ * It is generated at build time by shared/kernelinfo/procinfo_db.py, which
+ * reads the field list below from this very file, and is mmap()ed by
+ * linux_procinfo.cpp so that no parsing happens at VMI bring-up.
+ *
+ * Layout (all integers little endian):
+ *   procinfo_db_header
+ *   procinfo_db_record[record_count]   sorted by init_task_addr
+ *   uint32_t name_index[record_count]  record numbers sorted by strName
+ *   uint64_t ti_task[ti_task_count]    distinct ti_task offsets
+ */
+
+#ifndef LINUX_PROCINFO_DB_H_
+#define LINUX_PROCINFO_DB_H_
+
+#include <inttypes.h>
+
+#define PROCINFO_DB_MAGIC "DECAFPI"
+#define PROCINFO_DB_VERSION 1
+#define PROCINFO_DB_NAME_LEN 32
+#define PROCINFO_DB_INVALID ((uint64_t)-1)
+
+/* Every ProcInfo field, in on-disk order. init_task_addr must come first. */
+#define PROCINFO_DB_FIELDS(X) \
+	X(init_task_addr) \
+	X(init_task_size) \
+	X(ts_tasks) \
+	X(ts_pid) \
+	X(ts_tgid) \
+	X(ts_group_leader) \
+	X(ts_thread_group) \
+	X(ts_real_parent) \
+	X(ts_mm) \
+	X(ts_stack) \
+	X(ts_real_cred) \
+	X(ts_cred) \
+	X(ts_comm) \
+	X(modules) \
+	X(module_name) \
+	X(module_init) \
+	X(module_size) \
+	X(module_list) \
+	X(cred_uid) \
+	X(cred_gid) \
+	X(cred_euid) \
+	X(cred_egid) \
+	X(mm_mmap) \
+	X(mm_pgd) \
+	X(mm_arg_start) \
+	X(mm_start_brk) \
+	X(mm_brk) \
+	X(mm_start_stack) \
+	X(vma_vm_start) \
+	X(vma_vm_end) \
+	X(vma_vm_next) \
+	X(vma_vm_file) \
+	X(vma_vm_flags) \
+	X(vma_vm_pgoff) \
+	X(file_dentry) \
+	X(file_inode) \
+	X(dentry_d_name) \
+	X(dentry_d_iname) \
+	X(dentry_d_parent) \
+	X(ti_task) \
+	X(inode_ino) \
+	X(proc_fork_connector) \
+	X(proc_exit_connector) \
+	X(proc_exec_connector) \
+	X(vma_link) \
+	X(remove_vma) \
+	X(vma_adjust) \
+	X(trim_init_extable) \
+	X(mips_pgd_current)
+
+#define PROCINFO_DB_ENUM(field) PROCINFO_DB_##field,
+enum {
+	PROCINFO_DB_FIELDS(PROCINFO_DB_ENUM)
+	PROCINFO_DB_NUM_FIELDS
+};
+#undef PROCINFO_DB_ENUM
+
+typedef struct _procinfo_db_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t field_count;      /* PROCINFO_DB_NUM_FIELDS of the generator */
+	uint32_t record_count;
+	uint32_t record_size;      /* sizeof(procinfo_db_record) */
+	uint32_t name_index_offset;
+	uint32_t ti_task_count;
+	uint32_t ti_task_offset;
+	uint32_t reserved;
+} procinfo_db_header;
+
+typedef struct _procinfo_db_record
+{
+	char strName[PROCINFO_DB_NAME_LEN];
+	uint64_t fields[PROCINFO_DB_NUM_FIELDS];
+} procinfo_db_record;
+
+#endif /* LINUX_PROCINFO_DB_H_ */
@@ -24,6 +24,7 @@
 #include <string>
 #include <list>
 #include <set>
+#include <map>
 #include <algorithm>
 #include <assert.h>
 #include <errno.h>
@@ -76,6 +77,22 @@ static int first = 1;
 // current linux profile
 static ProcInfo OFFSET_PROFILE = {"VMI"};
 
+// A file-backed vm_area_struct, as recorded by traverse_mmap and kept up to date
+// by the vma_link/vma_adjust/remove_vma hooks.
+// A module mapping is a run of contiguous VMAs backed by the same file, and is
+// registered with VMI at the vm_start of its first VMA.
+typedef struct _vma_rec
+{
+    target_ulong vm_end;
+    module *mod;
+    bool is_base;   // this VMA starts a module mapping
+} vma_rec;
+
+typedef map<target_ulong, vma_rec> vma_index_t;
+
+// pid -> file-backed VMAs of that process, keyed by vm_start
+static unordered_map<uint32_t, vma_index_t> vma_index_map;
+
 
 void print_loaded_modules(CPUState *env)
 {
@@ -327,15 +344,80 @@ static process *traverse_task_struct_remove(CPUState *env)
 	
 	//monitor_printf(default_mon,"process with pid [%08x]  ended\n",right_pid);
 
+    vma_index_map.erase(right_pid);
     VMI_remove_process(right_pid);
     return right_proc;
 }
 
+// Read the range and the backing file of a vm_area_struct.
+// Returns 0 if the VMA is file-backed and has a valid name, -1 otherwise.
+static int read_vma_info(CPUState *env, target_ulong vma, target_ulong *vm_start,
+                         target_ulong *vm_end, char *name, unsigned int *inode_number)
+{
+    target_ulong vma_file, f_dentry, f_inode;
+
+    // read start and end of the vma
+    if (DECAF_read_mem(env, vma + OFFSET_PROFILE.vma_vm_start, sizeof(target_ptr), vm_start) < 0)
+        return -1;
+
+    if (DECAF_read_mem(env, vma + OFFSET_PROFILE.vma_vm_end, sizeof(target_ptr), vm_end) < 0)
+        return -1;
+
+    // read the struct* file entry of the vma, used to then extract the dentry of the this page
+    if (DECAF_read_mem(env, vma + OFFSET_PROFILE.vma_vm_file, sizeof(target_ptr), &vma_file) < 0 || !vma_file)
+        return -1;
+
+    // dentry extraction from the struct* file
+    if (DECAF_read_mem(env, vma_file + OFFSET_PROFILE.file_dentry, sizeof(target_ptr), &f_dentry) < 0 || !f_dentry)
+        return -1;
+
+    // read small names form the dentry
+    if (DECAF_read_mem(env, f_dentry + OFFSET_PROFILE.dentry_d_iname, 32, name) < 0)
+        return -1;
+
+    // inode struct extraction from the struct* file
+    if (DECAF_read_mem(env, f_dentry + OFFSET_PROFILE.file_inode, sizeof(target_ptr), &f_inode) < 0 || !f_inode)
+        return -1;
+
+    // inode_number extraction
+    if (DECAF_read_mem(env, f_inode + OFFSET_PROFILE.inode_ino, sizeof(unsigned int), inode_number) < 0 || !*inode_number)
+        return -1;
+
+    name[31] = '\0';	// truncate long string
+
+    // name is invalid, move on the data structure
+    if (strlen(name) == 0)
+        return -1;
+
+    return 0;
+}
+
+// Find the module for a file, or create it if we haven't seen this file before
+static module *get_vma_module(const char *name, unsigned int inode_number, target_ulong size)
+{
+    char key[32+32];
+    module *mod;
+
+    sprintf(key, "%u_%s", inode_number, name);
+    mod = VMI_find_module_by_key(key);
+    if (!mod)
+    {
+        mod = new module();
+        strncpy(mod->name, name, 31);
+        mod->name[31] = '\0';
+        mod->size = size;
+        mod->inode_number = inode_number;
+        mod->symbols_extracted = 0;
+        VMI_add_module(mod, key);
+    }
+    return mod;
+}
+
 // Traverse the memory map for a process
 void traverse_mmap(CPUState *env, void *opaque)
 {
     process *proc = (process *)opaque;
-    target_ulong mm, vma_curr, vma_file, f_dentry, f_inode, mm_mmap, vma_next=NULL;
+    target_ulong mm, vma_curr, mm_mmap, vma_next=NULL;
     set<target_ulong> module_bases;
     unsigned int inode_number;
     target_ulong vma_vm_start = 0, vma_vm_end = 0;
@@ -358,6 +440,9 @@ void traverse_mmap(CPUState *env, void *opaque)
     if (-1UL == proc->cr3)
         return;
 
+    // The full traversal rebuilds the VMA index; from now on the VMA hooks keep it up to date.
+    vma_index_t &vmas = vma_index_map[proc->pid];
+    vmas.clear();
 
     // starting from the first vm_area, read vm_file. NOTICE vm_area_struct can be null
     if (( vma_curr = mm_mmap) == 0)
@@ -366,44 +451,9 @@ void traverse_mmap(CPUState *env, void *opaque)
 
     while(true)
     {
-        // read start of curr vma
-        if (DECAF_read_mem(env, vma_curr + OFFSET_PROFILE.vma_vm_start, sizeof(target_ptr), &vma_vm_start) < 0)
-            goto next;
-
-        // read end of curr vma
-        if (DECAF_read_mem(env, vma_curr + OFFSET_PROFILE.vma_vm_end, sizeof(target_ptr), &vma_vm_end) < 0)
-            goto next;
-
-        // read the struct* file entry of the curr vma, used to then extract the dentry of the this page
-        if (DECAF_read_mem(env, vma_curr + OFFSET_PROFILE.vma_vm_file, sizeof(target_ptr), &vma_file) < 0 || !vma_file)
-            goto next;
-
-        // dentry extraction from the struct* file
-        if (DECAF_read_mem(env, vma_file + OFFSET_PROFILE.file_dentry, sizeof(target_ptr), &f_dentry) < 0 || !f_dentry)
-            goto next;
-
-
-        // read small names form the dentry
-        if (DECAF_read_mem(env, f_dentry + OFFSET_PROFILE.dentry_d_iname, 32, name) < 0)
-            goto next;
-
-
-        // inode struct extraction from the struct* file
-        if (DECAF_read_mem(env, f_dentry + OFFSET_PROFILE.file_inode, sizeof(target_ptr), &f_inode) < 0 || !f_inode)
-            goto next;
-
-        // inode_number extraction
-        if (DECAF_read_mem(env, f_inode + OFFSET_PROFILE.inode_ino , sizeof(unsigned int), &inode_number) < 0 || !inode_number)
+        if (read_vma_info(env, vma_curr, &vma_vm_start, &vma_vm_end, name, &inode_number) < 0)
             goto next;
 
-        name[31] = '\0';	// truncate long string
-
-
-        // name is invalid, move on the data structure
-        if (strlen(name)==0)
-            goto next;
-
-
         if (!strcmp(last_mod_name.c_str(), name))
         {
             // extending the module
@@ -413,27 +463,21 @@ void traverse_mmap(CPUState *env, void *opaque)
                 target_ulong new_size = vma_vm_end - mod_vm_start;
                 if (mod->size < new_size)
                     mod->size = new_size;
+                vma_rec rec = { vma_vm_end, mod, false };
+                vmas[vma_vm_start] = rec;
             }
             // This is a special case when the data struct is BEING populated
             goto next;
         }
 
-        char key[32+32];
         //not extending, a different module
         mod_vm_start = vma_vm_start;
 
-        sprintf(key, "%u_%s", inode_number, name);
-        mod = VMI_find_module_by_key(key);
+        mod = get_vma_module(name, inode_number, vma_vm_end - vma_vm_start);
         module_bases.insert(vma_vm_start);
-        if (!mod)
         {
-            mod = new module();
-            strncpy(mod->name, name, 31);
-            mod->name[31] = '\0';
-            mod->size = vma_vm_end - vma_vm_start;
-            mod->inode_number = inode_number;
-            mod->symbols_extracted = 0;
-            VMI_add_module(mod, key);
+            vma_rec rec = { vma_vm_end, mod, true };
+            vmas[vma_vm_start] = rec;
         }
 
         if(VMI_find_module_by_base(proc->cr3, vma_vm_start) != mod)
@@ -476,7 +520,6 @@ next:
         VMI_remove_module(proc->pid, *iter2);
     }
 }
-
 //New process callback function
 static void new_proc_callback(DECAF_Callback_Params* params)
 {
@@ -502,26 +545,268 @@ static void proc_end_callback(DECAF_Callback_Params *params)
     traverse_task_struct_remove(env);
 }
 
-// Callback corresponding to `vma_link`,`vma_adjust` & `remove_vma`
-// This marks the `modules_extracted` for the process `false`
-void VMA_update_func_callback(DECAF_Callback_Params *params)
+// Read the n-th (0-based) argument of a kernel function. Only valid at the
+// first instruction of the function, i.e. from an optimized block begin callback.
+static int get_kernel_func_arg(CPUState *env, int n, target_ulong *arg)
 {
-    CPUState *env = params->bb.env;
+#if defined(TARGET_I386)
+    // The i386 kernel is built with -mregparm=3
+    static const int arg_regs[] = { R_EAX, R_EDX, R_ECX };
+    if (n < 3)
+    {
+        *arg = env->regs[arg_regs[n]];
+        return 0;
+    }
+    // skip the return address
+    return DECAF_read_ptr(env, DECAF_getESP(env) + (n - 2) * sizeof(target_ptr), arg);
+#elif defined(TARGET_ARM)
+    if (n < 4)
+    {
+        *arg = env->regs[n];
+        return 0;
+    }
+    return DECAF_read_ptr(env, DECAF_getESP(env) + (n - 4) * sizeof(target_ptr), arg);
+#elif defined(TARGET_MIPS)
+    // o32: a0-a3, the caller reserves home slots for them on the stack
+    if (n < 4)
+    {
+        *arg = env->active_tc.gpr[4 + n];
+        return 0;
+    }
+    return DECAF_read_ptr(env, DECAF_getESP(env) + n * sizeof(target_ptr), arg);
+#else
+    return -1;
+#endif
+}
 
-    target_ulong pc = DECAF_getPC(env);
+// Find the process whose memory map is being changed. Returns NULL if the process
+// is unknown or still waits for a full traversal, in which case there is nothing
+// to update incrementally.
+static process *get_vma_process(CPUState *env, target_ulong mm)
+{
+    process *proc;
+    target_ulong pgd;
+
+    if (mm != 0 && DECAF_read_ptr(env, mm + OFFSET_PROFILE.mm_pgd, &pgd) == 0)
+        proc = VMI_find_process_by_pgd(DECAF_get_phys_addr(env, pgd));
+    else
+        proc = VMI_find_process_by_pgd(DECAF_getPGD(env));
 
-    if(!(pc == OFFSET_PROFILE.vma_link) && !(pc == OFFSET_PROFILE.vma_adjust) && !(pc == OFFSET_PROFILE.remove_vma))
+    if (!proc || !proc->modules_extracted || proc->pid == 0)
+        return NULL;
+
+    return proc;
+}
+
+// Read a new VMA from the guest and add it to the index, without registering anything yet
+static int vma_index_add(CPUState *env, vma_index_t &vmas, target_ulong vma,
+                         target_ulong *vm_start, target_ulong *vm_end)
+{
+    unsigned int inode_number;
+    char name[32];
+
+    if (read_vma_info(env, vma, vm_start, vm_end, name, &inode_number) < 0)
+        return -1;
+
+    vma_rec rec = { *vm_end, get_vma_module(name, inode_number, *vm_end - *vm_start), false };
+    vmas[*vm_start] = rec;
+    return 0;
+}
+
+// Drop a VMA from the index. If it started a module mapping, the base is kept in
+// `stale' until vma_index_regroup decides whether the mapping still starts there.
+static void vma_index_erase(vma_index_t &vmas, vma_index_t::iterator it,
+                            map<target_ulong, module *> &stale)
+{
+    if (it->second.is_base)
+        stale[it->first] = it->second.mod;
+    vmas.erase(it);
+}
+
+// Recompute the module mappings covering [lo, hi) after the index was changed,
+// and report only the mappings that really appeared or disappeared.
+static void vma_index_regroup(process *proc, vma_index_t &vmas, target_ulong lo, target_ulong hi,
+                              map<target_ulong, module *> &stale)
+{
+    vma_index_t::iterator it = vmas.lower_bound(lo), prev;
+    target_ulong head = 0, last_end = 0;
+    module *head_mod = NULL;
+
+    // back up to the head of the mapping that reaches into lo
+    if (it == vmas.end() && it != vmas.begin())
+        --it;
+    while (it != vmas.begin())
+    {
+        prev = it;
+        --prev;
+        if (prev->second.mod != it->second.mod || prev->second.vm_end != it->first)
+            break;
+        it = prev;
+    }
+
+    for (; it != vmas.end(); ++it)
+    {
+        vma_rec &rec = it->second;
+        bool joins = (head_mod == rec.mod && last_end == it->first);
+
+        if (!joins && it->first >= hi)
+            break;
+
+        if (!joins)
+        {
+            head = it->first;
+            head_mod = rec.mod;
+        }
+
+        if (!joins && !rec.is_base)
+        {
+            map<target_ulong, module *>::iterator s = stale.find(it->first);
+            if (s != stale.end() && s->second == rec.mod)
+                stale.erase(s);
+            else
+                VMI_insert_module(proc->pid, it->first, rec.mod);
+            rec.is_base = true;
+        }
+        else if (joins && rec.is_base)
+        {
+            VMI_remove_module(proc->pid, it->first);
+            rec.is_base = false;
+        }
+
+        if (rec.mod->size < rec.vm_end - head)
+            rec.mod->size = rec.vm_end - head;
+        last_end = rec.vm_end;
+    }
+
+    for (map<target_ulong, module *>::iterator s = stale.begin(); s != stale.end(); ++s)
+        VMI_remove_module(proc->pid, s->first);
+    stale.clear();
+}
+
+// vma_link(mm, vma, prev, rb_link, rb_parent)
+static void vma_link_callback(CPUState *env)
+{
+    target_ulong mm, vma, vm_start, vm_end;
+    map<target_ulong, module *> stale;
+    process *proc;
+
+    if (get_kernel_func_arg(env, 0, &mm) < 0 || get_kernel_func_arg(env, 1, &vma) < 0)
         return;
 
-    uint32_t pgd =  DECAF_getPGD(env);
-    process *proc = NULL;
+    if ((proc = get_vma_process(env, mm)) == NULL)
+        return;
 
-    proc = VMI_find_process_by_pgd(pgd);
+    vma_index_t &vmas = vma_index_map[proc->pid];
+    if (vma_index_add(env, vmas, vma, &vm_start, &vm_end) < 0)
+        return;
 
-    if(proc)
-        proc->modules_extracted = false;
+    vma_index_regroup(proc, vmas, vm_start, vm_end, stale);
 }
 
+// vma_adjust(vma, start, end, pgoff, insert)
+// Handles a VMA being shrunk or grown in place, and split_vma passing the other
+// half in `insert'. If the new range runs into the next VMA, or the VMA shrinks
+// away from a next VMA that starts at its old end (vma_merge case 4, where the
+// kernel then moves next->vm_start down), we don't try to follow the kernel and
+// fall back to a full traversal on the next TLB fill.
+static void vma_adjust_callback(CPUState *env)
+{
+    target_ulong vma, start, end, insert, vm_start, ins_start, ins_end;
+    map<target_ulong, module *> stale;
+    vma_index_t::iterator it, next;
+    target_ulong lo, hi;
+    process *proc;
+
+    if (get_kernel_func_arg(env, 0, &vma) < 0
+        || get_kernel_func_arg(env, 1, &start) < 0
+        || get_kernel_func_arg(env, 2, &end) < 0
+        || get_kernel_func_arg(env, 4, &insert) < 0)
+        return;
+
+    if ((proc = get_vma_process(env, 0)) == NULL)
+        return;
+
+    vma_index_t &vmas = vma_index_map[proc->pid];
+
+    if (DECAF_read_ptr(env, vma + OFFSET_PROFILE.vma_vm_start, &vm_start) < 0)
+        goto rescan;
+
+    lo = start;
+    hi = end;
+    it = vmas.find(vm_start);
+    if (it != vmas.end())
+    {
+        vma_rec rec = it->second;
+
+        next = it;
+        ++next;
+        if (next != vmas.end()
+            && (end > next->first || (end < rec.vm_end && next->first == rec.vm_end)))
+            goto rescan;
+
+        lo = min(lo, vm_start);
+        hi = max(hi, rec.vm_end);
+        vma_index_erase(vmas, it, stale);
+        rec.vm_end = end;
+        rec.is_base = false;
+        vmas[start] = rec;
+    }
+
+    if (insert != 0 && vma_index_add(env, vmas, insert, &ins_start, &ins_end) == 0)
+    {
+        lo = min(lo, ins_start);
+        hi = max(hi, ins_end);
+    }
+
+    vma_index_regroup(proc, vmas, lo, hi, stale);
+    return;
+
+rescan:
+    proc->modules_extracted = false;
+}
+
+// remove_vma(vma)
+static void remove_vma_callback(CPUState *env)
+{
+    target_ulong vma, vm_start, vm_end;
+    map<target_ulong, module *> stale;
+    process *proc;
+
+    if (get_kernel_func_arg(env, 0, &vma) < 0)
+        return;
+
+    if ((proc = get_vma_process(env, 0)) == NULL)
+        return;
+
+    if (DECAF_read_ptr(env, vma + OFFSET_PROFILE.vma_vm_start, &vm_start) < 0)
+        return;
+
+    vma_index_t &vmas = vma_index_map[proc->pid];
+    vma_index_t::iterator it = vmas.find(vm_start);
+    if (it == vmas.end())
+        return;
+
+    vm_end = it->second.vm_end;
+    vma_index_erase(vmas, it, stale);
+    vma_index_regroup(proc, vmas, vm_start, vm_end, stale);
+}
+
+// Callback corresponding to `vma_link`,`vma_adjust` & `remove_vma`
+// This reads the vm_area_struct being changed and applies the change to the
+// process's VMA index, instead of re-traversing the whole memory map.
+void VMA_update_func_callback(DECAF_Callback_Params *params)
+{
+    CPUState *env = params->bb.env;
+
+    target_ulong pc = DECAF_getPC(env);
+
+    if (pc == OFFSET_PROFILE.vma_link)
+        vma_link_callback(env);
+    else if (pc == OFFSET_PROFILE.vma_adjust)
+        vma_adjust_callback(env);
+    else if (pc == OFFSET_PROFILE.remove_vma)
+        remove_vma_callback(env);
+}
 // TLB miss callback
 // This callback is only used for updating modules when users have registered for either a
 // module loaded/unloaded callback.
@@ -0,0 +1,165 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+
+DECAF is based on QEMU, a whole-system emulator. You can redistribute
+and modify it under the terms of the GNU LGPL, version 2.1 or later,
+but it is made available WITHOUT ANY WARRANTY. See the top-level
+README file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+/*
+ * SlotQueue.c
+ */
+
+#include <stdlib.h>
+#include "qemu-thread.h"
+#include "SlotQueue.h"
+
+/* The producer fills slot fill; the worker processes the queued slots
+   starting at drain. The slot being filled is never queued, so at most
+   n_slots - 1 slots wait for the worker */
+struct SlotQueue {
+  int n_slots;
+  SlotQueue_func_t process;
+  void *opaque;
+  int fill;
+  int drain;
+  int queued;
+  int stop;
+  QemuMutex lock;
+  QemuCond queued_cond;
+  QemuCond free_cond;
+  QemuThread thread;
+};
+
+static void *SlotQueue_thread(void *arg)
+{
+  SlotQueue_t* q = (SlotQueue_t*) arg;
+  int slot;
+
+  qemu_mutex_lock(&q->lock);
+  for (;;)
+  {
+    while (q->queued == 0 && !q->stop)
+    {
+      qemu_cond_wait(&q->queued_cond, &q->lock);
+    }
+    if (q->queued == 0)
+    {
+      break;
+    }
+
+    slot = q->drain;
+    qemu_mutex_unlock(&q->lock);
+
+    q->process(q->opaque, slot);
+
+    qemu_mutex_lock(&q->lock);
+    q->drain = (q->drain + 1) % q->n_slots;
+    q->queued--;
+    qemu_cond_signal(&q->free_cond);
+  }
+  qemu_mutex_unlock(&q->lock);
+
+  return (NULL);
+}
+
+SlotQueue_t* SlotQueue_new(int n_slots, SlotQueue_func_t process, void *opaque)
+{
+  SlotQueue_t* q;
+
+  if (n_slots < 2)
+  {
+    return (NULL);
+  }
+
+  q = (SlotQueue_t*) calloc(1, sizeof(SlotQueue_t));
+  if (q == NULL)
+  {
+    return (NULL);
+  }
+  q->n_slots = n_slots;
+  q->process = process;
+  q->opaque = opaque;
+
+  qemu_mutex_init(&q->lock);
+  qemu_cond_init(&q->queued_cond);
+  qemu_cond_init(&q->free_cond);
+  qemu_thread_create(&q->thread, SlotQueue_thread, q);
+
+  return (q);
+}
+
+int SlotQueue_fill_slot(SlotQueue_t* q)
+{
+  //only the producer moves fill
+  return (q->fill);
+}
+
+/* Queue the slot being filled, with the lock held */
+static void SlotQueue_queue(SlotQueue_t* q)
+{
+  q->queued++;
+  qemu_cond_signal(&q->queued_cond);
+  q->fill = (q->fill + 1) % q->n_slots;
+}
+
+void SlotQueue_submit(SlotQueue_t* q)
+{
+  qemu_mutex_lock(&q->lock);
+  SlotQueue_queue(q);
+  while (q->queued == q->n_slots)
+  {
+    qemu_cond_wait(&q->free_cond, &q->lock);
+  }
+  qemu_mutex_unlock(&q->lock);
+}
+
+int SlotQueue_try_submit(SlotQueue_t* q)
+{
+  int ret = -1;
+
+  qemu_mutex_lock(&q->lock);
+  if (q->queued < q->n_slots - 1)
+  {
+    SlotQueue_queue(q);
+    ret = 0;
+  }
+  qemu_mutex_unlock(&q->lock);
+  return (ret);
+}
+
+int SlotQueue_pending(SlotQueue_t* q)
+{
+  int queued;
+
+  qemu_mutex_lock(&q->lock);
+  queued = q->queued;
+  qemu_mutex_unlock(&q->lock);
+  return (queued);
+}
+
+void SlotQueue_delete(SlotQueue_t* q)
+{
+  if (q == NULL)
+  {
+    return;
+  }
+
+  qemu_mutex_lock(&q->lock);
+  q->stop = 1;
+  qemu_cond_signal(&q->queued_cond);
+  qemu_mutex_unlock(&q->lock);
+  qemu_thread_join(&q->thread);
+
+  qemu_cond_destroy(&q->free_cond);
+  qemu_cond_destroy(&q->queued_cond);
+  qemu_mutex_destroy(&q->lock);
+  free(q);
+}
@@ -0,0 +1,68 @@
+/*
+Copyright (C) <2012> <Syracuse System Security (Sycure) Lab>
+
+DECAF is based on QEMU, a whole-system emulator. You can redistribute
+and modify it under the terms of the GNU LGPL, version 2.1 or later,
+but it is made available WITHOUT ANY WARRANTY. See the top-level
+README file for more details.
+
+For more information about DECAF and other softwares, see our
+web site at:
+http://sycurelab.ecs.syr.edu/
+
+If you have any questions about DECAF,please post it on
+http://code.google.com/p/decaf-platform/
+*/
+
+/*
+ * SlotQueue.h
+ *
+ *  A ring of n_slots buffers that a plugin fills in the emulation thread
+ *  and a worker thread processes, so that compressing, hashing or writing
+ *  them does not stall the guest. The queue only deals in slot numbers;
+ *  the buffers themselves belong to the plugin.
+ *
+ *  The producer owns the slot returned by SlotQueue_fill_slot until it
+ *  submits it. The worker calls the process function on every submitted
+ *  slot, in order and without any lock held, after which the slot can be
+ *  filled again.
+ */
+
+#ifndef SLOTQUEUE_H_
+#define SLOTQUEUE_H_
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef void (*SlotQueue_func_t) (void *opaque, int slot);
+
+typedef struct SlotQueue SlotQueue_t;
+
+/* Start the worker thread. Returns NULL on error */
+SlotQueue_t* SlotQueue_new(int n_slots, SlotQueue_func_t process, void *opaque);
+
+/* The slot the producer fills */
+int SlotQueue_fill_slot(SlotQueue_t* q);
+
+/* Hand the slot being filled to the worker, and wait until the next one
+   is free */
+void SlotQueue_submit(SlotQueue_t* q);
+
+/* Hand the slot being filled to the worker if the next one is free.
+   Returns 0, or -1 if it is not, in which case nothing is submitted */
+int SlotQueue_try_submit(SlotQueue_t* q);
+
+/* Number of slots submitted and not yet processed */
+int SlotQueue_pending(SlotQueue_t* q);
+
+/* Process the submitted slots, stop the worker thread and free the queue.
+   The slot being filled is not submitted */
+void SlotQueue_delete(SlotQueue_t* q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SLOTQUEUE_H_ */
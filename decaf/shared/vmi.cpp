@@ -72,40 +72,44 @@ static os_handle_c handle_funds_c[] = {
 
 static void block_end_cb(DECAF_Callback_Params* temp)
 {
-    static long long count_out = 0x8000000000L;	// detection fails after 1000 basic blocks
+    static long long count_out = 0x8000000000L;	// detection fails after this many probes
+    static unsigned int kernel_fills = 0;
+    CPUState *env = temp->tx.env;
     int found_guest_os = 0;
 
-    // Probing guest OS for every basic block is too expensive and wasteful.
-    // Let's just do it once every 256 basic blocks
-    if ((count_out & 0xff) != 0)
-    	goto _skip_probe;
+    // There is nothing to fingerprint until the guest kernel is up and running.
+    // Until the Windows probe finds ntoskrnl, it scans for its PE header each
+    // time it is called, so probe only once every 256 kernel-mode TLB fills.
+    if (!DECAF_is_in_kernel(env))
+    	return;
+    if ((kernel_fills++ & 0xff) != 0)
+    	return;
 
 	for(size_t i=0; i<sizeof(handle_funds_c)/sizeof(handle_funds_c[0]); i++)
 	{
-		if(handle_funds_c[i].find(temp->ie.env, insn_handle_c) == 1)
+		if(handle_funds_c[i].find(env, insn_handle_c) == 1)
 		{
 			GuestOS_index_c = i;
 			found_guest_os = 1;
+			break;
 		}
 	}
 
-#ifdef TARGET_I386
-	if(GuestOS_index_c == 0 || GuestOS_index_c == 1)
-		monitor_printf(default_mon, "its win xp \n");
-	else if(GuestOS_index_c == 2 || GuestOS_index_c == 3)
-		monitor_printf(default_mon, "its win 7 \n");
-	else if(GuestOS_index_c == 4)
-		monitor_printf(default_mon, "its linux \n");
-#endif
-
 	if(found_guest_os)
 	{
+#ifdef TARGET_I386
+		if(GuestOS_index_c == 0 || GuestOS_index_c == 1)
+			monitor_printf(default_mon, "its win xp \n");
+		else if(GuestOS_index_c == 2 || GuestOS_index_c == 3)
+			monitor_printf(default_mon, "its win 7 \n");
+		else if(GuestOS_index_c == 4)
+			monitor_printf(default_mon, "its linux \n");
+#endif
 		DECAF_unregister_callback(DECAF_TLB_EXEC_CB, insn_handle_c);
 		handle_funds_c[GuestOS_index_c].init();
+		return;
 	}
 
-_skip_probe:
-
 	if (count_out-- <= 0)	{// does not find
 		DECAF_unregister_callback(DECAF_TLB_EXEC_CB, insn_handle_c);
 		monitor_printf(default_mon, "oops! guest OS type cannot be decided. \n");
@@ -399,8 +403,7 @@ int VMI_insert_module(uint32_t pid, target_ulong base, module *mod)
 	//We also need to removed the previous modules if they happen to sit on the same region
 
 	for (uint32_t vaddr = base; vaddr < base + mod->size; vaddr += 4096) {
-		proc->resolved_pages.insert(vaddr >> 12);
-		proc->unresolved_pages.erase(vaddr >> 12);
+		proc->resolved_pages.set(vaddr >> 12);
 		//TODO: UnloadModule callback
 		proc->module_list.erase(vaddr);
 	}
@@ -447,8 +450,7 @@ int VMI_remove_module(uint32_t pid, uint32_t base)
 
 
 	for (uint32_t vaddr = base; vaddr < base + mod->size; vaddr += 4096) {
-		proc->resolved_pages.erase(vaddr >> 12);
-		proc->unresolved_pages.erase(vaddr >> 12);
+		proc->resolved_pages.clear(vaddr >> 12);
 	}
 
 	//proc->module_list.erase(m_iter);
@@ -11,6 +11,7 @@
 #define VMI_H_
 
 #include <list>
+#include <string.h>
 #include <tr1/unordered_map>
 #include <tr1/unordered_set>
 #include "vmi_callback.h"
@@ -47,6 +48,66 @@ public:
 };
 
 
+// A set of 4KB virtual pages in a 32-bit address space. It is a directory of
+// 1024 bitmaps, each covering 4MB, which are only allocated when used.
+class page_bitmap{
+public:
+	page_bitmap()
+	{
+		memset(dir, 0, sizeof(dir));
+	}
+
+	~page_bitmap()
+	{
+		for (int i = 0; i < PB_DIR_SIZE; i++)
+			delete[] dir[i];
+	}
+
+	bool test(uint32_t page_num) const
+	{
+		const uint32_t *leaf = dir[(page_num >> 10) & (PB_DIR_SIZE - 1)];
+		return leaf && (leaf[(page_num >> 5) & 31] & (1U << (page_num & 31)));
+	}
+
+	void set(uint32_t page_num)
+	{
+		uint32_t *&leaf = dir[(page_num >> 10) & (PB_DIR_SIZE - 1)];
+		if (!leaf) {
+			leaf = new uint32_t[32];
+			memset(leaf, 0, 32 * sizeof(uint32_t));
+		}
+		leaf[(page_num >> 5) & 31] |= (1U << (page_num & 31));
+	}
+
+	void clear(uint32_t page_num)
+	{
+		uint32_t *leaf = dir[(page_num >> 10) & (PB_DIR_SIZE - 1)];
+		if (leaf)
+			leaf[(page_num >> 5) & 31] &= ~(1U << (page_num & 31));
+	}
+
+private:
+	enum { PB_DIR_SIZE = 1024 };
+	uint32_t *dir[PB_DIR_SIZE];
+
+	page_bitmap(const page_bitmap &);
+	page_bitmap &operator=(const page_bitmap &);
+};
+
+
+//what a loader list looked like when it was last walked completely
+struct ldr_list_sig {
+    uint32_t flink; //of the list head
+    uint32_t blink; //of the list head
+    uint32_t tail_base; //DllBase of the last entry
+    uint32_t tail_size; //SizeOfImage of the last entry
+
+    bool operator!=(const ldr_list_sig &o) const {
+        return flink != o.flink || blink != o.blink
+            || tail_base != o.tail_base || tail_size != o.tail_size;
+    }
+};
+
 class process{
 public:
     uint32_t cr3;
@@ -58,8 +119,10 @@ public:
     //map base address to module pointer
     unordered_map < uint32_t,module * >module_list;
     //a set of virtual pages that have been resolved with module information
-    unordered_set< uint32_t > resolved_pages;
-    unordered_map< uint32_t, int > unresolved_pages;
+    page_bitmap resolved_pages;
+    //base addresses of modules whose symbols are yet to be extracted
+    list< uint32_t > pending_symbols;
+    ldr_list_sig ldr_sig;
 };
 
 
@@ -82,7 +82,10 @@ uintptr_t block_handle = 0;
 BYTE *recon_file_data_raw = 0;
 #define MAX_MODULE_COUNT 500
 
-/* Timer to check for proc exits */
+/* CR3 seen at the last TLB exec fill, used to detect proc exits */
+static uint32_t last_cr3 = 0;
+
+/* Timer to sweep for the proc exits missed on CR3 switches */
 static QEMUTimer *recon_timer = NULL;
 
 unordered_map < uint32_t, pair<module *, uint32_t> > phys_module_map;
@@ -106,21 +109,42 @@ static bool should_extract_symbol(const char *module_name)
 
 
 
-static inline int is_page_resolved(process *proc, uint32_t page_num)
+static inline int is_page_resolved(process *proc, uint32_t addr)
 {
-	return (proc->resolved_pages.find(page_num>>12) != proc->resolved_pages.end());
+	return proc->resolved_pages.test(addr>>12);
 }
 
-static inline int unresolved_attempt(process *proc, uint32_t addr)
+/*
+ * Modules are discovered by walking a loader list: PsLoadedModuleList for the
+ * kernel and the PEB loader list for a process. The loader always appends new
+ * entries (InsertTailList in LdrpInsertDataTableEntry), so loading a module
+ * changes the Blink of the list head, or, when the entry freed by an unload is
+ * reused at the tail, the DllBase and SizeOfImage of the tail entry. We keep
+ * the head and the tail entry after each complete walk and only walk the list
+ * again once one of them has changed. The loader keeps no entry count, and
+ * counting the entries would be a walk of its own.
+ */
+static inline int ldr_list_changed(CPUState *env, process *proc, uint32_t list_head,
+		uint32_t base_offset, uint32_t size_offset, ldr_list_sig *sig)
 {
-	unordered_map <uint32_t, int>::iterator iter = proc->unresolved_pages.find(addr>>12);
-	if(iter == proc->unresolved_pages.end()) {
-		proc->unresolved_pages[addr>>12] = 1;
-		return 1;
+	if (DECAF_read_mem(env, list_head, 4, &sig->flink) < 0
+			|| DECAF_read_mem(env, list_head + 4, 4, &sig->blink) < 0)
+		return 0;
+
+	sig->tail_base = sig->tail_size = 0;
+	if (sig->blink != list_head) {
+		DECAF_read_mem(env, sig->blink + base_offset, 4, &sig->tail_base);
+		DECAF_read_mem(env, sig->blink + size_offset, 4, &sig->tail_size);
 	}
-	iter->second++;
 
-	return iter->second;
+	return (*sig != proc->ldr_sig);
+}
+
+static inline void insert_module(process *proc, uint32_t base, module *mod)
+{
+	VMI_insert_module(proc->pid, base, mod);
+	if (!mod->symbols_extracted)
+		proc->pending_symbols.push_back(base);
 }
 
 
@@ -243,17 +267,22 @@ static char * get_basename(char *fullname)
 
 static void update_kernel_modules(CPUState *env, target_ulong vaddr) {
 	uint32_t kdvb, psLM, curr_mod, next_mod;
+	ldr_list_sig sig;
 	uint32_t holder;
 	module *curr_entry = NULL;
+	int complete = 1;
 
 	if (gkpcr == 0)
 		return;
 
-	//If this page has been resolved, return immediately
-	//if (is_page_resolved(kernel_proc, vaddr)) return;
-
 	DECAF_read_mem(env, gkpcr + KDVB_OFFSET, 4, &kdvb);
 	DECAF_read_mem(env, kdvb + PSLM_OFFSET, 4, &psLM);
+
+	if (!ldr_list_changed(env, kernel_proc, psLM,
+			handle_funds[GuestOS_index].offset->DLLBASE_OFFSET,
+			handle_funds[GuestOS_index].offset->SIZE_OFFSET, &sig))
+		return;
+
 	DECAF_read_mem(env, psLM, 4, &curr_mod);
 
 	while (curr_mod != 0 && curr_mod != psLM) {
@@ -263,8 +292,8 @@ static void update_kernel_modules(CPUState *env, target_ulong vaddr) {
 				curr_mod + handle_funds[GuestOS_index].offset->DLLBASE_OFFSET,
 				4, &base);
 
-		//if (is_page_resolved(kernel_proc, base))
-			//goto next;
+		if (kernel_proc->module_list.find(base) != kernel_proc->module_list.end())
+			goto next;
 
 
 		char name[512];
@@ -279,8 +308,10 @@ static void update_kernel_modules(CPUState *env, target_ulong vaddr) {
 		//uniquely identify a module.
 		//We do not use full module name, because the same module can be referenced through
 		//different full paths: e.g., c://windows/system32 and /systemroot/windows/system32.
-		if(get_IMAGE_NT_HEADERS(env->cr[3], base, &nth, env) < 0)
+		if(get_IMAGE_NT_HEADERS(env->cr[3], base, &nth, env) < 0) {
+			complete = 0;
 			goto next;
+		}
 
 		snprintf(key, sizeof(key)-1, "%s:%08x", base_name, nth.OptionalHeader.CheckSum);
 		//See if we have extracted detailed info about this module
@@ -296,7 +327,7 @@ static void update_kernel_modules(CPUState *env, target_ulong vaddr) {
 			VMI_add_module(curr_entry, key);
 		}
 
-		VMI_insert_module(kernel_proc->pid, base, curr_entry);
+		insert_module(kernel_proc, base, curr_entry);
 
 next:
 		DECAF_read_mem(env, curr_mod, 4, &next_mod);
@@ -305,11 +336,14 @@ next:
 			//monitor_printf(default_mon,
 			//		"Something is wrong. Next->prev != curr. curr_mod = 0x%08x\n",
 			//		curr_mod);
+			complete = 0;
 			break;
 		}
 		curr_mod = next_mod;
 	}
 
+	if (complete)
+		kernel_proc->ldr_sig = sig;
 }
 
 static void update_loaded_user_mods_with_peb(CPUState* env, process *proc,
@@ -317,12 +351,18 @@ static void update_loaded_user_mods_with_peb(CPUState* env, process *proc,
 {
 	uint32_t cr3 = proc->cr3;
 	uint32_t ldr, memlist, first_dll=0, curr_dll, count=0;
+	ldr_list_sig sig;
 	module *curr_entry = NULL;
+	int complete = 1;
 
 	if (peb == 0x00) return;
 
 	DECAF_read_mem(env, peb + 0xc, 4, &ldr);
 	memlist = ldr + 0xc;
+
+	if (!ldr_list_changed(env, proc, memlist, 0x18, 0x20, &sig))
+		return;
+
 	DECAF_read_mem(env, memlist, 4, &first_dll);
 
 	if (first_dll == 0)	return;
@@ -332,10 +372,12 @@ static void update_loaded_user_mods_with_peb(CPUState* env, process *proc,
 		IMAGE_NT_HEADERS nth;
 		count++;
 		uint32_t base = 0; //, size = 0;
-		if (DECAF_read_mem(env, curr_dll + 0x18, 4, &base) < 0)
+		if (DECAF_read_mem(env, curr_dll + 0x18, 4, &base) < 0) {
+			complete = 0;
 			break;
+		}
 
-		if (!is_page_resolved(proc, base)) {
+		if (proc->module_list.find(base) == proc->module_list.end()) {
 			char name[512];
 			char key[512];
 
@@ -345,8 +387,10 @@ static void update_loaded_user_mods_with_peb(CPUState* env, process *proc,
 			//uniquely identify a module.
 			//We do not use full module name, because the same module can be referenced through
 			//different full paths: e.g., c://windows/system32 and /systemroot/windows/system32.
-			if(get_IMAGE_NT_HEADERS(cr3, base, &nth, env) < 0)
+			if(get_IMAGE_NT_HEADERS(cr3, base, &nth, env) < 0) {
+				complete = 0;
 				goto next;
+			}
 
 			snprintf(key, sizeof(key)-1, "%s:%08x", name, nth.OptionalHeader.CheckSum);
 			//See if we have extracted detailed info about this module
@@ -360,7 +404,7 @@ static void update_loaded_user_mods_with_peb(CPUState* env, process *proc,
 				VMI_add_module(curr_entry, key);
 			}
 
-			VMI_insert_module(proc->pid, base, curr_entry);
+			insert_module(proc, base, curr_entry);
 			//message_m(proc->pid, cr3, base, curr_entry);
 
 		}
@@ -370,6 +414,8 @@ next:
 		DECAF_read_mem(env, curr_dll, 4, &curr_dll);
 	} while (curr_dll != 0 && curr_dll != first_dll && count < MAX_MODULE_COUNT);
 
+	if (complete)
+		proc->ldr_sig = sig;
 }
 
 static void extract_export_table(IMAGE_NT_HEADERS *nth, uint32_t cr3, uint32_t base, module *mod, CPUState *_env)
@@ -468,14 +514,21 @@ static void extract_PE_info(uint32_t cr3, uint32_t base, module *mod, CPUState *
 }
 
 
+//Only the modules inserted with symbols pending are visited, and each one
+//is dropped from the list once its symbols are in (or it is gone).
 static void retrieve_missing_symbols(process *proc, CPUState *_env)
 {
-	unordered_map < uint32_t,module * >::iterator iter = proc->module_list.begin();
+	list < uint32_t >::iterator iter = proc->pending_symbols.begin();
+
+	while (iter != proc->pending_symbols.end()) {
+		unordered_map < uint32_t,module * >::iterator m_iter = proc->module_list.find(*iter);
+		if (m_iter != proc->module_list.end() && !m_iter->second->symbols_extracted)
+			extract_PE_info(proc->cr3, m_iter->first, m_iter->second, _env);
 
-	for(; iter!=proc->module_list.end(); iter++) {
-		module *cur_mod = iter->second;
-		if(!cur_mod->symbols_extracted)
-			extract_PE_info(proc->cr3, iter->first, cur_mod, _env);
+		if (m_iter == proc->module_list.end() || m_iter->second->symbols_extracted)
+			iter = proc->pending_symbols.erase(iter);
+		else
+			iter++;
 	}
 }
 
@@ -500,6 +553,47 @@ static inline void get_new_modules(CPUState* _env, process * proc, target_ulong
 	}
 }
 
+//Whether ExitTime is set in the EPROCESS of proc
+static inline int proc_has_exited(CPUState *env, process *proc)
+{
+	uint32_t end_time[2];
+
+	//0x78 for xp, 0x88 for win7
+	if (DECAF_read_mem(env, proc->EPROC_base_addr
+			+ handle_funds[GuestOS_index].offset->PEXIT_TIME,
+			8, end_time) < 0)
+		return 0;
+
+	return (end_time[0] | end_time[1]) != 0;
+}
+
+/*
+ * A process runs its last thread until after PspExitThread has set ExitTime
+ * in its EPROCESS, and never returns to its address space after that.
+ * So whenever execution leaves an address space, we only need to check the
+ * exit time of the process that owned it. Loading a new CR3 flushes the TLB,
+ * so the first exec fill after a context switch is where we notice it.
+ * A process can also die without us seeing its CR3 being left (it is torn
+ * down from another process, or no exec fill follows the switch); the
+ * sweep in check_procexit_all catches those.
+ */
+static inline void check_procexit(CPUState *env, uint32_t cr3)
+{
+	process *proc;
+
+	if (cr3 == last_cr3)
+		return;
+
+	proc = VMI_find_process_by_pgd(last_cr3);
+	last_cr3 = cr3;
+
+	if (proc == NULL || proc == kernel_proc || proc->parent_pid == 0)
+		return;
+
+	if (proc_has_exited(env, proc))
+		VMI_remove_process(proc->pid);
+}
+
 static void tlb_call_back(DECAF_Callback_Params *temp)
 {
 	CPUState *ourenv = temp->tx.env;
@@ -507,6 +601,8 @@ static void tlb_call_back(DECAF_Callback_Params *temp)
 	uint32_t cr3 = ourenv->cr[3];
 	process *proc;
 
+	check_procexit(ourenv, cr3);
+
 	if(DECAF_is_in_kernel(ourenv)) {
 		proc = kernel_proc;
 		kernel_proc->cr3 = cr3;
@@ -517,19 +613,19 @@ static void tlb_call_back(DECAF_Callback_Params *temp)
 	}
 
 	if (proc ) {
-		
+
 		if (!is_page_resolved(proc, vaddr)) {
+			//This walks the loader list only if it has changed since the last walk
 			get_new_modules(ourenv, proc, vaddr);
 
-			if (!is_page_resolved(proc, vaddr)) {
-				int attempts = unresolved_attempt(proc, vaddr);
-				if (attempts > 3)
-					proc->resolved_pages.insert(vaddr>>12);
-			}
-
+			//Not in any module we know of. Leave it alone until a module
+			//is inserted over it or removed from it.
+			if (!is_page_resolved(proc, vaddr))
+				proc->resolved_pages.set(vaddr>>12);
 		}
-		retrieve_missing_symbols(proc, ourenv);
-	
+
+		if (!proc->pending_symbols.empty())
+			retrieve_missing_symbols(proc, ourenv);
 	}
 }
 
@@ -613,28 +709,46 @@ found:
 	return ntoskrnl_base;
 }
 
+/* Number of times probe_windows scans for ntoskrnl before giving up */
+#define PROBE_WINDOWS_MAX_SCANS 1024
+
 /*FIXME: Supports only 32bit guest. */
 static uint32_t probe_windows(CPUState *_env)
 {
+	static uint32_t ntoskrnl_base = 0;
+	static int scans_left = PROBE_WINDOWS_MAX_SCANS;
 	uint32_t base;
 
+	// KPCR and ntoskrnl are located only once, and all the find_* functions
+	// share the result. Scanning for the ntoskrnl PE header is expensive, so
+	// until ntoskrnl is found, the probe is tried again on later calls only
+	// as long as the scan budget lasts.
+	if (rtflag == 1)
+		return ntoskrnl_base;
+	if (scans_left == 0)
+		return 0;
+
 	if (_env->eip > 0x80000000 && _env->segs[R_FS].base > 0x80000000) {
 		gkpcr = get_kpcr();
 		if (gkpcr != 0) {
 			//DECAF_unregister_callback(DECAF_INSN_END_CB, insn_handle);
-			rtflag = 1;
-
 			get_os_version(_env);
 			base = get_ntoskrnl(_env);
-			monitor_printf(default_mon,
-					"The base address of ntoskrnl.exe is %08x\n", base);
 			if (!base) {
-				monitor_printf(default_mon,
-						"Unable to locate kernel base. Stopping VM...\n");
+				if (--scans_left == 0)
+					monitor_printf(default_mon,
+							"Unable to locate kernel base, giving up\n");
+				else if (scans_left == PROBE_WINDOWS_MAX_SCANS - 1)
+					monitor_printf(default_mon,
+							"Unable to locate kernel base, trying again later\n");
 				//vm_stop(RUN_STATE_DEBUG);
 				return 0;
 			} else {
+				monitor_printf(default_mon,
+						"The base address of ntoskrnl.exe is %08x\n", base);
 				VMI_guest_kernel_base = 0x80000000;
+				ntoskrnl_base = base;
+				rtflag = 1;
 				return base;
 			}
 		}
@@ -675,16 +789,15 @@ int find_winxpsp3(CPUState *_env, uintptr_t insn_handle) {
 
 
 
-void check_procexit(void *)
+//Fallback sweep over all the processes, every 10 seconds of guest time
+static void check_procexit_all(void *)
 {
 	/* AWH - cpu_single_env is invalid outside of the main exec thread */
-	CPUState *env = /* AWH cpu_single_env ? cpu_single_env :*/ first_cpu;
+	CPUState *env = first_cpu;
+	vector<target_ulong> pid_list;
+
 	qemu_mod_timer(recon_timer,
 			qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() * 10);
-	//monitor_printf(default_mon, "Checking for proc exits...\n");
-
-	uint32_t end_time[2];
-	vector<target_ulong> pid_list;
 
 	unordered_map < uint32_t, process * >::iterator iter = process_map.begin();
 	for (; iter!=process_map.end(); iter++) {
@@ -692,13 +805,8 @@ void check_procexit(void *)
 		if (proc->parent_pid == 0)
 			continue;
 
-		//0x78 for xp, 0x88 for win7
-		DECAF_read_mem(env, proc->EPROC_base_addr
-						+ handle_funds[GuestOS_index].offset->PEXIT_TIME,
-						8,  end_time);
-		if (end_time[0] | end_time[1]) {
+		if (proc_has_exited(env, proc))
 			pid_list.push_back(proc->pid);
-		}
 	}
 
 	for (size_t i=0; i<pid_list.size(); i++) {
@@ -715,10 +823,9 @@ void win_vmi_init()
 	kernel_proc->pid = 0;
 	VMI_create_process(kernel_proc);
 
-	recon_timer = qemu_new_timer_ns(vm_clock, check_procexit, 0);
+	recon_timer = qemu_new_timer_ns(vm_clock, check_procexit_all, 0);
 	qemu_mod_timer(recon_timer,
 			qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() * 30);
-
 }
 
 #endif
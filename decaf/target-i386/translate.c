@@ -2358,7 +2358,7 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
         /* jump to same page: we can use a direct jump */
         gen_jmp_im(eip);
 
-    	if (DECAF_is_callback_needed(DECAF_INSN_END_CB)) {
+    	if (DECAF_is_InsnCallback_needed(DECAF_INSN_END_CB, cur_pc)) {
     		gen_helper_DECAF_invoke_insn_end_callback(cpu_env);
         }
 
@@ -2812,7 +2812,7 @@ static void gen_eob(DisasContext *s)
     } else if (s->tf) {
     	gen_helper_single_step();
     } else {
-    	if (DECAF_is_callback_needed(DECAF_INSN_END_CB)) {
+    	if (DECAF_is_InsnCallback_needed(DECAF_INSN_END_CB, cur_pc)) {
     		gen_helper_DECAF_invoke_insn_end_callback(cpu_env);
         }    
 
@@ -7854,7 +7854,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     if (!s->is_jmp) {
         gen_jmp_im(s->pc - s->cs_base);
 
-		if(DECAF_is_callback_needed(DECAF_INSN_END_CB))
+		if(DECAF_is_InsnCallback_needed(DECAF_INSN_END_CB, cur_pc))
 			gen_helper_DECAF_invoke_insn_end_callback(cpu_env);
 
 		//Heng: now we change the opcode-specific callback to instruction end.
@@ -8200,6 +8200,12 @@ static inline void gen_intermediate_code_internal(CPUState *env,
       // since all of the other calls to tcg_const... don't have it
     }
 
+    //the page of the block was written since code last ran from it
+    if (!search_pc)
+      tb->DECAF_write_exec = DECAF_is_WriteExecCallback_needed(env, tb->pc);
+    if (tb->DECAF_write_exec)
+      gen_helper_DECAF_invoke_write_exec_callback(cpu_env, tcg_const_tl(pc_start));
+
 #ifdef CONFIG_TCG_TAINT
     gen_old_opc_ptr = gen_opc_ptr;
     gen_old_opparam_ptr = gen_opparam_ptr;
@@ -8244,7 +8250,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO))
             gen_io_start();
 
-        if (DECAF_is_callback_needed(DECAF_INSN_BEGIN_CB))
+        if (DECAF_is_InsnCallback_needed(DECAF_INSN_BEGIN_CB, pc_ptr))
         	gen_helper_DECAF_invoke_insn_begin_callback(cpu_env);
 
         pc_ptr = disas_insn(dc, pc_ptr);
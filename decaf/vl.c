@@ -2179,7 +2179,8 @@ int main(int argc, char **argv, char **envp)
     const char *optarg;
     const char *loadvm = NULL;
     const char *after_loadvm = NULL; // AWH
-    const char *load_plugin = NULL; // AWH
+    const char **load_plugins = NULL; // AWH
+    int nb_load_plugins = 0;
     QDict* plugin_path = qdict_new();
 #ifdef CONFIG_VMI_ENABLE
     FILE *vmi_profile_fp = NULL;
@@ -2805,7 +2806,9 @@ int main(int argc, char **argv, char **envp)
                 after_loadvm = optarg;
                 break;
             case QEMU_OPTION_load_plugin:       // DECAF option
-                load_plugin = optarg;
+                load_plugins = g_realloc(load_plugins,
+                        (nb_load_plugins + 1) * sizeof(*load_plugins));
+                load_plugins[nb_load_plugins++] = optarg;
                 break;
             case QEMU_OPTION_toggle_kvm:
             	DECAF_kvm_enabled = optarg;
@@ -3512,9 +3515,9 @@ int main(int argc, char **argv, char **envp)
 	DECAF_blocks_init();
     DECAF_init();                // some initializations have to be done
     // before loadvm
-    if (loadvm == NULL && load_plugin){
+    for (i = 0; loadvm == NULL && i < nb_load_plugins; i++) {
         QObject *data = NULL;
-        qdict_put(plugin_path, "filename", qstring_from_str(load_plugin));
+        qdict_put(plugin_path, "filename", qstring_from_str(load_plugins[i]));
         do_load_plugin(cur_mon, plugin_path, &data);
     }
 #endif // AWH
@@ -3548,5 +3551,6 @@ int main(int argc, char **argv, char **envp)
     net_cleanup();
     res_free();
     QDECREF(plugin_path);
+    g_free(load_plugins);
     return 0;
 }